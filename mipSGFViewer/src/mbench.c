@@ -0,0 +1,2829 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *\
+ * This is GNU Go, a Go program. Contact gnugo@gnu.org, or see       *
+ * http://www.gnu.org/software/gnugo/ for more information.          *
+ *                                                                   *
+ * Copyright 1999, 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2007,   *
+ * 2008 and 2009 by the Free Software Foundation.                    *
+ *                                                                   *
+ * This program is free software; you can redistribute it and/or     *
+ * modify it under the terms of the GNU General Public License as    *
+ * published by the Free Software Foundation - version 3 or          *
+ * (at your option) any later version.                               *
+ *                                                                   *
+ * This program is distributed in the hope that it will be useful,   *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of    *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the     *
+ * GNU General Public License in file COPYING for more details.      *
+ *                                                                   *
+ * You should have received a copy of the GNU General Public         *
+ * License along with this program; if not, write to the Free        *
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor,       *
+ * Boston, MA 02111, USA.                                            *
+\* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * mbench.c
+ *
+ * Throughput measurements for the SGF library and the board code.
+ * These are reached from the mipgo command line, see main().
+ */
+
+#include "mgnugo.h"
+#include "mgg_utils.h"
+#include "mrandom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+
+/* Wall clock time in seconds. */
+
+static double
+bench_time(void)
+{
+#if HAVE_GETTIMEOFDAY
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.e-6 * tv.tv_usec;
+#else
+  return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+
+static long
+file_size(const char *filename)
+{
+  FILE *file = fopen(filename, "rb");
+  long size;
+
+  if (!file)
+    return -1;
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  fclose(file);
+  return size;
+}
+
+
+/* Read a whole file into a new buffer. Returns NULL if it cannot be
+ * read.
+ */
+
+static char *
+read_file(const char *filename, unsigned long *size)
+{
+  long length = file_size(filename);
+  FILE *input = fopen(filename, "rb");
+  char *buffer;
+
+  if (length < 0 || !input) {
+    if (input)
+      fclose(input);
+    return NULL;
+  }
+  buffer = xalloc(length + 1);
+  *size = fread(buffer, 1, length, input);
+  fclose(input);
+  return buffer;
+}
+
+
+/*
+ * Compare two SGF trees node by node and property by property,
+ * including the siblings following a and b. Returns 1 if they are
+ * identical. The trees are walked in step through their parent links,
+ * so deep trees need no stack.
+ */
+
+static int
+sgf_trees_equal(SGFNode *a, SGFNode *b)
+{
+  SGFNode *atop = a ? a->parent : NULL;
+  SGFNode *btop = b ? b->parent : NULL;
+  SGFProperty *pa;
+  SGFProperty *pb;
+
+  while (a && b) {
+    for (pa = a->props, pb = b->props; pa && pb; pa = pa->next, pb = pb->next)
+      if (pa->name != pb->name || strcmp(pa->value, pb->value) != 0)
+	return 0;
+    if (pa || pb)
+      return 0;
+
+    if (a->child && b->child) {
+      a = a->child;
+      b = b->child;
+      continue;
+    }
+    if (a->child || b->child)
+      return 0;
+
+    while (!a->next && !b->next) {
+      a = a->parent;
+      b = b->parent;
+      if (a == atop || b == btop)
+	return a == atop && b == btop;
+    }
+    a = a->next;
+    b = b->next;
+  }
+
+  return a == b;
+}
+
+
+/*
+ * Compare the main lines (first children) of two games.
+ */
+
+static int
+sgf_main_lines_equal(SGFNode *a, SGFNode *b)
+{
+  SGFProperty *pa;
+  SGFProperty *pb;
+
+  for (; a && b; a = a->child, b = b->child) {
+    for (pa = a->props, pb = b->props; pa && pb; pa = pa->next, pb = pb->next)
+      if (pa->name != pb->name || strcmp(pa->value, pb->value) != 0)
+	return 0;
+    if (pa || pb)
+      return 0;
+  }
+
+  return a == b;
+}
+
+
+/*
+ * Check that a flat tree has the same nodes and properties as the
+ * game of root it was built from, and the same links between them.
+ * Both are walked in step, the flat tree through its own links, which
+ * must also visit the nodes in preorder.
+ */
+
+static int
+sgf_flat_equal(const SGFFlatTree *flat, SGFNode *root)
+{
+  SGFNode *node = root;
+  unsigned int count = 0;
+  unsigned int n = 0;
+
+  if (flat->nnodes == 0 || flat->nodes[0].parent != SGF_FLAT_NONE)
+    return 0;
+
+  while (node) {
+    const SGFFlatNode *flatnode = &flat->nodes[n];
+    SGFProperty *prop;
+    unsigned int k;
+
+    if (n != count++)
+      return 0;
+
+    for (prop = node->props, k = 0; prop; prop = prop->next, k++) {
+      const SGFFlatProperty *flatprop = &flat->props[flatnode->props + k];
+      int i, j, point;
+
+      if (prop->flags & SGFPROP_POINTS) {
+	/* A point set is flattened into a property for each point. */
+	for (point = 0;
+	     sgfNextPoint(prop, &point, &i, &j, SGF_POINTSET_SIZE);
+	     flatprop++, k++) {
+	  const char *value = flat->values + flatprop->value;
+	  if (k >= flatnode->nprops || flatprop->name != prop->name
+	      || value[0] != 'a' + j || value[1] != 'a' + i || value[2] != '\0')
+	    return 0;
+	}
+	k--;
+	continue;
+      }
+
+      if (k >= flatnode->nprops || flatprop->name != prop->name
+	  || strcmp(flat->values + flatprop->value, prop->value) != 0)
+	return 0;
+    }
+    if (k != flatnode->nprops)
+      return 0;
+
+    if ((node->child != NULL) != (flatnode->child != SGF_FLAT_NONE))
+      return 0;
+    if (node->child) {
+      if (flatnode->child >= flat->nnodes
+	  || flat->nodes[flatnode->child].parent != n)
+	return 0;
+      node = node->child;
+      n = flatnode->child;
+      continue;
+    }
+
+    while (node != root && !node->next) {
+      if (flat->nodes[n].next != SGF_FLAT_NONE)
+	return 0;
+      node = node->parent;
+      n = flat->nodes[n].parent;
+    }
+    if (node == root)
+      break;
+
+    flatnode = &flat->nodes[n];
+    if (flatnode->next >= flat->nnodes
+	|| flat->nodes[flatnode->next].parent != flatnode->parent)
+      return 0;
+    node = node->next;
+    n = flatnode->next;
+  }
+
+  return count == flat->nnodes;
+}
+
+
+/*
+ * Replay loops over all nodes of a game, adding up the positions of
+ * the moves. The first works on the SGF tree, the second on its flat
+ * copy; both must give the same sum.
+ */
+
+static unsigned long
+tree_move_sum(SGFNode *root, int boardsize)
+{
+  unsigned long sum = 0;
+  SGFNode *node = root;
+  SGFProperty *prop;
+  int i, j;
+
+  while (node) {
+    for (prop = node->props; prop; prop = prop->next)
+      if (prop->name == SGFB || prop->name == SGFW) {
+	if (get_moveXY(prop, &i, &j, boardsize) && i >= 0 && j >= 0)
+	  sum += POS(i, j);
+	break;
+      }
+
+    if (node->child)
+      node = node->child;
+    else {
+      while (node != root && !node->next)
+	node = node->parent;
+      node = node == root ? NULL : node->next;
+    }
+  }
+
+  return sum;
+}
+
+static unsigned long
+flat_move_sum(const SGFFlatTree *flat)
+{
+  unsigned long sum = 0;
+  unsigned int n;
+
+  for (n = 0; n < flat->nnodes; n++)
+    if (flat->nodes[n].color != EMPTY)
+      sum += flat->nodes[n].move;
+
+  return sum;
+}
+
+
+/* Event scanner callbacks which only look at the root node. */
+
+static int
+root_node_event(void *data, int depth)
+{
+  int *nodes = data;
+
+  UNUSED(depth);
+  return (*nodes)++ == 0 ? SGF_SCAN_CONTINUE : SGF_SCAN_SKIP;
+}
+
+static int
+root_property_event(void *data, short name, const char *value, int length)
+{
+  UNUSED(data);
+  UNUSED(value);
+  UNUSED(length);
+  return name == SGFB || name == SGFW ? SGF_SCAN_SKIP : SGF_SCAN_CONTINUE;
+}
+
+
+/*
+ * Parse each file with readsgffile() and with readsgffile_mmap(),
+ * check that both give the same tree and report the throughput of
+ * each parser over the whole corpus. For comparison the root
+ * properties are also collected with the event scanner, the files are
+ * read lazily and then expanded, and the trees are built in an arena
+ * to compare allocation and teardown costs. Finally a replay loop over all nodes is timed on the SGF
+ * tree and on its flat copy.
+ */
+
+int
+bench_parse(int argc, char *argv[])
+{
+  double stdio_time = 0.0;
+  double mmap_time = 0.0;
+  double scan_time = 0.0;
+  double lazy_time = 0.0;
+  double expand_time = 0.0;
+  double arena_time = 0.0;
+  double heap_free_time = 0.0;
+  double arena_free_time = 0.0;
+  unsigned long arena_objects = 0;
+  unsigned long arena_blocks = 0;
+  double flat_time = 0.0;
+  double tree_walk_time = 0.0;
+  double flat_walk_time = 0.0;
+  unsigned long flat_nodes = 0;
+  SGFEvents root_events = {NULL, root_node_event, root_property_event, NULL};
+  double total_bytes = 0.0;
+  int mismatches = 0;
+  int k;
+
+  for (k = 0; k < argc; k++) {
+    SGFNode *stdio_tree;
+    SGFNode *mmap_tree;
+    SGFMapping *mapping;
+    SGFNode *lazy_tree;
+    SGFMapping *lazy_mapping;
+    SGFNode *arena_tree;
+    SGFArena *arena;
+    SGFFlatTree flat;
+    SGFNode *game;
+    SGFParser parser;
+    unsigned long tree_sum = 0;
+    unsigned long flat_sum = 0;
+    int boardsize;
+    int nodes = 0;
+    int rep;
+    long size = file_size(argv[k]);
+    double t;
+
+    if (size < 0) {
+      fprintf(stderr, "Cannot open %s\n", argv[k]);
+      continue;
+    }
+
+    t = bench_time();
+    stdio_tree = readsgffile(argv[k]);
+    stdio_time += bench_time() - t;
+
+    t = bench_time();
+    mmap_tree = readsgffile_mmap(argv[k], &mapping);
+    mmap_time += bench_time() - t;
+
+    t = bench_time();
+    lazy_tree = readsgffile_mmap_lazy(argv[k], NULL, &lazy_mapping);
+    lazy_time += bench_time() - t;
+
+    t = bench_time();
+    scansgffile_ctx(&parser, argv[k], &root_events, &nodes);
+    scan_time += bench_time() - t;
+
+    t = bench_time();
+    arena = sgf_arena_new();
+    readsgffile_arena(&parser, argv[k], arena, &arena_tree);
+    arena_time += bench_time() - t;
+
+    if (!stdio_tree || !mmap_tree
+	|| !sgf_trees_equal(stdio_tree, mmap_tree)) {
+      fprintf(stderr, "Trees differ: %s\n", argv[k]);
+      mismatches++;
+    }
+
+    if (!lazy_tree || !sgf_main_lines_equal(stdio_tree, lazy_tree)) {
+      fprintf(stderr, "Lazy main line differs: %s\n", argv[k]);
+      mismatches++;
+    }
+    else {
+      /* The unparsed variations are written as they were read, in
+       * their own property order; read back and written again they
+       * must give what the full tree does.
+       */
+      unsigned long written, full_written;
+      char *text = writesgf_to_buffer(lazy_tree, &written);
+      char *full_text = writesgf_to_buffer(stdio_tree, &full_written);
+      SGFNode *copy = NULL;
+
+      readsgfmem_ctx(&parser, text, written, &copy);
+      free(text);
+      text = copy ? writesgf_to_buffer(copy, &written) : NULL;
+      if (!text || written != full_written
+	  || memcmp(text, full_text, written) != 0) {
+	fprintf(stderr, "Written lazy tree differs: %s\n", argv[k]);
+	mismatches++;
+      }
+      sgfFreeNode(copy);
+      free(text);
+      free(full_text);
+    }
+    t = bench_time();
+    sgfExpandAll(lazy_tree);
+    expand_time += bench_time() - t;
+    if (!sgf_trees_equal(stdio_tree, lazy_tree)) {
+      fprintf(stderr, "Expanded lazy tree differs: %s\n", argv[k]);
+      mismatches++;
+    }
+    sgfFreeNode(lazy_tree);
+    sgf_unmap(lazy_mapping);
+
+    if (!arena_tree || !sgf_trees_equal(stdio_tree, arena_tree)) {
+      fprintf(stderr, "Arena tree differs: %s\n", argv[k]);
+      mismatches++;
+    }
+    arena_objects += arena->allocations;
+
+    for (game = stdio_tree; game; game = game->next) {
+      t = bench_time();
+      sgfflat_build(&flat, game);
+      flat_time += bench_time() - t;
+      flat_nodes += flat.nnodes;
+
+      if (!sgfGetIntProperty(game, "SZ", &boardsize))
+	boardsize = 19;
+      t = bench_time();
+      for (rep = 0; rep < 10; rep++)
+	tree_sum += tree_move_sum(game, boardsize);
+      tree_walk_time += bench_time() - t;
+
+      t = bench_time();
+      for (rep = 0; rep < 10; rep++)
+	flat_sum += flat_move_sum(&flat);
+      flat_walk_time += bench_time() - t;
+
+      if (!sgf_flat_equal(&flat, game)
+	  || tree_sum != flat_sum) {
+	fprintf(stderr, "Flat tree differs: %s\n", argv[k]);
+	mismatches++;
+      }
+      sgfflat_free(&flat);
+    }
+    arena_blocks += arena->nblocks;
+
+    t = bench_time();
+    sgfFreeNode(stdio_tree);
+    heap_free_time += bench_time() - t;
+
+    t = bench_time();
+    sgf_arena_free(arena);
+    arena_free_time += bench_time() - t;
+
+    sgfFreeNode(mmap_tree);
+    sgf_unmap(mapping);
+    total_bytes += size;
+  }
+
+  printf("%d files, %.1f MB\n", argc, total_bytes / 1e6);
+  printf("readsgffile:      %8.3f s  %8.1f MB/s\n",
+	 stdio_time, total_bytes / 1e6 / stdio_time);
+  printf("readsgffile_mmap: %8.3f s  %8.1f MB/s\n",
+	 mmap_time, total_bytes / 1e6 / mmap_time);
+  printf("lazy mmap:        %8.3f s  %8.1f MB/s  (+%.3f s to expand all)\n",
+	 lazy_time, total_bytes / 1e6 / lazy_time, expand_time);
+  printf("scansgffile_ctx:  %8.3f s  %8.1f MB/s  (root properties only)\n",
+	 scan_time, total_bytes / 1e6 / scan_time);
+  printf("readsgffile_arena:%8.3f s  %8.1f MB/s\n",
+	 arena_time, total_bytes / 1e6 / arena_time);
+  printf("%lu objects in %lu arena blocks\n", arena_objects, arena_blocks);
+  printf("teardown: sgfFreeNode %.3f s, sgf_arena_free %.3f s\n",
+	 heap_free_time, arena_free_time);
+  printf("sgfflat_build:    %8.3f s  (%lu nodes)\n", flat_time, flat_nodes);
+  printf("replay x10: SGFNode %.3f s, SGFFlatTree %.3f s\n",
+	 tree_walk_time, flat_walk_time);
+  printf("mismatching trees: %d\n", mismatches);
+
+  return mismatches > 0;
+}
+
+
+/*
+ * Compare loading the games of each file from its text with loading
+ * them from its binary cache (foo.sgf.cache, built first if missing or stale). Both
+ * ways the moves of all nodes are added up once.
+ */
+
+int
+bench_cache(int argc, char *argv[])
+{
+  char cachename[FILENAME_MAX];
+  double parse_time = 0.0;
+  double cache_time = 0.0;
+  unsigned long parse_sum = 0;
+  unsigned long cache_sum = 0;
+  int failures = 0;
+  int k;
+
+  for (k = 0; k < argc; k++) {
+    SGFCache cache;
+    SGFFlatTree flat;
+    SGFNode *root;
+    SGFNode *game;
+    unsigned int n;
+    int status;
+    double t;
+
+    gg_snprintf(cachename, sizeof(cachename), "%s.cache", argv[k]);
+    status = sgfcache_open(&cache, cachename, argv[k]);
+    if (status == SGFCACHE_OK)
+      sgfcache_close(&cache);
+    else
+      status = sgfcache_build(argv[k], cachename);
+    if (status != SGFCACHE_OK) {
+      fprintf(stderr, "%s: %s\n", cachename, sgfcache_strerror(status));
+      failures++;
+      continue;
+    }
+
+    t = bench_time();
+    root = readsgffile(argv[k]);
+    for (game = root; game; game = game->next) {
+      sgfflat_build(&flat, game);
+      parse_sum += flat_move_sum(&flat);
+      sgfflat_free(&flat);
+    }
+    sgfFreeNode(root);
+    parse_time += bench_time() - t;
+
+    t = bench_time();
+    if (sgfcache_open(&cache, cachename, argv[k]) == SGFCACHE_OK) {
+      for (n = 0; sgfcache_get_game(&cache, n, &flat); n++)
+	cache_sum += flat_move_sum(&flat);
+      sgfcache_close(&cache);
+    }
+    cache_time += bench_time() - t;
+  }
+
+  printf("%d files\n", argc);
+  printf("parse and flatten: %8.3f s\n", parse_time);
+  printf("open cache:        %8.3f s\n", cache_time);
+  if (parse_sum != cache_sum) {
+    printf("move sums differ: %lu and %lu\n", parse_sum, cache_sum);
+    failures++;
+  }
+
+  return failures > 0;
+}
+
+
+/*
+ * Index each collection file and compare the time for the prescan
+ * with that of parsing the whole file. Then parse one game from the
+ * middle of the file through the index and check it against the
+ * full parse.
+ */
+
+int
+bench_index(int argc, char *argv[])
+{
+  int failures = 0;
+  int k;
+
+  for (k = 0; k < argc; k++) {
+    SGFParser parser;
+    SGFIndex index;
+    SGFNode *root;
+    SGFNode *game;
+    SGFNode *single;
+    double index_time, parse_time, game_time;
+    double t;
+    int n;
+
+    t = bench_time();
+    if (sgf_index_build_file(&parser, argv[k], &index) != SGF_OK) {
+      sgfparser_perror(&parser, stderr);
+      failures++;
+      continue;
+    }
+    index_time = bench_time() - t;
+
+    t = bench_time();
+    readsgffile_ctx(&parser, argv[k], &root);
+    parse_time = bench_time() - t;
+
+    n = index.ngames / 2;
+    t = bench_time();
+    readsgfgame_ctx(&parser, argv[k], &index, n, &single);
+    game_time = bench_time() - t;
+
+    for (game = root; game && n > 0; game = game->next)
+      n--;
+    if (!game || !single || single->next
+	|| !sgf_trees_equal(game->child, single->child)) {
+      fprintf(stderr, "%s: indexed game differs\n", argv[k]);
+      failures++;
+    }
+
+    printf("%s: %d games\n", argv[k], index.ngames);
+    printf("  index %.3f s, full parse %.3f s, game %d alone %.6f s\n",
+	   index_time, parse_time, index.ngames / 2, game_time);
+
+    sgfFreeNode(single);
+    sgfFreeNode(root);
+    sgf_index_free(&index);
+  }
+
+  return failures > 0;
+}
+
+
+
+/*
+ * Synthetic game of nnodes moves, each with a comment of about
+ * comment_length bytes and an escaped ']' now and then. This is the
+ * kind of input where the vectorized delimiter search pays off.
+ */
+
+static char *
+commented_game(int nnodes, int comment_length, unsigned long *size)
+{
+  static const char words[] = "black should tenuki here since the ko ";
+  char *buffer = xalloc(nnodes * (comment_length + 32) + 64);
+  char *p = buffer;
+  int n, k;
+
+  p += sprintf(p, "(;FF[4]GM[1]SZ[19]");
+  for (n = 0; n < nnodes; n++) {
+    p += sprintf(p, ";%c[%c%c]C[", n % 2 ? 'W' : 'B',
+		 'a' + n % 19, 'a' + (n / 19) % 19);
+    for (k = 0; k < comment_length; k++)
+      *p++ = words[(n + k) % (sizeof(words) - 1)];
+    if (n % 8 == 0)
+      p += sprintf(p, " \\] [1\\]");
+    *p++ = ']';
+  }
+  p += sprintf(p, ")\n");
+
+  *size = p - buffer;
+  return buffer;
+}
+
+
+/*
+ * Parse a synthetic comment heavy game and each of the given files
+ * from memory with every delimiter search the CPU supports. The trees
+ * must equal those of the scalar version.
+ */
+
+int
+bench_delim(int argc, char *argv[])
+{
+  static const char *names[] = {"scalar", "sse2", "avx2"};
+  int failures = 0;
+  int k;
+
+  for (k = -1; k < argc; k++) {
+    const char *name = k < 0 ? "synthetic" : argv[k];
+    SGFParser parser;
+    SGFNode *reference = NULL;
+    unsigned long size;
+    char *buffer;
+    int repeat;
+    int impl;
+
+    if (k < 0)
+      buffer = commented_game(20000, 400, &size);
+    else {
+      long length = file_size(argv[k]);
+      FILE *input = fopen(argv[k], "rb");
+      if (length < 0 || !input) {
+	fprintf(stderr, "%s: cannot read\n", argv[k]);
+	if (input)
+	  fclose(input);
+	failures++;
+	continue;
+      }
+      buffer = xalloc(length + 1);
+      size = fread(buffer, 1, length, input);
+      fclose(input);
+    }
+
+    repeat = 1 + 50000000 / (size + 1);
+    printf("%s: %lu bytes\n", name, size);
+    for (impl = SGF_DELIM_SCALAR; impl <= SGF_DELIM_AVX2; impl++) {
+      SGFNode *root = NULL;
+      double t;
+      int r;
+
+      if (!sgf_set_delim_impl(impl))
+	continue;
+
+      t = bench_time();
+      for (r = 0; r < repeat; r++) {
+	sgfFreeNode(root);
+	readsgfmem_ctx(&parser, buffer, size, &root);
+      }
+      t = bench_time() - t;
+      printf("  %-6s %8.1f MB/s\n", names[impl],
+	     repeat * (size / 1048576.0) / (t > 0.0 ? t : 1e-9));
+
+      if (!reference)
+	reference = root;
+      else {
+	if (!sgf_trees_equal(reference, root)) {
+	  fprintf(stderr, "%s: %s tree differs\n", name, names[impl]);
+	  failures++;
+	}
+	sgfFreeNode(root);
+      }
+    }
+
+    sgfFreeNode(reference);
+    free(buffer);
+  }
+
+  sgf_set_delim_impl(sgf_delim_impl());
+  return failures > 0;
+}
+
+
+
+/*
+ * Time writing each file with writesgf() to a scratch file and with
+ * writesgf_to_buffer(). The two must give the same text.
+ */
+
+int
+bench_write(int argc, char *argv[])
+{
+  static const char scratch[] = "bench_write.tmp";
+  double file_time = 0.0;
+  double buffer_time = 0.0;
+  unsigned long total = 0;
+  int failures = 0;
+  int k;
+
+  for (k = 0; k < argc; k++) {
+    SGFNode *root = readsgffile(argv[k]);
+    unsigned long size;
+    char *buffer;
+    char *text;
+    long length;
+    FILE *file;
+    double t;
+
+    if (!root) {
+      failures++;
+      continue;
+    }
+
+    t = bench_time();
+    writesgf(root, scratch);
+    file_time += bench_time() - t;
+
+    t = bench_time();
+    buffer = writesgf_to_buffer(root, &size);
+    buffer_time += bench_time() - t;
+    total += size;
+
+    length = file_size(scratch);
+    text = xalloc(length + 1);
+    file = fopen(scratch, "rb");
+    if (!file || fread(text, 1, length, file) != (size_t) length
+	|| (unsigned long) length != size
+	|| memcmp(text, buffer, size) != 0) {
+      fprintf(stderr, "%s: writesgf_to_buffer() differs\n", argv[k]);
+      failures++;
+    }
+    if (file)
+      fclose(file);
+
+    free(text);
+    free(buffer);
+    sgfFreeNode(root);
+  }
+  remove(scratch);
+
+  printf("%d files, %.1f MB written\n", argc, total / 1048576.0);
+  printf("writesgf:           %8.3f s\n", file_time);
+  printf("writesgf_to_buffer: %8.3f s\n", buffer_time);
+
+  return failures > 0;
+}
+
+
+
+/* Scanner callback counting all nodes. */
+
+static int
+count_node_event(void *data, int depth)
+{
+  long *nodes = data;
+
+  UNUSED(depth);
+  (*nodes)++;
+  return SGF_SCAN_CONTINUE;
+}
+
+
+/*
+ * A game of about nnodes nodes. With variations set, every move has
+ * a one move variation beside it, so that the text nests nnodes / 2
+ * levels deep; otherwise the game is a single main line.
+ */
+
+static SGFNode *
+deep_game(long nnodes, int variations)
+{
+  SGFNode *root = sgfNewNode();
+  SGFNode *node = root;
+  char move[3];
+  long n;
+
+  sgfAddProperty(root, "GM", "1");
+  sgfAddProperty(root, "FF", "4");
+  sgfAddProperty(root, "SZ", "19");
+
+  for (n = 1; n < nnodes; n++) {
+    move[0] = 'a' + n % 19;
+    move[1] = 'a' + (n / 19) % 19;
+    move[2] = '\0';
+
+    if (variations && n + 1 < nnodes) {
+      sgfAddProperty(sgfAddChild(node), n % 2 ? "W" : "B", "tt");
+      n++;
+    }
+    node = sgfAddChild(node);
+    sgfAddProperty(node, n % 2 ? "B" : "W", move);
+  }
+
+  return root;
+}
+
+
+/*
+ * Stress the tree algorithms with games of nnodes nodes (a million
+ * by default), one a single main line and one nested as deeply as the
+ * number of nodes allows: build, write, read back, scan, compare and
+ * free each. Nothing may recurse on the depth of the tree.
+ */
+
+int
+bench_deep(int argc, char *argv[])
+{
+  SGFEvents count_events = {NULL, count_node_event, NULL, NULL};
+  long nnodes = argc > 0 ? atol(argv[0]) : 1000000;
+  int failures = 0;
+  int variations;
+
+  if (nnodes < 1)
+    nnodes = 1;
+
+  for (variations = 0; variations <= 1; variations++) {
+    SGFParser parser;
+    SGFNode *root;
+    SGFNode *copy;
+    unsigned long size;
+    long scanned = 0;
+    char *text;
+    double t;
+
+    printf("%s, %ld nodes\n", variations ? "nested variations" : "main line",
+	   nnodes);
+
+    t = bench_time();
+    root = deep_game(nnodes, variations);
+    printf("  build: %8.3f s\n", bench_time() - t);
+
+    t = bench_time();
+    text = writesgf_to_buffer(root, &size);
+    printf("  write: %8.3f s  (%lu bytes)\n", bench_time() - t, size);
+
+    t = bench_time();
+    if (readsgfmem_ctx(&parser, text, size, &copy) != SGF_OK) {
+      sgfparser_perror(&parser, stderr);
+      failures++;
+    }
+    printf("  read:  %8.3f s\n", bench_time() - t);
+
+    t = bench_time();
+    scansgfmem_ctx(&parser, text, size, &count_events, &scanned);
+    printf("  scan:  %8.3f s\n", bench_time() - t);
+
+    if (!copy || !sgf_trees_equal(root, copy) || scanned != nnodes) {
+      fprintf(stderr, "tree read back differs\n");
+      failures++;
+    }
+
+    t = bench_time();
+    sgfFreeNode(root);
+    sgfFreeNode(copy);
+    printf("  free:  %8.3f s  (both trees)\n", bench_time() - t);
+
+    free(text);
+  }
+
+  return failures > 0;
+}
+
+
+/*
+ * Query the previous sibling, child count, depth and subtree size of
+ * every node, as a variation menu or progress display would.
+ * Returns a checksum of the answers.
+ */
+
+static unsigned long
+navigation_sum(SGFNode *root)
+{
+  unsigned long sum = 0;
+  SGFNode *node = root;
+
+  while (node) {
+    sum += (sgfPrev(node) != NULL) + sgfChildCount(node) + sgfDepth(node)
+	   + sgfSubtreeSize(node);
+    if (node->child)
+      node = node->child;
+    else {
+      while (node->parent && !node->next)
+	node = node->parent;
+      node = node->next;
+    }
+  }
+
+  return sum;
+}
+
+
+/*
+ * Time the navigation queries on the games in the given files with
+ * and without the navigation index, and check that both agree.
+ */
+
+int
+bench_nav(int argc, char *argv[])
+{
+  double plain_time = 0.0;
+  double build_time = 0.0;
+  double index_time = 0.0;
+  int failures = 0;
+  int k;
+
+  for (k = 0; k < argc; k++) {
+    SGFNode *root = readsgffile(argv[k]);
+    unsigned long plain;
+    unsigned long indexed;
+    double t;
+
+    if (!root) {
+      failures++;
+      continue;
+    }
+
+    t = bench_time();
+    plain = navigation_sum(root);
+    plain_time += bench_time() - t;
+
+    t = bench_time();
+    sgfBuildIndex(root);
+    build_time += bench_time() - t;
+
+    t = bench_time();
+    indexed = navigation_sum(root);
+    index_time += bench_time() - t;
+
+    if (plain != indexed) {
+      fprintf(stderr, "%s: navigation index differs\n", argv[k]);
+      failures++;
+    }
+    sgfFreeNode(root);
+  }
+
+  printf("without index: %8.3f s\n", plain_time);
+  printf("build index:   %8.3f s\n", build_time);
+  printf("with index:    %8.3f s\n", index_time);
+
+  return failures > 0;
+}
+
+
+/*
+ * Jump to random nodes of the games in the given files with
+ * sgftreeGoto(), once using the saved positions and once replaying
+ * from the root, and check that the boards agree.
+ */
+
+int
+bench_goto(int argc, char *argv[])
+{
+  double goto_time = 0.0;
+  double replay_time = 0.0;
+  long jumps = 0;
+  int failures = 0;
+  int k;
+
+  gg_srand(1);
+  for (k = 0; k < argc; k++) {
+    SGFTree tree;
+    SGFTree scratch;
+    SGFNode **nodes;
+    SGFNode *node;
+    unsigned long nnodes = 0;
+    int n;
+
+    sgftree_clear(&tree);
+    if (!sgftree_readfile(&tree, argv[k])) {
+      failures++;
+      continue;
+    }
+    sgfBuildIndex(tree.root);
+
+    nodes = xalloc(sgfSubtreeSize(tree.root) * sizeof(SGFNode *));
+    for (node = tree.root; node; ) {
+      nodes[nnodes++] = node;
+      if (node->child)
+	node = node->child;
+      else {
+	while (node->parent && !node->next)
+	  node = node->parent;
+	node = node == tree.root ? NULL : node->next;
+      }
+    }
+
+    for (n = 0; n < 200; n++) {
+      Intersection saved[BOARDSIZE];
+      int ko_pos;
+      double t;
+
+      node = nodes[gg_urand() % nnodes];
+
+      t = bench_time();
+      if (!sgftreeGoto(&tree, node))
+	break;
+      goto_time += bench_time() - t;
+      memcpy(saved, board, sizeof(board));
+      ko_pos = board_ko_pos;
+
+      /* Nothing saved: the whole way from the root. */
+      scratch = tree;
+      scratch.checkpoints = NULL;
+      t = bench_time();
+      sgftreeGoto(&scratch, node);
+      replay_time += bench_time() - t;
+      sgftree_clear_checkpoints(&scratch);
+
+      if (memcmp(saved, board, sizeof(board)) != 0 || ko_pos != board_ko_pos) {
+	fprintf(stderr, "%s: position at depth %d differs\n", argv[k],
+		sgfDepth(node));
+	failures++;
+	break;
+      }
+      jumps++;
+    }
+
+    free(nodes);
+    sgftree_free(&tree);
+  }
+
+  printf("%ld jumps\n", jumps);
+  printf("with checkpoints: %8.3f s\n", goto_time);
+  printf("replay from root: %8.3f s\n", replay_time);
+
+  return failures > 0;
+}
+
+
+/* Checksum of the stones on the board. */
+
+static unsigned int
+board_checksum(void)
+{
+  unsigned int sum = 2166136261U;
+  int pos;
+
+  for (pos = BOARDMIN; pos < BOARDMAX; pos++)
+    if (ON_BOARD(pos))
+      sum = (sum ^ board[pos]) * 16777619U;
+
+  return sum;
+}
+
+
+static int
+compare_node_pointers(const void *a, const void *b)
+{
+  SGFNode *na = *(SGFNode * const *) a;
+  SGFNode *nb = *(SGFNode * const *) b;
+
+  return na < nb ? -1 : na > nb;
+}
+
+
+/*
+ * Browse the games in the given files at random with an SGFNavigator:
+ * forward into random variations, back, and now and then a jump to
+ * any node. Every position is checked against sgftreeGoto().
+ */
+
+int
+bench_browse(int argc, char *argv[])
+{
+  double goto_time = 0.0;
+  double browse_time = 0.0;
+  long steps = 0;
+  int failures = 0;
+  int k;
+
+  gg_srand(1);
+  for (k = 0; k < argc && !failures; k++) {
+    SGFTree tree;
+    SGFNavigator nav;
+    SGFNode **nodes;
+    unsigned int *reference;
+    SGFNode *node;
+    unsigned long nnodes = 0;
+    unsigned long n;
+    double t;
+
+    sgftree_clear(&tree);
+    if (!sgftree_readfile(&tree, argv[k])) {
+      failures++;
+      continue;
+    }
+    sgfBuildIndex(tree.root);
+
+    nodes = xalloc(sgfSubtreeSize(tree.root) * sizeof(SGFNode *));
+    for (node = tree.root; node; ) {
+      nodes[nnodes++] = node;
+      if (node->child)
+	node = node->child;
+      else {
+	while (node->parent && !node->next)
+	  node = node->parent;
+	node = node == tree.root ? NULL : node->next;
+      }
+    }
+    qsort(nodes, nnodes, sizeof(SGFNode *), compare_node_pointers);
+
+    /* The position at every node, set up from the root. */
+    reference = xalloc(nnodes * sizeof(unsigned int));
+    t = bench_time();
+    for (n = 0; n < nnodes; n++) {
+      sgftreeGoto(&tree, nodes[n]);
+      reference[n] = board_checksum();
+    }
+    goto_time += bench_time() - t;
+    sgftree_clear_checkpoints(&tree);
+
+    t = bench_time();
+    sgfnav_init(&nav, tree.root);
+    for (n = 0; n < 10 * nnodes; n++) {
+      int r = gg_urand() % 100;
+      SGFNode **found;
+
+      if (r < 5)
+	sgfnav_goto(&nav, nodes[gg_urand() % nnodes]);
+      else if (r < 60 && nav.node->child) {
+	int c = gg_urand() % sgfChildCount(nav.node);
+	for (node = nav.node->child; c > 0; c--)
+	  node = node->next;
+	sgfnav_forward(&nav, node);
+      }
+      else if (!sgfnav_back(&nav))
+	sgfnav_forward(&nav, nav.node->child);
+
+      found = bsearch(&nav.node, nodes, nnodes, sizeof(SGFNode *),
+		      compare_node_pointers);
+      if (!found || reference[found - nodes] != board_checksum()) {
+	fprintf(stderr, "%s: position at depth %d differs\n", argv[k],
+		nav.depth);
+	failures++;
+	break;
+      }
+      steps++;
+    }
+    sgfnav_free(&nav);
+    browse_time += bench_time() - t;
+
+    free(reference);
+    free(nodes);
+    sgftree_free(&tree);
+  }
+
+  printf("%ld steps\n", steps);
+  printf("sgftreeGoto() to every node: %8.3f s\n", goto_time);
+  printf("browsing with SGFNavigator:  %8.3f s\n", browse_time);
+
+  return failures > 0;
+}
+
+
+/* Keep only the first size bytes of a file, as a crash might. */
+
+static int
+truncate_file(const char *filename, long size)
+{
+  FILE *file = fopen(filename, "rb");
+  char *buffer;
+  int ok;
+
+  if (!file)
+    return 0;
+  buffer = xalloc(size > 0 ? size : 1);
+  ok = (long) fread(buffer, 1, size, file) == size;
+  fclose(file);
+
+  if (ok) {
+    file = fopen(filename, "wb");
+    ok = file && (long) fwrite(buffer, 1, size, file) == size;
+    if (file && fclose(file) != 0)
+      ok = 0;
+  }
+  free(buffer);
+  return ok;
+}
+
+
+/*
+ * Journal a tree read lazily from a file: a move and a comment at the
+ * end of the main line and in a variation which is not parsed yet
+ * when the journal starts. The recovered tree must equal the edited
+ * one. Returns the number of failures.
+ */
+
+static int
+journal_lazy_tree(const char *filename)
+{
+  static const char text[] =
+    "(;GM[1]FF[4]SZ[19];B[aa](;W[bb];B[cc])(;W[dd];B[ee];W[ff]))";
+  char sgfname[FILENAME_MAX];
+  SGFTree tree;
+  SGFTree copy;
+  SGFNode *node;
+  FILE *file;
+  int failures = 0;
+
+  gg_snprintf(sgfname, sizeof(sgfname), "%s.sgf", filename);
+  file = fopen(sgfname, "wb");
+  if (!file || fputs(text, file) == EOF || fclose(file) != 0) {
+    fprintf(stderr, "%s: cannot write\n", sgfname);
+    return 1;
+  }
+
+  sgftree_clear(&tree);
+  sgftree_clear(&copy);
+  if (!sgftree_readfile_lazy(&tree, sgfname)
+      || !sgftree_journal_start(&tree, filename, 0)) {
+    fprintf(stderr, "%s: cannot journal lazily read tree\n", sgfname);
+    sgftree_free(&tree);
+    remove(sgfname);
+    return 1;
+  }
+
+  for (node = tree.root; node->child; node = node->child)
+    ;
+  sgftreeSetLastNode(&tree, node);
+  sgftreeAddPlay(&tree, WHITE, 5, 5);
+  sgftreeAddComment(&tree, "main line");
+
+  node = sgfNextVariation(tree.root->child->child);
+  if (node) {
+    for (; node->child; node = node->child)
+      ;
+    sgftreeSetLastNode(&tree, node);
+    sgftreeAddPlay(&tree, BLACK, 6, 6);
+    sgftreeAddComment(&tree, "variation");
+  }
+  sgftree_journal_close(&tree);
+
+  if (!node
+      || !sgftree_journal_recover(&copy, filename, 0)
+      || !sgf_trees_equal(tree.root, copy.root)) {
+    fprintf(stderr, "lazily read tree recovered from a journal differs\n");
+    failures++;
+  }
+
+  sgftree_free(&tree);
+  sgftree_free(&copy);
+  remove(sgfname);
+  remove(filename);
+  return failures;
+}
+
+
+/*
+ * Record a game of nmoves moves (10000 by default), with a short
+ * variation every 50 moves, in a journal and rebuild it from there:
+ * after a crash which tore the last record, from a fresh snapshot,
+ * and from a journal cut in the middle of a record. Last, journal a
+ * tree read lazily from a file.
+ */
+
+int
+bench_journal(int argc, char *argv[])
+{
+  long nmoves = argc > 0 ? atol(argv[0]) : 10000;
+  const char *filename = argc > 1 ? argv[1] : "bench.sgfj";
+  SGFTree tree;
+  SGFTree copy;
+  SGFTree again;
+  FILE *file;
+  long size;
+  long n;
+  int failures = 0;
+  double t;
+
+  sgftree_clear(&tree);
+  sgftree_clear(&copy);
+  sgftree_clear(&again);
+
+  t = bench_time();
+  if (!sgftree_journal_start(&tree, filename, 64))
+    return 1;
+  sgftreeCreateHeaderNode(&tree, 19, 6.5, 0);
+  for (n = 0; n < nmoves; n++) {
+    sgftreeAddPlay(&tree, n % 2 ? WHITE : BLACK, n % 19, (n / 19) % 19);
+    if (n % 50 == 49) {
+      SGFNode *node = tree.lastnode;
+      sgftreeStartVariant(&tree);
+      sgftreeAddComment(&tree, "variation");
+      sgftreeSetLastNode(&tree, node);
+    }
+  }
+  sgftreeWriteResult(&tree, 3.5, 1);
+  sgftree_journal_sync(&tree);
+  t = bench_time() - t;
+  size = file_size(filename);
+  printf("record:   %8.3f s  (%.2f us per move, %ld bytes)\n",
+	 t, 1e6 * t / (nmoves > 0 ? nmoves : 1), size);
+
+  /* A crash in the middle of writing a record. */
+  file = fopen(filename, "ab");
+  if (file) {
+    fputs("N 1 0 0 00000000\nP 3", file);
+    fclose(file);
+  }
+  t = bench_time();
+  if (!sgftree_journal_recover(&copy, filename, 64)
+      || !sgf_trees_equal(tree.root, copy.root)
+      || file_size(filename) != size) {
+    fprintf(stderr, "tree recovered after a torn record differs\n");
+    failures++;
+  }
+  printf("recover:  %8.3f s\n", bench_time() - t);
+
+  /* A new snapshot of the recovered tree, and one more move. */
+  t = bench_time();
+  if (!sgftree_journal_start(&copy, filename, 0)) {
+    sgftree_free(&tree);
+    sgftree_free(&copy);
+    return 1;
+  }
+  printf("snapshot: %8.3f s  (%ld bytes)\n", bench_time() - t,
+	 file_size(filename));
+  sgftreeAddPlay(&copy, BLACK, 3, 3);
+  sgftree_journal_close(&copy);
+
+  /* The snapshot is written as writesgf() would, so compare as text. */
+  if (!sgftree_journal_recover(&again, filename, 0)
+      || again.lastnode == NULL
+      || again.lastnode->props == NULL) {
+    fprintf(stderr, "tree recovered from a snapshot differs\n");
+    failures++;
+  }
+  else {
+    unsigned long size1, size2;
+    char *text1 = writesgf_to_buffer(copy.root, &size1);
+    char *text2 = writesgf_to_buffer(again.root, &size2);
+
+    if (size1 != size2 || memcmp(text1, text2, size1) != 0) {
+      fprintf(stderr, "tree recovered from a snapshot differs\n");
+      failures++;
+    }
+    free(text1);
+    free(text2);
+  }
+  sgftree_free(&again);
+
+  /* Cut into the last record: the move is lost, its node is not. */
+  sgftree_clear(&again);
+  truncate_file(filename, file_size(filename) - 3);
+  if (!sgftree_journal_recover(&again, filename, 0)
+      || again.lastnode == NULL
+      || again.lastnode->props != NULL
+      || again.lastnode->parent == NULL) {
+    fprintf(stderr, "tree recovered from a cut journal is wrong\n");
+    failures++;
+  }
+
+  sgftree_free(&tree);
+  sgftree_free(&copy);
+  sgftree_free(&again);
+  remove(filename);
+
+  failures += journal_lazy_tree(filename);
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures > 0;
+}
+
+
+
+#define BENCH_BOOK_MOVES 30
+
+/*
+ * Follow the main line of a game as book_add_game() does and look up
+ * each position in the book. One of the moves listed must lead to the
+ * position the game went on to, up to orientation. Returns the number
+ * of positions where it does not.
+ */
+
+static int
+book_check_game(const OpeningBook *book, SGFNode *root, long *lookups,
+		double *lookup_time)
+{
+  SGFNode *node;
+  SGFProperty *prop;
+  BookMove moves[BOARDMAX + 1];
+  int boardsize = 19;
+  int nmoves = 0;
+  int failures = 0;
+
+  sgfGetIntProperty(root, "SZ", &boardsize);
+  if (boardsize != book->boardsize)
+    return 0;
+
+  board_size = boardsize;
+  clear_board();
+  begin_setup();
+  for (prop = root->props; prop; prop = prop->next)
+    if (prop->name == SGFAB || prop->name == SGFAW) {
+      int i, j, k;
+      for (k = 0; sgfNextPoint(prop, &k, &i, &j, board_size); )
+	if (board[POS(i, j)] == EMPTY)
+	  add_stone(POS(i, j), prop->name == SGFAB ? BLACK : WHITE);
+    }
+  end_setup();
+
+  for (node = root; node && nmoves < BENCH_BOOK_MOVES; node = node->child) {
+    Hash_data played;
+    Hash_data hd;
+    double t;
+    int move = NO_MOVE;
+    int color = EMPTY;
+    int n;
+    int k;
+
+    for (prop = node->props; prop; prop = prop->next) {
+      if (node != root
+	  && (prop->name == SGFAB || prop->name == SGFAW
+	      || prop->name == SGFAE))
+	break;
+      if (prop->name == SGFB || prop->name == SGFW) {
+	move = get_sgfmove(prop);
+	color = prop->name == SGFB ? BLACK : WHITE;
+      }
+    }
+    if (prop)
+      break;
+    if (color == EMPTY)
+      continue;
+
+    t = bench_time();
+    n = book_lookup(book, color, moves, BOARDMAX + 1);
+    *lookup_time += bench_time() - t;
+    (*lookups)++;
+
+    if ((!ON_BOARD(move) && move != PASS_MOVE)
+	|| !trymove(move, color, "book_check_game", NO_MOVE))
+      break;
+    hashdata_calc_orientation_invariant(&played, board, board_ko_pos);
+    popgo();
+
+    for (k = 0; k < n; k++) {
+      if (!trymove(moves[k].move, color, "book_check_game", NO_MOVE))
+	continue;
+      hashdata_calc_orientation_invariant(&hd, board, board_ko_pos);
+      popgo();
+      if (hashdata_is_equal(hd, played))
+	break;
+    }
+    if (k == n)
+      failures++;
+
+    trymove(move, color, "book_check_game", NO_MOVE);
+    nmoves++;
+  }
+
+  while (stackp > 0)
+    popgo();
+  return failures;
+}
+
+
+/*
+ * Build an opening book of the first moves of the games in the given
+ * files, write it, and look up every position of those games in the
+ * mapped book.
+ */
+
+int
+bench_book(int argc, char *argv[])
+{
+  const char *bookname = "bench.book";
+  BookBuilder *builder;
+  OpeningBook book;
+  double lookup_time = 0.0;
+  double t;
+  long lookups = 0;
+  long games = 0;
+  int failures = 0;
+  int k;
+
+  builder = book_builder_new(0, BENCH_BOOK_MOVES);
+  t = bench_time();
+  for (k = 0; k < argc; k++) {
+    int n = book_add_file(builder, argv[k]);
+    if (n < 0)
+      failures++;
+    else
+      games += n;
+  }
+  printf("build:  %8.3f s  (%ld games)\n", bench_time() - t, games);
+
+  t = bench_time();
+  if (!book_write(builder, bookname)) {
+    fprintf(stderr, "%s: cannot write book\n", bookname);
+    book_builder_free(builder);
+    return 1;
+  }
+  book_builder_free(builder);
+  printf("write:  %8.3f s  (%ld bytes)\n", bench_time() - t,
+	 file_size(bookname));
+
+  if (!book_open(&book, bookname)) {
+    fprintf(stderr, "%s: cannot open book\n", bookname);
+    return 1;
+  }
+  printf("%u positions, %u moves\n", book.npositions, book.nmoves);
+
+  for (k = 0; k < argc; k++) {
+    SGFParser ctx;
+    SGFIndex index;
+    int n;
+
+    if (sgf_index_build_file(&ctx, argv[k], &index) != SGF_OK) {
+      sgf_index_free(&index);
+      continue;
+    }
+    for (n = 0; n < index.ngames; n++) {
+      SGFNode *root;
+
+      if (readsgfgame_ctx(&ctx, argv[k], &index, n, &root) != SGF_OK)
+	continue;
+      failures += book_check_game(&book, root, &lookups, &lookup_time);
+      sgfFreeNode(root);
+    }
+    sgf_index_free(&index);
+  }
+  printf("lookup: %8.3f s  (%ld positions, %.2f us each)\n", lookup_time,
+	 lookups, 1e6 * lookup_time / (lookups > 0 ? lookups : 1));
+
+  book_close(&book);
+  remove(bookname);
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures > 0;
+}
+
+
+
+/*
+ * Synthetic collection of ngames board diagrams: about a third of the
+ * points of each get a black stone and a third a white one, each
+ * listed as a value of its own as editors write them, and a second
+ * node marks the whole board with a range.
+ */
+
+static char *
+diagram_collection(int ngames, unsigned long *size)
+{
+  char *buffer = xalloc(ngames * (2 * 19 * 19 * 4 + 128) + 1);
+  char *p = buffer;
+  int n, color, pos;
+
+  for (n = 0; n < ngames; n++) {
+    unsigned char stones[19 * 19];
+
+    for (pos = 0; pos < 19 * 19; pos++)
+      stones[pos] = gg_urand() % 3;
+
+    p += sprintf(p, "(;FF[4]GM[1]SZ[19]");
+    for (color = 1; color <= 2; color++) {
+      p += sprintf(p, "%s", color == 1 ? "AB" : "AW");
+      for (pos = 0; pos < 19 * 19; pos++)
+	if (stones[pos] == color)
+	  p += sprintf(p, "[%c%c]", 'a' + pos % 19, 'a' + pos / 19);
+    }
+    p += sprintf(p, ";MA[aa:ss]TR[dd][pd][dp][pp])\n");
+  }
+
+  *size = p - buffer;
+  return buffer;
+}
+
+
+/* Mark the points of all properties called name in node. */
+
+static void
+node_points(SGFNode *node, short name, unsigned char points[19 * 19])
+{
+  SGFProperty *prop;
+  int i, j, k;
+
+  memset(points, 0, 19 * 19);
+  for (prop = node->props; prop; prop = prop->next)
+    if (prop->name == name)
+      for (k = 0; sgfNextPoint(prop, &k, &i, &j, 19); )
+	points[i * 19 + j] = 1;
+}
+
+
+/*
+ * Parse a synthetic collection of board diagrams and the given files,
+ * count the properties and bytes the trees take, and check that the
+ * points survive a round trip through the writer.
+ */
+
+int
+bench_points(int argc, char *argv[])
+{
+  static const short names[] = {
+    SGFAB, SGFAW, SGFAE, SGFCR, SGFMA, SGFSQ, SGFTR, SGFTB, SGFTW
+  };
+  int failures = 0;
+  int k;
+
+  gg_srand(1);
+  for (k = -1; k < argc; k++) {
+    const char *name = k < 0 ? "synthetic" : argv[k];
+    SGFParser parser;
+    SGFNode *root = NULL;
+    SGFNode *copy = NULL;
+    SGFNode *game, *node, *other;
+    unsigned long size, written;
+    unsigned long nprops = 0;
+    unsigned long npoints = 0;
+    unsigned long bytes = 0;
+    char *buffer;
+    char *text;
+    double t;
+
+    if (k < 0)
+      buffer = diagram_collection(2000, &size);
+    else if ((buffer = read_file(argv[k], &size)) == NULL) {
+      fprintf(stderr, "%s: cannot read\n", argv[k]);
+      failures++;
+      continue;
+    }
+
+    t = bench_time();
+    if (readsgfmem_ctx(&parser, buffer, size, &root) != SGF_OK) {
+      fprintf(stderr, "%s: cannot parse\n", name);
+      free(buffer);
+      failures++;
+      continue;
+    }
+    t = bench_time() - t;
+
+    for (game = root; game; game = game->next)
+      for (node = game; node; node = node->child) {
+	SGFProperty *prop;
+	for (prop = node->props; prop; prop = prop->next) {
+	  nprops++;
+	  npoints += sgfPointCount(prop);
+	  bytes += sizeof(SGFProperty);
+	  if (prop->flags & SGFPROP_POINTS)
+	    bytes += sizeof(SGFPointSet) + strlen(prop->value);
+	  else
+	    bytes += strlen(prop->value) + 1;
+	}
+      }
+
+    text = writesgf_to_buffer(root, &written);
+    readsgfmem_ctx(&parser, text, written, &copy);
+
+    /* Only the main lines are compared. */
+    for (game = root, other = copy; game && other;
+	 game = game->next, other = other->next)
+      for (node = game; node && other; node = node->child) {
+	unsigned char a[19 * 19], b[19 * 19];
+	unsigned int n;
+
+	if (node != game)
+	  other = other->child;
+	if (!other)
+	  break;
+	for (n = 0; n < sizeof(names) / sizeof(names[0]); n++) {
+	  node_points(node, names[n], a);
+	  node_points(other, names[n], b);
+	  if (memcmp(a, b, sizeof(a)) != 0) {
+	    fprintf(stderr, "%s: points differ after writing\n", name);
+	    failures++;
+	    break;
+	  }
+	}
+      }
+
+    printf("%s: %lu bytes read, %lu written\n", name, size, written);
+    printf("  parse %8.3f s, %lu properties for %lu points, %lu bytes\n",
+	   t, nprops, npoints, bytes);
+
+    free(text);
+    sgfFreeNode(copy);
+    sgfFreeNode(root);
+    free(buffer);
+  }
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures > 0;
+}
+
+
+/* Checksum of the size and liberties of the string of each stone. */
+
+static unsigned int
+string_checksum(void)
+{
+  unsigned int sum = 2166136261U;
+  int pos;
+
+  for (pos = BOARDMIN; pos < BOARDMAX; pos++)
+    if (IS_STONE(board[pos]))
+      sum = (sum ^ (countstones(pos) * MAXLIBS + countlib(pos))) * 16777619U;
+
+  return sum;
+}
+
+
+/*
+ * Apply the setup stones on the main line of game to a cleared board,
+ * one add_stone() or remove_stone() at a time or as batches. Returns
+ * the number of stones changed, or -1 if the board size is not
+ * supported.
+ */
+
+static long
+setup_game(SGFNode *game, int batched)
+{
+  SGFNode *node;
+  SGFProperty *prop;
+  int boardsize = 19;
+  long nstones = 0;
+
+  sgfGetIntProperty(game, "SZ", &boardsize);
+  if (boardsize < MIN_BOARD || boardsize > MAX_BOARD)
+    return -1;
+
+  board_size = boardsize;
+  clear_board();
+  for (node = game; node; node = node->child) {
+    if (batched)
+      begin_setup();
+    for (prop = node->props; prop; prop = prop->next) {
+      int i, j, k;
+      if (prop->name != SGFAB && prop->name != SGFAW && prop->name != SGFAE)
+	continue;
+      for (k = 0; sgfNextPoint(prop, &k, &i, &j, board_size); ) {
+	if (prop->name == SGFAE) {
+	  if (IS_STONE(board[POS(i, j)])) {
+	    remove_stone(POS(i, j));
+	    nstones++;
+	  }
+	}
+	else if (board[POS(i, j)] == EMPTY) {
+	  add_stone(POS(i, j), prop->name == SGFAB ? BLACK : WHITE);
+	  nstones++;
+	}
+      }
+    }
+    if (batched)
+      end_setup();
+  }
+
+  return nstones;
+}
+
+
+/*
+ * Set up the positions of a synthetic problem collection and the
+ * given files stone by stone and in batches, and check that both give
+ * the same board, hash and strings.
+ */
+
+int
+bench_setup(int argc, char *argv[])
+{
+  int failures = 0;
+  int k;
+
+  gg_srand(1);
+  hash_init();
+  for (k = -1; k < argc; k++) {
+    const char *name = k < 0 ? "synthetic" : argv[k];
+    SGFParser parser;
+    SGFNode *root = NULL;
+    SGFNode *game;
+    unsigned long size;
+    long ngames = 0;
+    long nstones = 0;
+    double single = 0.0;
+    double batched = 0.0;
+    char *buffer;
+
+    if (k < 0)
+      buffer = diagram_collection(500, &size);
+    else if ((buffer = read_file(argv[k], &size)) == NULL) {
+      fprintf(stderr, "%s: cannot read\n", argv[k]);
+      failures++;
+      continue;
+    }
+
+    if (readsgfmem_ctx(&parser, buffer, size, &root) != SGF_OK) {
+      fprintf(stderr, "%s: cannot parse\n", name);
+      free(buffer);
+      failures++;
+      continue;
+    }
+
+    for (game = root; game; game = game->next) {
+      Hash_data hash, check;
+      unsigned int sum;
+      unsigned int nstrings;
+      long n;
+      double t;
+
+      t = bench_time();
+      n = setup_game(game, 0);
+      single += bench_time() - t;
+      if (n < 0)
+	continue;
+      hash = board_hash;
+      sum = board_checksum();
+      nstrings = string_checksum();
+
+      t = bench_time();
+      setup_game(game, 1);
+      batched += bench_time() - t;
+
+      hashdata_recalc(&check, board, board_ko_pos);
+      if (!hashdata_is_equal(hash, board_hash)
+	  || !hashdata_is_equal(check, board_hash)
+	  || sum != board_checksum() || nstrings != string_checksum()) {
+	fprintf(stderr, "%s: game %ld differs after batched setup\n",
+		name, ngames + 1);
+	failures++;
+      }
+      ngames++;
+      nstones += n;
+    }
+
+    printf("%s: %ld games, %ld setup stones\n", name, ngames, nstones);
+    printf("  stone by stone %8.3f s, batched %8.3f s\n", single, batched);
+
+    sgfFreeNode(root);
+    free(buffer);
+  }
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures > 0;
+}
+
+
+/*
+ * Play the main line of every game in the given files, then take the
+ * moves back one to three at a time with undo_move() and check the
+ * position against the one seen on the way forward. For comparison
+ * the game is also replayed from the start for every undo, which is
+ * what undo_move() used to do.
+ */
+
+int
+bench_undo(int argc, char *argv[])
+{
+  struct undo_check {
+    Hash_data hash;
+    unsigned int board;
+    unsigned int strings;
+    int ko_pos;
+    int white_captured;
+    int black_captured;
+  } *check = xalloc((MAX_MOVE_HISTORY + 1) * sizeof(struct undo_check));
+  double undo_time = 0.0;
+  double replay_time = 0.0;
+  long nundos = 0;
+  int failures = 0;
+  int k;
+
+  hash_init();
+  for (k = 0; k < argc; k++) {
+    SGFParser parser;
+    SGFNode *root = NULL;
+    SGFNode *game;
+    unsigned long size;
+    char *buffer = read_file(argv[k], &size);
+
+    if (!buffer || readsgfmem_ctx(&parser, buffer, size, &root) != SGF_OK) {
+      fprintf(stderr, "%s: cannot read\n", argv[k]);
+      free(buffer);
+      failures++;
+      continue;
+    }
+
+    for (game = root; game; game = game->next) {
+      int moves[MAX_MOVE_HISTORY];
+      int colors[MAX_MOVE_HISTORY];
+      int nmoves = 0;
+      int step = 0;
+      SGFNode *node;
+      double t;
+
+      if (setup_game(game, 1) < 0)
+	continue;
+
+      for (node = game; node && nmoves < MAX_MOVE_HISTORY;
+	   node = node->child) {
+	SGFProperty *prop;
+	struct undo_check *c = &check[nmoves];
+
+	c->hash = board_hash;
+	c->board = board_checksum();
+	c->strings = string_checksum();
+	c->ko_pos = board_ko_pos;
+	c->white_captured = white_captured;
+	c->black_captured = black_captured;
+
+	for (prop = node->props; prop; prop = prop->next)
+	  if (prop->name == SGFB || prop->name == SGFW) {
+	    int move = get_sgfmove(prop);
+	    int color = prop->name == SGFB ? BLACK : WHITE;
+	    if (move == PASS_MOVE
+		|| (ON_BOARD(move) && is_legal(move, color))) {
+	      play_move(move, color);
+	      moves[nmoves] = move;
+	      colors[nmoves] = color;
+	      nmoves++;
+	    }
+	    break;
+	  }
+      }
+
+      while (nmoves > 0) {
+	struct undo_check *c;
+	int n = 1 + step++ % 3;
+	int m;
+
+	if (n > nmoves)
+	  n = nmoves;
+	t = bench_time();
+	undo_move(n);
+	undo_time += bench_time() - t;
+	nmoves -= n;
+	nundos++;
+
+	c = &check[nmoves];
+	if (!hashdata_is_equal(c->hash, board_hash)
+	    || c->board != board_checksum()
+	    || c->strings != string_checksum()
+	    || c->ko_pos != board_ko_pos
+	    || c->white_captured != white_captured
+	    || c->black_captured != black_captured) {
+	  fprintf(stderr, "%s: position after undo to move %d differs\n",
+		  argv[k], nmoves);
+	  failures++;
+	  break;
+	}
+
+	t = bench_time();
+	setup_game(game, 1);
+	for (m = 0; m < nmoves; m++)
+	  play_move(moves[m], colors[m]);
+	replay_time += bench_time() - t;
+      }
+    }
+
+    sgfFreeNode(root);
+    free(buffer);
+  }
+
+  free(check);
+  printf("%ld undos\n", nundos);
+  printf("undo_move():       %8.3f s\n", undo_time);
+  printf("replay from start: %8.3f s\n", replay_time);
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures > 0;
+}
+
+
+/* The main line moves of one game, for bench_threads(). */
+struct thread_game {
+  int boardsize;
+  int nmoves;
+  int moves[MAX_MOVE_HISTORY];
+  int colors[MAX_MOVE_HISTORY];
+  unsigned int sum;
+};
+
+struct thread_work {
+  struct thread_game *games;
+  int ngames;
+  int first;
+  int step;
+};
+
+
+/*
+ * Play a game on ctx, or on the default board if ctx is NULL, and at
+ * every tenth move try each legal move for the side to play, summing
+ * up the liberties of the new stone.
+ */
+
+static unsigned int
+thread_game_sum(struct board_context *ctx, const struct thread_game *game)
+{
+  unsigned int sum = 2166136261U;
+  int libs[MAXLIBS];
+  int m, i, j;
+
+  if (ctx)
+    clear_board_ctx(ctx);
+  else {
+    board_size = game->boardsize;
+    clear_board();
+  }
+
+  for (m = 0; m < game->nmoves; m++) {
+    int move = game->moves[m];
+    int color = game->colors[m];
+
+    if (m % 10 == 0)
+      for (i = 0; i < game->boardsize; i++)
+	for (j = 0; j < game->boardsize; j++) {
+	  int pos = POS(i, j);
+	  int n, lib, libsum;
+	  if ((ctx ? board_color_ctx(ctx, pos) : board[pos]) != EMPTY
+	      || !(ctx ? trymove_ctx(ctx, pos, color, NULL, NO_MOVE)
+		   : trymove(pos, color, NULL, NO_MOVE)))
+	    continue;
+	  if (ctx) {
+	    n = countlib_ctx(ctx, pos);
+	    findlib_ctx(ctx, pos, MAXLIBS, libs);
+	    popgo_ctx(ctx);
+	  }
+	  else {
+	    n = countlib(pos);
+	    findlib(pos, MAXLIBS, libs);
+	    popgo();
+	  }
+	  /* The order of the liberties depends on how the strings
+	   * were built up, so only their sum goes into the checksum.
+	   */
+	  libsum = 0;
+	  for (lib = 0; lib < n && lib < MAXLIBS; lib++)
+	    libsum += libs[lib];
+	  sum = (sum ^ (pos * MAXLIBS + n)) * 16777619U;
+	  sum = (sum ^ libsum) * 16777619U;
+	}
+
+    if (ctx ? is_legal_ctx(ctx, move, color) : is_legal(move, color)) {
+      if (ctx)
+	play_move_ctx(ctx, move, color);
+      else
+	play_move(move, color);
+    }
+  }
+
+  return sum;
+}
+
+
+/* Read the main lines of the games in the given files for
+ * bench_threads() and bench_sizes(). Returns the number of files that
+ * could not be read.
+ */
+
+static int
+load_thread_games(int argc, char *argv[], struct thread_game **gamesp,
+		  int *ngamesp)
+{
+  struct thread_game *games = NULL;
+  int ngames = 0;
+  int failures = 0;
+  int k;
+
+  for (k = 0; k < argc; k++) {
+    SGFParser parser;
+    SGFNode *root = NULL;
+    SGFNode *game, *node;
+    unsigned long size;
+    char *buffer = read_file(argv[k], &size);
+
+    if (!buffer || readsgfmem_ctx(&parser, buffer, size, &root) != SGF_OK) {
+      fprintf(stderr, "%s: cannot read\n", argv[k]);
+      free(buffer);
+      failures++;
+      continue;
+    }
+
+    for (game = root; game; game = game->next) {
+      struct thread_game *tg;
+      int boardsize = 19;
+
+      sgfGetIntProperty(game, "SZ", &boardsize);
+      if (boardsize < MIN_BOARD || boardsize > MAX_BOARD)
+	continue;
+
+      games = xrealloc(games, (ngames + 1) * sizeof(struct thread_game));
+      tg = &games[ngames++];
+      tg->boardsize = boardsize;
+      tg->nmoves = 0;
+      board_size = boardsize;
+      for (node = game; node && tg->nmoves < MAX_MOVE_HISTORY;
+	   node = node->child) {
+	SGFProperty *prop;
+	for (prop = node->props; prop; prop = prop->next)
+	  if (prop->name == SGFB || prop->name == SGFW) {
+	    tg->moves[tg->nmoves] = get_sgfmove(prop);
+	    tg->colors[tg->nmoves] = prop->name == SGFB ? BLACK : WHITE;
+	    tg->nmoves++;
+	    break;
+	  }
+      }
+    }
+
+    sgfFreeNode(root);
+    free(buffer);
+  }
+
+  *gamesp = games;
+  *ngamesp = ngames;
+  return failures;
+}
+
+
+/* Work through every step-th game from first, each on a new context. */
+
+static void *
+thread_main(void *data)
+{
+  struct thread_work *work = data;
+  int g;
+
+  for (g = work->first; g < work->ngames; g += work->step) {
+    struct board_context *ctx
+      = board_context_new(work->games[g].boardsize);
+    work->games[g].sum = thread_game_sum(ctx, &work->games[g]);
+    board_context_free(ctx);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Play the main lines of the given files with a trymove() workload,
+ * first on the default board and then split over nthreads threads
+ * with a board context each, and check that all give the same sums.
+ * Without pthreads the contexts are worked through one after another.
+ */
+
+int
+bench_threads(int argc, char *argv[])
+{
+  int nthreads = atoi(argv[0]);
+  struct thread_game *games = NULL;
+  struct thread_work *work;
+  unsigned int *reference;
+  int ngames = 0;
+  int failures = 0;
+  double t, single_time, threads_time;
+  int g, k;
+
+  if (nthreads < 1) {
+    fprintf(stderr, "bad number of threads: %s\n", argv[0]);
+    return 1;
+  }
+
+  /* The hash tables are shared and must be set up before the threads
+   * start.
+   */
+  hash_init();
+  failures = load_thread_games(argc - 1, argv + 1, &games, &ngames);
+
+  reference = xalloc((ngames + 1) * sizeof(unsigned int));
+  t = bench_time();
+  for (g = 0; g < ngames; g++)
+    reference[g] = thread_game_sum(NULL, &games[g]);
+  single_time = bench_time() - t;
+
+  work = xalloc(nthreads * sizeof(struct thread_work));
+  for (k = 0; k < nthreads; k++) {
+    work[k].games = games;
+    work[k].ngames = ngames;
+    work[k].first = k;
+    work[k].step = nthreads;
+  }
+
+  t = bench_time();
+#if HAVE_PTHREAD_H
+  {
+    pthread_t *threads = xalloc(nthreads * sizeof(pthread_t));
+    for (k = 0; k < nthreads; k++)
+      if (pthread_create(&threads[k], NULL, thread_main, &work[k]) != 0) {
+	fprintf(stderr, "cannot start thread %d\n", k);
+	thread_main(&work[k]);
+	threads[k] = pthread_self();
+      }
+    for (k = 0; k < nthreads; k++)
+      if (!pthread_equal(threads[k], pthread_self()))
+	pthread_join(threads[k], NULL);
+    free(threads);
+  }
+#else
+  for (k = 0; k < nthreads; k++)
+    thread_main(&work[k]);
+#endif
+  threads_time = bench_time() - t;
+
+  for (g = 0; g < ngames; g++)
+    if (games[g].sum != reference[g]) {
+      fprintf(stderr, "game %d differs on a board context\n", g + 1);
+      failures++;
+    }
+
+  printf("%d games\n", ngames);
+  printf("default board:        %8.3f s\n", single_time);
+  printf("%2d threads, contexts: %8.3f s\n", nthreads, threads_time);
+  printf("%s\n", failures ? "FAILED" : "ok");
+
+  free(work);
+  free(reference);
+  free(games);
+  return failures > 0;
+}
+
+
+/* string_checksum() computed by a flood fill from each stone instead
+ * of from the incremental string data.
+ */
+
+static unsigned int
+flood_string_checksum(void)
+{
+  unsigned int sum = 2166136261U;
+  int mark[BOARDSIZE];
+  int queue[BOARDMAX];
+  int stamp = 0;
+  int pos, k;
+
+  memset(mark, 0, sizeof(mark));
+  for (pos = BOARDMIN; pos < BOARDMAX; pos++) {
+    int head = 0, tail = 0;
+    int stones = 0, libs = 0;
+    if (!IS_STONE(board[pos]))
+      continue;
+
+    stamp++;
+    queue[tail++] = pos;
+    mark[pos] = stamp;
+    while (head < tail) {
+      int str = queue[head++];
+      stones++;
+      for (k = 0; k < 4; k++) {
+	int pos2 = str + delta[k];
+	if (mark[pos2] == stamp)
+	  continue;
+	if (board[pos2] == EMPTY) {
+	  mark[pos2] = stamp;
+	  libs++;
+	}
+	else if (board[pos2] == board[pos]) {
+	  mark[pos2] = stamp;
+	  queue[tail++] = pos2;
+	}
+      }
+    }
+    sum = (sum ^ (stones * MAXLIBS + libs)) * 16777619U;
+  }
+
+  return sum;
+}
+
+
+/*
+ * Play the main lines of the games in the given files as permanent
+ * moves and check the string data at the end of each game against a
+ * flood fill of the board.
+ */
+
+int
+bench_replay(int argc, char *argv[])
+{
+  struct thread_game *games;
+  int ngames;
+  long nmoves = 0;
+  double t, play_time = 0.0;
+  int failures;
+  int g, m;
+
+  failures = load_thread_games(argc, argv, &games, &ngames);
+
+  for (g = 0; g < ngames; g++) {
+    struct thread_game *game = &games[g];
+
+    board_size = game->boardsize;
+    clear_board();
+    t = bench_time();
+    for (m = 0; m < game->nmoves; m++)
+      if (is_legal(game->moves[m], game->colors[m])) {
+	play_move(game->moves[m], game->colors[m]);
+	nmoves++;
+      }
+    play_time += bench_time() - t;
+
+    if (string_checksum() != flood_string_checksum()) {
+      fprintf(stderr, "game %d: string data differs from the board\n", g + 1);
+      failures++;
+    }
+  }
+
+  printf("%d games, %ld moves\n", ngames, nmoves);
+  printf("play_move():  %8.3f s  %10.0f moves/s\n", play_time,
+	 play_time > 0.0 ? nmoves / play_time : 0.0);
+  printf("%s\n", failures ? "FAILED" : "ok");
+
+  free(games);
+  return failures > 0;
+}
+
+
+/* The three kos of bench_ko(), on the left edge of the board. In each
+ * a white stone at ko_white[] or a black one at ko_black[] is in
+ * atari, and the other point is empty.
+ */
+static int ko_white[3];
+static int ko_black[3];
+
+static void
+setup_triple_ko(int boardsize)
+{
+  int k;
+
+  board_size = boardsize;
+  clear_board();
+  begin_setup();
+  for (k = 0; k < 3; k++) {
+    int r = 3 * k;
+    add_stone(POS(r, 1), BLACK);
+    add_stone(POS(r + 1, 0), BLACK);
+    add_stone(POS(r + 2, 1), BLACK);
+    add_stone(POS(r, 2), WHITE);
+    add_stone(POS(r + 2, 2), WHITE);
+    add_stone(POS(r + 1, 3), WHITE);
+    ko_white[k] = POS(r + 1, 1);
+    ko_black[k] = POS(r + 1, 2);
+    if (k < 2)
+      add_stone(ko_white[k], WHITE);
+    else
+      add_stone(ko_black[k], BLACK);
+  }
+  end_setup();
+}
+
+
+/* Capture in one of the kos, starting the search at ko first, unless
+ * the ko rule forbids it. Returns 1 if a capture was tried.
+ */
+
+static int
+try_ko_capture(int color, int first)
+{
+  int k;
+
+  for (k = 0; k < 3; k++) {
+    int ko = (first + k) % 3;
+    int pos = color == BLACK ? ko_black[ko] : ko_white[ko];
+    int stone = color == BLACK ? ko_white[ko] : ko_black[ko];
+    if (board[pos] == EMPTY && board[stone] == OTHER_COLOR(color)
+	&& trymove(pos, color, NULL, NO_MOVE))
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Stress the reuse of string numbers. On each of 9x9, 13x13 and 19x19
+ * a triple ko is first cycled through with trymove() as deep as the
+ * stack allows, each capture making a new string, and then fought
+ * over in a random walk of [steps] trymove() and popgo() calls mixing
+ * ko captures with other moves. The string data is checked against a
+ * flood fill of the board after each move, and after each popgo()
+ * against the string data before the move.
+ */
+
+int
+bench_ko(int argc, char *argv[])
+{
+  static const int sizes[] = {9, 13, 19};
+  long steps = argc > 0 ? atol(argv[0]) : 100000;
+  unsigned int sums[MAXSTACK];
+  int failures = 0;
+  int max_depth = 0;
+  double t = bench_time();
+  int n;
+  long k;
+
+  gg_srand(1);
+  for (n = 0; n < (int) (sizeof(sizes) / sizeof(sizes[0])); n++) {
+    unsigned int base;
+
+    setup_triple_ko(sizes[n]);
+    base = string_checksum();
+
+    /* The triple ko cycle. */
+    while (stackp < MAXSTACK - 3) {
+      int color = stackp % 2 == 0 ? BLACK : WHITE;
+      sums[stackp] = string_checksum();
+      if (!try_ko_capture(color, 0)) {
+	fprintf(stderr, "%dx%d: no ko capture at depth %d\n",
+		sizes[n], sizes[n], stackp);
+	failures++;
+	break;
+      }
+      if (string_checksum() != flood_string_checksum()) {
+	fprintf(stderr, "%dx%d: string data wrong at depth %d\n",
+		sizes[n], sizes[n], stackp);
+	failures++;
+      }
+    }
+    if (stackp > max_depth)
+      max_depth = stackp;
+    while (stackp > 0) {
+      popgo();
+      if (string_checksum() != sums[stackp]) {
+	fprintf(stderr, "%dx%d: popgo() wrong at depth %d\n",
+		sizes[n], sizes[n], stackp);
+	failures++;
+      }
+    }
+
+    /* The ko fight. */
+    for (k = 0; k < steps; k++) {
+      int color = stackp % 2 == 0 ? BLACK : WHITE;
+
+      if (stackp > 0 && (stackp >= MAXSTACK - 3 || gg_urand() % 3 == 0)) {
+	popgo();
+	if (string_checksum() != sums[stackp]) {
+	  fprintf(stderr, "%dx%d: popgo() wrong at depth %d\n",
+		  sizes[n], sizes[n], stackp);
+	  failures++;
+	}
+	continue;
+      }
+
+      sums[stackp] = string_checksum();
+      if (gg_urand() % 2 == 0) {
+	if (!try_ko_capture(color, gg_urand() % 3))
+	  continue;
+      }
+      else {
+	int pos = POS(gg_urand() % board_size, gg_urand() % board_size);
+	if (board[pos] != EMPTY || !trymove(pos, color, NULL, NO_MOVE))
+	  continue;
+      }
+      if (stackp > max_depth)
+	max_depth = stackp;
+      if (string_checksum() != flood_string_checksum()) {
+	fprintf(stderr, "%dx%d: string data wrong at depth %d\n",
+		sizes[n], sizes[n], stackp);
+	failures++;
+      }
+    }
+    while (stackp > 0)
+      popgo();
+
+    if (string_checksum() != base) {
+      fprintf(stderr, "%dx%d: position not restored\n",
+	      sizes[n], sizes[n]);
+      failures++;
+    }
+    if (failures)
+      break;
+  }
+
+  printf("%ld steps per board size, depth up to %d\n", steps, max_depth);
+  printf("%8.3f s\n", bench_time() - t);
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures > 0;
+}
+
+
+/*
+ * Run the workload of bench_threads() on each game twice, on a context
+ * of the 19x19 board core and on one of the smallest core the game
+ * fits in, and compare the times and sums for each core.
+ */
+
+int
+bench_sizes(int argc, char *argv[])
+{
+  static const int cores[] = {9, 13, MAX_BOARD};
+  int ncores = sizeof(cores) / sizeof(cores[0]);
+  struct thread_game *games;
+  int ngames;
+  int count[3] = {0, 0, 0};
+  double generic_time[3] = {0.0, 0.0, 0.0};
+  double sized_time[3] = {0.0, 0.0, 0.0};
+  int failures;
+  int g, c;
+
+  hash_init();
+  failures = load_thread_games(argc, argv, &games, &ngames);
+
+  for (g = 0; g < ngames; g++) {
+    struct thread_game *game = &games[g];
+    struct board_context *generic
+      = board_context_new_generic(game->boardsize);
+    struct board_context *sized = board_context_new(game->boardsize);
+    unsigned int generic_sum, sized_sum;
+    double t;
+
+    for (c = 0; game->boardsize > cores[c]; c++)
+      ;
+    count[c]++;
+
+    t = bench_time();
+    generic_sum = thread_game_sum(generic, game);
+    generic_time[c] += bench_time() - t;
+
+    t = bench_time();
+    sized_sum = thread_game_sum(sized, game);
+    sized_time[c] += bench_time() - t;
+
+    if (generic_sum != sized_sum) {
+      fprintf(stderr, "game %d (%dx%d) differs on the %dx%d core\n",
+	      g + 1, game->boardsize, game->boardsize, cores[c], cores[c]);
+      failures++;
+    }
+
+    board_context_free(generic);
+    board_context_free(sized);
+  }
+
+  printf("core     games    19x19 core   sized core\n");
+  for (c = 0; c < ncores; c++)
+    if (count[c] > 0)
+      printf("%2dx%-2d  %7d  %9.3f s  %9.3f s\n", cores[c], cores[c],
+	     count[c], generic_time[c], sized_time[c]);
+  printf("%s\n", failures ? "FAILED" : "ok");
+
+  free(games);
+  return failures > 0;
+}
+
+
+#if USE_BITBOARDS
+
+/* The bitboard of the stones of color, built from board[]. */
+
+static void
+scalar_stones(int color, Bitboard *bb)
+{
+  int pos;
+
+  memset(bb, 0, sizeof(*bb));
+  for (pos = BOARDMIN; pos < BOARDMAX; pos++)
+    if (board[pos] == color)
+      bb->w[pos / 64] |= (Bitword) 1 << (pos % 64);
+}
+
+
+/* Check that the bitboards of the stones agree with board[]. */
+
+static int
+bitboards_in_step(void)
+{
+  Bitboard a, b;
+  int color;
+
+  for (color = WHITE; color <= BLACK; color++) {
+    scalar_stones(color, &a);
+    bitboard_stones(color, &b);
+    if (memcmp(&a, &b, sizeof(a)) != 0)
+      return 0;
+  }
+  scalar_stones(EMPTY, &a);
+  bitboard_stones(EMPTY, &b);
+  return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+
+/* Strings at least this big count as big in bench_bitboard(). */
+#define BENCH_BIG_STRING 10
+
+/*
+ * Replay the main lines of the given files and time three whole-board
+ * operations at every position, once on board[] and the incremental
+ * string data and once with bitboards:
+ *   - counting the stones of each color and the empty points,
+ *   - finding the stones and liberties of the big strings,
+ *   - finding the liberties of all stones of each color together.
+ * The results are compared, the stones and liberties of every string
+ * are checked against findstones() and findlib(), and at every tenth
+ * move all legal moves are tried to check that popgo() also keeps the
+ * bitboards in step.
+ */
+
+int
+bench_bitboard(int argc, char *argv[])
+{
+  double scalar_time[3] = {0.0, 0.0, 0.0};
+  double bitboard_time[3] = {0.0, 0.0, 0.0};
+  long npositions = 0;
+  long nbig = 0;
+  int failures = 0;
+  int k;
+
+  hash_init();
+  for (k = 0; k < argc && !failures; k++) {
+    SGFParser parser;
+    SGFNode *root = NULL;
+    SGFNode *game, *node;
+    unsigned long size;
+    char *buffer = read_file(argv[k], &size);
+
+    if (!buffer || readsgfmem_ctx(&parser, buffer, size, &root) != SGF_OK) {
+      fprintf(stderr, "%s: cannot read\n", argv[k]);
+      free(buffer);
+      failures++;
+      continue;
+    }
+
+    for (game = root; game && !failures; game = game->next) {
+      int nmoves = 0;
+
+      if (setup_game(game, 1) < 0)
+	continue;
+
+      for (node = game; node && !failures; node = node->child) {
+	static int stones[MAX_BOARD * MAX_BOARD];
+	static int libs[MAXLIBS];
+	int origins[MAX_BOARD * MAX_BOARD];
+	int norigins = 0;
+	unsigned int scalar_sum[3] = {0, 0, 0};
+	unsigned int bitboard_sum[3] = {0, 0, 0};
+	SGFProperty *prop;
+	Bitboard bb, libbb;
+	double t;
+	int pos, n, i, color;
+
+	for (pos = BOARDMIN; pos < BOARDMAX; pos++)
+	  if (IS_STONE(board[pos]) && find_origin(pos) == pos)
+	    origins[norigins++] = pos;
+
+	/* Stone and empty point counts. */
+	t = bench_time();
+	for (pos = BOARDMIN; pos < BOARDMAX; pos++)
+	  if (ON_BOARD(pos))
+	    scalar_sum[0] += board[pos] == EMPTY ? 1 : board[pos] << 9;
+	scalar_time[0] += bench_time() - t;
+
+	t = bench_time();
+	bitboard_stones(EMPTY, &bb);
+	bitboard_sum[0] = bitboard_count(&bb);
+	for (color = WHITE; color <= BLACK; color++) {
+	  bitboard_stones(color, &bb);
+	  bitboard_sum[0] += bitboard_count(&bb) * (color << 9);
+	}
+	bitboard_time[0] += bench_time() - t;
+
+	/* Stones and liberties of the big strings. */
+	t = bench_time();
+	for (i = 0; i < norigins; i++)
+	  if (countstones(origins[i]) >= BENCH_BIG_STRING) {
+	    scalar_sum[1] += findstones(origins[i], MAX_BOARD * MAX_BOARD,
+					stones);
+	    scalar_sum[1] += findlib(origins[i], MAXLIBS, libs) << 9;
+	  }
+	scalar_time[1] += bench_time() - t;
+
+	t = bench_time();
+	for (i = 0; i < norigins; i++)
+	  if (countstones(origins[i]) >= BENCH_BIG_STRING) {
+	    bitboard_sum[1] += bitboard_string(origins[i], &bb);
+	    bitboard_sum[1] += bitboard_liberties(&bb, &libbb) << 9;
+	    nbig++;
+	  }
+	bitboard_time[1] += bench_time() - t;
+
+	/* Liberties of all stones of each color together. */
+	t = bench_time();
+	for (color = WHITE; color <= BLACK; color++) {
+	  unsigned char mark[BOARDMAX];
+	  memset(mark, 0, sizeof(mark));
+	  for (pos = BOARDMIN; pos < BOARDMAX; pos++)
+	    if (board[pos] == color)
+	      for (i = 0; i < 4; i++) {
+		int lib = pos + delta[i];
+		if (board[lib] == EMPTY && !mark[lib]) {
+		  mark[lib] = 1;
+		  scalar_sum[2] += color;
+		}
+	      }
+	}
+	scalar_time[2] += bench_time() - t;
+
+	t = bench_time();
+	for (color = WHITE; color <= BLACK; color++) {
+	  bitboard_stones(color, &bb);
+	  bitboard_sum[2] += bitboard_liberties(&bb, &libbb) * color;
+	}
+	bitboard_time[2] += bench_time() - t;
+
+	/* Every string, outside the timing. */
+	for (i = 0; i < norigins && !failures; i++) {
+	  Bitboard expect;
+	  int m;
+
+	  memset(&expect, 0, sizeof(expect));
+	  n = findlib(origins[i], MAXLIBS, libs);
+	  for (m = 0; m < n; m++)
+	    expect.w[libs[m] / 64] |= (Bitword) 1 << (libs[m] % 64);
+	  bitboard_string(origins[i], &bb);
+	  bitboard_liberties(&bb, &libbb);
+	  if (memcmp(&expect, &libbb, sizeof(expect)) != 0
+	      || bitboard_count(&bb) != countstones(origins[i]))
+	    failures++;
+	}
+
+	if (memcmp(scalar_sum, bitboard_sum, sizeof(scalar_sum)) != 0
+	    || failures || !bitboards_in_step()) {
+	  fprintf(stderr, "%s: bitboards differ at move %d\n", argv[k],
+		  nmoves);
+	  failures++;
+	  break;
+	}
+	npositions++;
+
+	for (prop = node->props; prop; prop = prop->next)
+	  if (prop->name == SGFB || prop->name == SGFW) {
+	    int move = get_sgfmove(prop);
+	    color = prop->name == SGFB ? BLACK : WHITE;
+
+	    if (nmoves % 10 == 0)
+	      for (pos = BOARDMIN; pos < BOARDMAX; pos++)
+		if (board[pos] == EMPTY
+		    && trymove(pos, color, NULL, NO_MOVE)) {
+		  if (!bitboards_in_step())
+		    failures++;
+		  popgo();
+		}
+	    if (!bitboards_in_step()) {
+	      fprintf(stderr, "%s: bitboards differ after popgo()\n",
+		      argv[k]);
+	      failures++;
+	    }
+
+	    if (move == PASS_MOVE
+		|| (ON_BOARD(move) && is_legal(move, color)))
+	      play_move(move, color);
+	    nmoves++;
+	    break;
+	  }
+      }
+    }
+
+    sgfFreeNode(root);
+    free(buffer);
+  }
+
+  printf("%ld positions, %ld big strings\n", npositions, nbig);
+  printf("                      board[]   bitboards\n");
+  printf("counting stones:     %8.3f s  %8.3f s\n",
+	 scalar_time[0], bitboard_time[0]);
+  printf("big strings:         %8.3f s  %8.3f s\n",
+	 scalar_time[1], bitboard_time[1]);
+  printf("liberties per color: %8.3f s  %8.3f s\n",
+	 scalar_time[2], bitboard_time[2]);
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures > 0;
+}
+
+#endif
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 2
+ * End:
+ */
@@ -29,6 +29,7 @@
  * for an introduction.
  */
 
+#include "mboardcore.h"
 #include "mboard.h"
 #include "mhash.h"
 #include "msgftree.h"
@@ -40,6 +41,60 @@
 #include <stdarg.h>
 
 
+/* The table of context functions of this core, see mboardcore.h. */
+#define THIS_CORE BOARD_CORE_PASTE(board_core, MAX_BOARD)
+
+#if MAX_BOARD == DEFAULT_MAX_BOARD
+
+#define TO_CORE(pos)   (pos)
+#define FROM_CORE(pos) (pos)
+
+#else
+
+/* Convert a position between the layout of the program and that of
+ * this core. Points beyond the core's MAX_BOARD go to the border, so
+ * that board_color_ctx() sees them as off the board.
+ */
+#define PROGRAM_NS (DEFAULT_MAX_BOARD + 1)
+
+static int
+to_core(int pos)
+{
+  int i = pos / PROGRAM_NS - 1;
+  int j = pos % PROGRAM_NS - 1;
+
+  if (i > MAX_BOARD)
+    i = MAX_BOARD;
+  if (j > MAX_BOARD)
+    j = MAX_BOARD;
+  return POS(i, j);
+}
+
+#define TO_CORE(pos)   to_core(pos)
+#define FROM_CORE(pos) \
+  (((pos) / NS) * PROGRAM_NS + (pos) % NS)
+
+/* hashdata_recalc() in hash.c scans the board of the program's
+ * layout. This one scans the board of the core.
+ */
+static void
+core_hashdata_recalc(Hash_data *hd, Intersection *p, int ko_pos)
+{
+  int pos;
+
+  hashdata_clear(hd);
+  for (pos = BOARDMIN; pos < BOARDMAX; pos++)
+    if (IS_STONE(p[pos]))
+      hashdata_invert_stone(hd, pos, p[pos]);
+  if (ko_pos != 0)
+    hashdata_invert_ko(hd, ko_pos);
+}
+
+#define hashdata_recalc core_hashdata_recalc
+
+#endif
+
+
 /* This can be used for internal checks w/in board.c that should
  * typically not be necessary (for speed).
  */
@@ -49,6 +104,27 @@
 #define PARANOID1(x, pos)
 #endif
 
+/* Storage class of the pointer to the current board context, below.
+ * Each thread has its own.
+ */
+#if defined(__GNUC__)
+#define BOARD_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define BOARD_THREAD_LOCAL __declspec(thread)
+#else
+#define BOARD_THREAD_LOCAL
+#endif
+
+/* for testing: Check each undo_move() against a replay of the move
+ * history from the initial position.
+ */
+#define CHECK_UNDO 0
+
+/* for testing: Check the string data after each permanent move against
+ * a rebuild by new_position().
+ */
+#define CHECK_INCREMENTAL 0
+
 
 /* ================================================================ */
 /*                          data structures                         */
@@ -124,9 +200,28 @@ struct vertex_stack_entry {
 
 
 #define POP_VERTICES()\
-  while ((--vertex_stack_pointer)->address)\
-  *(vertex_stack_pointer->address) =\
-  vertex_stack_pointer->value
+  while ((--vertex_stack_pointer)->address) {\
+    *(vertex_stack_pointer->address) = vertex_stack_pointer->value;\
+    SET_STONE_BIT(vertex_stack_pointer->address - board,\
+		  vertex_stack_pointer->value);\
+  }
+
+
+/* Keep the bitboards of the stones in step with board[]. */
+#define BIT_WORD(pos) ((pos) >> 6)
+#define BIT_MASK(pos) ((Bitword) 1 << ((pos) & 63))
+
+#if USE_BITBOARDS
+#define SET_STONE_BIT(pos, color)\
+  do {\
+    stone_bits[WHITE].w[BIT_WORD(pos)] &= ~BIT_MASK(pos);\
+    stone_bits[BLACK].w[BIT_WORD(pos)] &= ~BIT_MASK(pos);\
+    if (IS_STONE(color))\
+      stone_bits[color].w[BIT_WORD(pos)] |= BIT_MASK(pos);\
+  } while (0)
+#else
+#define SET_STONE_BIT(pos, color) do {} while (0)
+#endif
 
 
 /* ================================================================ */
@@ -134,29 +229,416 @@ struct vertex_stack_entry {
 /* ================================================================ */
 
 
-/* Main array of string information. */
-static struct string_data string[MAX_STRINGS];
-static struct string_liberties_data string_libs[MAX_STRINGS];
-static struct string_neighbors_data string_neighbors[MAX_STRINGS];
+/* Effectively true unless we store full position in hash. */
+#define USE_BOARD_CACHES	(NUM_HASHVALUES <= 4)
+
+struct board_cache_entry {
+  int threshold;
+  int liberties;
+  Hash_data position_hash;
+};
+
+
+/*
+ * Everything that makes up one board: the position and its move
+ * history, the incremental string data, the undo stacks of trymove()
+ * and the liberty caches.
+ *
+ * The position and move history are reached through pointers. In the
+ * default context they point to the global variables declared in
+ * board.h, which the rest of the program reads, and in contexts made
+ * by board_context_new() to the context's own copy.
+ *
+ * The first member is the same in all board cores, so that the
+ * context functions can find the core a context belongs to.
+ */
+struct board_context {
+  const struct board_core *core;
+  int *board_size;
+  Intersection (*board)[BOARDSIZE];
+  int *board_ko_pos;
+  int *white_captured;
+  int *black_captured;
+
+  Intersection (*initial_board)[BOARDSIZE];
+  int *initial_board_ko_pos;
+  int *initial_white_captured;
+  int *initial_black_captured;
+  int (*move_history_color)[MAX_MOVE_HISTORY];
+  int (*move_history_pos)[MAX_MOVE_HISTORY];
+  Hash_data (*move_history_hash)[MAX_MOVE_HISTORY];
+  int *move_history_pointer;
+  int (*move_history_ko_pos)[MAX_MOVE_HISTORY];
+  int (*move_history_first_capture)[MAX_MOVE_HISTORY];
+  int (*move_history_captures)[MAX_CAPTURE_HISTORY];
+  int *move_history_capture_pointer;
+  int *movenum;
+  int *handicap;
+
+  signed char (*shadow)[BOARDMAX];
+  Hash_data *board_hash;
+  int *stackp;
+  int *position_number;
+
+  /* Main array of string information. */
+  struct string_data string[MAX_STRINGS];
+  struct string_liberties_data string_libs[MAX_STRINGS];
+  struct string_neighbors_data string_neighbors[MAX_STRINGS];
+
+  /* Stacks and stack pointers. */
+  struct change_stack_entry change_stack[STACK_SIZE];
+  struct change_stack_entry *change_stack_pointer;
+
+  struct vertex_stack_entry vertex_stack[STACK_SIZE];
+  struct vertex_stack_entry *vertex_stack_pointer;
+
+  /* Index into list of strings. The index is only valid if there is a
+   * stone at the vertex.
+   */
+  int string_number[BOARDMAX];
+
+  /* The stones in a string are linked together in a cyclic list. 
+   * These are the coordinates to the next stone in the string.
+   */
+  int next_stone[BOARDMAX];
+
+  /* Number of the next free string. */
+  int next_string;
+
+  /* Numbers below next_string of strings that have been captured or
+   * merged into another string, for reuse by new strings.
+   */
+  int free_string_list[MAX_STRINGS];
+  int free_strings;
+
+  /* For marking purposes. */
+  int ml[BOARDMAX];
+  int liberty_mark;
+  int string_mark;
+
+  int komaster;
+  int kom_pos;
+
+  /* Stack of trial moves to get to current
+   * position and which color made them. Perhaps 
+   * this should be one array of a structure 
+   */
+  int stack[MAXSTACK];
+  int move_color[MAXSTACK];
+  Hash_data board_hash_stack[MAXSTACK];
+
+  /* Nesting depth of begin_setup() and whether any stone has been
+   * added or removed since the outermost begin_setup().
+   */
+  int setup_depth;
+  int setup_changed;
+
+  /* approxlib() and accuratelib() caches. */
+  struct board_cache_entry approxlib_cache[BOARDMAX][2];
+  struct board_cache_entry accuratelib_cache[BOARDMAX][2];
+
+#if !USE_BITBOARDS
+  /* Stone counts cached by stones_on_board(). */
+  int stone_count_for_position;
+  int white_stones;
+  int black_stones;
+#endif
+
+  /* Statistics. */
+  int trymove_counter;
+
+#if USE_BITBOARDS
+  /* The stones of each color, indexed by WHITE and BLACK, and the
+   * points on the board.
+   */
+  Bitboard stone_bits[3];
+  Bitboard on_board_bits;
+#endif
+
+  /* The position and move history of a context made by
+   * board_context_new().
+   */
+  struct {
+    int board_size;
+    Intersection board[BOARDSIZE];
+    int board_ko_pos;
+    int white_captured;
+    int black_captured;
+    Intersection initial_board[BOARDSIZE];
+    int initial_board_ko_pos;
+    int initial_white_captured;
+    int initial_black_captured;
+    int move_history_color[MAX_MOVE_HISTORY];
+    int move_history_pos[MAX_MOVE_HISTORY];
+    Hash_data move_history_hash[MAX_MOVE_HISTORY];
+    int move_history_pointer;
+    int move_history_ko_pos[MAX_MOVE_HISTORY];
+    int move_history_first_capture[MAX_MOVE_HISTORY];
+    int move_history_captures[MAX_CAPTURE_HISTORY];
+    int move_history_capture_pointer;
+    int movenum;
+    int handicap;
+    signed char shadow[BOARDMAX];
+    Hash_data board_hash;
+    int stackp;
+    int position_number;
+  } own;
+};
+
+
+/* The board used by all the functions without a context argument. */
+#ifndef BOARD_CORE
+static struct board_context default_context = {
+  &THIS_CORE,
+  &board_size, &board, &board_ko_pos, &white_captured, &black_captured,
+  &initial_board, &initial_board_ko_pos, &initial_white_captured,
+  &initial_black_captured, &move_history_color, &move_history_pos,
+  &move_history_hash, &move_history_pointer, &move_history_ko_pos,
+  &move_history_first_capture, &move_history_captures,
+  &move_history_capture_pointer, &movenum, &handicap,
+  &shadow, &board_hash, &stackp, &position_number
+};
+#else
+/* The global board has the program's layout, so a smaller core only
+ * works on contexts. Its default board is a placeholder.
+ */
+#define OWN(name) &default_context.own.name
+static struct board_context default_context = {
+  &THIS_CORE,
+  OWN(board_size), OWN(board), OWN(board_ko_pos), OWN(white_captured),
+  OWN(black_captured), OWN(initial_board), OWN(initial_board_ko_pos),
+  OWN(initial_white_captured), OWN(initial_black_captured),
+  OWN(move_history_color), OWN(move_history_pos), OWN(move_history_hash),
+  OWN(move_history_pointer), OWN(move_history_ko_pos),
+  OWN(move_history_first_capture), OWN(move_history_captures),
+  OWN(move_history_capture_pointer), OWN(movenum), OWN(handicap),
+  OWN(shadow), OWN(board_hash), OWN(stackp), OWN(position_number)
+};
+#undef OWN
+#endif
+
+/* The context the functions of this file work on. The _ctx variants
+ * of the board functions switch it for the duration of the call. Each
+ * thread has its own, so that threads can work on separate contexts.
+ */
+static BOARD_THREAD_LOCAL struct board_context *bctx = &default_context;
+
+
+/* Forward declarations. */
+static void new_position(void);
+
+
+/* Make a new, empty context of this core. */
+
+static struct board_context *
+core_context_new(int boardsize)
+{
+  struct board_context *ctx = xalloc(sizeof(struct board_context));
+
+  gg_assert(boardsize >= MIN_BOARD && boardsize <= MAX_BOARD);
+  ctx->core = &THIS_CORE;
+  ctx->board_size = &ctx->own.board_size;
+  ctx->board = &ctx->own.board;
+  ctx->board_ko_pos = &ctx->own.board_ko_pos;
+  ctx->white_captured = &ctx->own.white_captured;
+  ctx->black_captured = &ctx->own.black_captured;
+  ctx->initial_board = &ctx->own.initial_board;
+  ctx->initial_board_ko_pos = &ctx->own.initial_board_ko_pos;
+  ctx->initial_white_captured = &ctx->own.initial_white_captured;
+  ctx->initial_black_captured = &ctx->own.initial_black_captured;
+  ctx->move_history_color = &ctx->own.move_history_color;
+  ctx->move_history_pos = &ctx->own.move_history_pos;
+  ctx->move_history_hash = &ctx->own.move_history_hash;
+  ctx->move_history_pointer = &ctx->own.move_history_pointer;
+  ctx->move_history_ko_pos = &ctx->own.move_history_ko_pos;
+  ctx->move_history_first_capture = &ctx->own.move_history_first_capture;
+  ctx->move_history_captures = &ctx->own.move_history_captures;
+  ctx->move_history_capture_pointer = &ctx->own.move_history_capture_pointer;
+  ctx->movenum = &ctx->own.movenum;
+  ctx->handicap = &ctx->own.handicap;
+  ctx->shadow = &ctx->own.shadow;
+  ctx->board_hash = &ctx->own.board_hash;
+  ctx->stackp = &ctx->own.stackp;
+  ctx->position_number = &ctx->own.position_number;
+#if !USE_BITBOARDS
+  ctx->stone_count_for_position = -1;
+#endif
+
+  ctx->own.board_size = boardsize;
+  ctx->core->clear(ctx);
+
+  return ctx;
+}
+
 
-/* Stacks and stack pointers. */
-static struct change_stack_entry change_stack[STACK_SIZE];
-static struct change_stack_entry *change_stack_pointer;
+static void
+core_context_free(struct board_context *ctx)
+{
+  gg_assert(ctx != &default_context && ctx != bctx);
+  free(ctx);
+}
 
-static struct vertex_stack_entry vertex_stack[STACK_SIZE];
-static struct vertex_stack_entry *vertex_stack_pointer;
 
+static int
+core_color(struct board_context *ctx, int pos)
+{
+  return (*ctx->board)[TO_CORE(pos)];
+}
 
-/* Index into list of strings. The index is only valid if there is a
- * stone at the vertex.
+
+/*
+ * Save board state.
  */
-static int string_number[BOARDMAX];
 
+void
+store_board(struct board_state *state)
+{
+  int k;
+
+  gg_assert(*bctx->stackp == 0);
+
+  state->board_size = *bctx->board_size;
+
+  memcpy(state->board, *bctx->board, sizeof(state->board));
+  memcpy(state->initial_board, *bctx->initial_board,
+	 sizeof(state->initial_board));
+
+  state->board_ko_pos = *bctx->board_ko_pos;
+  state->white_captured = *bctx->white_captured;
+  state->black_captured = *bctx->black_captured;
+  
+  state->initial_board_ko_pos = *bctx->initial_board_ko_pos;
+  state->initial_white_captured = *bctx->initial_white_captured;
+  state->initial_black_captured = *bctx->initial_black_captured;
+  
+  state->move_history_pointer = *bctx->move_history_pointer;
+  for (k = 0; k < state->move_history_pointer; k++) {
+    state->move_history_color[k] = (*bctx->move_history_color)[k];
+    state->move_history_pos[k] = (*bctx->move_history_pos)[k];
+    state->move_history_hash[k] = (*bctx->move_history_hash)[k];
+    state->move_history_ko_pos[k] = (*bctx->move_history_ko_pos)[k];
+    state->move_history_first_capture[k]
+      = (*bctx->move_history_first_capture)[k];
+  }
+  state->move_history_capture_pointer = *bctx->move_history_capture_pointer;
+  memcpy(state->move_history_captures, *bctx->move_history_captures,
+	 state->move_history_capture_pointer
+	 * sizeof(state->move_history_captures[0]));
+
+  state->komi = komi;
+  state->handicap = *bctx->handicap;
+  state->move_number = *bctx->movenum;
+}
 
-/* The stones in a string are linked together in a cyclic list. 
- * These are the coordinates to the next stone in the string.
+
+/*
+ * Restore a saved board state.
  */
-static int next_stone[BOARDMAX];
+
+void
+restore_board(struct board_state *state)
+{
+  int k;
+
+  gg_assert(*bctx->stackp == 0);
+
+  *bctx->board_size = state->board_size;
+
+  memcpy(*bctx->board, state->board, sizeof(state->board));
+  memcpy(*bctx->initial_board, state->initial_board,
+	 sizeof(state->initial_board));
+
+  *bctx->board_ko_pos = state->board_ko_pos;
+  *bctx->white_captured = state->white_captured;
+  *bctx->black_captured = state->black_captured;
+  
+  *bctx->initial_board_ko_pos = state->initial_board_ko_pos;
+  *bctx->initial_white_captured = state->initial_white_captured;
+  *bctx->initial_black_captured = state->initial_black_captured;
+  
+  *bctx->move_history_pointer = state->move_history_pointer;
+  for (k = 0; k < state->move_history_pointer; k++) {
+    (*bctx->move_history_color)[k] = state->move_history_color[k];
+    (*bctx->move_history_pos)[k] = state->move_history_pos[k];
+    (*bctx->move_history_hash)[k] = state->move_history_hash[k];
+    (*bctx->move_history_ko_pos)[k] = state->move_history_ko_pos[k];
+    (*bctx->move_history_first_capture)[k]
+      = state->move_history_first_capture[k];
+  }
+  *bctx->move_history_capture_pointer = state->move_history_capture_pointer;
+  memcpy(*bctx->move_history_captures, state->move_history_captures,
+	 state->move_history_capture_pointer
+	 * sizeof(state->move_history_captures[0]));
+
+  komi = state->komi;
+  *bctx->handicap = state->handicap;
+  *bctx->movenum = state->move_number;
+  
+  hashdata_recalc(bctx->board_hash, *bctx->board, *bctx->board_ko_pos);
+  new_position();
+}
+
+
+/* From here on the board state is that of the current context. Note
+ * that the names also hide the struct members of the same name, so
+ * code using board_state or board_context fields goes above.
+ */
+#define board_size                   (*bctx->board_size)
+#define board                        (*bctx->board)
+#define board_ko_pos                 (*bctx->board_ko_pos)
+#define white_captured               (*bctx->white_captured)
+#define black_captured               (*bctx->black_captured)
+#define initial_board                (*bctx->initial_board)
+#define initial_board_ko_pos         (*bctx->initial_board_ko_pos)
+#define initial_white_captured       (*bctx->initial_white_captured)
+#define initial_black_captured       (*bctx->initial_black_captured)
+#define move_history_color           (*bctx->move_history_color)
+#define move_history_pos             (*bctx->move_history_pos)
+#define move_history_hash            (*bctx->move_history_hash)
+#define move_history_pointer         (*bctx->move_history_pointer)
+#define move_history_ko_pos          (*bctx->move_history_ko_pos)
+#define move_history_first_capture   (*bctx->move_history_first_capture)
+#define move_history_captures        (*bctx->move_history_captures)
+#define move_history_capture_pointer (*bctx->move_history_capture_pointer)
+#define movenum                      (*bctx->movenum)
+#define handicap                     (*bctx->handicap)
+#define shadow                       (*bctx->shadow)
+#define board_hash                   (*bctx->board_hash)
+#define stackp                       (*bctx->stackp)
+#define position_number              (*bctx->position_number)
+
+#define string                       (bctx->string)
+#define string_libs                  (bctx->string_libs)
+#define string_neighbors             (bctx->string_neighbors)
+#define change_stack                 (bctx->change_stack)
+#define change_stack_pointer         (bctx->change_stack_pointer)
+#define vertex_stack                 (bctx->vertex_stack)
+#define vertex_stack_pointer         (bctx->vertex_stack_pointer)
+#define string_number                (bctx->string_number)
+#define next_stone                   (bctx->next_stone)
+#define next_string                  (bctx->next_string)
+#define free_string_list             (bctx->free_string_list)
+#define free_strings                 (bctx->free_strings)
+#define ml                           (bctx->ml)
+#define liberty_mark                 (bctx->liberty_mark)
+#define string_mark                  (bctx->string_mark)
+#define komaster                     (bctx->komaster)
+#define kom_pos                      (bctx->kom_pos)
+#define stack                        (bctx->stack)
+#define move_color                   (bctx->move_color)
+#define board_hash_stack             (bctx->board_hash_stack)
+#define setup_depth                  (bctx->setup_depth)
+#define setup_changed                (bctx->setup_changed)
+#define approxlib_cache              (bctx->approxlib_cache)
+#define accuratelib_cache            (bctx->accuratelib_cache)
+#if !USE_BITBOARDS
+#define stone_count_for_position     (bctx->stone_count_for_position)
+#define white_stones                 (bctx->white_stones)
+#define black_stones                 (bctx->black_stones)
+#endif
+#define trymove_counter              (bctx->trymove_counter)
+#define stone_bits                   (bctx->stone_bits)
+#define on_board_bits                (bctx->on_board_bits)
 
 
 /* ---------------------------------------------------------------- */
@@ -275,6 +757,7 @@ static int next_stone[BOARDMAX];
   do {\
     PUSH_VERTEX(board[pos]);\
     board[pos] = color;\
+    SET_STONE_BIT(pos, color);\
     hashdata_invert_stone(&board_hash, pos, color);\
   } while (0)
 
@@ -283,27 +766,17 @@ static int next_stone[BOARDMAX];
     PUSH_VERTEX(board[pos]);\
     hashdata_invert_stone(&board_hash, pos, board[pos]);\
     board[pos] = EMPTY;\
+    SET_STONE_BIT(pos, EMPTY);\
   } while (0)
 
 
-/* ---------------------------------------------------------------- */
-
-
-
-/* Number of the next free string. */
-static int next_string;
-
-
-/* For marking purposes. */
-static int ml[BOARDMAX];
-static int liberty_mark;
-static int string_mark;
-
-
 /* Forward declarations. */
 static void really_do_trymove(int pos, int color);
 static int do_trymove(int pos, int color, int ignore_ko);
 static void undo_trymove(void);
+static void reset_move_history(void);
+static void record_captures(int pos, int color);
+static void unplay_move(void);
 
 static int do_approxlib(int pos, int color, int maxlib, int *libs);
 static int slow_approxlib(int pos, int color, int maxlib, int *libs);
@@ -311,18 +784,16 @@ static int do_accuratelib(int pos, int color, int maxlib, int *libs);
 
 static int is_superko_violation(int pos, int color, enum ko_rules type);
 
-static void new_position(void);
 static int propagate_string(int stone, int str);
 static void find_liberties_and_neighbors(int s);
+static int new_string_number(void);
+static void free_string_number(int s);
 static int do_remove_string(int s);
 static void do_commit_suicide(int pos, int color);
 static void do_play_move(int pos, int color);
-
-static int komaster, kom_pos;
-
-
-/* Statistics. */
-static int trymove_counter = 0;
+#if CHECK_INCREMENTAL
+static void check_incremental_strings(void);
+#endif
 
 /* Coordinates for the eight directions, ordered
  * south, west, north, east, southwest, northwest, northeast, southeast.
@@ -337,78 +808,33 @@ int delta[8]  = { NS, -1, -NS, 1, NS-1, -NS-1, -NS+1, NS+1};
 /* ================================================================ */
 
 /*
- * Save board state.
- */
-
-void
-store_board(struct board_state *state)
-{
-  int k;
-
-  gg_assert(stackp == 0);
-
-  state->board_size = board_size;
-
-  memcpy(state->board, board, sizeof(board));
-  memcpy(state->initial_board, initial_board, sizeof(initial_board));
-
-  state->board_ko_pos = board_ko_pos;
-  state->white_captured = white_captured;
-  state->black_captured = black_captured;
-  
-  state->initial_board_ko_pos = initial_board_ko_pos;
-  state->initial_white_captured = initial_white_captured;
-  state->initial_black_captured = initial_black_captured;
-  
-  state->move_history_pointer = move_history_pointer;
-  for (k = 0; k < move_history_pointer; k++) {
-    state->move_history_color[k] = move_history_color[k];
-    state->move_history_pos[k] = move_history_pos[k];
-    state->move_history_hash[k] = move_history_hash[k];
-  }
-
-  state->komi = komi;
-  state->handicap = handicap;
-  state->move_number = movenum;
-}
-
-
-/*
- * Restore a saved board state.
+ * Set up an arbitrary position on the board of the current size with
+ * a single new_position(), instead of one for each stone as with
+ * add_stone() and remove_stone(). The move history starts afresh from
+ * the new position. last is not used and may be NULL.
  */
 
 void
-restore_board(struct board_state *state)
+setup_board(Intersection new_board[MAX_BOARD][MAX_BOARD], int ko_pos,
+	    int *last, float new_komi, int w_captured, int b_captured)
 {
-  int k;
+  int i, j;
 
+  UNUSED(last);
   gg_assert(stackp == 0);
 
-  board_size = state->board_size;
-
-  memcpy(board, state->board, sizeof(board));
-  memcpy(initial_board, state->initial_board, sizeof(initial_board));
+  for (i = 0; i < board_size; i++)
+    for (j = 0; j < board_size; j++)
+      board[POS(i, j)] = new_board[i][j];
 
-  board_ko_pos = state->board_ko_pos;
-  white_captured = state->white_captured;
-  black_captured = state->black_captured;
-  
-  initial_board_ko_pos = state->initial_board_ko_pos;
-  initial_white_captured = state->initial_white_captured;
-  initial_black_captured = state->initial_black_captured;
-  
-  move_history_pointer = state->move_history_pointer;
-  for (k = 0; k < move_history_pointer; k++) {
-    move_history_color[k] = state->move_history_color[k];
-    move_history_pos[k] = state->move_history_pos[k];
-    move_history_hash[k] = state->move_history_hash[k];
-  }
+  gg_assert(ko_pos == NO_MOVE || (ON_BOARD1(ko_pos) && board[ko_pos] == EMPTY));
+  board_ko_pos = ko_pos;
+  komi = new_komi;
+  white_captured = w_captured;
+  black_captured = b_captured;
 
-  komi = state->komi;
-  handicap = state->handicap;
-  movenum = state->move_number;
-  
   hashdata_recalc(&board_hash, board, board_ko_pos);
+  reset_move_history();
   new_position();
 }
 
@@ -445,6 +871,7 @@ clear_board(void)
   initial_black_captured = 0;
 
   move_history_pointer = 0;
+  move_history_capture_pointer = 0;
   movenum = 0;
 
   handicap = 0;
@@ -475,15 +902,6 @@ test_gray_border(void)
 /* ================================================================ */
 
 
-/* Stack of trial moves to get to current
- * position and which color made them. Perhaps 
- * this should be one array of a structure 
- */
-static int stack[MAXSTACK];
-static int move_color[MAXSTACK];
-
-static Hash_data board_hash_stack[MAXSTACK];
-
 /*
  * trymove pushes the position onto the stack, and makes a move
  * at pos of color. Returns one if the move is legal. The
@@ -510,7 +928,7 @@ trymove(int pos, int color, const char *message, int str)
     return 0;
 
   /* Store the move in an sgf tree if one is available. */
-  if (sgf_dumptree) {
+  if (sgf_dumptree && bctx == &default_context) {
     char buf[100];
 
     if (message == NULL)
@@ -542,9 +960,11 @@ trymove(int pos, int color, const char *message, int str)
     sgftreeAddComment(sgf_dumptree, buf);
   }
   
-  if (count_variations)
-    count_variations++;
-  stats.nodes++;
+  if (bctx == &default_context) {
+    if (count_variations)
+      count_variations++;
+    stats.nodes++;
+  }
 
   return 1;
 }
@@ -568,7 +988,7 @@ tryko(int pos, int color, const char *message)
   if (!do_trymove(pos, color, 1))
     return 0;
 
-  if (sgf_dumptree) {
+  if (sgf_dumptree && bctx == &default_context) {
     char buf[100];
     if (message == NULL)
       message = "UNKNOWN";
@@ -597,9 +1017,11 @@ tryko(int pos, int color, const char *message)
     sgftreeAddComment(sgf_dumptree, buf);
   }
   
-  if (count_variations)
-    count_variations++;
-  stats.nodes++;
+  if (bctx == &default_context) {
+    if (count_variations)
+      count_variations++;
+    stats.nodes++;
+  }
 
   return 1;
 }
@@ -723,7 +1145,7 @@ popgo()
 {
   undo_trymove();
   
-  if (sgf_dumptree) {
+  if (sgf_dumptree && bctx == &default_context) {
     char buf[100];
     int is_tryko = 0;
     char *sgf_comment;
@@ -795,31 +1217,313 @@ dump_stack(void)
   fflush(stderr);
 }
 
-/* Bare bones of dump_stack(). */
+/* Bare bones of dump_stack(). */
+void
+do_dump_stack(void)
+{
+  int n;
+
+  for (n = 0; n < stackp; n++)
+    gprintf("%o%s:%1m ", move_color[n] == BLACK ? "B" : "W", stack[n]);
+}
+
+/* ================================================================ */
+/*                        Board contexts                            */
+/* ================================================================ */
+
+/*
+ * Variants of the board functions working on a context made by
+ * board_context_new() instead of the default board. Each context may
+ * be used by one thread at a time; different threads may use different
+ * contexts at once. trymove(), tryko() and popgo() trace variations
+ * into sgf_dumptree and count them in count_variations and the global
+ * statistics only on the default board, so contexts never touch those
+ * globals.
+ *
+ * The core_ functions run a context of this core. They switch to it
+ * and convert the positions between the layout of the program and
+ * that of the core.
+ */
+
+static void
+core_clear(struct board_context *ctx)
+{
+  struct board_context *saved = bctx;
+  bctx = ctx;
+  clear_board();
+  bctx = saved;
+}
+
+
+static void
+core_play(struct board_context *ctx, int pos, int color)
+{
+  struct board_context *saved = bctx;
+  bctx = ctx;
+  play_move(TO_CORE(pos), color);
+  bctx = saved;
+}
+
+
+static int
+core_legal(struct board_context *ctx, int pos, int color)
+{
+  struct board_context *saved = bctx;
+  int result;
+
+  bctx = ctx;
+  result = is_legal(TO_CORE(pos), color);
+  bctx = saved;
+  return result;
+}
+
+
+static int
+core_try_move(struct board_context *ctx, int pos, int color,
+	      const char *message, int str)
+{
+  struct board_context *saved = bctx;
+  int result;
+
+  bctx = ctx;
+  result = trymove(TO_CORE(pos), color, message, TO_CORE(str));
+  bctx = saved;
+  return result;
+}
+
+
+static void
+core_pop(struct board_context *ctx)
+{
+  struct board_context *saved = bctx;
+  bctx = ctx;
+  popgo();
+  bctx = saved;
+}
+
+
+static int
+core_count_libs(struct board_context *ctx, int str)
+{
+  struct board_context *saved = bctx;
+  int result;
+
+  bctx = ctx;
+  result = countlib(TO_CORE(str));
+  bctx = saved;
+  return result;
+}
+
+
+static int
+core_find_libs(struct board_context *ctx, int str, int maxlib, int *libs)
+{
+  struct board_context *saved = bctx;
+  int result;
+  int k;
+
+  bctx = ctx;
+  result = findlib(TO_CORE(str), maxlib, libs);
+  bctx = saved;
+
+  for (k = 0; k < result && k < maxlib; k++)
+    libs[k] = FROM_CORE(libs[k]);
+  return result;
+}
+
+
+const struct board_core THIS_CORE = {
+  MAX_BOARD,
+  core_context_new,
+  core_context_free,
+  core_color,
+  core_clear,
+  core_play,
+  core_legal,
+  core_try_move,
+  core_pop,
+  core_count_libs,
+  core_find_libs
+};
+
+
+/* The board cores linked into the program, smallest first. */
+static const struct board_core *const board_cores[] = {
+  &board_core_9,
+  &board_core_13,
+  &board_core_19
+};
+
+
+/*
+ * Make a new, empty board of the given size, independent of the
+ * default one and of any other context. The context is run by the
+ * smallest board core the size fits in. The hash tables must have
+ * been initialized by hash_init() before contexts are used from
+ * several threads.
+ */
+
+struct board_context *
+board_context_new(int boardsize)
+{
+  int k;
+
+  for (k = 0; k < (int) (sizeof(board_cores) / sizeof(board_cores[0])); k++)
+    if (boardsize <= board_cores[k]->max_board)
+      return board_cores[k]->context_new(boardsize);
+
+  return core_context_new(boardsize);
+}
+
+
+/* Like board_context_new(), but always run by the core of the
+ * program's MAX_BOARD. For comparisons with the smaller cores.
+ */
+
+struct board_context *
+board_context_new_generic(int boardsize)
+{
+  return core_context_new(boardsize);
+}
+
+
+void
+board_context_free(struct board_context *ctx)
+{
+  ctx->core->context_free(ctx);
+}
+
+
+/* The color at pos on the board of ctx. */
+
+int
+board_color_ctx(struct board_context *ctx, int pos)
+{
+  return ctx->core->color(ctx, pos);
+}
+
+
+void
+clear_board_ctx(struct board_context *ctx)
+{
+  ctx->core->clear(ctx);
+}
+
+
+void
+play_move_ctx(struct board_context *ctx, int pos, int color)
+{
+  ctx->core->play(ctx, pos, color);
+}
+
+
+int
+is_legal_ctx(struct board_context *ctx, int pos, int color)
+{
+  return ctx->core->legal(ctx, pos, color);
+}
+
+
+int
+trymove_ctx(struct board_context *ctx, int pos, int color,
+	    const char *message, int str)
+{
+  return ctx->core->try_move(ctx, pos, color, message, str);
+}
+
+
+void
+popgo_ctx(struct board_context *ctx)
+{
+  ctx->core->pop(ctx);
+}
+
+
+int
+countlib_ctx(struct board_context *ctx, int str)
+{
+  return ctx->core->count_libs(ctx, str);
+}
+
+
+int
+findlib_ctx(struct board_context *ctx, int str, int maxlib, int *libs)
+{
+  return ctx->core->find_libs(ctx, str, maxlib, libs);
+}
+
+
+/* ================================================================ */
+/*                     Permanent moves                              */
+/* ================================================================ */
+
+
+static void
+reset_move_history(void)
+{
+  memcpy(initial_board, board, sizeof(board));
+  initial_board_ko_pos = board_ko_pos;
+  initial_white_captured = white_captured;
+  initial_black_captured = black_captured;
+  move_history_pointer = 0;
+  move_history_capture_pointer = 0;
+}
+
+/* Start a batch of add_stone() and remove_stone() calls. Until the
+ * matching end_setup() only the board array and board_hash are
+ * updated; the string data is stale and must not be used, so no
+ * moves may be played or tried and no liberties counted meanwhile.
+ * Batches may be nested, e.g. place_fixed_handicap() inside a setup
+ * node.
+ */
+
+void
+begin_setup(void)
+{
+  gg_assert(stackp == 0);
+  if (setup_depth++ == 0)
+    setup_changed = 0;
+}
+
+
+/* Finish a batch started by begin_setup(). The outermost end_setup()
+ * resets the move history and rebuilds the incremental board data
+ * once for all stones of the batch.
+ */
+
 void
-do_dump_stack(void)
+end_setup(void)
 {
-  int n;
-
-  for (n = 0; n < stackp; n++)
-    gprintf("%o%s:%1m ", move_color[n] == BLACK ? "B" : "W", stack[n]);
+  gg_assert(stackp == 0 && setup_depth > 0);
+  if (--setup_depth == 0 && setup_changed) {
+    reset_move_history();
+    new_position();
+  }
 }
 
-/* ================================================================ */
-/*                     Permanent moves                              */
-/* ================================================================ */
 
+/* Common tail of add_stone() and remove_stone(). Outside a setup
+ * batch the incremental data is rebuilt at once. Inside one only
+ * position_number is bumped, so that caches keyed on it notice the
+ * change. Without USE_BITBOARDS the stone counts of stones_on_board()
+ * are such a cache; with it they come straight from the bitboards,
+ * which add_stone() and remove_stone() keep up to date themselves.
+ */
 
 static void
-reset_move_history(void)
+setup_stone_changed(void)
 {
-  memcpy(initial_board, board, sizeof(board));
-  initial_board_ko_pos = board_ko_pos;
-  initial_white_captured = white_captured;
-  initial_black_captured = black_captured;
-  move_history_pointer = 0;
+  if (setup_depth > 0) {
+    setup_changed = 1;
+    position_number++;
+  }
+  else {
+    reset_move_history();
+    new_position();
+  }
 }
 
+
 /* Place a stone on the board and update the board_hash. This operation
  * destroys all move history.
  */
@@ -832,9 +1536,9 @@ add_stone(int pos, int color)
   ASSERT1(board[pos] == EMPTY, pos);
 
   board[pos] = color;
+  SET_STONE_BIT(pos, color);
   hashdata_invert_stone(&board_hash, pos, color);
-  reset_move_history();
-  new_position();
+  setup_stone_changed();
 }
 
 
@@ -851,20 +1555,24 @@ remove_stone(int pos)
 
   hashdata_invert_stone(&board_hash, pos, board[pos]);
   board[pos] = EMPTY;
-  reset_move_history();
-  new_position();
+  SET_STONE_BIT(pos, EMPTY);
+  setup_stone_changed();
 }
 
 
+/* Permanent moves update the string data incrementally, the same way
+ * as trymove(), reusing the numbers of captured and merged strings.
+ * Should the numbers in use still reach this limit, new_position()
+ * renumbers the strings on the board from zero, leaving the rest of
+ * MAX_STRINGS for reading from the position.
+ */
+#define STRING_COMPACT_LIMIT (MAX_STRINGS / 2)
+
 /* Play a move. Basically the same as play_move() below, but doesn't store
  * the move in history list.
- *
- * Set `update_internals' to zero if you want to play several moves in a
- * row to avoid overhead caused by new_position(). Don't forget to call
- * it yourself after all the moves have been played.
  */
 static void
-play_move_no_history(int pos, int color, int update_internals)
+play_move_no_history(int pos, int color)
 {
 #if CHECK_HASHING
   Hash_data oldkey;
@@ -896,10 +1604,16 @@ play_move_no_history(int pos, int color, int update_internals)
 #endif
   }
 
-  if (update_internals || next_string == MAX_STRINGS)
+  if (next_string >= STRING_COMPACT_LIMIT)
     new_position();
-  else
+  else {
     CLEAR_STACKS();
+    position_number++;
+  }
+
+#if CHECK_INCREMENTAL
+  check_incremental_strings();
+#endif
 }
 
 /* Load the initial position and replay the first n moves. */
@@ -912,10 +1626,11 @@ replay_move_history(int n)
   board_ko_pos = initial_board_ko_pos;
   white_captured = initial_white_captured;
   black_captured = initial_black_captured;
+  hashdata_recalc(&board_hash, board, board_ko_pos);
   new_position();
 
   for (k = 0; k < n; k++)
-    play_move_no_history(move_history_pos[k], move_history_color[k], 0);
+    play_move_no_history(move_history_pos[k], move_history_color[k]);
 
   new_position();
 }
@@ -929,9 +1644,10 @@ replay_move_history(int n)
  *    remove it and increase the prisoner count.
  *
  * In spite of the name "permanent move", this move can (usually) be
- * unplayed by undo_move(), but it is significantly more costly than
- * unplaying a temporary move. There are limitations on the available
- * move history, so under certain circumstances the move may not be
+ * unplayed by undo_move(). The move history records the ko point and
+ * the stones the move captures, so that undoing it does not need a
+ * replay of the game. There are limitations on the available move
+ * history, so under certain circumstances the move may not be
  * possible to unplay at a later time.
  */
 void
@@ -942,17 +1658,20 @@ play_move(int pos, int color)
   ASSERT1(pos == PASS_MOVE || ON_BOARD1(pos), pos);
   ASSERT1(pos == PASS_MOVE || board[pos] == EMPTY, pos);
   ASSERT1(komaster == EMPTY && kom_pos == NO_MOVE, pos);
+  ASSERT1(setup_depth == 0, pos);
 
   if (move_history_pointer >= MAX_MOVE_HISTORY) {
     /* The move history is full. We resolve this by collapsing the
      * first about 10% of the moves into the initial position.
      */
     int number_collapsed_moves = 1 + MAX_MOVE_HISTORY / 10;
+    int first_capture;
     int k;
     Intersection saved_board[BOARDSIZE];
     int saved_board_ko_pos = board_ko_pos;
     int saved_white_captured = white_captured;
     int saved_black_captured = black_captured;
+    Hash_data saved_board_hash = board_hash;
     memcpy(saved_board, board, sizeof(board));
 
     replay_move_history(number_collapsed_moves);
@@ -962,17 +1681,26 @@ play_move(int pos, int color)
     initial_white_captured = white_captured;
     initial_black_captured = black_captured;
 
+    first_capture = move_history_first_capture[number_collapsed_moves];
     for (k = number_collapsed_moves; k < move_history_pointer; k++) {
       move_history_color[k - number_collapsed_moves] = move_history_color[k];
       move_history_pos[k - number_collapsed_moves] = move_history_pos[k];
       move_history_hash[k - number_collapsed_moves] = move_history_hash[k];
+      move_history_ko_pos[k - number_collapsed_moves] = move_history_ko_pos[k];
+      move_history_first_capture[k - number_collapsed_moves]
+	= move_history_first_capture[k] - first_capture;
     }
     move_history_pointer -= number_collapsed_moves;
+    memmove(move_history_captures, move_history_captures + first_capture,
+	    (move_history_capture_pointer - first_capture)
+	    * sizeof(move_history_captures[0]));
+    move_history_capture_pointer -= first_capture;
 
     memcpy(board, saved_board, sizeof(board));
     board_ko_pos = saved_board_ko_pos;
     white_captured = saved_white_captured;
     black_captured = saved_black_captured;
+    board_hash = saved_board_hash;
     new_position();
   }
 
@@ -981,9 +1709,14 @@ play_move(int pos, int color)
   move_history_hash[move_history_pointer] = board_hash;
   if (board_ko_pos != NO_MOVE)
     hashdata_invert_ko(&move_history_hash[move_history_pointer], board_ko_pos);
+  move_history_ko_pos[move_history_pointer] = board_ko_pos;
+  move_history_first_capture[move_history_pointer]
+    = move_history_capture_pointer;
+  if (pos != PASS_MOVE)
+    record_captures(pos, color);
   move_history_pointer++;
   
-  play_move_no_history(pos, color, 1);
+  play_move_no_history(pos, color);
   
   movenum++;
 }
@@ -991,24 +1724,132 @@ play_move(int pos, int color)
 
 /* Undo n permanent moves. Returns 1 if successful and 0 if it fails.
  * If n moves cannot be undone, no move is undone.
+ *
+ * The moves are taken back one by one from their records in the move
+ * history and the incremental board data is rebuilt once at the end,
+ * so the cost does not depend on how long the game is.
  */
 int
 undo_move(int n)
 {
+  int k;
+#if CHECK_UNDO
+  Intersection undone_board[BOARDSIZE];
+  Hash_data undone_hash;
+  int undone_ko_pos;
+  int undone_white_captured;
+  int undone_black_captured;
+#endif
+
   gg_assert(stackp == 0);
   
   /* Fail if and only if the move history is too short. */
   if (move_history_pointer < n)
     return 0;
 
-  replay_move_history(move_history_pointer - n);
-  move_history_pointer -= n;
+  for (k = 0; k < n; k++)
+    unplay_move();
+  new_position();
   movenum -= n;
 
+#if CHECK_UNDO
+  memcpy(undone_board, board, sizeof(board));
+  undone_hash = board_hash;
+  undone_ko_pos = board_ko_pos;
+  undone_white_captured = white_captured;
+  undone_black_captured = black_captured;
+
+  replay_move_history(move_history_pointer);
+  gg_assert(memcmp(undone_board, board, sizeof(board)) == 0);
+  gg_assert(hashdata_is_equal(undone_hash, board_hash));
+  gg_assert(undone_ko_pos == board_ko_pos);
+  gg_assert(undone_white_captured == white_captured);
+  gg_assert(undone_black_captured == black_captured);
+#endif
+
   return 1;
 }
 
 
+/* Record the stones captured by a move at pos in the move history,
+ * before the move is played. If the move is a suicide, these are the
+ * friendly strings next to it and the stone itself.
+ */
+static void
+record_captures(int pos, int color)
+{
+  int suicide = is_suicide(pos, color);
+  int captured = suicide ? color : OTHER_COLOR(color);
+  int k, l;
+
+  for (k = 0; k < 4; k++) {
+    int str = pos + delta[k];
+
+    if (board[str] != captured || (!suicide && countlib(str) > 1))
+      continue;
+
+    /* Skip strings already recorded from another direction. */
+    for (l = 0; l < k; l++)
+      if (board[pos + delta[l]] == captured
+	  && same_string(pos + delta[l], str))
+	break;
+    if (l < k)
+      continue;
+
+    gg_assert(move_history_capture_pointer + countstones(str)
+	      <= MAX_CAPTURE_HISTORY);
+    move_history_capture_pointer
+      += findstones(str, MAX_CAPTURE_HISTORY - move_history_capture_pointer,
+		    move_history_captures + move_history_capture_pointer);
+  }
+
+  if (suicide) {
+    gg_assert(move_history_capture_pointer < MAX_CAPTURE_HISTORY);
+    move_history_captures[move_history_capture_pointer++] = pos;
+  }
+}
+
+
+/* Take back the last move of the move history by restoring the stones
+ * it captured, the ko point and the hash. The incremental board data
+ * is left for the caller to rebuild.
+ */
+static void
+unplay_move(void)
+{
+  int k = --move_history_pointer;
+  int pos = move_history_pos[k];
+  int captured;
+  int n;
+
+  if (pos != PASS_MOVE) {
+    /* After a suicide the point of the move is empty again. */
+    if (board[pos] == EMPTY)
+      captured = move_history_color[k];
+    else {
+      captured = OTHER_COLOR(move_history_color[k]);
+      board[pos] = EMPTY;
+    }
+
+    for (n = move_history_first_capture[k];
+	 n < move_history_capture_pointer; n++)
+      board[move_history_captures[n]] = captured;
+
+    n = move_history_capture_pointer - move_history_first_capture[k];
+    if (captured == WHITE)
+      white_captured -= n;
+    else
+      black_captured -= n;
+  }
+
+  move_history_capture_pointer = move_history_first_capture[k];
+  board_ko_pos = move_history_ko_pos[k];
+  board_hash = move_history_hash[k];
+  if (board_ko_pos != NO_MOVE)
+    hashdata_invert_ko(&board_hash, board_ko_pos);
+}
+
+
 /* Return the last move done by the opponent to color. Both if no move
  * was found or if the last move was a pass, PASS_MOVE is returned.
  */
@@ -1768,20 +2609,6 @@ fastlib(int pos, int color, int ignore_captures)
 }
 
 
-/* Effectively true unless we store full position in hash. */
-#define USE_BOARD_CACHES	(NUM_HASHVALUES <= 4)
-
-struct board_cache_entry {
-  int threshold;
-  int liberties;
-  Hash_data position_hash;
-};
-
-
-/* approxlib() cache. */
-static struct board_cache_entry approxlib_cache[BOARDMAX][2];
-
-
 /* Clears approxlib() cache. This function should be called only once
  * during engine initialization. Sets thresholds to zero.
  */
@@ -2070,10 +2897,6 @@ slow_approxlib(int pos, int color, int maxlib, int *libs)
 }
 
 
-/* accuratelib() cache. */
-static struct board_cache_entry accuratelib_cache[BOARDMAX][2];
-
-
 /* Clears accuratelib() cache. This function should be called only once
  * during engine initialization. Sets thresholds to zero.
  */
@@ -3235,12 +4058,12 @@ get_move_from_stack(int k, int *move, int *color)
 int
 stones_on_board(int color)
 {
-  static int stone_count_for_position = -1;
-  static int white_stones = 0;
-  static int black_stones = 0;
-
   gg_assert(stackp == 0);
 
+#if USE_BITBOARDS
+  return ((color & BLACK ? bitboard_count(&stone_bits[BLACK]) : 0) +
+	  (color & WHITE ? bitboard_count(&stone_bits[WHITE]) : 0));
+#else
   if (stone_count_for_position != position_number) {
     int pos;
     white_stones = 0;
@@ -3257,9 +4080,199 @@ stones_on_board(int color)
 
   return ((color & BLACK ? black_stones : 0) +
 	  (color & WHITE ? white_stones : 0));
+#endif
+}
+
+
+/* ================================================================ */
+/*                            Bitboards                             */
+/* ================================================================ */
+
+#if USE_BITBOARDS
+
+/* Number of set bits in w. */
+static int
+bit_count(Bitword w)
+{
+#if defined(__GNUC__)
+  return __builtin_popcountll(w);
+#else
+  int n;
+  for (n = 0; w; n++)
+    w &= w - 1;
+  return n;
+#endif
+}
+
+/* Index of the lowest set bit in w, which must not be zero. */
+static int
+lowest_bit(Bitword w)
+{
+#if defined(__GNUC__)
+  return __builtin_ctzll(w);
+#else
+  int n;
+  for (n = 0; !(w & 1); n++)
+    w >>= 1;
+  return n;
+#endif
+}
+
+
+/* The stones of color, or the empty points on the board for EMPTY. */
+
+void
+bitboard_stones(int color, Bitboard *bb)
+{
+  int k;
+
+  if (IS_STONE(color))
+    *bb = stone_bits[color];
+  else {
+    for (k = 0; k < BITBOARD_WORDS; k++)
+      bb->w[k] = on_board_bits.w[k]
+		 & ~(stone_bits[WHITE].w[k] | stone_bits[BLACK].w[k]);
+  }
+}
+
+
+/* The points of in and their neighbors, restricted to mask. Each word
+ * takes the bits shifted in from the words on either side, which
+ * leaves the loop free of branches for the compiler to vectorize.
+ */
+
+static void
+dilate_within(const Bitboard *in, const Bitboard *mask, Bitboard *out)
+{
+  Bitword padded[BITBOARD_WORDS + 2];
+  const Bitword *w = padded + 1;
+  Bitword result[BITBOARD_WORDS];
+  int k;
+
+  padded[0] = 0;
+  padded[BITBOARD_WORDS + 1] = 0;
+  memcpy(padded + 1, in->w, sizeof(in->w));
+
+  for (k = 0; k < BITBOARD_WORDS; k++)
+    result[k] = (w[k]
+		 | w[k] << 1 | w[k - 1] >> 63
+		 | w[k] >> 1 | w[k + 1] << 63
+		 | w[k] << NS | w[k - 1] >> (64 - NS)
+		 | w[k] >> NS | w[k + 1] << (64 - NS))
+		& mask->w[k];
+
+  memcpy(out->w, result, sizeof(result));
+}
+
+
+/* The points of in and their neighbors on the board. */
+
+void
+bitboard_dilate(const Bitboard *in, Bitboard *out)
+{
+  dilate_within(in, &on_board_bits, out);
+}
+
+
+/* The points on the edge of the board. */
+
+void
+bitboard_edge(Bitboard *bb)
+{
+  Bitboard off;
+  int k;
+
+  for (k = 0; k < BITBOARD_WORDS; k++)
+    off.w[k] = ~on_board_bits.w[k];
+  /* The dilation keeps only the points on the board. */
+  bitboard_dilate(&off, bb);
+}
+
+
+/* The stones of the string at str, found by flood fill: the set is
+ * dilated within the stones of the string's color until it stops
+ * growing. Returns the number of stones.
+ */
+
+int
+bitboard_string(int str, Bitboard *stones)
+{
+  const Bitboard *same;
+  Bitboard grown;
+
+  ASSERT1(IS_STONE(board[str]), str);
+  same = &stone_bits[board[str]];
+
+  memset(&grown, 0, sizeof(grown));
+  grown.w[BIT_WORD(str)] = BIT_MASK(str);
+  do {
+    *stones = grown;
+    dilate_within(stones, same, &grown);
+  } while (memcmp(&grown, stones, sizeof(grown)) != 0);
+
+  return bitboard_count(stones);
+}
+
+
+/* The empty points next to the given stones, which may belong to
+ * several strings. Returns the number of liberties.
+ */
+
+int
+bitboard_liberties(const Bitboard *stones, Bitboard *libs)
+{
+  int liberties = 0;
+  int k;
+
+  bitboard_dilate(stones, libs);
+  for (k = 0; k < BITBOARD_WORDS; k++) {
+    libs->w[k] &= on_board_bits.w[k]
+		  & ~(stone_bits[WHITE].w[k] | stone_bits[BLACK].w[k]);
+    liberties += bit_count(libs->w[k]);
+  }
+
+  return liberties;
+}
+
+
+int
+bitboard_count(const Bitboard *bb)
+{
+  int n = 0;
+  int k;
+
+  for (k = 0; k < BITBOARD_WORDS; k++)
+    n += bit_count(bb->w[k]);
+
+  return n;
 }
 
 
+/* The first point of bb after pos, or NO_MOVE if there is none. Start
+ * with pos == NO_MOVE to visit all points.
+ */
+
+int
+bitboard_next(const Bitboard *bb, int pos)
+{
+  int k = BIT_WORD(pos + 1);
+  Bitword w;
+
+  if (k >= BITBOARD_WORDS)
+    return NO_MOVE;
+  w = bb->w[k] & ~(BIT_MASK(pos + 1) - 1);
+  while (!w) {
+    if (++k >= BITBOARD_WORDS)
+      return NO_MOVE;
+    w = bb->w[k];
+  }
+
+  return k * 64 + lowest_bit(w);
+}
+
+#endif
+
+
 /* ===================== Statistics  ============================= */
 
 
@@ -3304,6 +4317,7 @@ new_position(void)
 
   position_number++;
   next_string = 0;
+  free_strings = 0;
   liberty_mark = 0;
   string_mark = 0;
   CLEAR_STACKS();
@@ -3313,13 +4327,22 @@ new_position(void)
   memset(string_neighbors, 0, sizeof(string_neighbors));
   memset(ml, 0, sizeof(ml));
   VALGRIND_MAKE_WRITABLE(next_stone, sizeof(next_stone));
+#if USE_BITBOARDS
+  memset(stone_bits, 0, sizeof(stone_bits));
+  memset(&on_board_bits, 0, sizeof(on_board_bits));
+#endif
 
   /* propagate_string relies on non-assigned stones to have
    * string_number -1.
    */
   for (pos = BOARDMIN; pos < BOARDMAX; pos++)
-    if (ON_BOARD(pos))
+    if (ON_BOARD(pos)) {
       string_number[pos] = -1;
+#if USE_BITBOARDS
+      on_board_bits.w[BIT_WORD(pos)] |= BIT_MASK(pos);
+      SET_STONE_BIT(pos, board[pos]);
+#endif
+    }
 
   /* Find the existing strings. */
   for (pos = BOARDMIN; pos < BOARDMAX; pos++) {
@@ -3343,6 +4366,60 @@ new_position(void)
 }
 
 
+#if CHECK_INCREMENTAL
+
+/*
+ * Debug function. Rebuild the string data with new_position() and
+ * check that the incrementally updated strings agreed with it.
+ */
+
+static void
+check_incremental_strings(void)
+{
+  int size[BOARDMAX];
+  int origin[BOARDMAX];
+  int liberties[BOARDMAX];
+  int neighbors[BOARDMAX];
+  int libsum[BOARDMAX];
+  int pos;
+  int k;
+
+  for (pos = BOARDMIN; pos < BOARDMAX; pos++) {
+    int s;
+    if (!ON_BOARD(pos) || !IS_STONE(board[pos]))
+      continue;
+    s = string_number[pos];
+    ASSERT1(s >= 0 && s < next_string && string[s].color == board[pos], pos);
+    size[pos] = string[s].size;
+    origin[pos] = string[s].origin;
+    liberties[pos] = string[s].liberties;
+    neighbors[pos] = string[s].neighbors;
+    libsum[pos] = 0;
+    for (k = 0; k < string[s].liberties && k < MAX_LIBERTIES; k++)
+      libsum[pos] += string_libs[s].list[k];
+  }
+
+  new_position();
+
+  for (pos = BOARDMIN; pos < BOARDMAX; pos++) {
+    int s;
+    int sum = 0;
+    if (!ON_BOARD(pos) || !IS_STONE(board[pos]))
+      continue;
+    s = string_number[pos];
+    for (k = 0; k < string[s].liberties && k < MAX_LIBERTIES; k++)
+      sum += string_libs[s].list[k];
+    ASSERT1(size[pos] == string[s].size, pos);
+    ASSERT1(origin[pos] == string[s].origin, pos);
+    ASSERT1(liberties[pos] == string[s].liberties, pos);
+    ASSERT1(neighbors[pos] == string[s].neighbors, pos);
+    ASSERT1(string[s].liberties > MAX_LIBERTIES || libsum[pos] == sum, pos);
+  }
+}
+
+#endif
+
+
 #if 0
 
 /*
@@ -3672,10 +4749,61 @@ do_remove_string(int s)
   else
     black_captured += size;
 
+  free_string_number(s);
   return size;
 }
 
 
+/* Take a number for a new string, preferably one given up by a
+ * string that has been captured or merged. That string comes back if
+ * the move is undone by popgo(), so everything of it the new string
+ * will overwrite is pushed first. Thus next_string only grows when
+ * there are more strings on the board than ever before on this
+ * line of play, and stays within MAX_STRINGS however long the
+ * reading goes on, e.g. through the cycles of a triple ko.
+ */
+
+static int
+new_string_number(void)
+{
+  int s;
+  int k;
+
+  if (free_strings == 0) {
+    PUSH_VALUE(next_string);
+    return next_string++;
+  }
+
+  PUSH_VALUE(free_strings);
+  s = free_string_list[--free_strings];
+
+  PUSH_VALUE(string[s].color);
+  PUSH_VALUE(string[s].size);
+  PUSH_VALUE(string[s].origin);
+  PUSH_VALUE(string[s].liberties);
+  PUSH_VALUE(string[s].neighbors);
+  for (k = 0; k < string[s].liberties && k < MAX_LIBERTIES; k++)
+    PUSH_VALUE(string_libs[s].list[k]);
+  for (k = 0; k < string[s].neighbors; k++)
+    PUSH_VALUE(string_neighbors[s].list[k]);
+
+  return s;
+}
+
+
+/* Give up the number of a string that has been captured or merged
+ * into another one.
+ */
+
+static void
+free_string_number(int s)
+{
+  PUSH_VALUE(free_string_list[free_strings]);
+  PUSH_VALUE(free_strings);
+  free_string_list[free_strings++] = s;
+}
+
+
 /* We have played an isolated new stone and need to create a new
  * string for it.
  */
@@ -3687,8 +4815,7 @@ create_new_string(int pos)
   int other = OTHER_COLOR(color);
 
   /* Get the next free string number. */
-  PUSH_VALUE(next_string);
-  s = next_string++;
+  s = new_string_number();
   PARANOID1(s < MAX_STRINGS, pos);
   string_number[pos] = s;
   /* Set up a size one cycle for the string. */
@@ -3958,6 +5085,8 @@ assimilate_string(int s, int pos)
       string[t].mark = string_mark;
     }
   }
+
+  free_string_number(s2);
 }
 
 
@@ -3973,8 +5102,7 @@ assimilate_neighbor_strings(int pos)
   int other = OTHER_COLOR(color);
 
   /* Get the next free string number. */
-  PUSH_VALUE(next_string);
-  s = next_string++;
+  s = new_string_number();
   PARANOID1(s < MAX_STRINGS, pos); 
   string_number[pos] = s;
   /* Set up a size one cycle for the string. */
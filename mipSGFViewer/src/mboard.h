@@ -69,19 +69,13 @@ typedef unsigned char Intersection;
  * liberty and each empty point can provide a liberty to at most four
  * strings, at least one out of five board points must be empty.
  *
- * FIXME: This is not sufficiently large. Above stackp==0, the
- *        incremental board code doesn't re-use the entries for
- *        removed or merged strings, while new strings require new
- *        entries. This is a problem only in very pathological cases,
- *        and is extremely unlikely to occur in practice.
- *
- *        Actually, in the not all that pathological case of a
- *        repeated triple ko cycle, each move creates a new string and
- *        thus makes use of one more string, which relatively quickly
- *        will exhaust the available strings. For a safe upper bound
- *        MAX_STRINGS should be set to
- *        MAX_STACK + 4 * MAX_BOARD * MAX_BOARD / 5.
- *        It's not clear that it's worth the extra memory, however.
+ * Strings that are captured or merged into another string give up
+ * their numbers for reuse by new strings, also above stackp==0, and
+ * popgo() undoes the reuse. So the number of string entries in use
+ * is at most the largest number of strings on the board along the
+ * current line of play, plus the one a merging move takes before its
+ * friendly neighbors are merged into it. Even a repeated triple ko
+ * cycle does not use up more entries.
  */
 #define MAX_STRINGS (4 * MAX_BOARD * MAX_BOARD / 5)
 
@@ -103,10 +97,22 @@ typedef unsigned char Intersection;
 
 
 #define MIN_BOARD          1       /* Minimum supported board size.   */
-#define MAX_BOARD         19       /* Maximum supported board size.   */
+#define DEFAULT_MAX_BOARD 19       /* Maximum supported board size.   */
+
+/* The board core in mboard.c is also compiled with MAX_BOARD set to
+ * smaller sizes on the command line, see board_context_new().
+ */
+#ifndef MAX_BOARD
+#define MAX_BOARD DEFAULT_MAX_BOARD
+#endif
 #define MAX_HANDICAP       9       /* Maximum supported handicap.     */
 #define MAX_MOVE_HISTORY 500       /* Max number of moves remembered. */
 
+/* Stones captured by the moves in the history. Each of them was either
+ * on the board before the first move or played by one of the moves.
+ */
+#define MAX_CAPTURE_HISTORY (MAX_BOARD * MAX_BOARD + MAX_MOVE_HISTORY)
+
 #define DEFAULT_BOARD_SIZE MAX_BOARD
 
 /* Colors and komaster states. */
@@ -198,6 +204,10 @@ extern int          move_history_color[MAX_MOVE_HISTORY];
 extern int          move_history_pos[MAX_MOVE_HISTORY];
 extern Hash_data    move_history_hash[MAX_MOVE_HISTORY];
 extern int          move_history_pointer;
+extern int          move_history_ko_pos[MAX_MOVE_HISTORY];
+extern int          move_history_first_capture[MAX_MOVE_HISTORY];
+extern int          move_history_captures[MAX_CAPTURE_HISTORY];
+extern int          move_history_capture_pointer;
 
 extern float        komi;
 extern int          handicap;     /* used internally in chinese scoring */
@@ -243,6 +253,10 @@ struct board_state {
   int move_history_pos[MAX_MOVE_HISTORY];
   Hash_data move_history_hash[MAX_MOVE_HISTORY];
   int move_history_pointer;
+  int move_history_ko_pos[MAX_MOVE_HISTORY];
+  int move_history_first_capture[MAX_MOVE_HISTORY];
+  int move_history_captures[MAX_CAPTURE_HISTORY];
+  int move_history_capture_pointer;
 
   float komi;
   int handicap;
@@ -254,6 +268,21 @@ struct board_state {
  */
 extern int position_number;
 
+/* Bitboards: bit pos stands for board[pos], so the points of a
+ * bitboard use the same padded coordinates as the board and the
+ * border column keeps rows apart when a bitboard is shifted. With
+ * USE_BITBOARDS the board keeps one for each color up to date.
+ */
+#define USE_BITBOARDS 1
+
+#define BITBOARD_WORDS (((BOARDMAX) + 63) / 64)
+
+typedef unsigned long long Bitword;
+
+typedef struct {
+  Bitword w[BITBOARD_WORDS];
+} Bitboard;
+
 /* ================================================================ */
 /*                        board.c functions                         */
 /* ================================================================ */
@@ -264,6 +293,8 @@ void clear_board(void);
 int test_gray_border(void);
 void setup_board(Intersection new_board[MAX_BOARD][MAX_BOARD], int ko_pos,
                  int *last, float new_komi, int w_captured, int b_captured);
+void begin_setup(void);
+void end_setup(void);
 void add_stone(int pos, int color);
 void remove_stone(int pos);
 void play_move(int pos, int color);
@@ -272,6 +303,35 @@ int undo_move(int n);
 void store_board(struct board_state *state);
 void restore_board(struct board_state *state);
 
+/* Independent boards, for use by separate threads. Positions passed
+ * to and returned from these are always in the POS() layout of the
+ * program, even when the context is run by a smaller board core.
+ */
+struct board_context;
+struct board_context *board_context_new(int boardsize);
+struct board_context *board_context_new_generic(int boardsize);
+void board_context_free(struct board_context *ctx);
+int board_color_ctx(struct board_context *ctx, int pos);
+void clear_board_ctx(struct board_context *ctx);
+void play_move_ctx(struct board_context *ctx, int pos, int color);
+int is_legal_ctx(struct board_context *ctx, int pos, int color);
+int trymove_ctx(struct board_context *ctx, int pos, int color,
+                const char *message, int str);
+void popgo_ctx(struct board_context *ctx);
+int countlib_ctx(struct board_context *ctx, int str);
+int findlib_ctx(struct board_context *ctx, int str, int maxlib, int *libs);
+
+#if USE_BITBOARDS
+/* Whole-board operations on bitboards. */
+void bitboard_stones(int color, Bitboard *bb);
+void bitboard_edge(Bitboard *bb);
+void bitboard_dilate(const Bitboard *in, Bitboard *out);
+int bitboard_string(int str, Bitboard *stones);
+int bitboard_liberties(const Bitboard *stones, Bitboard *libs);
+int bitboard_count(const Bitboard *bb);
+int bitboard_next(const Bitboard *bb, int pos);
+#endif
+
 /* Information about the permanent board. */
 int get_last_move(void);
 int get_last_player(void);
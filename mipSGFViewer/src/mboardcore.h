@@ -0,0 +1,173 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *\
+ * This is GNU Go, a Go program. Contact gnugo@gnu.org, or see       *
+ * http://www.gnu.org/software/gnugo/ for more information.          *
+ *                                                                   *
+ * Copyright 1999, 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2007,   *
+ * 2008 and 2009 by the Free Software Foundation.                    *
+ *                                                                   *
+ * This program is free software; you can redistribute it and/or     *
+ * modify it under the terms of the GNU General Public License as    *
+ * published by the Free Software Foundation - version 3 or          *
+ * (at your option) any later version.                               *
+ *                                                                   *
+ * This program is distributed in the hope that it will be useful,   *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of    *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the     *
+ * GNU General Public License in file COPYING for more details.      *
+ *                                                                   *
+ * You should have received a copy of the GNU General Public         *
+ * License along with this program; if not, write to the Free        *
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor,       *
+ * Boston, MA 02111, USA.                                            *
+\* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef _MBOARDCORE_H_
+#define _MBOARDCORE_H_
+
+/*
+ * mboard.c is compiled once for the program's MAX_BOARD and once more
+ * for each of the smaller board sizes in the Makefile, with BOARD_CORE
+ * set to the size. In such a board core the stride NS, BOARDMIN,
+ * BOARDMAX and all the array sizes are compile-time constants for that
+ * size, so that a 9x9 context is a fraction of the size of a 19x19 one
+ * and its loops are correspondingly shorter. The external names of a
+ * core get the size as suffix, e.g. play_move_9(), so that the cores
+ * can be linked together. This header must be included before any
+ * other by mboard.c.
+ *
+ * The cores are only reached through the board_context functions,
+ * which look at the core of the context and convert positions between
+ * the layout of the program and that of the core.
+ */
+
+#define BOARD_CORE_PASTE(name, size) BOARD_CORE_PASTE2(name, size)
+#define BOARD_CORE_PASTE2(name, size) name ## _ ## size
+
+#ifdef BOARD_CORE
+#define MAX_BOARD BOARD_CORE
+#define BOARD_CORE_NAME(name) BOARD_CORE_PASTE(name, BOARD_CORE)
+
+#define accuratelib                    BOARD_CORE_NAME(accuratelib)
+#define add_stone                      BOARD_CORE_NAME(add_stone)
+#define adjacent_strings               BOARD_CORE_NAME(adjacent_strings)
+#define approxlib                      BOARD_CORE_NAME(approxlib)
+#define are_neighbors                  BOARD_CORE_NAME(are_neighbors)
+#define begin_setup                    BOARD_CORE_NAME(begin_setup)
+#define bitboard_count                 BOARD_CORE_NAME(bitboard_count)
+#define bitboard_dilate                BOARD_CORE_NAME(bitboard_dilate)
+#define bitboard_edge                  BOARD_CORE_NAME(bitboard_edge)
+#define bitboard_liberties             BOARD_CORE_NAME(bitboard_liberties)
+#define bitboard_next                  BOARD_CORE_NAME(bitboard_next)
+#define bitboard_stones                BOARD_CORE_NAME(bitboard_stones)
+#define bitboard_string                BOARD_CORE_NAME(bitboard_string)
+#define board_color_ctx                BOARD_CORE_NAME(board_color_ctx)
+#define board_context_free             BOARD_CORE_NAME(board_context_free)
+#define board_context_new              BOARD_CORE_NAME(board_context_new)
+#define board_context_new_generic      BOARD_CORE_NAME(board_context_new_generic)
+#define chainlinks                     BOARD_CORE_NAME(chainlinks)
+#define chainlinks2                    BOARD_CORE_NAME(chainlinks2)
+#define chainlinks3                    BOARD_CORE_NAME(chainlinks3)
+#define clear_accuratelib_cache        BOARD_CORE_NAME(clear_accuratelib_cache)
+#define clear_approxlib_cache          BOARD_CORE_NAME(clear_approxlib_cache)
+#define clear_board                    BOARD_CORE_NAME(clear_board)
+#define clear_board_ctx                BOARD_CORE_NAME(clear_board_ctx)
+#define count_adjacent_stones          BOARD_CORE_NAME(count_adjacent_stones)
+#define count_common_libs              BOARD_CORE_NAME(count_common_libs)
+#define countlib                       BOARD_CORE_NAME(countlib)
+#define countlib_ctx                   BOARD_CORE_NAME(countlib_ctx)
+#define countstones                    BOARD_CORE_NAME(countstones)
+#define delta                          BOARD_CORE_NAME(delta)
+#define deltai                         BOARD_CORE_NAME(deltai)
+#define deltaj                         BOARD_CORE_NAME(deltaj)
+#define do_dump_stack                  BOARD_CORE_NAME(do_dump_stack)
+#define does_capture_something         BOARD_CORE_NAME(does_capture_something)
+#define dump_stack                     BOARD_CORE_NAME(dump_stack)
+#define edge_distance                  BOARD_CORE_NAME(edge_distance)
+#define end_setup                      BOARD_CORE_NAME(end_setup)
+#define extended_chainlinks            BOARD_CORE_NAME(extended_chainlinks)
+#define fastlib                        BOARD_CORE_NAME(fastlib)
+#define find_common_libs               BOARD_CORE_NAME(find_common_libs)
+#define find_origin                    BOARD_CORE_NAME(find_origin)
+#define findlib                        BOARD_CORE_NAME(findlib)
+#define findlib_ctx                    BOARD_CORE_NAME(findlib_ctx)
+#define findstones                     BOARD_CORE_NAME(findstones)
+#define get_kom_pos                    BOARD_CORE_NAME(get_kom_pos)
+#define get_komaster                   BOARD_CORE_NAME(get_komaster)
+#define get_last_move                  BOARD_CORE_NAME(get_last_move)
+#define get_last_opponent_move         BOARD_CORE_NAME(get_last_opponent_move)
+#define get_last_player                BOARD_CORE_NAME(get_last_player)
+#define get_move_from_stack            BOARD_CORE_NAME(get_move_from_stack)
+#define get_trymove_counter            BOARD_CORE_NAME(get_trymove_counter)
+#define has_neighbor                   BOARD_CORE_NAME(has_neighbor)
+#define have_common_lib                BOARD_CORE_NAME(have_common_lib)
+#define incremental_order_moves        BOARD_CORE_NAME(incremental_order_moves)
+#define is_allowed_move                BOARD_CORE_NAME(is_allowed_move)
+#define is_corner_vertex               BOARD_CORE_NAME(is_corner_vertex)
+#define is_edge_vertex                 BOARD_CORE_NAME(is_edge_vertex)
+#define is_illegal_ko_capture          BOARD_CORE_NAME(is_illegal_ko_capture)
+#define is_ko                          BOARD_CORE_NAME(is_ko)
+#define is_ko_point                    BOARD_CORE_NAME(is_ko_point)
+#define is_legal                       BOARD_CORE_NAME(is_legal)
+#define is_legal_ctx                   BOARD_CORE_NAME(is_legal_ctx)
+#define is_pass                        BOARD_CORE_NAME(is_pass)
+#define is_self_atari                  BOARD_CORE_NAME(is_self_atari)
+#define is_suicide                     BOARD_CORE_NAME(is_suicide)
+#define komaster_trymove               BOARD_CORE_NAME(komaster_trymove)
+#define liberty_of_string              BOARD_CORE_NAME(liberty_of_string)
+#define mark_string                    BOARD_CORE_NAME(mark_string)
+#define move_in_stack                  BOARD_CORE_NAME(move_in_stack)
+#define neighbor_of_string             BOARD_CORE_NAME(neighbor_of_string)
+#define play_move                      BOARD_CORE_NAME(play_move)
+#define play_move_ctx                  BOARD_CORE_NAME(play_move_ctx)
+#define popgo                          BOARD_CORE_NAME(popgo)
+#define popgo_ctx                      BOARD_CORE_NAME(popgo_ctx)
+#define remove_stone                   BOARD_CORE_NAME(remove_stone)
+#define reset_trymove_counter          BOARD_CORE_NAME(reset_trymove_counter)
+#define restore_board                  BOARD_CORE_NAME(restore_board)
+#define rotate1                        BOARD_CORE_NAME(rotate1)
+#define same_string                    BOARD_CORE_NAME(same_string)
+#define second_order_liberty_of_string BOARD_CORE_NAME(second_order_liberty_of_string)
+#define send_two_return_one            BOARD_CORE_NAME(send_two_return_one)
+#define setup_board                    BOARD_CORE_NAME(setup_board)
+#define square_dist                    BOARD_CORE_NAME(square_dist)
+#define stones_on_board                BOARD_CORE_NAME(stones_on_board)
+#define store_board                    BOARD_CORE_NAME(store_board)
+#define test_gray_border               BOARD_CORE_NAME(test_gray_border)
+#define tryko                          BOARD_CORE_NAME(tryko)
+#define trymove                        BOARD_CORE_NAME(trymove)
+#define trymove_ctx                    BOARD_CORE_NAME(trymove_ctx)
+#define undo_move                      BOARD_CORE_NAME(undo_move)
+#endif
+
+
+struct board_context;
+
+/* The context functions of one board core. */
+struct board_core {
+  int max_board;
+  struct board_context *(*context_new)(int boardsize);
+  void (*context_free)(struct board_context *ctx);
+  int (*color)(struct board_context *ctx, int pos);
+  void (*clear)(struct board_context *ctx);
+  void (*play)(struct board_context *ctx, int pos, int color);
+  int (*legal)(struct board_context *ctx, int pos, int color);
+  int (*try_move)(struct board_context *ctx, int pos, int color,
+                  const char *message, int str);
+  void (*pop)(struct board_context *ctx);
+  int (*count_libs)(struct board_context *ctx, int str);
+  int (*find_libs)(struct board_context *ctx, int str, int maxlib, int *libs);
+};
+
+extern const struct board_core board_core_9;
+extern const struct board_core board_core_13;
+extern const struct board_core board_core_19;
+
+#endif  /* _MBOARDCORE_H_ */
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 2
+ * End:
+ */
@@ -42,6 +42,10 @@ int          move_history_color[MAX_MOVE_HISTORY];
 int          move_history_pos[MAX_MOVE_HISTORY];
 Hash_data    move_history_hash[MAX_MOVE_HISTORY];
 int          move_history_pointer;
+int          move_history_ko_pos[MAX_MOVE_HISTORY];
+int          move_history_first_capture[MAX_MOVE_HISTORY];
+int          move_history_captures[MAX_CAPTURE_HISTORY];
+int          move_history_capture_pointer;
 
 float komi = 0.0;
 int handicap = 0;
@@ -0,0 +1,772 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *\
+ * This is GNU Go, a Go program. Contact gnugo@gnu.org, or see       *
+ * http://www.gnu.org/software/gnugo/ for more information.          *
+ *                                                                   *
+ * Copyright 1999, 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2007,   *
+ * 2008 and 2009 by the Free Software Foundation.                    *
+ *                                                                   *
+ * This program is free software; you can redistribute it and/or     *
+ * modify it under the terms of the GNU General Public License as    *
+ * published by the Free Software Foundation - version 3 or          *
+ * (at your option) any later version.                               *
+ *                                                                   *
+ * This program is distributed in the hope that it will be useful,   *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of    *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the     *
+ * GNU General Public License in file COPYING for more details.      *
+ *                                                                   *
+ * You should have received a copy of the GNU General Public         *
+ * License along with this program; if not, write to the Free        *
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor,       *
+ * Boston, MA 02111, USA.                                            *
+\* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * mbook.c
+ *
+ * Opening books merged from collections of games. See mgnugo.h.
+ *
+ * The positions of the first moves of the main line of each game are
+ * looked up by the hash value of their canonical orientation, the
+ * least of the hash values of the 8 rotations and reflections of the
+ * board. Positions which differ only by orientation, or which are
+ * reached by different move orders, therefore become one book
+ * position, and the book is a graph rather than a tree. Each position
+ * lists the moves played from it, with the number of games and their
+ * results, and the position each move leads to. Moves are stored in
+ * the canonical orientation of the position they are played from.
+ *
+ * A book file consists of a header, the positions sorted by hash value
+ * and color to move, and the moves of each position in turn, all in
+ * the byte order and word size of the machine that wrote it, so that
+ * it can be searched in place from a mapping of the file.
+ */
+
+#include "mgnugo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "mhash.h"
+#include "msgftree.h"
+
+
+#define BOOK_MAGIC      "MIPBOOK"
+#define BOOK_VERSION    1
+#define BOOK_BYTEORDER  0x01020304
+#define BOOK_NONE       0xffffffffU
+
+typedef struct BookHeader_t {
+  char magic[8];
+  unsigned int version;
+  unsigned int byteorder;	/* BOOK_BYTEORDER as written */
+  unsigned int hashsize;	/* sizeof(Hash_data) */
+  unsigned int boardsize;
+  unsigned int ngames;
+  unsigned int npositions;
+  unsigned int nmoves;
+  unsigned int reserved;
+} BookHeader;
+
+struct BookPosition_t {
+  Hash_data hash;		/* of the canonical orientation */
+  int color;			/* color to move */
+  unsigned int count;		/* games which reached the position */
+  unsigned int black_wins;
+  unsigned int white_wins;
+  unsigned int moves;		/* index of the first move */
+  unsigned int nmoves;
+};
+
+struct BookEdge_t {
+  int move;			/* in the canonical orientation */
+  unsigned int count;
+  unsigned int black_wins;
+  unsigned int white_wins;
+  unsigned int next;		/* position reached */
+};
+
+typedef struct BookPosition_t BookPosition;
+typedef struct BookEdge_t BookEdge;
+
+
+/*
+ * While a book is built, the positions are kept in a hash table and
+ * the moves of each position in a linked list.
+ */
+
+typedef struct BuildPosition_t {
+  struct BookPosition_t pos;	/* moves is the head of the list */
+  int chain;			/* next position in the same bucket */
+} BuildPosition;
+
+typedef struct BuildEdge_t {
+  struct BookEdge_t edge;	/* next is the index of a BuildPosition */
+  int sibling;			/* next move of the same position */
+} BuildEdge;
+
+struct BookBuilder_t {
+  int boardsize;
+  int max_moves;
+  unsigned int ngames;
+
+  BuildPosition *positions;
+  int npositions;
+  int positions_size;
+
+  BuildEdge *edges;
+  int nedges;
+  int edges_size;
+
+  int *buckets;
+  int nbuckets;			/* a power of two */
+};
+
+
+/* The inverse of reorientation rot of rotate1(). */
+
+static int
+inverse_rotation(int rot)
+{
+  if (rot == 1)
+    return 3;
+  if (rot == 3)
+    return 1;
+  return rot;
+}
+
+
+/*
+ * Compute the canonical hash value of the current position. The
+ * reorientations which give it are flagged in symmetries, a bit for
+ * each. There is more than one if the position is symmetric.
+ */
+
+static void
+canonical_hash(Hash_data *hd, int *symmetries)
+{
+  Hash_data hd_rot[8];
+  int rot;
+
+  hashdata_calc_orientations(hd_rot, board, board_ko_pos);
+  *hd = hd_rot[0];
+  *symmetries = 1;
+  for (rot = 1; rot < 8; rot++) {
+    if (hashdata_is_smaller(hd_rot[rot], *hd)) {
+      *hd = hd_rot[rot];
+      *symmetries = 0;
+    }
+    if (hashdata_is_equal(hd_rot[rot], *hd))
+      *symmetries |= 1 << rot;
+  }
+}
+
+
+/*
+ * Map a move into the canonical orientation. When the position is
+ * symmetric, moves which are the same up to its symmetries all map
+ * to the least of their images.
+ */
+
+static int
+canonical_move(int move, int symmetries)
+{
+  int best = NO_MOVE;
+  int rot;
+
+  for (rot = 0; rot < 8; rot++)
+    if (symmetries & (1 << rot)) {
+      int image = rotate1(move, rot);
+      if (best == NO_MOVE || image < best)
+	best = image;
+    }
+
+  return best;
+}
+
+
+BookBuilder *
+book_builder_new(int boardsize, int max_moves)
+{
+  BookBuilder *builder = xalloc(sizeof(BookBuilder));
+
+  hash_init();
+  builder->boardsize = boardsize;
+  builder->max_moves = max_moves;
+  builder->nbuckets = 1024;
+  builder->buckets = xalloc(builder->nbuckets * sizeof(int));
+  memset(builder->buckets, -1, builder->nbuckets * sizeof(int));
+
+  return builder;
+}
+
+
+void
+book_builder_free(BookBuilder *builder)
+{
+  if (!builder)
+    return;
+  free(builder->positions);
+  free(builder->edges);
+  free(builder->buckets);
+  free(builder);
+}
+
+
+static void
+rehash(BookBuilder *builder)
+{
+  int k;
+
+  free(builder->buckets);
+  builder->nbuckets *= 2;
+  builder->buckets = xalloc(builder->nbuckets * sizeof(int));
+  memset(builder->buckets, -1, builder->nbuckets * sizeof(int));
+
+  for (k = 0; k < builder->npositions; k++) {
+    BuildPosition *p = &builder->positions[k];
+    int bucket = p->pos.hash.hashval[0] & (builder->nbuckets - 1);
+    p->chain = builder->buckets[bucket];
+    builder->buckets[bucket] = k;
+  }
+}
+
+
+/* Find the position with hash value hd and color to move, or add it. */
+
+static int
+find_position(BookBuilder *builder, const Hash_data *hd, int color)
+{
+  BuildPosition *p;
+  int bucket = hd->hashval[0] & (builder->nbuckets - 1);
+  int k;
+
+  for (k = builder->buckets[bucket]; k >= 0; k = builder->positions[k].chain)
+    if (builder->positions[k].pos.color == color
+	&& hashdata_is_equal(builder->positions[k].pos.hash, *hd))
+      return k;
+
+  if (builder->npositions == builder->positions_size) {
+    builder->positions_size = builder->positions_size
+			      ? 2 * builder->positions_size : 1024;
+    builder->positions = xrealloc(builder->positions,
+				  builder->positions_size
+				  * sizeof(BuildPosition));
+  }
+
+  k = builder->npositions++;
+  p = &builder->positions[k];
+  memset(p, 0, sizeof(*p));
+  p->pos.hash = *hd;
+  p->pos.color = color;
+  p->pos.moves = BOOK_NONE;
+  p->chain = builder->buckets[bucket];
+  builder->buckets[bucket] = k;
+
+  if (builder->npositions > builder->nbuckets)
+    rehash(builder);
+  return k;
+}
+
+
+/* Find the move of a position, or add it. */
+
+static BuildEdge *
+find_edge(BookBuilder *builder, int position, int move)
+{
+  BuildEdge *e;
+  int k;
+
+  for (k = builder->positions[position].pos.moves; k != (int) BOOK_NONE;
+       k = builder->edges[k].sibling)
+    if (builder->edges[k].edge.move == move)
+      return &builder->edges[k];
+
+  if (builder->nedges == builder->edges_size) {
+    builder->edges_size = builder->edges_size ? 2 * builder->edges_size : 1024;
+    builder->edges = xrealloc(builder->edges,
+			      builder->edges_size * sizeof(BuildEdge));
+  }
+
+  k = builder->nedges++;
+  e = &builder->edges[k];
+  memset(e, 0, sizeof(*e));
+  e->edge.move = move;
+  e->edge.next = BOOK_NONE;
+  e->sibling = builder->positions[position].pos.moves;
+  builder->positions[position].pos.moves = k;
+  builder->positions[position].pos.nmoves++;
+  return e;
+}
+
+
+/* The winner of a game from its RE property, or EMPTY if unknown. */
+
+static int
+game_winner(SGFNode *root)
+{
+  char *result;
+
+  if (!sgfGetCharProperty(root, "RE", &result))
+    return EMPTY;
+  if ((result[0] == 'B' || result[0] == 'b') && result[1] == '+')
+    return BLACK;
+  if ((result[0] == 'W' || result[0] == 'w') && result[1] == '+')
+    return WHITE;
+  return EMPTY;
+}
+
+
+static void
+count_result(unsigned int *count, unsigned int *black_wins,
+	     unsigned int *white_wins, int winner)
+{
+  (*count)++;
+  if (winner == BLACK)
+    (*black_wins)++;
+  else if (winner == WHITE)
+    (*white_wins)++;
+}
+
+
+/*
+ * Add the first moves of the main line of a game to the book. The
+ * handicap stones of the root node are placed first. The game is
+ * followed until the move limit of the book, a node with setup
+ * stones, or an illegal move. A pass is a move like any other, from
+ * a position to the same stones with the other color to move.
+ *
+ * Returns the number of moves added, or -1 if the game was not used
+ * because its board size is not that of the book. A book made with
+ * boardsize 0 takes the size of its first game.
+ *
+ * This clears the board.
+ */
+
+int
+book_add_game(BookBuilder *builder, SGFNode *root)
+{
+  SGFNode *node;
+  SGFProperty *prop;
+  int boardsize = 19;
+  int max_moves = builder->max_moves;
+  int winner = game_winner(root);
+  int position = -1;
+  int nmoves = 0;
+  int symmetries = 0;
+
+  sgfGetIntProperty(root, "SZ", &boardsize);
+  if (builder->boardsize == 0 && boardsize >= MIN_BOARD
+      && boardsize <= MAX_BOARD)
+    builder->boardsize = boardsize;
+  if (boardsize != builder->boardsize)
+    return -1;
+
+  gg_assert(stackp == 0);
+  board_size = boardsize;
+  clear_board();
+  begin_setup();
+  for (prop = root->props; prop; prop = prop->next)
+    if (prop->name == SGFAB || prop->name == SGFAW) {
+      int i, j, k;
+      for (k = 0; sgfNextPoint(prop, &k, &i, &j, board_size); )
+	if (board[POS(i, j)] == EMPTY)
+	  add_stone(POS(i, j), prop->name == SGFAB ? BLACK : WHITE);
+    }
+  end_setup();
+
+  if (max_moves > MAXSTACK - 3)
+    max_moves = MAXSTACK - 3;
+
+  for (node = root; node && nmoves < max_moves; node = node->child) {
+    BookPosition *p;
+    BuildEdge *e;
+    Hash_data hd;
+    int move = NO_MOVE;
+    int color = EMPTY;
+
+    for (prop = node->props; prop; prop = prop->next) {
+      if (node != root
+	  && (prop->name == SGFAB || prop->name == SGFAW
+	      || prop->name == SGFAE))
+	break;
+      if (prop->name == SGFB || prop->name == SGFW) {
+	move = get_sgfmove(prop);
+	color = prop->name == SGFB ? BLACK : WHITE;
+      }
+    }
+    if (prop)
+      break;
+    if (color == EMPTY)
+      continue;
+
+    if (position < 0 || builder->positions[position].pos.color != color) {
+      canonical_hash(&hd, &symmetries);
+      position = find_position(builder, &hd, color);
+      p = &builder->positions[position].pos;
+      count_result(&p->count, &p->black_wins, &p->white_wins, winner);
+    }
+
+    if (!ON_BOARD(move) && move != PASS_MOVE)
+      break;
+    if (!trymove(move, color, "book_add_game", NO_MOVE))
+      break;
+
+    e = find_edge(builder, position, canonical_move(move, symmetries));
+    count_result(&e->edge.count, &e->edge.black_wins, &e->edge.white_wins,
+		 winner);
+
+    canonical_hash(&hd, &symmetries);
+    e->edge.next = find_position(builder, &hd, OTHER_COLOR(color));
+    position = e->edge.next;
+    p = &builder->positions[position].pos;
+    count_result(&p->count, &p->black_wins, &p->white_wins, winner);
+    nmoves++;
+  }
+
+  while (stackp > 0)
+    popgo();
+
+  builder->ngames++;
+  return nmoves;
+}
+
+
+/*
+ * Add all games of an SGF file or collection to the book. The games
+ * are parsed one at a time, so the file need not fit in memory as a
+ * tree.
+ *
+ * Returns the number of games added, or -1 if the file cannot be read.
+ */
+
+int
+book_add_file(BookBuilder *builder, const char *filename)
+{
+  SGFParser ctx;
+  SGFIndex index;
+  int added = 0;
+  int n;
+
+  if (sgf_index_build_file(&ctx, filename, &index) != SGF_OK) {
+    if (ctx.error == SGF_PARSE_ERROR)
+      sgfparser_perror(&ctx, stderr);
+    sgf_index_free(&index);
+    return -1;
+  }
+
+  for (n = 0; n < index.ngames; n++) {
+    SGFNode *root;
+
+    if (readsgfgame_ctx(&ctx, filename, &index, n, &root) != SGF_OK) {
+      if (ctx.error == SGF_PARSE_ERROR)
+	sgfparser_perror(&ctx, stderr);
+      continue;
+    }
+    if (book_add_game(builder, root) >= 0)
+      added++;
+    sgfFreeNode(root);
+  }
+
+  sgf_index_free(&index);
+  return added;
+}
+
+
+static BookBuilder *sort_builder;
+
+static int
+compare_positions(const void *a, const void *b)
+{
+  const BookPosition *pa = &sort_builder->positions[*(const int *) a].pos;
+  const BookPosition *pb = &sort_builder->positions[*(const int *) b].pos;
+
+  if (hashdata_is_smaller(pa->hash, pb->hash))
+    return -1;
+  if (hashdata_is_smaller(pb->hash, pa->hash))
+    return 1;
+  return pa->color - pb->color;
+}
+
+
+/* Most played moves first. */
+
+static int
+compare_edges(const void *a, const void *b)
+{
+  const BookEdge *ea = a;
+  const BookEdge *eb = b;
+
+  if (ea->count != eb->count)
+    return ea->count > eb->count ? -1 : 1;
+  return ea->move - eb->move;
+}
+
+
+/*
+ * Write the book to a file. As for cache files, the book is written
+ * under a temporary name and renamed when complete.
+ *
+ * Returns 1 on success, 0 on failure.
+ */
+
+int
+book_write(BookBuilder *builder, const char *filename)
+{
+  BookHeader header;
+  BookPosition *positions;
+  BookEdge *edges;
+  int *order;
+  int *rank;
+  char *tmpname;
+  FILE *file;
+  unsigned int nedges = 0;
+  int error = 0;
+  int k;
+
+  /* Sort the positions and renumber the positions reached by moves. */
+  order = xalloc((builder->npositions + 1) * sizeof(int));
+  rank = xalloc((builder->npositions + 1) * sizeof(int));
+  for (k = 0; k < builder->npositions; k++)
+    order[k] = k;
+  sort_builder = builder;
+  qsort(order, builder->npositions, sizeof(int), compare_positions);
+  for (k = 0; k < builder->npositions; k++)
+    rank[order[k]] = k;
+
+  positions = xalloc((builder->npositions + 1) * sizeof(BookPosition));
+  edges = xalloc((builder->nedges + 1) * sizeof(BookEdge));
+  for (k = 0; k < builder->npositions; k++) {
+    BookPosition *p = &positions[k];
+    int e;
+
+    *p = builder->positions[order[k]].pos;
+    e = p->moves;
+    p->moves = nedges;
+    for (; e != (int) BOOK_NONE; e = builder->edges[e].sibling) {
+      edges[nedges] = builder->edges[e].edge;
+      edges[nedges].next = rank[edges[nedges].next];
+      nedges++;
+    }
+    qsort(edges + p->moves, p->nmoves, sizeof(BookEdge), compare_edges);
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BOOK_MAGIC, sizeof(BOOK_MAGIC));
+  header.version = BOOK_VERSION;
+  header.byteorder = BOOK_BYTEORDER;
+  header.hashsize = sizeof(Hash_data);
+  header.boardsize = builder->boardsize;
+  header.ngames = builder->ngames;
+  header.npositions = builder->npositions;
+  header.nmoves = nedges;
+
+  tmpname = xalloc(strlen(filename) + 5);
+  sprintf(tmpname, "%s.tmp", filename);
+  file = fopen(tmpname, "wb");
+  if (!file)
+    error = 1;
+  else {
+    if (fwrite(&header, sizeof(header), 1, file) != 1
+	|| fwrite(positions, sizeof(BookPosition), header.npositions, file)
+	   != header.npositions
+	|| fwrite(edges, sizeof(BookEdge), header.nmoves, file)
+	   != header.nmoves)
+      error = 1;
+    if (fclose(file) != 0)
+      error = 1;
+
+    if (!error) {
+#ifdef WIN32
+      remove(filename);
+#endif
+      if (rename(tmpname, filename) != 0)
+	error = 1;
+    }
+    if (error)
+      remove(tmpname);
+  }
+
+  free(tmpname);
+  free(edges);
+  free(positions);
+  free(rank);
+  free(order);
+  return !error;
+}
+
+
+/*
+ * Map a book file into memory, or read it into a malloc'd buffer where
+ * mmap() is not available. Only the header is checked.
+ *
+ * Returns 1 on success, 0 if the file cannot be read or is not a book
+ * of this version made on a machine like this one.
+ */
+
+int
+book_open(OpeningBook *book, const char *filename)
+{
+  const BookHeader *header;
+
+  memset(book, 0, sizeof(*book));
+  hash_init();
+
+  {
+#ifndef WIN32
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+      return 0;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+      close(fd);
+      return 0;
+    }
+
+    book->size = st.st_size;
+    book->base = mmap(NULL, book->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (book->base == MAP_FAILED) {
+      book->base = NULL;
+      return 0;
+    }
+    book->mapped = 1;
+#else
+    FILE *file = fopen(filename, "rb");
+    long size;
+
+    if (!file)
+      return 0;
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0) {
+      fclose(file);
+      return 0;
+    }
+    rewind(file);
+
+    book->size = size;
+    book->base = xalloc(size);
+    if (fread(book->base, 1, size, file) != (size_t) size) {
+      fclose(file);
+      book_close(book);
+      return 0;
+    }
+    fclose(file);
+#endif
+  }
+
+  header = (const BookHeader *) book->base;
+  if (book->size < sizeof(BookHeader)
+      || memcmp(header->magic, BOOK_MAGIC, sizeof(BOOK_MAGIC)) != 0
+      || header->version != BOOK_VERSION
+      || header->byteorder != BOOK_BYTEORDER
+      || header->hashsize != sizeof(Hash_data)
+      || header->npositions > ((book->size - sizeof(BookHeader))
+			       / sizeof(BookPosition))
+      || header->nmoves > ((book->size - sizeof(BookHeader)
+			    - header->npositions * sizeof(BookPosition))
+			   / sizeof(BookEdge))) {
+    book_close(book);
+    return 0;
+  }
+
+  book->boardsize = header->boardsize;
+  book->ngames = header->ngames;
+  book->npositions = header->npositions;
+  book->nmoves = header->nmoves;
+  book->positions = (const BookPosition *) (header + 1);
+  book->moves = (const BookEdge *) (book->positions + book->npositions);
+  return 1;
+}
+
+
+void
+book_close(OpeningBook *book)
+{
+  if (book->base) {
+#ifndef WIN32
+    if (book->mapped)
+      munmap(book->base, book->size);
+    else
+#endif
+      free(book->base);
+  }
+  memset(book, 0, sizeof(*book));
+}
+
+
+/*
+ * Look up the current board position with color to move. Up to
+ * max_moves of the moves played from it are stored in moves, most
+ * played first and in the orientation of the board.
+ *
+ * Returns the number of moves stored, or -1 if the position is not
+ * in the book.
+ */
+
+int
+book_lookup(const OpeningBook *book, int color, BookMove *moves,
+	    int max_moves)
+{
+  const BookPosition *p = NULL;
+  Hash_data hd;
+  unsigned int low = 0;
+  unsigned int high = book->npositions;
+  unsigned int k;
+  int symmetries;
+  int rot;
+
+  if (board_size != book->boardsize)
+    return -1;
+
+  canonical_hash(&hd, &symmetries);
+  while (low < high) {
+    unsigned int mid = low + (high - low) / 2;
+    const BookPosition *q = &book->positions[mid];
+
+    if (hashdata_is_smaller(q->hash, hd)
+	|| (hashdata_is_equal(q->hash, hd) && q->color < color))
+      low = mid + 1;
+    else if (hashdata_is_equal(q->hash, hd) && q->color == color) {
+      p = q;
+      break;
+    }
+    else
+      high = mid;
+  }
+
+  if (!p || p->moves > book->nmoves || p->nmoves > book->nmoves - p->moves)
+    return -1;
+
+  for (rot = 0; !(symmetries & (1 << rot)); rot++)
+    ;
+  rot = inverse_rotation(rot);
+
+  for (k = 0; k < p->nmoves && (int) k < max_moves; k++) {
+    const BookEdge *e = &book->moves[p->moves + k];
+
+    moves[k].move = rotate1(e->move, rot);
+    moves[k].count = e->count;
+    moves[k].black_wins = e->black_wins;
+    moves[k].white_wins = e->white_wins;
+  }
+
+  return k;
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 2
+ * End:
+ */
@@ -104,6 +104,15 @@
 /* Define to 1 if you have the `vsnprintf' function. */
 #define HAVE_VSNPRINTF 1
 
+/* Define to 1 if you have the <zlib.h> header file and libz. */
+#define HAVE_ZLIB_H 1
+
+/* Define to 1 if you have the <zstd.h> header file and libzstd. */
+/* #undef HAVE_ZSTD_H */
+
+/* Define to 1 if you have the <pthread.h> header file and libpthread. */
+#define HAVE_PTHREAD_H 1
+
 /* Define to 1 if you have the `_vsnprintf' function. */
 /* #undef HAVE__VSNPRINTF */
 
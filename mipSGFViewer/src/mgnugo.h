@@ -360,6 +360,89 @@ void sgffile_printboard(SGFTree *tree);
 void sgffile_recordboard(SGFNode *node);
 int get_sgfmove(SGFProperty *property);
 
+/* Positions saved by sgftreeGoto() are this many levels apart. */
+#define SGF_CHECKPOINT_INTERVAL 16
+int sgftreeGoto(SGFTree *tree, SGFNode *node);
+
+/* Incremental navigation through the variations of a game. */
+typedef struct SGFNavLevel_t {
+  SGFNode *node;
+  int move;			/* move tried at this node, or NO_MOVE */
+  int color;
+  struct SGFNavPosition_t *undo;	/* position replaced here, or NULL */
+} SGFNavLevel;
+
+typedef struct SGFNavigator_t {
+  SGFNode *node;		/* current node, set up on the board */
+  SGFNavLevel *levels;		/* path from the root to node */
+  int depth;			/* level of node */
+  int base;			/* level of the permanent position */
+  int size;			/* allocated levels */
+  int handicap;			/* HA of the root */
+} SGFNavigator;
+
+int sgfnav_init(SGFNavigator *nav, SGFNode *root);
+int sgfnav_forward(SGFNavigator *nav, SGFNode *child);
+int sgfnav_back(SGFNavigator *nav);
+void sgfnav_goto(SGFNavigator *nav, SGFNode *node);
+void sgfnav_free(SGFNavigator *nav);
+
+/* mbook.c */
+/* Opening books merged from collections of games. */
+typedef struct BookBuilder_t BookBuilder;
+
+typedef struct OpeningBook_t {
+  char *base;			/* mapping of the book file */
+  unsigned long size;
+  int mapped;
+  int boardsize;
+  unsigned int ngames;
+  unsigned int npositions;
+  unsigned int nmoves;
+  const struct BookPosition_t *positions;
+  const struct BookEdge_t *moves;
+} OpeningBook;
+
+typedef struct BookMove_t {
+  int move;
+  unsigned int count;		/* games in which the move was played */
+  unsigned int black_wins;
+  unsigned int white_wins;
+} BookMove;
+
+BookBuilder *book_builder_new(int boardsize, int max_moves);
+int book_add_game(BookBuilder *builder, SGFNode *root);
+int book_add_file(BookBuilder *builder, const char *filename);
+int book_write(BookBuilder *builder, const char *filename);
+void book_builder_free(BookBuilder *builder);
+int book_open(OpeningBook *book, const char *filename);
+int book_lookup(const OpeningBook *book, int color, BookMove *moves,
+		int max_moves);
+void book_close(OpeningBook *book);
+
+/* mbench.c */
+int bench_parse(int argc, char *argv[]);
+int bench_cache(int argc, char *argv[]);
+int bench_index(int argc, char *argv[]);
+int bench_delim(int argc, char *argv[]);
+int bench_write(int argc, char *argv[]);
+int bench_deep(int argc, char *argv[]);
+int bench_journal(int argc, char *argv[]);
+int bench_nav(int argc, char *argv[]);
+int bench_goto(int argc, char *argv[]);
+int bench_browse(int argc, char *argv[]);
+int bench_book(int argc, char *argv[]);
+int bench_points(int argc, char *argv[]);
+int bench_setup(int argc, char *argv[]);
+int bench_undo(int argc, char *argv[]);
+int bench_threads(int argc, char *argv[]);
+int bench_sizes(int argc, char *argv[]);
+int bench_replay(int argc, char *argv[]);
+int bench_ko(int argc, char *argv[]);
+#if USE_BITBOARDS
+int bench_bitboard(int argc, char *argv[]);
+#endif
+
 /* sgfdecide.c */
 void decide_string(int pos);
 void decide_connection(int apos, int bpos);
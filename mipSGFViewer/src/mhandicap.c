@@ -173,6 +173,7 @@ place_fixed_handicap(int desired_handicap)
     handicap = desired_handicap;
 
   remaining_stones = handicap;
+  begin_setup();
   /* special cases: 5 and 7 */
   if (desired_handicap == 5 || desired_handicap == 7) {
     add_stone(POS(mid, mid), BLACK);
@@ -200,6 +201,7 @@ place_fixed_handicap(int desired_handicap)
     
     add_stone(POS(i, j), BLACK);
   }
+  end_setup();
 
   return handicap;
 }
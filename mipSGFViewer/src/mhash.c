@@ -77,16 +77,24 @@ hash_init_zobrist_array(Hash_data *array, int size)
 }
 
 /*
- * Initialize the board hash system.
+ * Initialize the board hash system. The random values are always drawn
+ * from the same seed, so that hash values can be stored in files and
+ * compared between runs. The state of the random generator is left
+ * as it was.
  */
 
 void
 hash_init(void)
 {
   static int is_initialized = 0;
+  struct gg_rand_state state;
+
   if (is_initialized)
     return;
   
+  gg_get_rand_state(&state);
+  gg_srand(1);
+
   INIT_ZOBRIST_ARRAY(black_hash);
   INIT_ZOBRIST_ARRAY(white_hash);
   INIT_ZOBRIST_ARRAY(ko_hash);
@@ -94,6 +102,7 @@ hash_init(void)
   INIT_ZOBRIST_ARRAY(kom_pos_hash);
   INIT_ZOBRIST_ARRAY(goal_hash);
 
+  gg_set_rand_state(&state);
   is_initialized = 1;
 }
 
@@ -161,31 +170,43 @@ hashdata_invert_kom_pos(Hash_data *hd, int kom_pos)
   hashdata_xor(*hd, kom_pos_hash[kom_pos]);
 }
 
-/* Calculate a transformation invariant hashvalue. */
-void 
-hashdata_calc_orientation_invariant(Hash_data *hd, Intersection *p, int ko_pos)
+/* Calculate the hashvalue of each of the 8 reorientations of the
+ * board, as given by rotate1().
+ */
+void
+hashdata_calc_orientations(Hash_data hd[8], Intersection *p, int ko_pos)
 {
   int pos;
   int rot;
-  Hash_data hd_rot;
 
   for (rot = 0; rot < 8; rot++) {
-    hashdata_clear(&hd_rot);
+    hashdata_clear(&hd[rot]);
     for (pos = BOARDMIN; pos < BOARDMAX; pos++) {
       if (p[pos] == WHITE)
-	hashdata_xor(hd_rot, white_hash[rotate1(pos, rot)]);
+	hashdata_xor(hd[rot], white_hash[rotate1(pos, rot)]);
       else if (p[pos] == BLACK)
-	hashdata_xor(hd_rot, black_hash[rotate1(pos, rot)]);
+	hashdata_xor(hd[rot], black_hash[rotate1(pos, rot)]);
     }
     
     if (ko_pos != NO_MOVE)
-      hashdata_xor(hd_rot, ko_hash[rotate1(ko_pos, rot)]);
-
-    if (rot == 0 || hashdata_is_smaller(hd_rot, *hd))
-      *hd = hd_rot;
+      hashdata_xor(hd[rot], ko_hash[rotate1(ko_pos, rot)]);
   }
 }
 
+/* Calculate a transformation invariant hashvalue. */
+void 
+hashdata_calc_orientation_invariant(Hash_data *hd, Intersection *p, int ko_pos)
+{
+  int rot;
+  Hash_data hd_rot[8];
+
+  hashdata_calc_orientations(hd_rot, p, ko_pos);
+  *hd = hd_rot[0];
+  for (rot = 1; rot < 8; rot++)
+    if (hashdata_is_smaller(hd_rot[rot], *hd))
+      *hd = hd_rot[rot];
+}
+
 /* Compute hash value to identify the goal area. */
 Hash_data
 goal_to_hashvalue(const signed char *goal)
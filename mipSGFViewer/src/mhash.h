@@ -94,6 +94,8 @@ void hashdata_invert_ko(Hash_data *hd, int pos);
 void hashdata_invert_stone(Hash_data *hd, int pos, int color);
 void hashdata_invert_komaster(Hash_data *hd, int komaster);
 void hashdata_invert_kom_pos(Hash_data *hd, int kom_pos);
+void hashdata_calc_orientations(Hash_data hd[8], Intersection *board,
+				int ko_pos);
 void hashdata_calc_orientation_invariant(Hash_data *hd, Intersection *board,
 					 int ko_pos);
 
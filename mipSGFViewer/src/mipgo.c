@@ -25,6 +25,7 @@
 
 #include "mboard.h"
 #include "mgnugo.h"
+#include "mgg_utils.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,7 +33,29 @@
 #include <ctype.h>
 
 #define USAGE "\
-Usage : joseki prefix filename\n\
+Usage : mipgo filename number\n\
+        mipgo --bench-parse file...\n\
+        mipgo --build-cache file...\n\
+        mipgo --verify-cache file...\n\
+        mipgo --bench-cache file...\n\
+        mipgo --bench-index file...\n\
+        mipgo --bench-delim [file...]\n\
+        mipgo --bench-write file...\n\
+        mipgo --bench-deep [nodes]\n\
+        mipgo --bench-journal [moves [file]]\n\
+        mipgo --bench-nav file...\n\
+        mipgo --bench-goto file...\n\
+        mipgo --bench-browse file...\n\
+        mipgo --build-book book moves file...\n\
+        mipgo --bench-book file...\n\
+        mipgo --bench-points [file...]\n\
+        mipgo --bench-setup [file...]\n\
+        mipgo --bench-undo file...\n\
+        mipgo --bench-threads threads file...\n\
+        mipgo --bench-sizes file...\n\
+        mipgo --bench-replay file...\n\
+        mipgo --bench-ko [steps]\n\
+        mipgo --bench-bitboard file...\n\
 "
 
 /* Joseki move types. */
@@ -430,17 +453,15 @@ static void make_pattern(int movei, int movej, int color, int marki, int markj,
 	}
 }
 
-/* Analyze the node properties in order to make a pattern. Then make
- * recursive calls for child node and siblings.
+/* Analyze the node properties in order to make a pattern. Returns
+ * the move of the node in *movei, *movej and *color, if any.
  */
-static void analyze_node(SGFNode *node, const char *prefix) {
+static void analyze_node_properties(SGFNode *node, const char *prefix,
+		int *movei, int *movej, int *color) {
 	SGFProperty *prop;
 	int i, j;
 	char labels[MAX_BOARD][MAX_BOARD];
 	int label_found = 0;
-	int movei = -1;
-	int movej = -1;
-	int color = EMPTY;
 	int marki = -1;
 	int markj = -1;
 	int multiple_marks = 0;
@@ -456,7 +477,7 @@ static void analyze_node(SGFNode *node, const char *prefix) {
 		switch (prop->name) {
 		case SGFSQ: /* Square */
 		case SGFMA: /* Mark */
-			if (marki != -1)
+			if (marki != -1 || sgfPointCount(prop) > 1)
 				multiple_marks = 1;
 			else {
 				get_moveXY(prop, &marki, &markj, boardsize);
@@ -465,15 +486,15 @@ static void analyze_node(SGFNode *node, const char *prefix) {
 			break;
 
 		case SGFW: /* White move */
-			color = WHITE;
-			get_moveXY(prop, &movei, &movej, boardsize);
-			movej = boardsize - 1 - movej;
+			*color = WHITE;
+			get_moveXY(prop, movei, movej, boardsize);
+			*movej = boardsize - 1 - *movej;
 			break;
 
 		case SGFB: /* Black move */
-			color = BLACK;
-			get_moveXY(prop, &movei, &movej, boardsize);
-			movej = boardsize - 1 - movej;
+			*color = BLACK;
+			get_moveXY(prop, movei, movej, boardsize);
+			*movej = boardsize - 1 - *movej;
 			break;
 
 		case SGFLB: /* Label, with value like "mh:A" */
@@ -493,22 +514,50 @@ static void analyze_node(SGFNode *node, const char *prefix) {
 	}
 
 	/* If we have a move and a square mark, produce a pattern. */
-	if (SAFE_ON_BOARD(movei, movej) && ON_BOARD2(marki, markj))
-		make_pattern(movei, movej, color, marki, markj, multiple_marks,
+	if (SAFE_ON_BOARD(*movei, *movej) && ON_BOARD2(marki, markj))
+		make_pattern(*movei, *movej, *color, marki, markj, multiple_marks,
 				(label_found ? labels : NULL ), comment, prefix);
-	printf("For debug +++ \n");
-	/* Traverse child, if any. */
-	if (node->child) {
-		if (SAFE_ON_BOARD(movei, movej))
-			tryko(POS(movei, movej), color, NULL );
-		analyze_node(node->child, prefix);
-		if (SAFE_ON_BOARD(movei, movej))
-			popgo();
+}
+
+/* Analyze the nodes of the tree from node on, including its siblings.
+ * The moves leading to each node are played on the board. An explicit
+ * stack records which of them were played, so deep trees do not
+ * exhaust the C stack.
+ */
+static void analyze_node(SGFNode *node, const char *prefix) {
+	char *played = NULL;
+	int stacksize = 0;
+	int depth = 0;
+
+	while (node) {
+		int movei = -1;
+		int movej = -1;
+		int color = EMPTY;
+
+		analyze_node_properties(node, prefix, &movei, &movej, &color);
+
+		/* Traverse child, if any. */
+		if (node->child) {
+			if (depth == stacksize) {
+				stacksize = stacksize ? 2 * stacksize : 64;
+				played = xrealloc(played, stacksize);
+			}
+			played[depth++] = SAFE_ON_BOARD(movei, movej)
+					&& tryko(POS(movei, movej), color, NULL );
+			node = node->child;
+			continue;
+		}
+
+		/* Traverse sibling, if any, else go back up. */
+		while (!node->next && depth > 0) {
+			node = node->parent;
+			if (played[--depth])
+				popgo();
+		}
+		node = node->next;
 	}
 
-	/* Traverse sibling, if any. */
-	if (node->next)
-		analyze_node(node->next, prefix);
+	free(played);
 }
 
 int showscore = 0;
@@ -655,7 +704,7 @@ void process_sgf(char* infilename, char* number) {
 	gameinfo_clear(&gameinfo);
 	sgftree_clear(&sgftree);
 
-	if (!sgftree_readfile(&sgftree, infilename)) {
+	if (!sgftree_readfile_lazy(&sgftree, infilename)) {
 		fprintf(stderr, "Cannot open or parse '%s'\n", infilename);
 		exit(EXIT_FAILURE);
 	}
@@ -672,117 +721,15 @@ void process_sgf(char* infilename, char* number) {
 }
 
 
-int doNext(Gameinfo *gameinfo, SGFTree *tree)
-{
-	int orientation = 0;
-	int next;
-
-	int move;
-	SGFProperty *prop;
-	printf("\nNode property:");
-	for (prop = tree->lastnode->props; prop; prop = prop->next) {
-		//DEBUG(DEBUG_LOADSGF, "%c%c[%s]\n",
-		//  prop->name & 0xff, (prop->name >> 8), prop->value);
-		printf("%c%c[%s] - ",prop->name & 0xff, (prop->name >> 8), prop->value);
-		switch (prop->name) {
-		case SGFAB:
-		case SGFAW:
-			/* Generally the last move is unknown when the AB or AW
-			 * properties are encountered. These are used to set up
-			 * a board position (diagram) or to place handicap stones
-			 * without reference to the order in which the stones are
-			 * placed on the board.
-			 */
-			move = rotate1(get_sgfmove(prop), orientation);
-			if (board[move] != EMPTY)
-				gprintf(
-						"Illegal SGF! attempt to add a stone at occupied point %1m\n",
-						move);
-			else
-				add_stone(move, prop->name == SGFAB ? BLACK : WHITE);
-			break;
-
-		case SGFPL:
-			/* Due to a bad comment in the SGF FF3 definition (in the
-			 * "Alphabetical list of properties" section) some
-			 * applications encode the colors with 1 for black and 2 for
-			 * white.
-			 */
-			if (prop->value[0] == 'w' || prop->value[0] == 'W'
-					|| prop->value[0] == '2')
-				next = WHITE;
-			else
-				next = BLACK;
-			/* following really should not be needed for proper sgf file */
-			if (stones_on_board(GRAY) == 0 && next == WHITE) {
-				place_fixed_handicap(gameinfo->handicap);
-				sgfOverwritePropertyInt(tree->root, "HA", handicap);
-			}
-			break;
-
-		case SGFW:
-		case SGFB:
-			next = prop->name == SGFW ? WHITE : BLACK;
-			/* following really should not be needed for proper sgf file */
-			if (stones_on_board(GRAY) == 0 && next == WHITE) {
-				place_fixed_handicap(gameinfo->handicap);
-				sgfOverwritePropertyInt(tree->root, "HA", handicap);
-			}
-
-			move = get_sgfmove(prop);
-//				if (move == untilmove || movenum == until - 1) {
-//					gameinfo->to_move = next;
-//					/* go back so that variant will be added to the proper node */
-//					sgftreeBack(tree);
-//					return next;
-//				}
-
-			move = rotate1(move, orientation);
-			if (move == PASS_MOVE || board[move] == EMPTY) {
-				gnugo_play_move(move, next);
-				next = OTHER_COLOR(next);
-			} else {
-				gprintf(
-						"WARNING: Move off board or on occupied position found in sgf-file.\n");
-				gprintf("Move at %1m ignored, trying to proceed.\n", move);
-				gameinfo->to_move = next;
-				return next;
-			}
-
-			break;
-
-		case SGFIL:
-			/* The IL property is not a standard SGF property but
-			 * is used by GNU Go to mark illegal moves. If a move
-			 * is found marked with the IL property which is a ko
-			 * capture then that ko capture is deemed illegal and
-			 * (board_ko_i, board_ko_j) is set to the location of
-			 * the ko.
-			 */
-			move = rotate1(get_sgfmove(prop), orientation);
-
-			if (board_size > 1) {
-				int move_color;
-
-				if (ON_BOARD(NORTH(move)))
-					move_color = OTHER_COLOR(board[NORTH(move)]);
-				else
-					move_color = OTHER_COLOR(board[SOUTH(move)]);
-				if (is_ko(move, move_color, NULL ))
-					board_ko_pos = move;
-			}
-			break;
-		}
-	}
-	return 0;
-}
-
 int sgfSimplePlayer(Gameinfo *gameinfo, SGFTree *tree,
 		const char *untilstr, int orientation) {
+	SGFNavigator nav;
+	SGFNode *node;
 	int bs;
 	int next = BLACK;
 	int untilmove = -1; /* Neither a valid move nor pass. */
 	int until = 9999;
+	int color;
 	char line[80];
 	if (!sgfGetIntProperty(tree->root, "SZ", &bs))
 		bs = 19;
@@ -801,8 +748,6 @@ int sgfSimplePlayer(Gameinfo *gameinfo, SGFTree *tree,
 		return EMPTY;
 	}
 
-	gnugo_clear_board(bs);
-
 	if (!sgfGetFloatProperty(tree->root, "KM", &komi)) {
 		if (gameinfo->handicap == 0)
 			komi = 5.5;
@@ -810,6 +755,13 @@ int sgfSimplePlayer(Gameinfo *gameinfo, SGFTree *tree,
 			komi = 0.5;
 	}
 
+	/* Set up the root position. The navigator takes the moves back
+	 * and forth on the trymove() stack, so no step below needs a
+	 * replay from the root.
+	 */
+	if (!sgfnav_init(&nav, tree->root))
+		return EMPTY;
+
 	/* Now we can safely parse the until string (which depends on board size). */
 	if (untilstr) {
 		if (*untilstr > '0' && *untilstr <= '9') {
@@ -821,35 +773,178 @@ int sgfSimplePlayer(Gameinfo *gameinfo, SGFTree *tree,
 		}
 	}
 
-	/* Finally, we iterate over all the properties of all the
-	 * nodes, actioning them. We follow only the 'child' pointers,
-	 * as we have no interest in variations.
-	 *
-	 * The sgf routines map AB[aa][bb][cc] into AB[aa]AB[bb]AB[cc]
+	/* Follow the main variation up to the until move. */
+	while (nav.node->child && nav.depth < until - 1
+			&& !(nav.depth > 0
+				&& rotate1(nav.levels[nav.depth].move, orientation) == untilmove))
+		sgfnav_forward(&nav, nav.node->child);
+	mip_ascii_showboard();
+
+	/* Browse the tree: Enter or f goes forward into the first
+	 * variation, a number into that variation, b goes back, n and p
+	 * switch to the next or previous variation and q quits.
 	 */
-	for (tree->lastnode = NULL ; sgftreeForward(tree);) {
-		//show variation
-		//TODO
-		//get input
-		//TODO
-		fgets(line,80,stdin);
-		//playmove
-		//TODO
-		doNext(gameinfo,tree);
-		//show board
+	for (;;) {
+		printf("\nMove %d, %d variation(s). ", sgfDepth(nav.node),
+				sgfChildCount(nav.node));
+		show_sgf_properties(nav.node);
+		printf("[f/b/n/p/N/q] ");
+		fflush(stdout);
+		if (!fgets(line, 80, stdin) || line[0] == 'q')
+			break;
+
+		if (line[0] == '\n' || line[0] == 'f')
+			sgfnav_forward(&nav, nav.node->child);
+		else if (line[0] == 'b')
+			sgfnav_back(&nav);
+		else if (line[0] == 'n' && (node = sgfNextVariation(nav.node))) {
+			sgfnav_back(&nav);
+			sgfnav_forward(&nav, node);
+		}
+		else if (line[0] == 'p' && sgfPrev(nav.node)) {
+			node = sgfPrev(nav.node);
+			sgfnav_back(&nav);
+			sgfnav_forward(&nav, node);
+		}
+		else if (line[0] >= '1' && line[0] <= '9') {
+			int k = atoi(line);
+			for (node = nav.node->child; node && k > 1; k--)
+				node = sgfNextVariation(node);
+			sgfnav_forward(&nav, node);
+		}
 		mip_ascii_showboard();
 	}
 
+	/* The color to move after the current node. */
+	for (node = nav.node; node; node = node->parent) {
+		SGFProperty *prop;
+		for (prop = node->props; prop; prop = prop->next)
+			if (prop->name == SGFB || prop->name == SGFW)
+				break;
+		if (prop) {
+			color = prop->name == SGFB ? BLACK : WHITE;
+			next = OTHER_COLOR(color);
+			break;
+		}
+	}
+	sgfnav_free(&nav);
+
 	gameinfo->to_move = next;
 	return next;
 }
 
+/*
+ * Build or verify the binary caches of the given SGF files. The cache
+ * of foo.sgf is foo.sgf.cache. Returns the number of failures.
+ */
+static int cache_files(int argc, char *argv[], int build) {
+	char cachename[FILENAME_MAX];
+	int failures = 0;
+	int status;
+	int k;
+
+	for (k = 0; k < argc; k++) {
+		gg_snprintf(cachename, sizeof(cachename), "%s.cache", argv[k]);
+		if (build)
+			status = sgfcache_build(argv[k], cachename);
+		else
+			status = sgfcache_check(argv[k], cachename);
+
+		if (status != SGFCACHE_OK) {
+			fprintf(stderr, "%s: %s\n", cachename, sgfcache_strerror(status));
+			failures++;
+		}
+	}
+
+	printf("%d of %d caches %s\n", argc - failures, argc,
+			build ? "built" : "verified");
+	return failures;
+}
+
+/*
+ * Build an opening book of the first moves of the games in the given
+ * files. The board size is that of the first game.
+ */
+static int build_book(const char *bookname, int moves, int argc, char *argv[]) {
+	BookBuilder *builder = book_builder_new(0, moves);
+	int games = 0;
+	int failures = 0;
+	int k;
+
+	for (k = 0; k < argc; k++) {
+		int n = book_add_file(builder, argv[k]);
+		if (n < 0) {
+			fprintf(stderr, "%s: cannot read file\n", argv[k]);
+			failures++;
+		}
+		else
+			games += n;
+	}
+
+	if (!book_write(builder, bookname)) {
+		fprintf(stderr, "%s: cannot write book\n", bookname);
+		failures++;
+	}
+	else
+		printf("%d games written to %s\n", games, bookname);
+
+	book_builder_free(builder);
+	return failures > 0;
+}
+
 int main(int argc, char *argv[]) {
 	const char *filename;
 	const char *number;
 
 	SGFNode *sgf;
 
+	if (argc >= 3 && strcmp(argv[1], "--bench-parse") == 0)
+		return bench_parse(argc - 2, argv + 2);
+	if (argc >= 3 && strcmp(argv[1], "--build-cache") == 0)
+		return cache_files(argc - 2, argv + 2, 1) > 0;
+	if (argc >= 3 && strcmp(argv[1], "--verify-cache") == 0)
+		return cache_files(argc - 2, argv + 2, 0) > 0;
+	if (argc >= 3 && strcmp(argv[1], "--bench-cache") == 0)
+		return bench_cache(argc - 2, argv + 2);
+	if (argc >= 3 && strcmp(argv[1], "--bench-index") == 0)
+		return bench_index(argc - 2, argv + 2);
+	if (argc >= 2 && strcmp(argv[1], "--bench-delim") == 0)
+		return bench_delim(argc - 2, argv + 2);
+	if (argc >= 3 && strcmp(argv[1], "--bench-write") == 0)
+		return bench_write(argc - 2, argv + 2);
+	if (argc >= 2 && strcmp(argv[1], "--bench-deep") == 0)
+		return bench_deep(argc - 2, argv + 2);
+	if (argc >= 2 && strcmp(argv[1], "--bench-journal") == 0)
+		return bench_journal(argc - 2, argv + 2);
+	if (argc >= 3 && strcmp(argv[1], "--bench-nav") == 0)
+		return bench_nav(argc - 2, argv + 2);
+	if (argc >= 3 && strcmp(argv[1], "--bench-goto") == 0)
+		return bench_goto(argc - 2, argv + 2);
+	if (argc >= 3 && strcmp(argv[1], "--bench-browse") == 0)
+		return bench_browse(argc - 2, argv + 2);
+	if (argc >= 5 && strcmp(argv[1], "--build-book") == 0)
+		return build_book(argv[2], atoi(argv[3]), argc - 4, argv + 4);
+	if (argc >= 3 && strcmp(argv[1], "--bench-book") == 0)
+		return bench_book(argc - 2, argv + 2);
+	if (argc >= 2 && strcmp(argv[1], "--bench-points") == 0)
+		return bench_points(argc - 2, argv + 2);
+	if (argc >= 2 && strcmp(argv[1], "--bench-setup") == 0)
+		return bench_setup(argc - 2, argv + 2);
+	if (argc >= 3 && strcmp(argv[1], "--bench-undo") == 0)
+		return bench_undo(argc - 2, argv + 2);
+	if (argc >= 4 && strcmp(argv[1], "--bench-threads") == 0)
+		return bench_threads(argc - 2, argv + 2);
+	if (argc >= 3 && strcmp(argv[1], "--bench-sizes") == 0)
+		return bench_sizes(argc - 2, argv + 2);
+	if (argc >= 3 && strcmp(argv[1], "--bench-replay") == 0)
+		return bench_replay(argc - 2, argv + 2);
+	if (argc >= 2 && strcmp(argv[1], "--bench-ko") == 0)
+		return bench_ko(argc - 2, argv + 2);
+#if USE_BITBOARDS
+	if (argc >= 3 && strcmp(argv[1], "--bench-bitboard") == 0)
+		return bench_bitboard(argc - 2, argv + 2);
+#endif
+
 	/* Check number of arguments. */
 	if (argc != 3) {
 		fprintf(stderr, USAGE);
@@ -1005,11 +1100,13 @@ int gameinfo_play_sgftree_rot(Gameinfo *gameinfo, SGFTree *tree,
 	 * nodes, actioning them. We follow only the 'child' pointers,
 	 * as we have no interest in variations.
 	 *
-	 * The sgf routines map AB[aa][bb][cc] into AB[aa]AB[bb]AB[cc]
+	 * The sgf routines read AB[aa][bb][cc] into one property whose
+	 * points are visited with sgfNextPoint().
 	 */
 	for (tree->lastnode = NULL ; sgftreeForward(tree);) {
 		SGFProperty *prop;
 		int move;
+		int i, j, k;
 
 		for (prop = tree->lastnode->props; prop; prop = prop->next) {
 			//DEBUG(DEBUG_LOADSGF, "%c%c[%s]\n",
@@ -1021,15 +1118,20 @@ int gameinfo_play_sgftree_rot(Gameinfo *gameinfo, SGFTree *tree,
 				 * properties are encountered. These are used to set up
 				 * a board position (diagram) or to place handicap stones
 				 * without reference to the order in which the stones are
-				 * placed on the board.
+				 * placed on the board. The stones of the property are added
+				 * as one batch.
 				 */
-				move = rotate1(get_sgfmove(prop), orientation);
-				if (board[move] != EMPTY)
-					gprintf(
-							"Illegal SGF! attempt to add a stone at occupied point %1m\n",
-							move);
-				else
-					add_stone(move, prop->name == SGFAB ? BLACK : WHITE);
+				begin_setup();
+				for (k = 0; sgfNextPoint(prop, &k, &i, &j, board_size); ) {
+					move = rotate1(POS(i, j), orientation);
+					if (board[move] != EMPTY)
+						gprintf(
+								"Illegal SGF! attempt to add a stone at occupied point %1m\n",
+								move);
+					else
+						add_stone(move, prop->name == SGFAB ? BLACK : WHITE);
+				}
+				end_setup();
 				break;
 
 			case SGFPL:
@@ -112,7 +112,8 @@ show_sgf_properties(SGFNode *node)
     }
 
     printf("(%d) ", propcount);
-    if (node->next)
+    /* The siblings of a node read lazily may not be parsed yet. */
+    if (sgfNextVariation(node))
       printf("n");
     if (node->child)
       printf("c");
@@ -124,23 +125,29 @@ show_sgf_properties(SGFNode *node)
 
 
 /*
- * Recursively traverse each node showing all properties.
+ * Traverse each node showing all properties: node, its subtree and
+ * its following siblings with theirs.
  */
 
 int
 show_sgf_tree(SGFNode *node)
 {
+  SGFNode *top = node->parent;
   int n = 0; /* number of nodes */
   
-  n++;
-  show_sgf_properties(node);
+  while (node) {
+    n++;
+    show_sgf_properties(node);
 
-  /* must search depth first- siblings are equal! */
-  if (node->child)
-    n += show_sgf_tree(node->child);
-
-  if (node->next)
-    n += show_sgf_tree(node->next);
+    /* must search depth first- siblings are equal! */
+    if (node->child)
+      node = node->child;
+    else {
+      while (node != top && !node->next)
+	node = node->parent;
+      node = node == top ? NULL : node->next;
+    }
+  }
   
   return n;
 }
@@ -0,0 +1,630 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *\
+ * This is GNU Go, a Go program. Contact gnugo@gnu.org, or see       *
+ * http://www.gnu.org/software/gnugo/ for more information.          *
+ *                                                                   *
+ * Copyright 1999, 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2007,   *
+ * 2008 and 2009 by the Free Software Foundation.                    *
+ *                                                                   *
+ * This program is free software; you can redistribute it and/or     *
+ * modify it under the terms of the GNU General Public License as    *
+ * published by the Free Software Foundation - version 3 or          *
+ * (at your option) any later version.                               *
+ *                                                                   *
+ * This program is distributed in the hope that it will be useful,   *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of    *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the     *
+ * GNU General Public License in file COPYING for more details.      *
+ *                                                                   *
+ * You should have received a copy of the GNU General Public         *
+ * License along with this program; if not, write to the Free        *
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor,       *
+ * Boston, MA 02111, USA.                                            *
+\* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * msgfcache.c
+ *
+ * Binary cache files of flat SGF trees. See msgftree.h.
+ *
+ * A cache file consists of a header, a directory with one entry per
+ * game, and the node, property and value arrays of each game, all in
+ * the byte order and word size of the machine that wrote it. Arrays
+ * start at multiples of 8 bytes so that they can be used in place
+ * from a mapping of the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "mboard.h"
+
+
+#define SGFCACHE_MAGIC      "SGFCACHE"
+#define SGFCACHE_VERSION    1
+#define SGFCACHE_BYTEORDER  0x01020304
+#define SGFCACHE_ALIGN      8
+
+typedef struct SGFCacheHeader_t {
+  char magic[8];
+  unsigned int version;
+  unsigned int byteorder;	/* SGFCACHE_BYTEORDER as written */
+  unsigned int longsize;	/* sizeof(long) */
+  unsigned int ngames;
+  unsigned int checksum;	/* Adler-32 of everything after the header */
+  unsigned int reserved;
+  long source_size;
+  long source_mtime;
+} SGFCacheHeader;
+
+typedef struct SGFCacheGame_t {
+  unsigned long nodes;		/* file offsets of the arrays */
+  unsigned long props;
+  unsigned long values;
+  unsigned int nnodes;
+  unsigned int nprops;
+  unsigned int values_size;
+  int boardsize;
+} SGFCacheGame;
+
+
+/* Adler-32 checksum, updated with size more bytes. */
+
+static unsigned int
+adler32(unsigned int sum, const char *buf, unsigned long size)
+{
+  unsigned long a = sum & 0xffff;
+  unsigned long b = (sum >> 16) & 0xffff;
+
+  while (size > 0) {
+    /* 5552 bytes is the most we can add up before b may overflow. */
+    unsigned long n = size < 5552 ? size : 5552;
+    size -= n;
+    while (n-- > 0) {
+      a += (unsigned char) *buf++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+
+  return (b << 16) | a;
+}
+
+
+/*
+ * Output state of sgfcache_write(). The checksum is kept up to date
+ * with everything written after the header.
+ */
+
+typedef struct CacheWriter_t {
+  FILE *file;
+  unsigned long offset;
+  unsigned int checksum;
+  int error;
+} CacheWriter;
+
+static void
+cache_put(CacheWriter *w, const void *buf, unsigned long size)
+{
+  if (size > 0 && fwrite(buf, 1, size, w->file) != size)
+    w->error = 1;
+  w->checksum = adler32(w->checksum, buf, size);
+  w->offset += size;
+}
+
+static void
+cache_align(CacheWriter *w)
+{
+  static const char zeros[SGFCACHE_ALIGN];
+  cache_put(w, zeros, (SGFCACHE_ALIGN - w->offset % SGFCACHE_ALIGN)
+	    % SGFCACHE_ALIGN);
+}
+
+
+static int
+source_stat(const char *source, long *size, long *mtime)
+{
+  struct stat st;
+
+  if (stat(source, &st) < 0)
+    return 0;
+  *size = st.st_size;
+  *mtime = st.st_mtime;
+  return 1;
+}
+
+
+/*
+ * Write the given games to a cache file for source. The file is
+ * written under a temporary name and renamed when complete, so a
+ * reader never sees a partial cache.
+ *
+ * Returns 1 on success, 0 on failure.
+ */
+
+int
+sgfcache_write(const char *cachename, const char *source,
+	       const SGFFlatTree *games, unsigned int ngames)
+{
+  SGFCacheHeader header;
+  SGFCacheGame *dir;
+  CacheWriter w;
+  char *tmpname;
+  unsigned int k;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SGFCACHE_MAGIC, sizeof(header.magic));
+  header.version = SGFCACHE_VERSION;
+  header.byteorder = SGFCACHE_BYTEORDER;
+  header.longsize = sizeof(long);
+  header.ngames = ngames;
+  if (!source_stat(source, &header.source_size, &header.source_mtime))
+    return 0;
+
+  /* Lay out the file. */
+  dir = xalloc((ngames ? ngames : 1) * sizeof(SGFCacheGame));
+  w.offset = sizeof(header) + ngames * sizeof(SGFCacheGame);
+  for (k = 0; k < ngames; k++) {
+    const SGFFlatTree *flat = &games[k];
+
+    w.offset += (SGFCACHE_ALIGN - w.offset % SGFCACHE_ALIGN) % SGFCACHE_ALIGN;
+    dir[k].nodes = w.offset;
+    w.offset += flat->nnodes * sizeof(SGFFlatNode);
+    w.offset += (SGFCACHE_ALIGN - w.offset % SGFCACHE_ALIGN) % SGFCACHE_ALIGN;
+    dir[k].props = w.offset;
+    w.offset += flat->nprops * sizeof(SGFFlatProperty);
+    dir[k].values = w.offset;
+    w.offset += flat->values_size;
+
+    dir[k].nnodes = flat->nnodes;
+    dir[k].nprops = flat->nprops;
+    dir[k].values_size = flat->values_size;
+    dir[k].boardsize = flat->boardsize;
+  }
+
+  tmpname = xalloc(strlen(cachename) + 5);
+  sprintf(tmpname, "%s.tmp", cachename);
+  w.file = fopen(tmpname, "wb");
+  if (!w.file) {
+    free(tmpname);
+    free(dir);
+    return 0;
+  }
+
+  /* The header goes last, when the checksum is known. */
+  w.checksum = 1;
+  w.error = 0;
+  if (fseek(w.file, sizeof(header), SEEK_SET) != 0)
+    w.error = 1;
+  w.offset = sizeof(header);
+  cache_put(&w, dir, ngames * sizeof(SGFCacheGame));
+  for (k = 0; k < ngames; k++) {
+    const SGFFlatTree *flat = &games[k];
+
+    cache_align(&w);
+    assert(w.offset == dir[k].nodes);
+    cache_put(&w, flat->nodes, flat->nnodes * sizeof(SGFFlatNode));
+    cache_align(&w);
+    cache_put(&w, flat->props, flat->nprops * sizeof(SGFFlatProperty));
+    cache_put(&w, flat->values, flat->values_size);
+  }
+
+  header.checksum = w.checksum;
+  if (fseek(w.file, 0, SEEK_SET) != 0
+      || fwrite(&header, sizeof(header), 1, w.file) != 1)
+    w.error = 1;
+  if (fclose(w.file) != 0)
+    w.error = 1;
+
+  if (!w.error) {
+#ifdef WIN32
+    remove(cachename);
+#endif
+    if (rename(tmpname, cachename) != 0)
+      w.error = 1;
+  }
+  if (w.error)
+    remove(tmpname);
+
+  free(tmpname);
+  free(dir);
+  return !w.error;
+}
+
+
+/*
+ * Map the contents of a file into memory, or read them into a malloc'd
+ * buffer where mmap() is not available.
+ */
+
+static int
+cache_load(SGFCache *cache, const char *cachename)
+{
+#ifndef WIN32
+  struct stat st;
+  int fd = open(cachename, O_RDONLY);
+
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  cache->size = st.st_size;
+  cache->base = mmap(NULL, cache->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (cache->base == MAP_FAILED) {
+    cache->base = NULL;
+    return 0;
+  }
+  cache->mapped = 1;
+  return 1;
+#else
+  FILE *file = fopen(cachename, "rb");
+  long size;
+
+  if (!file)
+    return 0;
+  if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0) {
+    fclose(file);
+    return 0;
+  }
+  rewind(file);
+
+  cache->size = size;
+  cache->base = xalloc(size);
+  if (fread(cache->base, 1, size, file) != (size_t) size) {
+    fclose(file);
+    free(cache->base);
+    cache->base = NULL;
+    return 0;
+  }
+  fclose(file);
+  return 1;
+#endif
+}
+
+
+/*
+ * Open a cache file. If source is not NULL, the cache must have been
+ * made from the current contents of that file. Only the header is
+ * looked at, so this costs little more than mapping the file.
+ *
+ * Returns one of the SGFCACHE_* codes. The cache need only be closed
+ * if SGFCACHE_OK is returned.
+ */
+
+int
+sgfcache_open(SGFCache *cache, const char *cachename, const char *source)
+{
+  SGFCacheHeader *header;
+  long size, mtime;
+
+  memset(cache, 0, sizeof(*cache));
+  if (!cache_load(cache, cachename))
+    return SGFCACHE_OPEN_ERROR;
+
+  header = (SGFCacheHeader *) cache->base;
+  if (cache->size < sizeof(SGFCacheHeader)
+      || memcmp(header->magic, SGFCACHE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != SGFCACHE_VERSION
+      || header->byteorder != SGFCACHE_BYTEORDER
+      || header->longsize != sizeof(long)
+      || header->ngames > ((cache->size - sizeof(SGFCacheHeader))
+			   / sizeof(SGFCacheGame))) {
+    sgfcache_close(cache);
+    return SGFCACHE_BAD_FORMAT;
+  }
+
+  if (source) {
+    if (!source_stat(source, &size, &mtime)) {
+      sgfcache_close(cache);
+      return SGFCACHE_OPEN_ERROR;
+    }
+    if (size != header->source_size || mtime != header->source_mtime) {
+      sgfcache_close(cache);
+      return SGFCACHE_STALE;
+    }
+  }
+
+  cache->ngames = header->ngames;
+  return SGFCACHE_OK;
+}
+
+
+/* Whether pos is PASS_MOVE or a point of a board of the given size. */
+
+static int
+valid_pos(int pos, int boardsize)
+{
+  return (pos == PASS_MOVE
+	  || (pos >= BOARDMIN && pos < BOARDMAX
+	      && I(pos) >= 0 && I(pos) < boardsize
+	      && J(pos) >= 0 && J(pos) < boardsize));
+}
+
+
+/*
+ * Check that the arrays of a flat tree read from a cache are what
+ * sgfflat_build() makes: the links of the nodes are in preorder and
+ * in range, the properties of each node lie within the property
+ * array, every value starts in the pool, which ends with '\0', and
+ * the decoded positions are on the board. A damaged or hostile cache
+ * whose checksum was not verified can then do no worse than give
+ * wrong values.
+ */
+
+static int
+flat_tree_valid(const SGFFlatTree *flat)
+{
+  unsigned int n, k;
+
+  if (flat->boardsize < MIN_BOARD || flat->boardsize > MAX_BOARD
+      || (flat->nprops > 0 && flat->values_size == 0)
+      || (flat->values_size > 0
+	  && flat->values[flat->values_size - 1] != '\0'))
+    return 0;
+
+  for (n = 0; n < flat->nnodes; n++) {
+    const SGFFlatNode *node = &flat->nodes[n];
+
+    if ((n == 0) != (node->parent == SGF_FLAT_NONE)
+	|| (n > 0 && node->parent >= n)
+	|| (node->child != SGF_FLAT_NONE && node->child != n + 1)
+	|| (node->next != SGF_FLAT_NONE
+	    && (node->next <= n || node->next >= flat->nnodes))
+	|| node->props > flat->nprops
+	|| node->nprops > flat->nprops - node->props
+	|| !valid_pos(node->move, flat->boardsize)
+	|| (node->color != EMPTY && node->color != WHITE
+	    && node->color != BLACK))
+      return 0;
+    if (node->child == n + 1 && n + 1 >= flat->nnodes)
+      return 0;
+  }
+
+  for (k = 0; k < flat->nprops; k++)
+    if (flat->props[k].value >= flat->values_size
+	|| !valid_pos(flat->props[k].pos, flat->boardsize))
+      return 0;
+
+  return 1;
+}
+
+
+/*
+ * Make flat refer to game k of the cache. The arrays of flat point
+ * into the cache and stay valid until it is closed; flat must not be
+ * passed to sgfflat_free().
+ *
+ * Returns 1 on success, 0 if k is out of range, the directory entry
+ * does not fit in the file or the arrays of the game are not a
+ * consistent flat tree. The checks cost a pass over the nodes and
+ * properties of the game, but not over its values.
+ */
+
+int
+sgfcache_get_game(const SGFCache *cache, unsigned int k, SGFFlatTree *flat)
+{
+  const SGFCacheGame *game;
+
+  sgfflat_clear(flat);
+  if (k >= cache->ngames)
+    return 0;
+
+  game = (const SGFCacheGame *) (cache->base + sizeof(SGFCacheHeader)) + k;
+  if (game->nodes % SGFCACHE_ALIGN != 0 || game->props % SGFCACHE_ALIGN != 0
+      || game->nodes > cache->size
+      || game->nnodes > (cache->size - game->nodes) / sizeof(SGFFlatNode)
+      || game->props > cache->size
+      || game->nprops > (cache->size - game->props) / sizeof(SGFFlatProperty)
+      || game->values > cache->size
+      || game->values_size > cache->size - game->values)
+    return 0;
+
+  flat->nodes = (SGFFlatNode *) (cache->base + game->nodes);
+  flat->props = (SGFFlatProperty *) (cache->base + game->props);
+  flat->values = cache->base + game->values;
+  flat->nnodes = game->nnodes;
+  flat->nprops = game->nprops;
+  flat->values_size = game->values_size;
+  flat->boardsize = game->boardsize;
+  if (!flat_tree_valid(flat)) {
+    sgfflat_clear(flat);
+    return 0;
+  }
+  return 1;
+}
+
+
+/* Check the sum of the whole cache. Returns 1 if it is right. */
+
+int
+sgfcache_verify(const SGFCache *cache)
+{
+  const SGFCacheHeader *header = (const SGFCacheHeader *) cache->base;
+
+  return adler32(1, cache->base + sizeof(SGFCacheHeader),
+		 cache->size - sizeof(SGFCacheHeader)) == header->checksum;
+}
+
+
+void
+sgfcache_close(SGFCache *cache)
+{
+  if (cache->base) {
+#ifndef WIN32
+    if (cache->mapped)
+      munmap(cache->base, cache->size);
+    else
+#endif
+      free(cache->base);
+  }
+  memset(cache, 0, sizeof(*cache));
+}
+
+
+/*
+ * Parse source and flatten each of its games into a new array in
+ * *games. Returns one of the SGF_* codes of the parser.
+ */
+
+static int
+flatten_source(const char *source, SGFFlatTree **games, unsigned int *ngames)
+{
+  SGFParser ctx;
+  SGFNode *root;
+  SGFNode *game;
+  unsigned int k;
+  int status;
+
+  *games = NULL;
+  *ngames = 0;
+  status = readsgffile_ctx(&ctx, source, &root);
+  if (status != SGF_OK) {
+    if (status == SGF_PARSE_ERROR)
+      sgfparser_perror(&ctx, stderr);
+    return status;
+  }
+
+  for (game = root; game; game = game->next)
+    (*ngames)++;
+  *games = xalloc(*ngames * sizeof(SGFFlatTree));
+
+  for (game = root, k = 0; game; game = game->next, k++)
+    if (!sgfflat_build(&(*games)[k], game))
+      status = SGF_PARSE_ERROR;
+
+  sgfFreeNode(root);
+  return status;
+}
+
+
+static void
+free_games(SGFFlatTree *games, unsigned int ngames)
+{
+  unsigned int k;
+
+  for (k = 0; k < ngames; k++)
+    sgfflat_free(&games[k]);
+  free(games);
+}
+
+
+/*
+ * Parse an SGF file and write the cache of all its games. Returns one
+ * of the SGFCACHE_* codes.
+ */
+
+int
+sgfcache_build(const char *source, const char *cachename)
+{
+  SGFFlatTree *games;
+  unsigned int ngames;
+  int status;
+
+  status = flatten_source(source, &games, &ngames);
+  if (status == SGF_OK)
+    status = sgfcache_write(cachename, source, games, ngames)
+	     ? SGFCACHE_OK : SGFCACHE_OPEN_ERROR;
+  else
+    status = status == SGF_OPEN_ERROR ? SGFCACHE_OPEN_ERROR : SGFCACHE_CORRUPT;
+
+  free_games(games, ngames);
+  return status;
+}
+
+
+static int
+flat_trees_equal(const SGFFlatTree *a, const SGFFlatTree *b)
+{
+  return (a->nnodes == b->nnodes
+	  && a->nprops == b->nprops
+	  && a->values_size == b->values_size
+	  && a->boardsize == b->boardsize
+	  && memcmp(a->nodes, b->nodes, a->nnodes * sizeof(SGFFlatNode)) == 0
+	  && memcmp(a->props, b->props,
+		    a->nprops * sizeof(SGFFlatProperty)) == 0
+	  && memcmp(a->values, b->values, a->values_size) == 0);
+}
+
+
+/*
+ * Check a cache against its SGF file: it must be up to date, its sum
+ * must be right, and its games must be those of a fresh parse of the
+ * file. Returns one of the SGFCACHE_* codes.
+ */
+
+int
+sgfcache_check(const char *source, const char *cachename)
+{
+  SGFCache cache;
+  SGFFlatTree cached;
+  SGFFlatTree *games;
+  unsigned int ngames;
+  unsigned int k;
+  int status;
+
+  status = sgfcache_open(&cache, cachename, source);
+  if (status != SGFCACHE_OK)
+    return status;
+
+  if (!sgfcache_verify(&cache)) {
+    sgfcache_close(&cache);
+    return SGFCACHE_CORRUPT;
+  }
+
+  status = flatten_source(source, &games, &ngames);
+  if (status != SGF_OK)
+    status = status == SGF_OPEN_ERROR ? SGFCACHE_OPEN_ERROR : SGFCACHE_CORRUPT;
+  else if (ngames != cache.ngames)
+    status = SGFCACHE_CORRUPT;
+  else
+    for (k = 0; k < ngames && status == SGFCACHE_OK; k++)
+      if (!sgfcache_get_game(&cache, k, &cached)
+	  || !flat_trees_equal(&games[k], &cached))
+	status = SGFCACHE_CORRUPT;
+
+  free_games(games, ngames);
+  sgfcache_close(&cache);
+  return status;
+}
+
+
+const char *
+sgfcache_strerror(int status)
+{
+  switch (status) {
+  case SGFCACHE_OK:
+    return "ok";
+  case SGFCACHE_OPEN_ERROR:
+    return "cannot read file";
+  case SGFCACHE_BAD_FORMAT:
+    return "not a cache file of this version";
+  case SGFCACHE_STALE:
+    return "source file has changed";
+  case SGFCACHE_CORRUPT:
+    return "cache is corrupt";
+  default:
+    return "unknown error";
+  }
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 2
+ * End:
+ */
@@ -241,6 +241,543 @@ get_sgfmove(SGFProperty *property)
 }
 
 
+/* The color to play at node, from its move or else its PL property,
+ * or EMPTY if it has neither.
+ */
+
+static int
+node_color_to_play(SGFNode *node)
+{
+  SGFProperty *prop;
+  int color = EMPTY;
+
+  for (prop = node->props; prop; prop = prop->next)
+    if (prop->name == SGFB || prop->name == SGFW)
+      return prop->name == SGFB ? BLACK : WHITE;
+    else if (prop->name == SGFPL) {
+      /* Due to a bad comment in the SGF FF3 definition (in the
+       * "Alphabetical list of properties" section) some
+       * applications encode the colors with 1 for black and 2 for
+       * white.
+       */
+      if (prop->value[0] == 'w' || prop->value[0] == 'W'
+	  || prop->value[0] == '2')
+	color = WHITE;
+      else
+	color = BLACK;
+    }
+
+  return color;
+}
+
+
+/* In a handicap game without AB, the fixed handicap stones go on the
+ * board when white is first to play at node on an empty board.
+ */
+
+static void
+place_missing_handicap(SGFNode *node, int handicap)
+{
+  if (handicap > 1 && stones_on_board(GRAY) == 0
+      && node_color_to_play(node) == WHITE)
+    place_fixed_handicap(handicap);
+}
+
+
+/* The IL property is not a standard SGF property but is used by GNU
+ * Go to mark illegal moves. If a move is found marked with the IL
+ * property which is a ko capture then that ko capture is deemed
+ * illegal and board_ko_pos is set to the location of the ko.
+ */
+
+static void
+apply_illegal_ko(SGFNode *node)
+{
+  SGFProperty *prop;
+
+  for (prop = node->props; prop; prop = prop->next)
+    if (prop->name == SGFIL && board_size > 1) {
+      int ko = get_sgfmove(prop);
+      int ko_color;
+
+      if (!ON_BOARD(ko))
+	continue;
+      if (ON_BOARD(NORTH(ko)))
+	ko_color = OTHER_COLOR(board[NORTH(ko)]);
+      else
+	ko_color = OTHER_COLOR(board[SOUTH(ko)]);
+      if (is_ko(ko, ko_color, NULL))
+	board_ko_pos = ko;
+    }
+}
+
+
+/*
+ * Action the setup stones and the move of an SGF node on the board,
+ * in that order, placing the fixed handicap stones of the game first
+ * if they are missing. Stones on occupied points and moves which are
+ * not legal there are ignored. The setup stones are batched so that
+ * the board is rebuilt once per node rather than once per stone.
+ */
+
+static void
+play_sgf_node(SGFNode *node, int handicap)
+{
+  SGFProperty *prop;
+  int move = NO_MOVE;
+  int color = EMPTY;
+  int i, j, k;
+
+  begin_setup();
+  for (prop = node->props; prop; prop = prop->next) {
+    switch (prop->name) {
+    case SGFAB:
+    case SGFAW:
+      for (k = 0; sgfNextPoint(prop, &k, &i, &j, board_size); )
+	if (board[POS(i, j)] == EMPTY)
+	  add_stone(POS(i, j), prop->name == SGFAB ? BLACK : WHITE);
+      break;
+
+    case SGFAE:
+      for (k = 0; sgfNextPoint(prop, &k, &i, &j, board_size); )
+	if (IS_STONE(board[POS(i, j)]))
+	  remove_stone(POS(i, j));
+      break;
+
+    case SGFB:
+    case SGFW:
+      if (color == EMPTY) {
+	move = get_sgfmove(prop);
+	color = prop->name == SGFB ? BLACK : WHITE;
+      }
+      break;
+    }
+  }
+  end_setup();
+
+  place_missing_handicap(node, handicap);
+  if (color != EMPTY
+      && (move == PASS_MOVE
+	  || (ON_BOARD(move) && board[move] == EMPTY
+	      && !is_suicide(move, color))))
+    play_move(move, color);
+  apply_illegal_ko(node);
+}
+
+
+/*
+ * Set up the board position at node, which may be anywhere in the
+ * tree, and make it the current node. Going there from the root would
+ * take a new_position() for each node on the way. Instead the position
+ * is restored from the nearest saved one above the node and only the
+ * nodes after it are played. Positions are saved on the way at every
+ * SGF_CHECKPOINT_INTERVAL-th level, so scrubbing back and forth
+ * through a game soon needs at most that many moves per jump.
+ *
+ * Returns 1 on success, 0 if the board size of the game is not
+ * supported.
+ */
+
+int
+sgftreeGoto(SGFTree *tree, SGFNode *node)
+{
+  struct board_state *state = NULL;
+  SGFNode **path;
+  SGFNode *start;
+  SGFNode *root;
+  int depth = sgfDepth(node);
+  int handicap = 0;
+  int n = 0;
+
+  for (root = node; root->parent; root = root->parent)
+    ;
+  sgfGetIntProperty(root, "HA", &handicap);
+
+  path = xalloc((depth + 1) * sizeof(SGFNode *));
+  for (start = node; start; start = start->parent) {
+    state = sgftree_get_checkpoint(tree, start);
+    if (state)
+      break;
+    path[n++] = start;
+  }
+
+  if (state)
+    restore_board(state);
+  else {
+    int bs;
+
+    if (!sgfGetIntProperty(root, "SZ", &bs))
+      bs = 19;
+    if (bs < MIN_BOARD || bs > MAX_BOARD) {
+      free(path);
+      return 0;
+    }
+    gnugo_clear_board(bs);
+    sgfGetFloatProperty(root, "KM", &komi);
+  }
+
+  /* path[k] is k levels above node. */
+  while (n > 0) {
+    SGFNode *p = path[--n];
+
+    play_sgf_node(p, handicap);
+    if ((depth - n) % SGF_CHECKPOINT_INTERVAL == 0) {
+      state = xalloc(sizeof(struct board_state));
+      store_board(state);
+      sgftree_set_checkpoint(tree, p, state);
+    }
+  }
+
+  free(path);
+  tree->lastnode = node;
+  return 1;
+}
+
+
+/* ================================================================ */
+/*                     Incremental navigation                       */
+/* ================================================================ */
+
+/*
+ * An SGFNavigator keeps the position of its current node on the board
+ * and moves to any neighbouring node of the tree with a small change:
+ * moves are tried and taken back with tryko() and popgo(), so stepping
+ * through a variation costs no new_position() at all.
+ *
+ * Setup stones (AB, AW, AE) cannot be placed on top of the move stack,
+ * nor can the fixed handicap stones of an HA without them or the ko of
+ * an IL property. At such a node the position is therefore made
+ * permanent with a single setup_board(), and the position it replaces
+ * is kept in an undo log at that level. Going back past the node
+ * restores it and tries the moves above it again. The same happens when the move stack
+ * would overflow in a very long game.
+ */
+
+/* A position saved in the undo log. */
+struct SGFNavPosition_t {
+  Intersection board[MAX_BOARD][MAX_BOARD];
+  int ko_pos;
+  int white_captured;
+  int black_captured;
+  int prev_base;		/* level of the permanent position before */
+};
+
+
+static void
+save_position(struct SGFNavPosition_t *p)
+{
+  int i, j;
+
+  for (i = 0; i < board_size; i++)
+    for (j = 0; j < board_size; j++)
+      p->board[i][j] = BOARD(i, j);
+  p->ko_pos = board_ko_pos;
+  p->white_captured = white_captured;
+  p->black_captured = black_captured;
+}
+
+
+/* The point of a move or setup property, PASS_MOVE if it is none. */
+
+static int
+property_point(SGFProperty *prop)
+{
+  int i, j;
+
+  if (!get_moveXY(prop, &i, &j, board_size) || i < 0 || j < 0)
+    return PASS_MOVE;
+  return POS(i, j);
+}
+
+
+/* The move of node and its color, or NO_MOVE if it has none. */
+
+static int
+node_move(SGFNode *node, int *color)
+{
+  SGFProperty *prop;
+
+  for (prop = node->props; prop; prop = prop->next)
+    if (prop->name == SGFB || prop->name == SGFW) {
+      *color = prop->name == SGFB ? BLACK : WHITE;
+      return property_point(prop);
+    }
+
+  return NO_MOVE;
+}
+
+
+/* Whether node changes the position other than by a move: setup
+ * stones, an IL property, or white to play on an empty board in a
+ * handicap game, which places the fixed handicap stones first.
+ */
+
+static int
+has_setup(SGFNavigator *nav, SGFNode *node)
+{
+  SGFProperty *prop;
+
+  for (prop = node->props; prop; prop = prop->next)
+    if (prop->name == SGFAB || prop->name == SGFAW || prop->name == SGFAE
+	|| prop->name == SGFIL)
+      return 1;
+
+  return (nav->handicap > 1 && stones_on_board(GRAY) == 0
+	  && node_color_to_play(node) == WHITE);
+}
+
+
+/*
+ * Make p, with the setup stones of node added, the permanent position
+ * and play the move of node on it. As in sgftreeGoto(), stones on
+ * occupied points are ignored. If the board is still empty when white
+ * is to play, the fixed handicap stones are placed first. Moves
+ * marked with IL that are ko captures are made illegal. Returns the
+ * move, NO_MOVE if there is none or it cannot be played.
+ */
+
+static int
+set_position(struct SGFNavPosition_t *p, SGFNode *node, int handicap)
+{
+  SGFProperty *prop;
+  int move;
+  int color;
+  int i, j, k;
+
+  for (prop = node->props; prop; prop = prop->next) {
+    if (prop->name != SGFAB && prop->name != SGFAW && prop->name != SGFAE)
+      continue;
+
+    for (k = 0; sgfNextPoint(prop, &k, &i, &j, board_size); ) {
+      if (prop->name == SGFAE)
+	p->board[i][j] = EMPTY;
+      else if (p->board[i][j] == EMPTY)
+	p->board[i][j] = prop->name == SGFAB ? BLACK : WHITE;
+      else
+	continue;
+      p->ko_pos = NO_MOVE;
+    }
+  }
+
+  setup_board(p->board, p->ko_pos, NULL, komi, p->white_captured,
+	      p->black_captured);
+
+  place_missing_handicap(node, handicap);
+
+  move = node_move(node, &color);
+  if (move == NO_MOVE
+      || (move != PASS_MOVE
+	  && (board[move] != EMPTY || is_suicide(move, color))))
+    move = NO_MOVE;
+  else
+    play_move(move, color);
+
+  apply_illegal_ko(node);
+  return move;
+}
+
+
+/*
+ * Make the position at the current level permanent, applying the setup
+ * stones and the move of node on top if node is not NULL, and log the
+ * position it replaces.
+ */
+
+static void
+rebase(SGFNavigator *nav, SGFNode *node)
+{
+  struct SGFNavPosition_t current;
+  struct SGFNavPosition_t *old = xalloc(sizeof(*old));
+  int d;
+
+  save_position(&current);
+  for (d = nav->depth; d > nav->base; d--)
+    if (nav->levels[d].move != NO_MOVE)
+      popgo();
+  save_position(old);
+  old->prev_base = nav->base;
+
+  nav->levels[nav->depth].undo = old;
+  nav->base = nav->depth;
+
+  if (node)
+    set_position(&current, node, nav->handicap);
+  else
+    setup_board(current.board, current.ko_pos, NULL, komi,
+		current.white_captured, current.black_captured);
+
+  /* The move, if any, is part of the permanent position now. */
+  nav->levels[nav->depth].move = NO_MOVE;
+}
+
+
+/*
+ * Set up the position at root and make it the current node. Returns 0
+ * if the board size of the game is not supported.
+ */
+
+int
+sgfnav_init(SGFNavigator *nav, SGFNode *root)
+{
+  struct SGFNavPosition_t p;
+  int bs;
+
+  if (!sgfGetIntProperty(root, "SZ", &bs))
+    bs = 19;
+  if (bs < MIN_BOARD || bs > MAX_BOARD)
+    return 0;
+
+  gnugo_clear_board(bs);
+  sgfGetFloatProperty(root, "KM", &komi);
+
+  nav->size = 64;
+  nav->levels = xalloc(nav->size * sizeof(SGFNavLevel));
+  nav->depth = 0;
+  nav->base = 0;
+  nav->node = root;
+  nav->levels[0].node = root;
+  nav->levels[0].move = NO_MOVE;
+  nav->levels[0].color = EMPTY;
+  nav->levels[0].undo = NULL;
+  nav->handicap = 0;
+  sgfGetIntProperty(root, "HA", &nav->handicap);
+
+  save_position(&p);
+  set_position(&p, root, nav->handicap);
+  return 1;
+}
+
+
+/*
+ * Go forward to child, which must be a child of the current node.
+ * Returns 0 if child is NULL.
+ */
+
+int
+sgfnav_forward(SGFNavigator *nav, SGFNode *child)
+{
+  SGFNavLevel *level;
+
+  if (!child)
+    return 0;
+  gg_assert(child->parent == nav->node);
+
+  if (nav->depth + 1 >= nav->size) {
+    nav->size *= 2;
+    nav->levels = xrealloc(nav->levels, nav->size * sizeof(SGFNavLevel));
+  }
+
+  level = &nav->levels[++nav->depth];
+  level->node = child;
+  level->move = NO_MOVE;
+  level->undo = NULL;
+  nav->node = child;
+
+  if (has_setup(nav, child)) {
+    rebase(nav, child);
+    return 1;
+  }
+
+  level->move = node_move(child, &level->color);
+  if (level->move == NO_MOVE)
+    return 1;
+
+  if (stackp >= MAXSTACK - 3) {
+    /* Flatten the move stack into the position of the parent. */
+    int move = level->move;
+
+    level->move = NO_MOVE;
+    nav->depth--;
+    rebase(nav, NULL);
+    nav->depth++;
+    level->move = move;
+  }
+
+  /* Moves which cannot be played are ignored, as by sgftreeGoto(). */
+  if (!tryko(level->move, level->color, NULL))
+    level->move = NO_MOVE;
+
+  return 1;
+}
+
+
+/* Go back to the parent of the current node. Returns 0 at the root. */
+
+int
+sgfnav_back(SGFNavigator *nav)
+{
+  SGFNavLevel *level = &nav->levels[nav->depth];
+  struct SGFNavPosition_t *old = level->undo;
+  int d;
+
+  if (nav->depth == 0)
+    return 0;
+
+  if (level->move != NO_MOVE)
+    popgo();
+
+  if (old) {
+    gg_assert(nav->base == nav->depth);
+    setup_board(old->board, old->ko_pos, NULL, komi, old->white_captured,
+		old->black_captured);
+    nav->base = old->prev_base;
+    for (d = nav->base + 1; d < nav->depth; d++)
+      if (nav->levels[d].move != NO_MOVE)
+	tryko(nav->levels[d].move, nav->levels[d].color, NULL);
+    free(old);
+    level->undo = NULL;
+  }
+
+  nav->depth--;
+  nav->node = nav->levels[nav->depth].node;
+  return 1;
+}
+
+
+/*
+ * Go to any node of the same game: back to the closest common
+ * ancestor and forward from there.
+ */
+
+void
+sgfnav_goto(SGFNavigator *nav, SGFNode *node)
+{
+  int depth = sgfDepth(node);
+  SGFNode **path = xalloc((depth + 1) * sizeof(SGFNode *));
+  SGFNode *p = node;
+  int d;
+
+  for (d = depth; d >= 0; d--) {
+    path[d] = p;
+    p = p->parent;
+  }
+
+  while (nav->depth > depth || nav->levels[nav->depth].node != path[nav->depth])
+    sgfnav_back(nav);
+  for (d = nav->depth + 1; d <= depth; d++)
+    sgfnav_forward(nav, path[d]);
+
+  free(path);
+}
+
+
+/* Take back all temporary moves and release the undo log. */
+
+void
+sgfnav_free(SGFNavigator *nav)
+{
+  int d;
+
+  for (d = nav->depth; d > nav->base; d--)
+    if (nav->levels[d].move != NO_MOVE)
+      popgo();
+  for (d = 0; d <= nav->depth; d++)
+    free(nav->levels[d].undo);
+  free(nav->levels);
+  nav->levels = NULL;
+}
+
+
 /*
  * Local Variables:
  * tab-width: 8
@@ -0,0 +1,359 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *\
+ * This is GNU Go, a Go program. Contact gnugo@gnu.org, or see       *
+ * http://www.gnu.org/software/gnugo/ for more information.          *
+ *                                                                   *
+ * Copyright 1999, 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2007,   *
+ * 2008 and 2009 by the Free Software Foundation.                    *
+ *                                                                   *
+ * This program is free software; you can redistribute it and/or     *
+ * modify it under the terms of the GNU General Public License as    *
+ * published by the Free Software Foundation - version 3 or          *
+ * (at your option) any later version.                               *
+ *                                                                   *
+ * This program is distributed in the hope that it will be useful,   *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of    *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the     *
+ * GNU General Public License in file COPYING for more details.      *
+ *                                                                   *
+ * You should have received a copy of the GNU General Public         *
+ * License along with this program; if not, write to the Free        *
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor,       *
+ * Boston, MA 02111, USA.                                            *
+\* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * msgfflat.c
+ *
+ * Conversion of SGF trees to the flat preorder representation of
+ * SGFFlatTree and read-only navigation in it. See msgftree.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mboard.h"
+
+
+void
+sgfflat_clear(SGFFlatTree *flat)
+{
+  memset(flat, 0, sizeof(*flat));
+}
+
+
+void
+sgfflat_free(SGFFlatTree *flat)
+{
+  free(flat->nodes);
+  free(flat->props);
+  free(flat->values);
+  sgfflat_clear(flat);
+}
+
+
+/*
+ * Next node of the game tree of root in preorder, i.e. the order of
+ * the nodes in an SGFFlatTree. Siblings of the root (further games of
+ * a collection) are not part of the game.
+ */
+
+static SGFNode *
+preorder_next(SGFNode *node, SGFNode *root)
+{
+  if (node->child)
+    return node->child;
+
+  while (node != root && !node->next)
+    node = node->parent;
+
+  return node == root ? NULL : node->next;
+}
+
+
+/*
+ * Properties whose values are points. LB is included since its value
+ * starts with the labelled point.
+ */
+
+static int
+is_point_property(short name)
+{
+  switch (name) {
+  case SGFB:
+  case SGFW:
+  case SGFAB:
+  case SGFAW:
+  case SGFAE:
+  case SGFCR:
+  case SGFSQ:
+  case SGFTR:
+  case SGFMA:
+  case SGFTB:
+  case SGFTW:
+  case SGFSL:
+  case SGFDD:
+  case SGFLB:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+
+/*
+ * Decode a point valued property to a board position. Passes and
+ * points outside the board give PASS_MOVE.
+ */
+
+static int
+decode_point(SGFProperty *prop, int boardsize)
+{
+  int i, j;
+
+  if (!get_moveXY(prop, &i, &j, boardsize) || i < 0 || j < 0)
+    return PASS_MOVE;
+
+  return POS(i, j);
+}
+
+
+/*
+ * Add a flat property with a value of its own for each point of a
+ * point set, as if the points had been read one by one.
+ */
+
+static void
+add_points(SGFFlatTree *flat, SGFProperty *prop, unsigned int *p,
+	   unsigned int *v)
+{
+  int i, j, k;
+
+  for (k = 0; sgfNextPoint(prop, &k, &i, &j, SGF_POINTSET_SIZE); ) {
+    SGFFlatProperty *flatprop = &flat->props[(*p)++];
+    char *value = flat->values + *v;
+
+    flatprop->name = prop->name;
+    flatprop->value = *v;
+    if (i < flat->boardsize && j < flat->boardsize)
+      flatprop->pos = POS(i, j);
+    else
+      flatprop->pos = PASS_MOVE;
+    value[0] = 'a' + j;
+    value[1] = 'a' + i;
+    value[2] = '\0';
+    *v += 3;
+  }
+}
+
+
+/*
+ * Build a flat copy of the game tree rooted at root; further games of
+ * a collection need a flat tree each. All values are copied, so the
+ * SGF tree may be freed afterwards. A lazily read tree is expanded
+ * first. Moves are decoded for the board size given by SZ in the root,
+ * 19 by default.
+ *
+ * Returns 1 on success, 0 if the tree is too large for 32-bit
+ * indices.
+ */
+
+int
+sgfflat_build(SGFFlatTree *flat, SGFNode *root)
+{
+  unsigned long nnodes = 0;
+  unsigned long nprops = 0;
+  unsigned long values_size = 0;
+  unsigned int parent = SGF_FLAT_NONE;
+  unsigned int prev = SGF_FLAT_NONE;
+  unsigned int n = 0;
+  unsigned int p = 0;
+  unsigned int v = 0;
+  SGFProperty *prop;
+  SGFNode *node;
+  int boardsize;
+
+  sgfflat_clear(flat);
+  if (!root)
+    return 1;
+
+  sgfExpandAll(root);
+  if (!sgfGetIntProperty(root, "SZ", &boardsize))
+    boardsize = 19;
+  if (boardsize > MAX_BOARD)
+    boardsize = MAX_BOARD;
+
+  /* First pass: find the sizes of the arrays. */
+  for (node = root; node; node = preorder_next(node, root)) {
+    nnodes++;
+    for (prop = node->props; prop; prop = prop->next) {
+      if (prop->flags & SGFPROP_POINTS) {
+	nprops += sgfPointCount(prop);
+	values_size += 3 * sgfPointCount(prop);
+	continue;
+      }
+      nprops++;
+      values_size += strlen(prop->value) + 1;
+    }
+  }
+
+  if (nnodes >= SGF_FLAT_NONE || nprops >= SGF_FLAT_NONE
+      || values_size >= SGF_FLAT_NONE)
+    return 0;
+
+  flat->nodes = xalloc(nnodes * sizeof(SGFFlatNode));
+  flat->props = xalloc((nprops ? nprops : 1) * sizeof(SGFFlatProperty));
+  flat->values = xalloc(values_size ? values_size : 1);
+  flat->nnodes = nnodes;
+  flat->nprops = nprops;
+  flat->values_size = values_size;
+  flat->boardsize = boardsize;
+
+  /* Second pass: fill them in. parent is the index of the parent of
+   * the current node and prev that of its preceding sibling, if any.
+   */
+  node = root;
+  while (node) {
+    SGFFlatNode *flatnode = &flat->nodes[n];
+
+    flatnode->parent = parent;
+    flatnode->child = SGF_FLAT_NONE;
+    flatnode->next = SGF_FLAT_NONE;
+    flatnode->props = p;
+    flatnode->nprops = 0;
+    flatnode->move = PASS_MOVE;
+    flatnode->color = EMPTY;
+    if (prev != SGF_FLAT_NONE)
+      flat->nodes[prev].next = n;
+
+    for (prop = node->props; prop; prop = prop->next) {
+      SGFFlatProperty *flatprop;
+      int size;
+
+      if (prop->flags & SGFPROP_POINTS) {
+	add_points(flat, prop, &p, &v);
+	flatnode->nprops += sgfPointCount(prop);
+	continue;
+      }
+
+      flatprop = &flat->props[p++];
+      size = strlen(prop->value) + 1;
+
+      flatprop->name = prop->name;
+      flatprop->pos = NO_MOVE;
+      flatprop->value = v;
+      memcpy(flat->values + v, prop->value, size);
+      v += size;
+      flatnode->nprops++;
+
+      if (is_point_property(prop->name))
+	flatprop->pos = decode_point(prop, boardsize);
+      if (flatnode->color == EMPTY
+	  && (prop->name == SGFB || prop->name == SGFW)) {
+	flatnode->color = prop->name == SGFB ? BLACK : WHITE;
+	flatnode->move = flatprop->pos;
+      }
+    }
+
+    if (node->child) {
+      flatnode->child = n + 1;
+      parent = n;
+      prev = SGF_FLAT_NONE;
+      node = node->child;
+    }
+    else {
+      prev = n;
+      while (node != root && !node->next) {
+	node = node->parent;
+	prev = parent;
+	parent = flat->nodes[parent].parent;
+      }
+      node = node == root ? NULL : node->next;
+    }
+    n++;
+  }
+
+  assert(n == nnodes && p == nprops && v == values_size);
+  return 1;
+}
+
+
+/*
+ * Return the value of the first property called name in the given
+ * node, or NULL if there is none. name is encoded as in SGFProperty.
+ */
+
+const char *
+sgfflat_get_property(const SGFFlatTree *flat, unsigned int node, short name)
+{
+  const SGFFlatProperty *prop = flat->props + flat->nodes[node].props;
+  const SGFFlatProperty *end = prop + flat->nodes[node].nprops;
+
+  for (; prop < end; prop++)
+    if (prop->name == name)
+      return flat->values + prop->value;
+
+  return NULL;
+}
+
+
+void
+sgfflat_cursor_init(SGFFlatCursor *cursor, const SGFFlatTree *flat)
+{
+  cursor->tree = flat;
+  cursor->lastnode = SGF_FLAT_NONE;
+}
+
+
+/* Go back one node in the tree. If lastnode is SGF_FLAT_NONE, go to
+ * the last node of the main variation. Same as sgftreeBack().
+ */
+
+int
+sgfflatBack(SGFFlatCursor *cursor)
+{
+  if (cursor->lastnode != SGF_FLAT_NONE) {
+    unsigned int parent = cursor->tree->nodes[cursor->lastnode].parent;
+    if (parent != SGF_FLAT_NONE)
+      cursor->lastnode = parent;
+    else
+      return 0;
+  }
+  else
+    while (sgfflatForward(cursor))
+      ;
+
+  return 1;
+}
+
+
+/* Go forward one node in the tree. If lastnode is SGF_FLAT_NONE, go
+ * to the tree root. Same as sgftreeForward().
+ */
+
+int
+sgfflatForward(SGFFlatCursor *cursor)
+{
+  if (cursor->lastnode != SGF_FLAT_NONE) {
+    unsigned int child = cursor->tree->nodes[cursor->lastnode].child;
+    if (child != SGF_FLAT_NONE)
+      cursor->lastnode = child;
+    else
+      return 0;
+  }
+  else if (cursor->tree->nnodes > 0)
+    cursor->lastnode = 0;
+  else
+    return 0;
+
+  return 1;
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 2
+ * End:
+ */
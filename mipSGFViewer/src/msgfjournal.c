@@ -0,0 +1,629 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *\
+ * This is GNU Go, a Go program. Contact gnugo@gnu.org, or see       *
+ * http://www.gnu.org/software/gnugo/ for more information.          *
+ *                                                                   *
+ * Copyright 1999, 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2007,   *
+ * 2008 and 2009 by the Free Software Foundation.                    *
+ *                                                                   *
+ * This program is free software; you can redistribute it and/or     *
+ * modify it under the terms of the GNU General Public License as    *
+ * published by the Free Software Foundation - version 3 or          *
+ * (at your option) any later version.                               *
+ *                                                                   *
+ * This program is distributed in the hope that it will be useful,   *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of    *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the     *
+ * GNU General Public License in file COPYING for more details.      *
+ *                                                                   *
+ * You should have received a copy of the GNU General Public         *
+ * License along with this program; if not, write to the Free        *
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor,       *
+ * Boston, MA 02111, USA.                                            *
+\* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * msgfjournal.c
+ *
+ * Append-only journals of SGF trees. See msgftree.h.
+ *
+ * A journal starts with a snapshot of the tree as SGF text, followed
+ * by one record for each node or property added since. The nodes are
+ * numbered: those of the snapshot in preorder over all games, then
+ * each new node in turn. Every record is
+ *
+ *   <type> <a> <b> <length> <sum>\n<length bytes of payload>\n
+ *
+ * where sum is a checksum of the rest of the record, so that a record
+ * torn by a crash is recognised. The types are
+ *
+ *   T 0 0         snapshot, the payload is the SGF text of the tree
+ *   R <id> 0      new root node <id> (no payload)
+ *   N <parent> F  new first (F = 0) or last (F = 1) child of <parent>
+ *   P <id> <name> property <name> (an SGFProperty name) added to <id>
+ *   S <id> <name> property <name> of <id> set, as sgfOverwriteProperty()
+ *
+ * Replaying a journal stops at the first bad record; the file is cut
+ * there and appending continues.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include "mgg_utils.h"
+#include "msgftree.h"
+
+#define JOURNAL_MAGIC "SGFJOURNAL 1\n"
+#define JOURNAL_NONE  0xffffffffU
+
+
+struct SGFJournal_t {
+  FILE *file;
+  int sync_every;		/* records between fsyncs, 0 for none */
+  int unsynced;
+  int error;			/* a write failed */
+  unsigned int nnodes;		/* ids handed out so far */
+
+  /* Open addressing hash table from nodes to their ids. */
+  SGFNode **keys;
+  unsigned int *ids;
+  unsigned int tablesize;	/* a power of two */
+  unsigned int used;
+};
+
+
+/* 32-bit FNV-1a hash, the checksum of the records. */
+
+static unsigned int
+journal_sum(unsigned int sum, const char *buf, unsigned long size)
+{
+  unsigned long k;
+
+  for (k = 0; k < size; k++) {
+    sum ^= (unsigned char) buf[k];
+    sum *= 16777619U;
+  }
+
+  return sum;
+}
+
+#define JOURNAL_SUM_INIT  2166136261U
+
+
+/* ---------------------------------------------------------------- */
+/*                         Node numbering                           */
+/* ---------------------------------------------------------------- */
+
+
+static unsigned int
+node_hash(SGFNode *node, unsigned int tablesize)
+{
+  unsigned long key = (unsigned long) node / sizeof(void *);
+
+  return (unsigned int) (key * 2654435761UL) & (tablesize - 1);
+}
+
+
+static void
+insert_node(SGFJournal *j, SGFNode *node, unsigned int id)
+{
+  unsigned int h;
+
+  if (2 * (j->used + 1) > j->tablesize) {
+    SGFNode **keys = j->keys;
+    unsigned int *ids = j->ids;
+    unsigned int size = j->tablesize;
+    unsigned int k;
+
+    j->tablesize = size ? 2 * size : 1024;
+    j->keys = xalloc(j->tablesize * sizeof(SGFNode *));
+    j->ids = xalloc(j->tablesize * sizeof(unsigned int));
+    j->used = 0;
+    for (k = 0; k < size; k++)
+      if (keys[k])
+	insert_node(j, keys[k], ids[k]);
+    free(keys);
+    free(ids);
+  }
+
+  for (h = node_hash(node, j->tablesize); j->keys[h];
+       h = (h + 1) & (j->tablesize - 1))
+    if (j->keys[h] == node) {
+      j->ids[h] = id;
+      return;
+    }
+
+  j->keys[h] = node;
+  j->ids[h] = id;
+  j->used++;
+}
+
+
+/* The id of node, or JOURNAL_NONE if it is unknown. */
+
+static unsigned int
+node_id(SGFJournal *j, SGFNode *node)
+{
+  unsigned int h;
+
+  if (!node || j->tablesize == 0)
+    return JOURNAL_NONE;
+
+  for (h = node_hash(node, j->tablesize); j->keys[h];
+       h = (h + 1) & (j->tablesize - 1))
+    if (j->keys[h] == node)
+      return j->ids[h];
+
+  return JOURNAL_NONE;
+}
+
+
+/*
+ * Number the nodes of all games from root on in preorder, as a reader
+ * of the snapshot will find them. If nodes is not NULL it receives the
+ * nodes by id; it must have room for all of them.
+ */
+
+static void
+number_nodes(SGFJournal *j, SGFNode *root, SGFNode **nodes)
+{
+  SGFNode *node = root;
+
+  while (node) {
+    if (nodes)
+      nodes[j->nnodes] = node;
+    insert_node(j, node, j->nnodes++);
+
+    if (node->child)
+      node = node->child;
+    else {
+      while (node->parent && !node->next)
+	node = node->parent;
+      node = node->next;
+    }
+  }
+}
+
+
+/* ---------------------------------------------------------------- */
+/*                             Writing                              */
+/* ---------------------------------------------------------------- */
+
+
+static int
+journal_fsync(FILE *file)
+{
+  if (fflush(file) != 0)
+    return 0;
+#ifndef WIN32
+  if (fsync(fileno(file)) != 0)
+    return 0;
+#else
+  if (_commit(_fileno(file)) != 0)
+    return 0;
+#endif
+  return 1;
+}
+
+
+static void
+write_record(SGFJournal *j, int type, unsigned int a, int b,
+	     const char *payload, unsigned long length)
+{
+  char line[64];
+  int n;
+  unsigned int sum;
+
+  if (j->error)
+    return;
+
+  n = sprintf(line, "%c %u %d %lu", type, a, b, length);
+  sum = journal_sum(journal_sum(JOURNAL_SUM_INIT, line, n), payload, length);
+
+  if (fprintf(j->file, "%s %08x\n", line, sum) < 0
+      || fwrite(payload, 1, length, j->file) != length
+      || putc('\n', j->file) == EOF
+      || fflush(j->file) != 0) {
+    fprintf(stderr, "Warning: cannot write SGF journal\n");
+    j->error = 1;
+    return;
+  }
+
+  if (j->sync_every > 0 && ++j->unsynced >= j->sync_every)
+    sgfjournal_sync(j);
+}
+
+
+static SGFJournal *
+new_journal(int sync_every)
+{
+  SGFJournal *j = xalloc(sizeof(SGFJournal));
+
+  j->sync_every = sync_every;
+  return j;
+}
+
+
+static void
+free_journal(SGFJournal *j)
+{
+  if (j->file)
+    fclose(j->file);
+  free(j->keys);
+  free(j->ids);
+  free(j);
+}
+
+
+/*
+ * Start a journal of the tree at root (which may be NULL) in filename.
+ * The snapshot is written to a temporary file which replaces filename
+ * once it is on disk, so an older journal stays valid until then.
+ * Records are synced every sync_every records, or only by
+ * sgfjournal_sync() if it is 0. A lazily read tree is expanded first.
+ * Returns NULL if the file cannot be written.
+ */
+
+SGFJournal *
+sgfjournal_create(const char *filename, SGFNode *root, int sync_every)
+{
+  SGFJournal *j = new_journal(sync_every);
+  char tmpname[FILENAME_MAX];
+  unsigned long size = 0;
+  char *text = NULL;
+
+  /* The writer leaves the variations of a lazily read tree unparsed,
+   * but the nodes are numbered as a full reader of the snapshot sees
+   * them, and any node may be edited later.
+   */
+  if (root) {
+    sgfExpandAll(root);
+    text = writesgf_to_buffer(root, &size);
+  }
+
+  gg_snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+  j->file = fopen(tmpname, "wb");
+  if (!j->file
+      || fputs(JOURNAL_MAGIC, j->file) == EOF) {
+    free(text);
+    free_journal(j);
+    return NULL;
+  }
+
+  write_record(j, 'T', 0, 0, text ? text : "", size);
+  free(text);
+  if (j->error || !journal_fsync(j->file)) {
+    free_journal(j);
+    remove(tmpname);
+    return NULL;
+  }
+  fclose(j->file);
+
+  j->file = NULL;
+  if (rename(tmpname, filename) != 0
+      || (j->file = fopen(filename, "ab")) == NULL) {
+    free_journal(j);
+    remove(tmpname);
+    return NULL;
+  }
+
+  number_nodes(j, root, NULL);
+  return j;
+}
+
+
+/* root has become the root of the tree. */
+
+void
+sgfjournal_new_root(SGFJournal *j, SGFNode *root)
+{
+  insert_node(j, root, j->nnodes);
+  write_record(j, 'R', j->nnodes++, 0, "", 0);
+}
+
+
+/*
+ * node has been added as the first or last child of its parent. Its
+ * properties are recorded separately.
+ */
+
+void
+sgfjournal_new_node(SGFJournal *j, SGFNode *node, int first)
+{
+  unsigned int parent = node_id(j, node->parent);
+
+  if (parent == JOURNAL_NONE) {
+    fprintf(stderr, "Warning: SGF journal does not know the parent node\n");
+    j->error = 1;
+    return;
+  }
+
+  insert_node(j, node, j->nnodes++);
+  write_record(j, 'N', parent, first ? 0 : 1, "", 0);
+}
+
+
+/* Record the properties of node which follow after, or all of them if
+ * after is NULL.
+ */
+
+void
+sgfjournal_add_properties(SGFJournal *j, SGFNode *node, SGFProperty *after)
+{
+  unsigned int id = node_id(j, node);
+  SGFProperty *prop = after ? after->next : node->props;
+
+  if (id == JOURNAL_NONE) {
+    fprintf(stderr, "Warning: SGF journal does not know the node\n");
+    j->error = 1;
+    return;
+  }
+
+  for (; prop; prop = prop->next)
+    write_record(j, 'P', id, prop->name, prop->value, strlen(prop->value));
+}
+
+
+/* Record the current value of the first property name of node. */
+
+void
+sgfjournal_set_property(SGFJournal *j, SGFNode *node, short name)
+{
+  unsigned int id = node_id(j, node);
+  SGFProperty *prop;
+
+  if (id == JOURNAL_NONE) {
+    fprintf(stderr, "Warning: SGF journal does not know the node\n");
+    j->error = 1;
+    return;
+  }
+
+  for (prop = node->props; prop; prop = prop->next)
+    if (prop->name == name) {
+      write_record(j, 'S', id, name, prop->value, strlen(prop->value));
+      return;
+    }
+}
+
+
+/* Force the records written so far to disk. Returns 1 on success. */
+
+int
+sgfjournal_sync(SGFJournal *j)
+{
+  j->unsynced = 0;
+  if (j->error || !journal_fsync(j->file)) {
+    j->error = 1;
+    return 0;
+  }
+  return 1;
+}
+
+
+/* Sync and close the journal. Returns 1 if everything was written. */
+
+int
+sgfjournal_close(SGFJournal *j)
+{
+  int ok;
+
+  if (!j)
+    return 1;
+
+  ok = sgfjournal_sync(j);
+  free_journal(j);
+  return ok;
+}
+
+
+/* ---------------------------------------------------------------- */
+/*                            Recovery                              */
+/* ---------------------------------------------------------------- */
+
+
+/*
+ * Parse the record at *p, ending before end. Returns 0 if it is
+ * incomplete or damaged, else advances *p past it.
+ */
+
+static int
+read_record(char **p, char *end, int *type, unsigned int *a, int *b,
+	    char **payload, unsigned long *length)
+{
+  char *line = *p;
+  char *eol = memchr(line, '\n', end - line);
+  char *space;
+  unsigned int sum;
+  char c;
+  int n;
+
+  if (!eol)
+    return 0;
+  *eol = '\0';
+  space = strrchr(line, ' ');
+  n = sscanf(line, "%c %u %d %lu %x", &c, a, b, length, &sum);
+  *eol = '\n';
+  if (!space || n != 5)
+    return 0;
+
+  *type = c;
+  *payload = eol + 1;
+  if (*length >= (unsigned long) (end - *payload)
+      || (*payload)[*length] != '\n'
+      || journal_sum(journal_sum(JOURNAL_SUM_INIT, line, space - line),
+		     *payload, *length) != sum)
+    return 0;
+
+  (*payload)[*length] = '\0';
+  *p = *payload + *length + 1;
+  return 1;
+}
+
+
+/*
+ * Rebuild a tree from the journal in filename into *root, allocating
+ * from arena if it is not NULL, and reopen the journal for appending.
+ * *lastnode is set to the node added or given properties last, where
+ * the sgftree* functions would go on. Returns NULL if the
+ * journal cannot be read or has no valid snapshot; *root then holds
+ * any nodes built so far, for the caller to free.
+ */
+
+SGFJournal *
+sgfjournal_replay(const char *filename, SGFArena *arena, SGFNode **root,
+		  SGFNode **lastnode, int sync_every)
+{
+  SGFJournal *j;
+  SGFNode **nodes = NULL;
+  unsigned int maxnodes = 0;
+  SGFParser parser;
+  FILE *file;
+  char *buffer;
+  char *p;
+  char *end;
+  long size;
+  int type, b;
+  unsigned int a;
+  char *payload;
+  unsigned long length;
+
+  *root = NULL;
+  *lastnode = NULL;
+
+  file = fopen(filename, "rb");
+  if (!file)
+    return NULL;
+  if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0
+      || fseek(file, 0, SEEK_SET) != 0) {
+    fclose(file);
+    return NULL;
+  }
+  buffer = xalloc(size + 1);
+  size = fread(buffer, 1, size, file);
+  fclose(file);
+  end = buffer + size;
+
+  p = buffer + strlen(JOURNAL_MAGIC);
+  if (size < (long) strlen(JOURNAL_MAGIC)
+      || memcmp(buffer, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != 0
+      || !read_record(&p, end, &type, &a, &b, &payload, &length)
+      || type != 'T') {
+    fprintf(stderr, "%s: not an SGF journal\n", filename);
+    free(buffer);
+    return NULL;
+  }
+
+  j = new_journal(sync_every);
+  if (length > 0) {
+    if (readsgfmem_arena(&parser, payload, length, arena, root) != SGF_OK) {
+      sgfparser_perror(&parser, stderr);
+      free(buffer);
+      free_journal(j);
+      return NULL;
+    }
+  }
+
+  /* The snapshot nodes, then one more per record at most. */
+  maxnodes = (end - p) / 8 + 1;
+  {
+    SGFNode *node;
+    for (node = *root; node; ) {
+      maxnodes++;
+      if (node->child)
+	node = node->child;
+      else {
+	while (node->parent && !node->next)
+	  node = node->parent;
+	node = node->next;
+      }
+    }
+  }
+  nodes = xalloc(maxnodes * sizeof(SGFNode *));
+  number_nodes(j, *root, nodes);
+
+  while (p < end) {
+    char *record = p;
+    SGFNode *node;
+    char name[3];
+
+    if (!read_record(&p, end, &type, &a, &b, &payload, &length))
+      break;
+    node = a < j->nnodes ? nodes[a] : NULL;
+
+    name[0] = b & 0xff;
+    name[1] = (b >> 8) & 0xff;
+    name[2] = '\0';
+
+    if (type == 'R' && a == j->nnodes && j->nnodes < maxnodes) {
+      node = arena ? sgfNewArenaNode(arena) : sgfNewNode();
+      /* The old root stays allocated, as sgftreeCreateHeaderNode()
+       * leaves it.
+       */
+      *root = node;
+      nodes[j->nnodes] = node;
+      insert_node(j, node, j->nnodes++);
+    }
+    else if (type == 'N' && node && j->nnodes < maxnodes) {
+      if (b == 0 && node->child)
+	node = sgfStartVariantFirst(node->child);
+      else
+	node = sgfAddChild(node);
+      nodes[j->nnodes] = node;
+      insert_node(j, node, j->nnodes++);
+    }
+    else if (type == 'P' && node)
+      sgfAddProperty(node, name, payload);
+    else if (type == 'S' && node) {
+      sgfOverwriteProperty(node, name, payload);
+      continue;
+    }
+    else {
+      /* A valid record which makes no sense: stop here as well. */
+      p = record;
+      break;
+    }
+    *lastnode = node;
+  }
+  free(nodes);
+
+  /* Cut off anything damaged and continue after the last good record. */
+  j->file = fopen(filename, "r+b");
+  if (!j->file) {
+    free(buffer);
+    free_journal(j);
+    return NULL;
+  }
+  if (p < end) {
+    fprintf(stderr, "%s: discarding %ld damaged bytes of the journal\n",
+	    filename, (long) (end - p));
+    fflush(j->file);
+#ifndef WIN32
+    if (ftruncate(fileno(j->file), p - buffer) != 0)
+      j->error = 1;
+#else
+    if (_chsize(_fileno(j->file), p - buffer) != 0)
+      j->error = 1;
+#endif
+  }
+  free(buffer);
+  if (j->error || fseek(j->file, 0, SEEK_END) != 0) {
+    free_journal(j);
+    return NULL;
+  }
+
+  return j;
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 2
+ * End:
+ */
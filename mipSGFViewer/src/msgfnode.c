@@ -29,9 +29,26 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <string.h>
 #include <assert.h>
+#include <setjmp.h>
+#include <limits.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* Vector versions of the delimiter search, see find_delim(). */
+#if defined(__GNUC__) && defined(__SSE2__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define SGF_DELIM_X86 1
+#include <immintrin.h>
+#endif
 
 
 #if TIME_WITH_SYS_TIME
@@ -50,6 +67,7 @@
 
 #define STRICT_SGF 's'
 #define LAX_SGF    'l'
+#define NEXT_SGF   'n'	/* lax, but end of input is no error */
 
 /* Set this to 1 if you want warnings for missing GM and FF properties. */
 #define VERBOSE_WARNINGS 0
@@ -89,6 +107,117 @@ xrealloc(void *pt, unsigned int size)
 }
 
 
+/* ================================================================ */
+/*                            SGF Arenas                            */
+/* ================================================================ */
+
+
+#define ARENA_BLOCK_SIZE  65536
+#define ARENA_ALIGN       sizeof(void *)
+
+struct SGFArenaBlock_t {
+  struct SGFArenaBlock_t *next;
+  /* The memory handed out follows, suitably aligned. */
+};
+
+#define ARENA_HEADER \
+  ((sizeof(struct SGFArenaBlock_t) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+
+/*
+ * Create an empty arena.
+ */
+
+SGFArena *
+sgf_arena_new(void)
+{
+  return xalloc(sizeof(SGFArena));
+}
+
+
+/*
+ * Allocate size bytes of zeroed memory from the arena. Requests too
+ * large to share a block get a block of their own, which is linked
+ * behind the current one so that the bump pointer is not lost.
+ */
+
+void *
+sgf_arena_alloc(SGFArena *arena, unsigned int size)
+{
+  struct SGFArenaBlock_t *block;
+  unsigned long block_size;
+  void *pt;
+
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  arena->allocations++;
+  arena->bytes += size;
+
+  if ((unsigned long) (arena->end - arena->next) < size) {
+    if (size > ARENA_BLOCK_SIZE / 4 && arena->blocks) {
+      block = xalloc(ARENA_HEADER + size);
+      block->next = arena->blocks->next;
+      arena->blocks->next = block;
+      arena->nblocks++;
+      arena->block_bytes += ARENA_HEADER + size;
+      return (char *) block + ARENA_HEADER;
+    }
+
+    block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block_size += ARENA_HEADER;
+    block = malloc(block_size);
+    if (!block) {
+      fprintf(stderr, "sgf_arena_alloc: Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->next = (char *) block + ARENA_HEADER;
+    arena->end = (char *) block + block_size;
+    arena->nblocks++;
+    arena->block_bytes += block_size;
+  }
+
+  pt = arena->next;
+  arena->next += size;
+  memset(pt, 0, size);
+  return pt;
+}
+
+
+/*
+ * Copy a string into the arena.
+ */
+
+static char *
+arena_strdup(SGFArena *arena, const char *s)
+{
+  char *copy = sgf_arena_alloc(arena, strlen(s) + 1);
+  strcpy(copy, s);
+  return copy;
+}
+
+
+/*
+ * Release the arena together with everything allocated from it.
+ */
+
+void
+sgf_arena_free(SGFArena *arena)
+{
+  struct SGFArenaBlock_t *block;
+
+  if (!arena)
+    return;
+
+  while (arena->blocks) {
+    block = arena->blocks;
+    arena->blocks = block->next;
+    free(block);
+  }
+  free(arena);
+}
+
+
 /* ================================================================ */
 /*                           SGF Nodes                              */
 /* ================================================================ */
@@ -110,19 +239,66 @@ sgfNewNode()
   return newnode;
 }
 
+
+/*
+ * Allocate a new SGF node in an arena.
+ */
+
+SGFNode *
+sgfNewArenaNode(SGFArena *arena)
+{
+  SGFNode *newnode = sgf_arena_alloc(arena, sizeof(SGFNode));
+  newnode->arena = arena;
+  return newnode;
+}
+
+
+/*
+ * Allocate a node for the same tree as node, i.e. from its arena if
+ * it has one.
+ */
+
+static SGFNode *
+new_node_like(SGFNode *node)
+{
+  if (node->arena)
+    return sgfNewArenaNode(node->arena);
+  return sgfNewNode();
+}
+
 /*
- * Recursively free an sgf node
+ * Free an sgf node with its children and its following siblings.
+ * Nodes owned by an arena are left for sgf_arena_free().
+ *
+ * This works without recursion, whatever the depth of the tree: the
+ * children of each node are spliced into the list of nodes still to
+ * be freed, in front of its siblings.
  */
 
 void
 sgfFreeNode(SGFNode *node)
 {
-  if (node == NULL)
+  SGFNode *next;
+  SGFNode *last;
+
+  if (node == NULL || node->arena)
     return;
-  sgfFreeNode(node->next);
-  sgfFreeNode(node->child);
-  sgfFreeProperty(node->props);
-  free(node);
+
+  while (node) {
+    if (node->child) {
+      for (last = node->child; last->next; last = last->next)
+	;
+      last->next = node->next;
+      node->next = node->child;
+    }
+
+    next = node->next;
+    sgfFreeProperty(node->props);
+    free(node->lazy);
+    free(node->index);
+    free(node);
+    node = next;
+  }
 }
 
 
@@ -212,8 +388,15 @@ sgfGetFloatProperty(SGFNode *node, const char *name, float *value)
 }
 
 
+/* The point set whose text is the value of prop. */
+#define POINTSET(prop) \
+  ((SGFPointSet *) ((prop)->value - offsetof(SGFPointSet, text)))
+
+
 /*
- * Read a property as text from an SGF node.
+ * Read a property as text from an SGF node. Of a point set this is
+ * its first point in the source, as it was when the set was a
+ * property per point.
  */
 
 int
@@ -224,7 +407,10 @@ sgfGetCharProperty(SGFNode *node, const char *name, char **value)
 
   for (prop = node->props; prop; prop = prop->next)
     if (prop->name == nam) {
-      *value = prop->value;
+      if (prop->flags & SGFPROP_POINTS)
+	*value = POINTSET(prop)->first;
+      else
+	*value = prop->value;
       return 1;
     }
 
@@ -250,6 +436,29 @@ sgfHasProperty(SGFNode *node, const char *name)
 }
 
 
+/*
+ * Make room for a new value of size bytes in prop of node. A borrowed
+ * value is left alone and replaced by fresh memory, from the arena of
+ * the node if there is one.
+ */
+
+static void
+sgf_resize_value(SGFNode *node, SGFProperty *prop, unsigned int size)
+{
+  if (node->arena)
+    prop->value = sgf_arena_alloc(node->arena, size);
+  else if (prop->flags & (SGFPROP_BORROWED | SGFPROP_POINTS)) {
+    if (!(prop->flags & SGFPROP_BORROWED))
+      free(POINTSET(prop));
+    prop->value = xalloc(size);
+    prop->flags &= ~SGFPROP_BORROWED;
+  }
+  else
+    prop->value = xrealloc(prop->value, size);
+  prop->flags &= ~SGFPROP_POINTS;
+}
+
+
 /*
  * Overwrite a property from an SGF node with text or create a new
  * one if it does not exist.
@@ -263,7 +472,7 @@ sgfOverwriteProperty(SGFNode *node, const char *name, const char *text)
 
   for (prop = node->props; prop; prop = prop->next)
     if (prop->name == nam) {
-      prop->value = xrealloc(prop->value, strlen(text)+1);
+      sgf_resize_value(node, prop, strlen(text)+1);
       strcpy(prop->value, text);
       return;
     }
@@ -285,7 +494,7 @@ sgfOverwritePropertyInt(SGFNode *node, const char *name, int val)
 
   for (prop = node->props; prop; prop = prop->next)
     if (prop->name == nam) {
-      prop->value = xrealloc(prop->value, 12);
+      sgf_resize_value(node, prop, 12);
       gg_snprintf(prop->value, 12, "%d", val);
       return;
    }
@@ -307,7 +516,7 @@ sgfOverwritePropertyFloat(SGFNode *node, const char *name, float val)
 
   for (prop = node->props; prop; prop = prop->next)
     if (prop->name == nam) {
-      prop->value = xrealloc(prop->value, 15);
+      sgf_resize_value(node, prop, 15);
       gg_snprintf(prop->value, 15, "%3.1f", val);
       return;
     }
@@ -326,6 +535,8 @@ sgfPrev(SGFNode *node)
   SGFNode *q;
   SGFNode *prev;
 
+  if (node->index)
+    return node->index->prev;
   if (!node->parent)
     return NULL;
 
@@ -354,24 +565,198 @@ sgfRoot(SGFNode *node)
 }
 
 
+/* ================================================================ */
+/*                         Navigation index                         */
+/* ================================================================ */
+
+/*
+ * The navigation index of a tree keeps the previous sibling, the
+ * number of children, the depth and the size of the subtree of every
+ * node, so that sgfPrev(), sgfChildCount(), sgfDepth() and
+ * sgfSubtreeSize() take constant time. It is built by sgfBuildIndex()
+ * and kept up to date by sgfAddChild(), sgfAddPlay(), sgfStartVariant()
+ * and sgfStartVariantFirst(); adding a node costs one step for each
+ * of its ancestors. Nodes linked into the tree by other means are not
+ * indexed.
+ */
+
+static SGFNodeIndex *
+new_index_like(SGFNode *node)
+{
+  if (node->arena)
+    return sgf_arena_alloc(node->arena, sizeof(SGFNodeIndex));
+  return xalloc(sizeof(SGFNodeIndex));
+}
+
+
+/*
+ * Index node, which has just been linked into the tree after prev (or
+ * as first child if prev is NULL), if its parent is indexed.
+ */
+
+static void
+index_new_node(SGFNode *node, SGFNode *prev)
+{
+  SGFNode *parent = node->parent;
+
+  if (!parent || !parent->index)
+    return;
+
+  node->index = new_index_like(node);
+  node->index->prev = prev;
+  node->index->nchildren = 0;
+  node->index->depth = parent->index->depth + 1;
+  node->index->size = 1;
+  if (node->next && node->next->index)
+    node->next->index->prev = node;
+
+  parent->index->nchildren++;
+  for (; parent; parent = parent->parent)
+    parent->index->size++;
+}
+
+
+/*
+ * Build the navigation index of all games starting at root. Lazily
+ * read variations are expanded first. Building it again brings it up
+ * to date after changes the index did not see.
+ */
+
+void
+sgfBuildIndex(SGFNode *root)
+{
+  SGFNode *node = root;
+  SGFNode *prev = NULL;
+
+  sgfExpandAll(root);
+
+  while (node) {
+    SGFNode *parent = node->parent;
+
+    if (!node->index)
+      node->index = new_index_like(node);
+    node->index->prev = parent ? prev : NULL;
+    node->index->nchildren = 0;
+    node->index->depth = parent ? parent->index->depth + 1 : 0;
+    node->index->size = 1;
+    if (parent)
+      parent->index->nchildren++;
+
+    if (node->child) {
+      prev = NULL;
+      node = node->child;
+      continue;
+    }
+
+    /* The subtree of node is complete; so are those of the ancestors
+     * without further siblings.
+     */
+    while (node->parent && !node->next) {
+      node->parent->index->size += node->index->size;
+      node = node->parent;
+    }
+    if (node->parent)
+      node->parent->index->size += node->index->size;
+    prev = node;
+    node = node->next;
+  }
+}
+
+
+/* Number of children (variations) of node. */
+
+int
+sgfChildCount(SGFNode *node)
+{
+  SGFNode *child;
+  int n = 0;
+
+  if (node->index)
+    return node->index->nchildren;
+
+  sgfExpandVariations(node);
+  for (child = node->child; child; child = child->next)
+    n++;
+  return n;
+}
+
+
+/* Number of nodes from the root of the game to node, 0 for the root. */
+
+int
+sgfDepth(SGFNode *node)
+{
+  int depth = 0;
+
+  if (node->index)
+    return node->index->depth;
+
+  for (; node->parent; node = node->parent)
+    depth++;
+  return depth;
+}
+
+
+/* Number of nodes in the subtree of node, including node itself. */
+
+unsigned long
+sgfSubtreeSize(SGFNode *node)
+{
+  SGFNode *top = node;
+  unsigned long size = 0;
+
+  if (node->index)
+    return node->index->size;
+
+  while (node) {
+    size++;
+    sgfExpandVariations(node);
+    if (node->child)
+      node = node->child;
+    else {
+      while (node != top && !node->next)
+	node = node->parent;
+      node = node == top ? NULL : node->next;
+    }
+  }
+
+  return size;
+}
+
+
 /* ================================================================ */
 /*                         SGF Properties                           */
 /* ================================================================ */
 
 
 /*
- * Make an SGF property.
+ * Make an SGF property. If borrow is set, the property points to
+ * value instead of taking a copy of it. Properties of arena nodes are
+ * allocated in the arena, and their values count as borrowed.
  */
 static SGFProperty *
 do_sgf_make_property(short sgf_name,  const char *value,
-		     SGFNode *node, SGFProperty *last)
+		     SGFNode *node, SGFProperty *last, int borrow)
 {
   SGFProperty *prop;
 
-  prop = (SGFProperty *) xalloc(sizeof(SGFProperty));
+  if (node->arena) {
+    prop = sgf_arena_alloc(node->arena, sizeof(SGFProperty));
+    prop->value = borrow ? (char *) value : arena_strdup(node->arena, value);
+    prop->flags = SGFPROP_BORROWED;
+  }
+  else {
+    prop = (SGFProperty *) xalloc(sizeof(SGFProperty));
+    if (borrow) {
+      prop->value = (char *) value;
+      prop->flags = SGFPROP_BORROWED;
+    }
+    else {
+      prop->value = xalloc(strlen(value) + 1);
+      strcpy(prop->value, value);
+    }
+  }
   prop->name = sgf_name;
-  prop->value = xalloc(strlen(value) + 1);
-  strcpy(prop->value, value);
   prop->next = NULL;
 
   if (last == NULL)
@@ -383,12 +768,10 @@ do_sgf_make_property(short sgf_name,  const char *value,
 }
 
 
-/* Make an SGF property.  In case of a property with a range it
- * expands it and makes several properties instead.
- */
-SGFProperty *
-sgfMkProperty(const char *name, const  char *value,
-	      SGFNode *node, SGFProperty *last)
+/* Properties which may have ranges of points as values. */
+
+static int
+allows_ranges(short sgf_name)
 {
   static const short properties_allowing_ranges[12] = {
     /* Board setup properties. */
@@ -405,131 +788,403 @@ sgfMkProperty(const char *name, const  char *value,
   };
 
   int k;
-  short sgf_name;
-
-  if (strlen(name) == 1)
-    sgf_name = name[0] | (short) (' ' << 8);
-  else
-    sgf_name = name[0] | name[1] << 8;
 
   for (k = 0; k < 12; k++) {
     if (properties_allowing_ranges[k] == sgf_name)
-      break;
-  }
-
-  if (k < 12
-      && strlen(value) == 5
-      && value[2] == ':') {
-    char x1 = value[0];
-    char y1 = value[1];
-    char x2 = value[3];
-    char y2 = value[4];
-    char new_value[] = "xy";
-
-    if (x1 <= x2 && y1 <= y2) {
-      for (new_value[0] = x1; new_value[0] <= x2; new_value[0]++) {
-	for (new_value[1] = y1; new_value[1] <= y2; new_value[1]++)
-	  last = do_sgf_make_property(sgf_name, new_value, node, last);
-      }
-
-      return last;
-    }
+      return 1;
   }
 
-  /* Not a range property. */
-  return do_sgf_make_property(sgf_name, value, node, last);
+  return 0;
 }
 
 
 /*
- * Recursively free an SGF property.
- *
+ * Decode a value "xy" or "xy:zw" of length len into a rectangle of
+ * points which fit in a point set. Returns 0 for anything else.
  */
-
-void
-sgfFreeProperty(SGFProperty *prop)
+static int
+point_rectangle(const char *value, int len, int *i1, int *j1, int *i2, int *j2)
 {
-  if (prop == NULL)
-    return;
-  sgfFreeProperty(prop->next);
-  free(prop->value);
-  free(prop);
-}
+  if (len != 2 && !(len == 5 && value[2] == ':'))
+    return 0;
 
+  *j1 = value[0] - 'a';
+  *i1 = value[1] - 'a';
+  *j2 = value[len - 2] - 'a';
+  *i2 = value[len - 1] - 'a';
 
-/* ================================================================ */
-/*                        High level functions                      */
-/* ================================================================ */
+  return (*i1 >= 0 && *j1 >= 0 && *i1 <= *i2 && *j1 <= *j2
+	  && *i2 < SGF_POINTSET_SIZE && *j2 < SGF_POINTSET_SIZE);
+}
 
 
+#define POINT_BIT(i, j)  ((i) * SGF_POINTSET_SIZE + (j))
+#define HAS_POINT(bits, i, j) \
+  ((bits)[POINT_BIT(i, j) / 32] & (1U << (POINT_BIT(i, j) % 32)))
+#define SET_POINT(bits, i, j) \
+  ((bits)[POINT_BIT(i, j) / 32] |= 1U << (POINT_BIT(i, j) % 32))
+#define CLEAR_POINT(bits, i, j) \
+  ((bits)[POINT_BIT(i, j) / 32] &= ~(1U << (POINT_BIT(i, j) % 32)))
+
 /*
- * Add a stone to the current or the given node.
- * Return the node where the stone was added.
+ * Add the points of value, a list of points and ranges joined by "][",
+ * to bits. Returns the number of points in value, or 0 leaving bits
+ * alone if any part of it does not fit in a point set.
  */
+static int
+add_value_points(unsigned int bits[SGF_POINTSET_WORDS], const char *value)
+{
+  const char *v;
+  int points = 0;
+  int pass;
+
+  /* Check the whole list before adding anything. */
+  for (pass = 0; pass < 2; pass++) {
+    for (v = value; ; v += 2) {
+      const char *end = strstr(v, "][");
+      int len = end ? end - v : (int) strlen(v);
+      int i1, j1, i2, j2;
+      int i, j;
+
+      if (!point_rectangle(v, len, &i1, &j1, &i2, &j2))
+	return 0;
+      if (pass == 0)
+	points += (i2 - i1 + 1) * (j2 - j1 + 1);
+      else
+	for (i = i1; i <= i2; i++)
+	  for (j = j1; j <= j2; j++)
+	    SET_POINT(bits, i, j);
+
+      if (!end)
+	break;
+      v = end;
+    }
+  }
 
-SGFNode *
-sgfAddStone(SGFNode *node, int color, int movex, int movey)
-{
-  char move[3];
-
-  sprintf(move, "%c%c", movey + 'a', movex + 'a');
-  sgfAddProperty(node, (color == BLACK) ? "AB" : "AW", move);
-
-  return node;
+  return points;
 }
 
 
 /*
- * Add a move to the gametree.
+ * Write the points of bits to text as values joined by "][", covering
+ * them greedily with rectangles: from each point not yet written, as
+ * far right as the row goes, then as far down as whole rows go. The
+ * first rectangle starts at the point "first", so that the value
+ * begins with it. text needs room for 4 bytes per point. Returns the
+ * length.
  */
-
-SGFNode *
-sgfAddPlay(SGFNode *node, int who, int movex, int movey)
+static int
+compress_points(const unsigned int bits[SGF_POINTSET_WORDS],
+		const char *first, char *text)
 {
-  char move[3];
-  SGFNode *new;
-  
-  /* a pass move? */
-  if (movex == -1 && movey == -1)
-    move[0] = 0;
-  else
-    sprintf(move, "%c%c", movey + 'a', movex + 'a');
+  unsigned int left[SGF_POINTSET_WORDS];
+  char *p = text;
+  int k;
 
-  if (node->child)
-    new = sgfStartVariantFirst(node->child);
-  else {
-    new = sgfNewNode();
-    node->child = new;
-    new->parent = node;
+  memcpy(left, bits, sizeof(left));
+  for (k = -1; k < SGF_POINTSET_SIZE * SGF_POINTSET_SIZE; k++) {
+    int i1 = k < 0 ? first[1] - 'a' : k / SGF_POINTSET_SIZE;
+    int j1 = k < 0 ? first[0] - 'a' : k % SGF_POINTSET_SIZE;
+    int i2, j2;
+    int i, j;
+
+    if (!HAS_POINT(left, i1, j1))
+      continue;
+
+    for (j2 = j1; j2 + 1 < SGF_POINTSET_SIZE && HAS_POINT(left, i1, j2 + 1);
+	 j2++)
+      ;
+    for (i2 = i1; i2 + 1 < SGF_POINTSET_SIZE; i2++) {
+      for (j = j1; j <= j2; j++)
+	if (!HAS_POINT(left, i2 + 1, j))
+	  break;
+      if (j <= j2)
+	break;
+    }
+
+    for (i = i1; i <= i2; i++)
+      for (j = j1; j <= j2; j++)
+	CLEAR_POINT(left, i, j);
+
+    if (p > text) {
+      *p++ = ']';
+      *p++ = '[';
+    }
+    *p++ = 'a' + j1;
+    *p++ = 'a' + i1;
+    if (i2 > i1 || j2 > j1) {
+      *p++ = ':';
+      *p++ = 'a' + j2;
+      *p++ = 'a' + i2;
+    }
   }
-  
-  sgfAddProperty(new, (who == BLACK) ? "B" : "W", move);
 
-  return new;
+  *p = '\0';
+  return p - text;
 }
 
 
 /*
- * Add a move to the gametree. New variations are added after the old
- * ones rather than before.
+ * Make a property of the points of bits, npoints of them, of which
+ * first came first in the source. A single point makes an ordinary
+ * property, more make a point set whose value is the compressed list
+ * of its points, starting with first.
  */
-
-SGFNode *
-sgfAddPlayLast(SGFNode *node, int who, int movex, int movey)
+static SGFProperty *
+make_point_property(short sgf_name, const unsigned int bits[SGF_POINTSET_WORDS],
+		    int npoints, const char *first,
+		    SGFNode *node, SGFProperty *last)
 {
-  char move[3];
-  SGFNode *new;
+  char text[4 * SGF_POINTSET_SIZE * SGF_POINTSET_SIZE + 1];
+  unsigned int size = compress_points(bits, first, text) + 1;
+  SGFPointSet *set;
 
-  /* a pass move? */
-  if (movex == -1 && movey == -1)
-    move[0] = 0;
+  if (npoints < 2 || strlen(text) == 2)
+    return do_sgf_make_property(sgf_name, text, node, last, 0);
+
+  size += offsetof(SGFPointSet, text);
+  if (node->arena)
+    set = sgf_arena_alloc(node->arena, size);
   else
-    sprintf(move, "%c%c", movey + 'a', movex + 'a');
+    set = xalloc(size);
+  memcpy(set->bits, bits, sizeof(set->bits));
+  set->first[0] = first[0];
+  set->first[1] = first[1];
+  set->first[2] = '\0';
+  strcpy(set->text, text);
+
+  last = do_sgf_make_property(sgf_name, set->text, node, last, 1);
+  last->flags = SGFPROP_POINTS | (node->arena ? SGFPROP_BORROWED : 0);
+  return last;
+}
 
-  new = sgfAddChild(node);
-  sgfAddProperty(new, (who == BLACK) ? "B" : "W", move);
 
-  return new;
+/* Property name as stored in SGFProperty. */
+static short
+property_name(const char *name)
+{
+  if (strlen(name) == 1)
+    return name[0] | (short) (' ' << 8);
+  else
+    return name[0] | name[1] << 8;
+}
+
+
+/* Make an SGF property. A range of points, or a list of points and
+ * ranges joined by "][", makes a point set. Other ranges are expanded
+ * into a property for each point. The expanded values are always
+ * copied, even when borrow is set.
+ */
+static SGFProperty *
+make_property(const char *name, const  char *value,
+	      SGFNode *node, SGFProperty *last, int borrow)
+{
+  short sgf_name = property_name(name);
+
+  if (allows_ranges(sgf_name)) {
+    unsigned int bits[SGF_POINTSET_WORDS];
+    int npoints;
+
+    memset(bits, 0, sizeof(bits));
+    npoints = add_value_points(bits, value);
+    if (npoints > 1)
+      return make_point_property(sgf_name, bits, npoints, value,
+				 node, last);
+
+    if (strlen(value) == 5 && value[2] == ':') {
+      char x1 = value[0];
+      char y1 = value[1];
+      char x2 = value[3];
+      char y2 = value[4];
+      char new_value[] = "xy";
+
+      if (x1 <= x2 && y1 <= y2) {
+	for (new_value[0] = x1; new_value[0] <= x2; new_value[0]++) {
+	  for (new_value[1] = y1; new_value[1] <= y2; new_value[1]++)
+	    last = do_sgf_make_property(sgf_name, new_value, node, last, 0);
+	}
+
+	return last;
+      }
+    }
+  }
+
+  /* Not a range property. */
+  return do_sgf_make_property(sgf_name, value, node, last, borrow);
+}
+
+
+SGFProperty *
+sgfMkProperty(const char *name, const  char *value,
+	      SGFNode *node, SGFProperty *last)
+{
+  return make_property(name, value, node, last, 0);
+}
+
+
+/*
+ * Visit the points of a property: set *k to 0, then each call stores
+ * the next point in (*i, *j), in GNU Go co-ordinates as for
+ * get_moveXY(), and returns 1 until there are no more. Points outside
+ * the board, and passes, are skipped.
+ */
+
+int
+sgfNextPoint(SGFProperty *prop, int *k, int *i, int *j, int boardsize)
+{
+  const int end = SGF_POINTSET_SIZE * SGF_POINTSET_SIZE;
+
+  if (!(prop->flags & SGFPROP_POINTS)) {
+    if (*k > 0)
+      return 0;
+    *k = end;
+    return (get_moveXY(prop, i, j, boardsize) && *i >= 0 && *j >= 0);
+  }
+
+  for (; *k < end; (*k)++) {
+    const SGFPointSet *set = POINTSET(prop);
+    int bit = *k;
+
+    if (set->bits[bit / 32] == 0) {
+      *k = (bit / 32 + 1) * 32 - 1;
+      continue;
+    }
+    if ((set->bits[bit / 32] & (1U << (bit % 32)))
+	&& bit / SGF_POINTSET_SIZE < boardsize
+	&& bit % SGF_POINTSET_SIZE < boardsize) {
+      *i = bit / SGF_POINTSET_SIZE;
+      *j = bit % SGF_POINTSET_SIZE;
+      (*k)++;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/* The number of points of a property, 0 or 1 unless it is a set. */
+
+int
+sgfPointCount(SGFProperty *prop)
+{
+  const SGFPointSet *set;
+  int count = 0;
+  int k;
+
+  if (!(prop->flags & SGFPROP_POINTS)) {
+    int i, j;
+    k = 0;
+    return sgfNextPoint(prop, &k, &i, &j, SGF_POINTSET_SIZE);
+  }
+
+  set = POINTSET(prop);
+  for (k = 0; k < SGF_POINTSET_WORDS; k++) {
+    unsigned int bits = set->bits[k];
+    for (; bits; bits &= bits - 1)
+      count++;
+  }
+
+  return count;
+}
+
+
+/*
+ * Free an SGF property and the ones following it.
+ */
+
+void
+sgfFreeProperty(SGFProperty *prop)
+{
+  SGFProperty *next;
+
+  for (; prop; prop = next) {
+    next = prop->next;
+    if (!(prop->flags & SGFPROP_BORROWED)) {
+      if (prop->flags & SGFPROP_POINTS)
+	free(POINTSET(prop));
+      else
+	free(prop->value);
+    }
+    free(prop);
+  }
+}
+
+
+/* ================================================================ */
+/*                        High level functions                      */
+/* ================================================================ */
+
+
+/*
+ * Add a stone to the current or the given node.
+ * Return the node where the stone was added.
+ */
+
+SGFNode *
+sgfAddStone(SGFNode *node, int color, int movex, int movey)
+{
+  char move[3];
+
+  sprintf(move, "%c%c", movey + 'a', movex + 'a');
+  sgfAddProperty(node, (color == BLACK) ? "AB" : "AW", move);
+
+  return node;
+}
+
+
+/*
+ * Add a move to the gametree.
+ */
+
+SGFNode *
+sgfAddPlay(SGFNode *node, int who, int movex, int movey)
+{
+  char move[3];
+  SGFNode *new;
+  
+  /* a pass move? */
+  if (movex == -1 && movey == -1)
+    move[0] = 0;
+  else
+    sprintf(move, "%c%c", movey + 'a', movex + 'a');
+
+  if (node->child)
+    new = sgfStartVariantFirst(node->child);
+  else {
+    new = new_node_like(node);
+    node->child = new;
+    new->parent = node;
+    index_new_node(new, NULL);
+  }
+  
+  sgfAddProperty(new, (who == BLACK) ? "B" : "W", move);
+
+  return new;
+}
+
+
+/*
+ * Add a move to the gametree. New variations are added after the old
+ * ones rather than before.
+ */
+
+SGFNode *
+sgfAddPlayLast(SGFNode *node, int who, int movex, int movey)
+{
+  char move[3];
+  SGFNode *new;
+
+  /* a pass move? */
+  if (movex == -1 && movey == -1)
+    move[0] = 0;
+  else
+    sprintf(move, "%c%c", movey + 'a', movex + 'a');
+
+  new = sgfAddChild(node);
+  sgfAddProperty(new, (who == BLACK) ? "B" : "W", move);
+
+  return new;
 }
 
 
@@ -710,10 +1365,12 @@ sgfStartVariant(SGFNode *node)
   assert(node);
   assert(node->parent);
 
+  sgfExpandVariations(node->parent);
   while (node->next)
     node = node->next;
-  node->next = sgfNewNode();
+  node->next = new_node_like(node);
   node->next->parent = node->parent;
+  index_new_node(node->next, node);
 
   return node->next;
 }
@@ -727,15 +1384,17 @@ SGFNode *
 sgfStartVariantFirst(SGFNode *node)
 {
   SGFNode *old_first_child = node;
-  SGFNode *new_first_child = sgfNewNode();
+  SGFNode *new_first_child;
 
   assert(node);
+  new_first_child = new_node_like(node);
   assert(node->parent);
 
   new_first_child->next = old_first_child;
   new_first_child->parent = old_first_child->parent;
 
   new_first_child->parent->child = new_first_child;
+  index_new_node(new_first_child, NULL);
 
   return new_first_child;
 }
@@ -749,18 +1408,24 @@ sgfStartVariantFirst(SGFNode *node)
 SGFNode *
 sgfAddChild(SGFNode *node)
 {
-  SGFNode *new_node = sgfNewNode();
+  SGFNode *new_node;
   assert(node);
 
+  new_node = new_node_like(node);
+
   new_node->parent = node;
   
-  if (!node->child)
+  if (!node->child) {
     node->child = new_node;
+    index_new_node(new_node, NULL);
+  }
   else {
+    sgfExpandVariations(node);
     node = node->child;
     while (node->next)
       node = node->next;
     node->next = new_node;
+    index_new_node(new_node, node);
   }
 
   return new_node;
@@ -876,31 +1541,37 @@ sgf_write_header(SGFNode *root, int overwrite, int seed, float komi,
  *   2) The only recursion is on gametree.
  *   3) Tokens are only one character
  * 
- * We will use a global state to keep track of the remaining input
- * and a global char variable, `lookahead' to hold the next token.  
+ * All parser state lives in an SGFParser context which keeps track
+ * of the remaining input and holds the next token in `lookahead'.
  * The function `nexttoken' skips whitespace and fills lookahead with 
- * the new token.
+ * the new token. Each reader uses its own context, so that several
+ * files can be parsed at the same time on different threads.
+ *
+ * The input is either a stdio stream or a memory buffer. For
+ * readsgffile_mmap() the buffer is a writable private mapping of the
+ * whole file, and property values are unescaped and terminated in
+ * place so that the tree can borrow them without any copying.
+ *
+ * Syntax errors do not return through the recursive descent; instead
+ * parse_error() records the error in the context and longjmp()s back
+ * to the reader entry point.
  */
 
 
-static void parse_error(const char *msg, int arg);
-static void nexttoken(void);
-static void match(int expected);
-
-
-static FILE *sgffile;
+static void parse_error(SGFParser *ctx, const char *msg, int arg);
+static void nexttoken(SGFParser *ctx);
+static void match(SGFParser *ctx, int expected);
+static void skip_gametree(SGFParser *ctx);
+static void skip_variations(SGFParser *ctx, SGFNode *node);
 
 
-#define sgf_getch() (getc(sgffile))
-
-
-static char *sgferr;
-#ifdef TEST_SGFPARSER
-static int sgferrarg;
-#endif
-static int sgferrpos;
+static int file_fill(SGFParser *ctx);
 
-static int lookahead;
+#define sgf_getch(ctx) \
+  ((ctx)->bufp ? ((ctx)->bufp < (ctx)->bufend \
+		  ? (int) (unsigned char) *(ctx)->bufp++ : EOF) \
+   : ((ctx)->filepos++, (ctx)->zin->next < (ctx)->zin->end \
+      ? (int) *(ctx)->zin->next++ : file_fill(ctx)))
 
 
 /* ---------------------------------------------------------------- */
@@ -908,260 +1579,1536 @@ static int lookahead;
 /* ---------------------------------------------------------------- */
 
 
+/*
+ * Number of input bytes consumed so far.
+ */
+
+static long
+parse_position(SGFParser *ctx)
+{
+  if (ctx->bufp)
+    return ctx->bufp - ctx->buf;
+  return ctx->filepos;
+}
+
+
 static void
-parse_error(const char *msg, int arg)
+parse_error(SGFParser *ctx, const char *msg, int arg)
+{
+  ctx->error = SGF_PARSE_ERROR;
+  ctx->errmsg = msg;
+  ctx->errarg = arg;
+  ctx->errpos = parse_position(ctx);
+  longjmp(ctx->env, 1);
+}
+
+
+/*
+ * File input: refill the buffer of the decoder. Damaged compressed
+ * input is a parse error rather than an early end of the file.
+ */
+
+static int
+file_fill(SGFParser *ctx)
 {
-  fprintf(stderr, msg, arg);
-  fprintf(stderr, "\n");
-  exit(EXIT_FAILURE);
+  int c = sgfz_fill(ctx->zin);
+
+  if (ctx->zin->error)
+    parse_error(ctx, "Corrupt compressed input.", 0);
+  return c;
 }
 
 
 static void
-nexttoken()
+nexttoken(SGFParser *ctx)
 {
   do
-    lookahead = sgf_getch();
-  while (isspace(lookahead));
+    ctx->lookahead = sgf_getch(ctx);
+  while (isspace(ctx->lookahead));
 }
 
 
 static void
-match(int expected)
+match(SGFParser *ctx, int expected)
 {
-  if (lookahead != expected)
-    parse_error("expected: %c", expected);
+  if (ctx->lookahead != expected)
+    parse_error(ctx, "expected: %c", expected);
   else
-    nexttoken();
+    nexttoken(ctx);
 }
 
 /* ---------------------------------------------------------------- */
-/*                        The parser proper                         */
+/*                         Delimiter search                         */
 /* ---------------------------------------------------------------- */
 
+/*
+ * Inside a property value only ']' and '\\' need attention; for
+ * memory input the bytes in between are found with find_delim(), which
+ * returns the first of them in [p, end), or end. On x86 this compares
+ * 16 (SSE2) or 32 (AVX2) bytes at a time; the best version the CPU
+ * supports is picked on the first call.
+ */
 
-static void
-propident(char *buffer, int size)
+static const char *
+find_delim_scalar(const char *p, const char *end)
 {
-  if (lookahead == EOF || !isupper(lookahead)) 
-    parse_error("Expected an upper case letter.", 0);
-  
-  while (lookahead != EOF && isalpha(lookahead)) {
-    if (isupper(lookahead) && size > 1) {
-      *buffer++ = lookahead;
-      size--;
-    }
-    nexttoken();
-  }
-  *buffer = '\0';
+  while (p < end && *p != ']' && *p != '\\')
+    p++;
+  return p;
 }
 
+#if SGF_DELIM_X86
 
-static void
-propvalue(char *buffer, int size)
+static const char *
+find_delim_sse2(const char *p, const char *end)
 {
-  char *p = buffer;
+  const __m128i close = _mm_set1_epi8(']');
+  const __m128i escape = _mm_set1_epi8('\\');
 
-  match('[');
-  while (lookahead != ']' && lookahead != EOF) {
-    if (lookahead == '\\') {
-      lookahead = sgf_getch();
-      /* Follow the FF4 definition of backslash */
-      if (lookahead == '\r') {
-	lookahead = sgf_getch();
-	if (lookahead == '\n') 
-	  lookahead = sgf_getch();
-      }
-      else if (lookahead == '\n') {
-	lookahead = sgf_getch();
-	if (lookahead == '\r') 
-	  lookahead = sgf_getch();
-      }
-    }
-    if (size > 1) {
-      *p++ = lookahead;
-      size--;
-    }
-    lookahead = sgf_getch();
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, close),
+					      _mm_cmpeq_epi8(v, escape)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
   }
-  match(']');
-  
-  /* Remove trailing whitespace. The double cast below is needed
-   * because "char" may be represented as a signed char, in which case
-   * characters between 128 and 255 would be negative and a direct
-   * cast to int would cause a negative value to be passed to isspace,
-   * possibly causing an assertion failure.
-   */
-  --p;
-  while (p > buffer && isspace((int) (unsigned char) *p))
-    --p;
-  *++p = '\0';
-}
 
+  return find_delim_scalar(p, end);
+}
 
-static SGFProperty *
-property(SGFNode *n, SGFProperty *last)
+__attribute__((target("avx2")))
+static const char *
+find_delim_avx2(const char *p, const char *end)
 {
-  char name[3];
-  char buffer[4000];
+  const __m256i close = _mm256_set1_epi8(']');
+  const __m256i escape = _mm256_set1_epi8('\\');
 
-  propident(name, sizeof(name));
-  do {
-    propvalue(buffer, sizeof(buffer));
-    last = sgfMkProperty(name, buffer, n, last);
-  } while (lookahead == '[');
-  return last;
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    unsigned int mask = _mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, close),
+		      _mm256_cmpeq_epi8(v, escape)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+
+  return find_delim_scalar(p, end);
 }
 
+#endif /* SGF_DELIM_X86 */
 
-static void
-node(SGFNode *n)
-{
-  SGFProperty *last = NULL;
-  match(';');
-  while (lookahead != EOF && isupper(lookahead))
-    last = property(n, last);
-}
 
+static const char *find_delim_init(const char *p, const char *end);
 
-static SGFNode *
-sequence(SGFNode *n)
-{
-  node(n);
-  while (lookahead == ';') {
-    SGFNode *new = sgfNewNode();
-    new->parent = n;
-    n->child = new;
-    n = new;
-    node(n);
+static const char *(*find_delim)(const char *p, const char *end)
+  = find_delim_init;
+static int delim_impl = -1;
+
+
+static int
+delim_impl_supported(int impl)
+{
+  switch (impl) {
+  case SGF_DELIM_SCALAR:
+    return 1;
+#if SGF_DELIM_X86
+  case SGF_DELIM_SSE2:
+    return 1;
+  case SGF_DELIM_AVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return 0;
   }
-  return n;
 }
 
 
-static void
-gametree(SGFNode **p, SGFNode *parent, int mode) 
+/*
+ * Choose the implementation of the delimiter search, one of the
+ * SGF_DELIM_* values. Returns 0 if the CPU or the compiler does not
+ * support it. This is only meant for testing and benchmarking; the
+ * fastest one is used by default.
+ */
+
+int
+sgf_set_delim_impl(int impl)
 {
-  if (mode == STRICT_SGF)
-    match('(');
+  if (!delim_impl_supported(impl))
+    return 0;
+
+  delim_impl = impl;
+#if SGF_DELIM_X86
+  if (impl == SGF_DELIM_AVX2)
+    find_delim = find_delim_avx2;
+  else if (impl == SGF_DELIM_SSE2)
+    find_delim = find_delim_sse2;
   else
-    for (;;) {
-      if (lookahead == EOF) {
-	parse_error("Empty file?", 0);
-	break;
-      }
-      if (lookahead == '(') {
-	while (lookahead == '(')
-	  nexttoken();
-	if (lookahead == ';')
-	  break;
-      }
-      nexttoken();
-    }
+#endif
+    find_delim = find_delim_scalar;
 
-  /* The head is parsed */
-  {
-    SGFNode *head = sgfNewNode();
-    SGFNode *last;
+  return 1;
+}
 
-    head->parent = parent;
-    *p = head;
 
-    last = sequence(head);
-    p = &last->child;
-    while (lookahead == '(') {
-      gametree(p, last, STRICT_SGF);
-      p = &((*p)->next);
-    }
-    if (mode == STRICT_SGF)
-      match(')');
-  }
+/* The implementation in use, or the one which will be picked. */
+
+int
+sgf_delim_impl(void)
+{
+  int impl;
+
+  if (delim_impl >= 0)
+    return delim_impl;
+
+  for (impl = SGF_DELIM_AVX2; impl > SGF_DELIM_SCALAR; impl--)
+    if (delim_impl_supported(impl))
+      break;
+  return impl;
 }
 
 
-/*
- * Fuseki readers
- * Reads an SGF file for extract_fuseki in a compact way
+/* Initial value of find_delim. Several threads may get here at once,
+ * but they all make the same choice.
  */
 
-static void
-gametreefuseki(SGFNode **p, SGFNode *parent, int mode, 
-	       int moves_per_game, int i)
+static const char *
+find_delim_init(const char *p, const char *end)
 {
-  if (mode == STRICT_SGF)
-    match('(');
-  else
-    for (;;) {
-      if (lookahead == EOF) {
-	parse_error("Empty file?", 0);
-	break;
-      }
-      if (lookahead == '(') {
-	while (lookahead == '(')
-	  nexttoken();
-	if (lookahead == ';')
+  sgf_set_delim_impl(sgf_delim_impl());
+  return find_delim(p, end);
+}
+
+
+/*
+ * Most values (moves, setup points, short numbers) end within a few
+ * bytes, where a plain loop beats setting up the vector search. Only
+ * longer values are handed to find_delim().
+ */
+
+#define DELIM_PREFIX 16
+
+static const char *
+next_delim(const char *p, const char *end)
+{
+  const char *stop = end - p > DELIM_PREFIX ? p + DELIM_PREFIX : end;
+
+  while (p < stop && *p != ']' && *p != '\\')
+    p++;
+  if (p < stop || p == end)
+    return p;
+  return find_delim(p, end);
+}
+
+
+/*
+ * Memory input: get the character following a backslash at *pp,
+ * advancing *pp past it. Following the FF4 definition of backslash, a
+ * line break (CR, LF, CRLF or LFCR) after it is removed and the next
+ * character is taken literally. Returns EOF at the end of the input.
+ */
+
+#define mem_getch(p, end) ((p) < (end) ? (int) (unsigned char) *(p)++ : EOF)
+
+static int
+escaped_char(const char **pp, const char *end)
+{
+  const char *p = *pp;
+  int c = mem_getch(p, end);
+
+  if (c == '\r') {
+    c = mem_getch(p, end);
+    if (c == '\n')
+      c = mem_getch(p, end);
+  }
+  else if (c == '\n') {
+    c = mem_getch(p, end);
+    if (c == '\r')
+      c = mem_getch(p, end);
+  }
+
+  *pp = p;
+  return c;
+}
+
+
+/*
+ * Memory input: unescape the rest of a property value, whose first
+ * character is in lookahead, into dest. Only the first size - 1
+ * characters are stored, like propvalue() does. dest may be the value
+ * itself for unescaping in place. Afterwards lookahead is the closing
+ * ']', or EOF if there is none. Returns the number of characters
+ * stored.
+ */
+
+static long
+unescape_value(SGFParser *ctx, char *dest, long size)
+{
+  const char *src = ctx->bufp - 1;  /* where lookahead came from */
+  const char *end = ctx->bufend;
+  long n = 0;
+  int c;
+
+  if (ctx->lookahead == EOF)
+    return 0;
+
+  for (;;) {
+    const char *q = next_delim(src, end);
+    long len = q - src;
+
+    if (len > size - 1 - n)
+      len = size - 1 - n;
+    if (len > 0 && dest + n != src)
+      memmove(dest + n, src, len);
+    n += len;
+    src = q;
+
+    if (src == end) {
+      c = EOF;
+      break;
+    }
+    if (*src == ']') {
+      c = ']';
+      src++;
+      break;
+    }
+
+    src++;
+    c = escaped_char(&src, end);
+    if (c == EOF)
+      break;
+    if (n < size - 1)
+      dest[n++] = c;
+  }
+
+  ctx->bufp = (char *) src;
+  ctx->lookahead = c;
+  return n;
+}
+
+
+/* ---------------------------------------------------------------- */
+/*                        The parser proper                         */
+/* ---------------------------------------------------------------- */
+
+
+static void
+propident(SGFParser *ctx, char *buffer, int size)
+{
+  if (ctx->lookahead == EOF || !isupper(ctx->lookahead)) 
+    parse_error(ctx, "Expected an upper case letter.", 0);
+  
+  while (ctx->lookahead != EOF && isalpha(ctx->lookahead)) {
+    if (isupper(ctx->lookahead) && size > 1) {
+      *buffer++ = ctx->lookahead;
+      size--;
+    }
+    nexttoken(ctx);
+  }
+  *buffer = '\0';
+}
+
+
+static void
+propvalue(SGFParser *ctx, char *buffer, int size)
+{
+  char *p = buffer;
+
+  match(ctx, '[');
+  /* Memory input is done in bulk and leaves nothing for the loop. */
+  if (ctx->bufp)
+    p += unescape_value(ctx, buffer, size);
+  while (ctx->lookahead != ']' && ctx->lookahead != EOF) {
+    if (ctx->lookahead == '\\') {
+      ctx->lookahead = sgf_getch(ctx);
+      /* Follow the FF4 definition of backslash */
+      if (ctx->lookahead == '\r') {
+	ctx->lookahead = sgf_getch(ctx);
+	if (ctx->lookahead == '\n') 
+	  ctx->lookahead = sgf_getch(ctx);
+      }
+      else if (ctx->lookahead == '\n') {
+	ctx->lookahead = sgf_getch(ctx);
+	if (ctx->lookahead == '\r') 
+	  ctx->lookahead = sgf_getch(ctx);
+      }
+    }
+    if (size > 1) {
+      *p++ = ctx->lookahead;
+      size--;
+    }
+    ctx->lookahead = sgf_getch(ctx);
+  }
+  match(ctx, ']');
+  
+  /* Remove trailing whitespace. The double cast below is needed
+   * because "char" may be represented as a signed char, in which case
+   * characters between 128 and 255 would be negative and a direct
+   * cast to int would cause a negative value to be passed to isspace,
+   * possibly causing an assertion failure.
+   */
+  --p;
+  while (p > buffer && isspace((int) (unsigned char) *p))
+    --p;
+  *++p = '\0';
+}
+
+
+/* Same as propvalue() for writable memory input, but the value is
+ * unescaped in place and returned. This is safe since the write
+ * position never gets ahead of the read position, and the terminating
+ * '\0' at most overwrites the closing ']'. There is no length limit.
+ */
+
+static char *
+propvalue_inplace(SGFParser *ctx)
+{
+  char *buffer;
+  char *p;
+
+  match(ctx, '[');
+  buffer = ctx->bufp - 1;  /* where lookahead came from */
+  p = buffer + unescape_value(ctx, buffer, LONG_MAX);
+  match(ctx, ']');
+
+  /* Remove trailing whitespace, see propvalue(). */
+  --p;
+  while (p > buffer && isspace((int) (unsigned char) *p))
+    --p;
+  *++p = '\0';
+
+  return buffer;
+}
+
+
+static SGFProperty *
+property(SGFParser *ctx, SGFNode *n, SGFProperty *last)
+{
+  char name[3];
+  char buffer[4000];
+  unsigned int points[SGF_POINTSET_WORDS];
+  char first[3];
+  int npoints = 0;
+  int ranges;
+
+  propident(ctx, name, sizeof(name));
+  ranges = allows_ranges(property_name(name));
+  if (ranges)
+    memset(points, 0, sizeof(points));
+
+  do {
+    char *value;
+
+    if (ctx->inplace)
+      value = propvalue_inplace(ctx);
+    else {
+      propvalue(ctx, buffer, sizeof(buffer));
+      value = buffer;
+    }
+
+    /* The points of a setup or markup property are collected into a
+     * single point set.
+     */
+    if (ranges) {
+      int added = add_value_points(points, value);
+      if (added > 0) {
+	if (npoints == 0) {
+	  first[0] = value[0];
+	  first[1] = value[1];
+	}
+	npoints += added;
+	continue;
+      }
+    }
+    last = make_property(name, value, n, last, ctx->inplace);
+  } while (ctx->lookahead == '[');
+
+  if (npoints > 0)
+    last = make_point_property(property_name(name), points, npoints, first,
+			       n, last);
+  return last;
+}
+
+
+static void
+node(SGFParser *ctx, SGFNode *n)
+{
+  SGFProperty *last = NULL;
+  match(ctx, ';');
+  while (ctx->lookahead != EOF && isupper(ctx->lookahead))
+    last = property(ctx, n, last);
+}
+
+
+static SGFNode *
+sequence(SGFParser *ctx, SGFNode *n)
+{
+  node(ctx, n);
+  while (ctx->lookahead == ';') {
+    SGFNode *new = new_node_like(n);
+    new->parent = n;
+    n->child = new;
+    n = new;
+    node(ctx, n);
+  }
+  return n;
+}
+
+
+/*
+ * Skip to the first "(;" in lax mode, or match the "(" in strict
+ * mode. Returns 0 if the input ends before the next game of a
+ * collection (NEXT_SGF mode).
+ */
+
+static int
+gametree_start(SGFParser *ctx, int mode)
+{
+  if (mode == STRICT_SGF)
+    match(ctx, '(');
+  else
+    for (;;) {
+      if (ctx->lookahead == EOF) {
+	if (mode == NEXT_SGF)
+	  return 0;
+	parse_error(ctx, "Empty file?", 0);
+	break;
+      }
+      if (ctx->lookahead == '(') {
+	while (ctx->lookahead == '(')
+	  nexttoken(ctx);
+	if (ctx->lookahead == ';')
+	  break;
+      }
+      nexttoken(ctx);
+    }
+
+  return 1;
+}
+
+
+/*
+ * Parse a game tree into *p, with parent as the parent of its head.
+ *
+ * Nested variations are handled with an explicit stack in ctx instead
+ * of recursion, so the depth of the input is only limited by memory.
+ * The stack holds the heads of the enclosing variations; head is the
+ * current one, last the end of its sequence and prev the variation
+ * below last which has just been parsed, if any.
+ */
+
+static void
+gametree(SGFParser *ctx, SGFNode **p, SGFNode *parent, int mode) 
+{
+  SGFNode *head;
+  SGFNode *last;
+  SGFNode *prev = NULL;
+  int depth = 0;
+
+  if (!gametree_start(ctx, mode))
+    return;
+
+  head = ctx->arena ? sgfNewArenaNode(ctx->arena) : sgfNewNode();
+  head->parent = parent;
+  *p = head;
+  last = sequence(ctx, head);
+
+  for (;;) {
+    if (ctx->lookahead == '(' && prev && ctx->lazy && ctx->bufp)
+      skip_variations(ctx, last);
+
+    if (ctx->lookahead == '(') {
+      match(ctx, '(');
+      if (depth == ctx->stacksize) {
+	ctx->stacksize = ctx->stacksize ? 2 * ctx->stacksize : 64;
+	ctx->stack = xrealloc(ctx->stack,
+			      ctx->stacksize * sizeof(SGFNode *));
+      }
+      ctx->stack[depth++] = head;
+
+      head = new_node_like(last);
+      head->parent = last;
+      if (prev)
+	prev->next = head;
+      else
+	last->child = head;
+      prev = NULL;
+      last = sequence(ctx, head);
+      continue;
+    }
+
+    if (depth == 0)
+      break;
+
+    match(ctx, ')');
+    prev = head;
+    last = head->parent;
+    head = ctx->stack[--depth];
+  }
+
+  if (mode == STRICT_SGF)
+    match(ctx, ')');
+}
+
+
+/*
+ * Fuseki readers
+ * Reads an SGF file for extract_fuseki in a compact way
+ */
+
+static void
+gametreefuseki(SGFParser *ctx, SGFNode **p, SGFNode *parent, int mode, 
+	       int moves_per_game, int i)
+{
+  gametree_start(ctx, mode);
+  
+  /* The head is parsed */
+  {
+
+    SGFNode *head = ctx->arena ? sgfNewArenaNode(ctx->arena) : sgfNewNode();
+    SGFNode *last;
+    head->parent = parent;
+    *p = head;
+    
+    last = sequence(ctx, head);
+    p = &last->child;
+    while (ctx->lookahead == '(') {
+      if (last->props 
+	  && (last->props->name == SGFB || last->props->name == SGFW))
+	i++;
+      /* break after number_of_moves moves in SGF file */
+      if (i >= moves_per_game) { 
+	last->child = NULL;
+	last->next = NULL;
+	break;
+      }
+      else {
+	gametreefuseki(ctx, p, last, mode, moves_per_game, i);
+	p = &((*p)->next);
+      }
+    }
+    if (mode == STRICT_SGF)
+      match(ctx, ')');
+  }
+}
+
+
+/*
+ * A collection is a sequence of game trees. The roots of the games
+ * are chained through their next pointers. Game trees are read in lax
+ * mode, so stray closing parentheses between them are skipped.
+ * Anything after the last game which does not start with '(' is
+ * ignored.
+ */
+
+static void
+collection(SGFParser *ctx, SGFNode **p)
+{
+  gametree(ctx, p, NULL, LAX_SGF);
+  for (;;) {
+    p = &((*p)->next);
+    while (ctx->lookahead == ')')
+      nexttoken(ctx);
+    if (ctx->lookahead != '(')
+      break;
+    gametree(ctx, p, NULL, NEXT_SGF);
+    if (!*p)
+      break;
+  }
+}
+
+
+/* ---------------------------------------------------------------- */
+/*                        Event scanner                             */
+/* ---------------------------------------------------------------- */
+
+/*
+ * The scanner walks the same grammar as gametree(), sequence() and
+ * node() but builds no tree. Instead it reports what it sees through
+ * the callbacks in an SGFEvents table. Values are handed out as
+ * borrowed slices, valid only during the callback: straight from
+ * memory input when the value has no escapes, otherwise from a
+ * scratch buffer in the context which is reused for every value.
+ */
+
+
+/*
+ * Skip a property value whose '[' has already been consumed, up to
+ * and including the closing ']'. Escapes are treated exactly as in
+ * propvalue() so that both agree on where a value ends.
+ */
+
+static void
+skip_value(SGFParser *ctx)
+{
+  int c;
+
+  /* Memory input: jump from one ']' or '\\' to the next. */
+  if (ctx->bufp) {
+    const char *p = ctx->bufp;
+
+    for (;;) {
+      p = next_delim(p, ctx->bufend);
+      if (p < ctx->bufend && *p == ']') {
+	ctx->bufp = (char *) p + 1;
+	return;
+      }
+      if (p == ctx->bufend || (p++, escaped_char(&p, ctx->bufend) == EOF)) {
+	ctx->bufp = ctx->bufend;
+	parse_error(ctx, "expected: %c", ']');
+      }
+    }
+  }
+
+  for (;;) {
+    c = sgf_getch(ctx);
+    if (c == '\\') {
+      c = sgf_getch(ctx);
+      if (c == '\r') {
+	c = sgf_getch(ctx);
+	if (c == '\n')
+	  c = sgf_getch(ctx);
+      }
+      else if (c == '\n') {
+	c = sgf_getch(ctx);
+	if (c == '\r')
+	  c = sgf_getch(ctx);
+      }
+    }
+    else if (c == ']')
+      return;
+    if (c == EOF)
+      parse_error(ctx, "expected: %c", ']');
+  }
+}
+
+
+/*
+ * Skip the rest of the current game tree, including all its
+ * variations and the closing ')'. Afterwards lookahead holds the
+ * token following the ')'.
+ */
+
+static void
+skip_gametree(SGFParser *ctx)
+{
+  int depth = 1;
+
+  for (;;) {
+    if (ctx->lookahead == EOF)
+      parse_error(ctx, "expected: %c", ')');
+    if (ctx->lookahead == '[')
+      skip_value(ctx);
+    else if (ctx->lookahead == '(')
+      depth++;
+    else if (ctx->lookahead == ')' && --depth == 0)
+      break;
+    ctx->lookahead = sgf_getch(ctx);
+  }
+  nexttoken(ctx);
+}
+
+
+/*
+ * Lazy mode: skip the remaining variations of node, which start at
+ * the '(' in lookahead, and remember where their text is. Memory input
+ * only.
+ */
+
+struct SGFLazy_t {
+  char *start;		/* the '(' of the first unparsed variation */
+  unsigned long length;
+  int inplace;		/* unescape in place, as the rest of the tree */
+};
+
+static void
+skip_variations(SGFParser *ctx, SGFNode *node)
+{
+  char *start = ctx->bufp - 1;  /* where lookahead came from */
+  char *end;
+
+  while (ctx->lookahead == '(') {
+    nexttoken(ctx);
+    skip_gametree(ctx);
+  }
+  end = ctx->lookahead == EOF ? ctx->bufend : ctx->bufp - 1;
+
+  if (node->arena)
+    node->lazy = sgf_arena_alloc(node->arena, sizeof(struct SGFLazy_t));
+  else
+    node->lazy = xalloc(sizeof(struct SGFLazy_t));
+  node->lazy->start = start;
+  node->lazy->length = end - start;
+  node->lazy->inplace = ctx->inplace;
+}
+
+
+/*
+ * Read a property value into ctx->scratch, growing it as needed. The
+ * '[' has already been matched. Returns the length of the value.
+ */
+
+static int
+propvalue_scratch(SGFParser *ctx)
+{
+  int n = 0;
+
+  while (ctx->lookahead != ']' && ctx->lookahead != EOF) {
+    if (ctx->lookahead == '\\') {
+      ctx->lookahead = sgf_getch(ctx);
+      /* Follow the FF4 definition of backslash */
+      if (ctx->lookahead == '\r') {
+	ctx->lookahead = sgf_getch(ctx);
+	if (ctx->lookahead == '\n') 
+	  ctx->lookahead = sgf_getch(ctx);
+      }
+      else if (ctx->lookahead == '\n') {
+	ctx->lookahead = sgf_getch(ctx);
+	if (ctx->lookahead == '\r') 
+	  ctx->lookahead = sgf_getch(ctx);
+      }
+    }
+    if (n + 1 >= ctx->scratchsize) {
+      ctx->scratchsize = ctx->scratchsize ? 2 * ctx->scratchsize : 256;
+      ctx->scratch = xrealloc(ctx->scratch, ctx->scratchsize);
+    }
+    ctx->scratch[n++] = ctx->lookahead;
+    ctx->lookahead = sgf_getch(ctx);
+  }
+  match(ctx, ']');
+
+  /* Remove trailing whitespace, see propvalue(). */
+  while (n > 1 && isspace((int) (unsigned char) ctx->scratch[n-1]))
+    n--;
+  if (ctx->scratch)
+    ctx->scratch[n] = '\0';
+
+  return n;
+}
+
+
+/*
+ * Scan one property value and return a slice of it in *value and
+ * *length.
+ */
+
+static void
+scan_propvalue(SGFParser *ctx, const char **value, int *length)
+{
+  match(ctx, '[');
+
+  if (ctx->bufp && ctx->lookahead != EOF) {
+    char *start = ctx->bufp - 1;  /* where lookahead came from */
+    char *end = (char *) next_delim(start, ctx->bufend);
+
+    if (end < ctx->bufend && *end == ']') {
+      int n = end - start;
+      while (n > 1 && isspace((int) (unsigned char) start[n-1]))
+	n--;
+      *value = start;
+      *length = n;
+      ctx->bufp = end + 1;
+      nexttoken(ctx);
+      return;
+    }
+  }
+
+  *length = propvalue_scratch(ctx);
+  *value = ctx->scratch ? ctx->scratch : "";
+}
+
+
+/*
+ * Deliver an event. Returns the callback's verdict, or
+ * SGF_SCAN_CONTINUE for events nobody listens to. SGF_SCAN_STOP ends
+ * the scan right away.
+ */
+
+static int
+scan_event(SGFParser *ctx, int action)
+{
+  if (action == SGF_SCAN_STOP)
+    longjmp(ctx->env, 2);
+  return action;
+}
+
+
+static int
+scan_property(SGFParser *ctx, const SGFEvents *events, void *data)
+{
+  char name[3];
+  short sgf_name;
+  const char *value;
+  int length;
+  int action = SGF_SCAN_CONTINUE;
+
+  propident(ctx, name, sizeof(name));
+  if (name[1] == '\0')
+    sgf_name = name[0] | (short) (' ' << 8);
+  else
+    sgf_name = name[0] | name[1] << 8;
+
+  do {
+    scan_propvalue(ctx, &value, &length);
+    if (events->property && action == SGF_SCAN_CONTINUE)
+      action = scan_event(ctx, events->property(data, sgf_name,
+						value, length));
+  } while (ctx->lookahead == '[');
+
+  return action;
+}
+
+
+static int
+scan_node(SGFParser *ctx, const SGFEvents *events, void *data, int depth)
+{
+  int action = SGF_SCAN_CONTINUE;
+
+  match(ctx, ';');
+  if (events->node)
+    action = scan_event(ctx, events->node(data, depth));
+  while (action == SGF_SCAN_CONTINUE
+	 && ctx->lookahead != EOF && isupper(ctx->lookahead))
+    action = scan_property(ctx, events, data);
+
+  return action;
+}
+
+
+static int
+scan_sequence(SGFParser *ctx, const SGFEvents *events, void *data, int depth)
+{
+  int action = scan_node(ctx, events, data, depth);
+
+  while (action == SGF_SCAN_CONTINUE && ctx->lookahead == ';')
+    action = scan_node(ctx, events, data, depth);
+
+  return action;
+}
+
+
+/*
+ * Scan a game tree. Like gametree() this does not recurse; only the
+ * depth needs to be known, since a variation is entered only while
+ * the enclosing one is being continued.
+ */
+
+static void
+scan_gametree(SGFParser *ctx, const SGFEvents *events, void *data, int mode)
+{
+  int action;
+  int depth = 0;
+
+  if (!gametree_start(ctx, mode))
+    return;
+
+  for (;;) {
+    action = SGF_SCAN_CONTINUE;
+    if (events->begin_gametree)
+      action = scan_event(ctx, events->begin_gametree(data, depth));
+    if (action == SGF_SCAN_CONTINUE)
+      action = scan_sequence(ctx, events, data, depth);
+
+    /* Close game trees until one continues with a variation. */
+    while (action != SGF_SCAN_CONTINUE || ctx->lookahead != '(') {
+      if (action == SGF_SCAN_SKIP)
+	skip_gametree(ctx);
+      else if (depth > 0 || mode == STRICT_SGF)
+	match(ctx, ')');
+
+      if (events->end_gametree)
+	scan_event(ctx, events->end_gametree(data, depth));
+      if (depth == 0)
+	return;
+      depth--;
+      action = SGF_SCAN_CONTINUE;
+    }
+
+    match(ctx, '(');
+    depth++;
+  }
+}
+
+
+/* ---------------------------------------------------------------- */
+/*                         Reader entry points                      */
+/* ---------------------------------------------------------------- */
+
+
+static void
+init_parser(SGFParser *ctx)
+{
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->error = SGF_OK;
+}
+
+
+/*
+ * Parse the whole input described by ctx, with the fuseki reader if
+ * fuseki is set. The fuseki reader only reads the first game of a
+ * collection. On a syntax error the partial tree is freed.
+ */
+
+static int
+parse_input(SGFParser *ctx, SGFNode **root, int fuseki, int moves_per_game)
+{
+  ctx->tree = NULL;
+  if (setjmp(ctx->env) == 0) {
+    nexttoken(ctx);
+    if (fuseki)
+      gametreefuseki(ctx, &ctx->tree, NULL, LAX_SGF, moves_per_game, 0);
+    else
+      collection(ctx, &ctx->tree);
+  }
+  else {
+    sgfFreeNode(ctx->tree);
+    ctx->tree = NULL;
+  }
+  free(ctx->stack);
+  ctx->stack = NULL;
+  ctx->stacksize = 0;
+
+  *root = ctx->tree;
+  return ctx->error;
+}
+
+
+static void
+close_input(SGFParser *ctx)
+{
+  sgfz_close(ctx->zin);
+  ctx->zin = NULL;
+  if (ctx->file && ctx->file != stdin)
+    fclose(ctx->file);
+  ctx->file = NULL;
+}
+
+
+/*
+ * Open filename (or stdin for "-") as input for ctx. gzip or zstd
+ * compressed input is decoded on the fly.
+ */
+
+static int
+open_input(SGFParser *ctx, const char *filename)
+{
+  if (strcmp(filename, "-") == 0)
+    ctx->file = stdin;
+  else
+    ctx->file = fopen(filename, "rb");
+
+  if (ctx->file)
+    ctx->zin = sgfz_open(ctx->file);
+
+  if (!ctx->zin) {
+    close_input(ctx);
+    ctx->error = SGF_OPEN_ERROR;
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * Reentrant reader. Parses filename ("-" for stdin) into *root using
+ * ctx for all parser state. Returns SGF_OK, SGF_OPEN_ERROR or
+ * SGF_PARSE_ERROR. On a parse error *root is NULL and ctx->errmsg,
+ * ctx->errarg and ctx->errpos describe the problem; the program is
+ * never terminated.
+ *
+ * Every game of a collection is read; *root is the root of the first
+ * game and the roots of the others follow through root->next.
+ */
+
+int
+readsgffile_ctx(SGFParser *ctx, const char *filename, SGFNode **root)
+{
+  return readsgffile_arena(ctx, filename, NULL, root);
+}
+
+
+/*
+ * Same as readsgffile_ctx(), but the tree is built in arena. After a
+ * parse error the partial tree stays in the arena until it is freed.
+ */
+
+int
+readsgffile_arena(SGFParser *ctx, const char *filename, SGFArena *arena,
+		  SGFNode **root)
+{
+  char *buffer;
+  long size;
+
+  init_parser(ctx);
+  ctx->arena = arena;
+  *root = NULL;
+  if (!open_input(ctx, filename))
+    return ctx->error;
+
+  /* Uncompressed files are read in one go so that the memory fast
+   * paths apply. Anything else is parsed as it is decoded.
+   */
+  if (ctx->zin->kind == SGFZ_PLAIN && ctx->file != stdin
+      && fseek(ctx->file, 0, SEEK_END) == 0
+      && (size = ftell(ctx->file)) >= 0
+      && fseek(ctx->file, 0, SEEK_SET) == 0) {
+    buffer = xalloc(size + 1);
+    size = fread(buffer, 1, size, ctx->file);
+    close_input(ctx);
+    readsgfmem_arena(ctx, buffer, size, arena, root);
+    free(buffer);
+    return ctx->error;
+  }
+
+  parse_input(ctx, root, 0, 0);
+  close_input(ctx);
+
+  return ctx->error;
+}
+
+
+/*
+ * Reentrant reader for an SGF record held in memory. The buffer is
+ * not modified and the values are copied into the tree.
+ */
+
+int
+readsgfmem_ctx(SGFParser *ctx, const char *buffer, unsigned long size,
+	       SGFNode **root)
+{
+  return readsgfmem_arena(ctx, buffer, size, NULL, root);
+}
+
+
+int
+readsgfmem_arena(SGFParser *ctx, const char *buffer, unsigned long size,
+		 SGFArena *arena, SGFNode **root)
+{
+  static char empty[1];
+
+  init_parser(ctx);
+  ctx->arena = arena;
+  ctx->buf = size > 0 ? (char *) buffer : empty;
+  ctx->bufp = ctx->buf;
+  ctx->bufend = ctx->buf + size;
+
+  return parse_input(ctx, root, 0, 0);
+}
+
+
+/*
+ * Same as readsgfmem_arena(), but in lazy mode. The buffer must stay
+ * unchanged until all variations which are needed have been expanded.
+ */
+
+int
+readsgfmem_lazy(SGFParser *ctx, const char *buffer, unsigned long size,
+		SGFArena *arena, SGFNode **root)
+{
+  static char empty[1];
+
+  init_parser(ctx);
+  ctx->arena = arena;
+  ctx->lazy = 1;
+  ctx->buf = size > 0 ? (char *) buffer : empty;
+  ctx->bufp = ctx->buf;
+  ctx->bufend = ctx->buf + size;
+
+  return parse_input(ctx, root, 0, 0);
+}
+
+
+/*
+ * Parse the variations of node which were left unparsed in lazy mode
+ * and append them to its children. They are parsed lazily themselves.
+ * Returns SGF_OK, or SGF_PARSE_ERROR if their text turns out to be
+ * broken, in which case they are dropped.
+ */
+
+int
+sgfExpandVariations(SGFNode *node)
+{
+  struct SGFLazy_t *lazy = node->lazy;
+  SGFNode *variations = NULL;
+  SGFNode **p = &variations;
+  SGFNode *last;
+  SGFParser ctx;
+
+  if (!lazy)
+    return SGF_OK;
+  node->lazy = NULL;
+
+  init_parser(&ctx);
+  ctx.buf = lazy->start;
+  ctx.bufp = ctx.buf;
+  ctx.bufend = ctx.buf + lazy->length;
+  ctx.inplace = lazy->inplace;
+  ctx.lazy = 1;
+  ctx.arena = node->arena;
+  if (!node->arena)
+    free(lazy);
+
+  if (setjmp(ctx.env) == 0) {
+    nexttoken(&ctx);
+    while (ctx.lookahead == '(') {
+      gametree(&ctx, p, node, STRICT_SGF);
+      p = &((*p)->next);
+    }
+  }
+  else {
+    free(ctx.stack);
+    sgfFreeNode(variations);
+    return ctx.error;
+  }
+  free(ctx.stack);
+
+  for (last = node->child; last->next; last = last->next)
+    ;
+  last->next = variations;
+  return SGF_OK;
+}
+
+
+/*
+ * Expand all variations of all games starting at root. Returns
+ * SGF_OK, or SGF_PARSE_ERROR if any variation was broken.
+ */
+
+int
+sgfExpandAll(SGFNode *root)
+{
+  SGFNode *node = root;
+  int status = SGF_OK;
+
+  while (node) {
+    if (sgfExpandVariations(node) != SGF_OK)
+      status = SGF_PARSE_ERROR;
+
+    if (node->child)
+      node = node->child;
+    else {
+      while (node && !node->next)
+	node = node->parent;
+      if (node)
+	node = node->next;
+    }
+  }
+
+  return status;
+}
+
+
+/*
+ * Return the next sibling of node, parsing it first if it was left
+ * unparsed.
+ */
+
+SGFNode *
+sgfNextVariation(SGFNode *node)
+{
+  if (!node->next && node->parent && node->parent->lazy)
+    sgfExpandVariations(node->parent);
+  return node->next;
+}
+
+
+/*
+ * Scan the input described by ctx, delivering events. Both a syntax
+ * error and SGF_SCAN_STOP end up here through longjmp().
+ */
+
+static int
+scan_input(SGFParser *ctx, const SGFEvents *events, void *data)
+{
+  if (setjmp(ctx->env) == 0) {
+    nexttoken(ctx);
+    scan_gametree(ctx, events, data, LAX_SGF);
+    for (;;) {
+      while (ctx->lookahead == ')')
+	nexttoken(ctx);
+      if (ctx->lookahead != '(')
+	break;
+      scan_gametree(ctx, events, data, NEXT_SGF);
+    }
+  }
+
+  free(ctx->scratch);
+  ctx->scratch = NULL;
+  ctx->scratchsize = 0;
+
+  return ctx->error;
+}
+
+
+/*
+ * Reentrant event scanner for filename ("-" for stdin). No tree is
+ * built; the callbacks in events are called with data as they are
+ * encountered. Returns the same codes as readsgffile_ctx().
+ */
+
+int
+scansgffile_ctx(SGFParser *ctx, const char *filename,
+		const SGFEvents *events, void *data)
+{
+  init_parser(ctx);
+  if (!open_input(ctx, filename))
+    return ctx->error;
+
+  scan_input(ctx, events, data);
+  close_input(ctx);
+
+  return ctx->error;
+}
+
+
+/*
+ * Event scanner for an SGF record in memory. Values without escapes
+ * are handed to the callbacks as slices of buffer itself.
+ */
+
+int
+scansgfmem_ctx(SGFParser *ctx, const char *buffer, unsigned long size,
+	       const SGFEvents *events, void *data)
+{
+  static char empty[1];
+
+  init_parser(ctx);
+  ctx->buf = size > 0 ? (char *) buffer : empty;
+  ctx->bufp = ctx->buf;
+  ctx->bufend = ctx->buf + size;
+
+  return scan_input(ctx, events, data);
+}
+
+
+/* ---------------------------------------------------------------- */
+/*                         Collection index                         */
+/* ---------------------------------------------------------------- */
+
+/*
+ * The index is built by a prescan which only matches parentheses and
+ * skips over property values with skip_value(), so that escaped ']'
+ * and parentheses inside comments are handled like the parser does.
+ * Nothing is parsed or allocated per game apart from the index entry.
+ */
+
+static void
+index_add(SGFIndex *index, long offset, long length)
+{
+  if (index->ngames == index->size) {
+    index->size = index->size ? 2 * index->size : 64;
+    index->games = xrealloc(index->games,
+			    index->size * sizeof(SGFIndexEntry));
+  }
+  index->games[index->ngames].offset = offset;
+  index->games[index->ngames].length = length;
+  index->ngames++;
+}
+
+
+/*
+ * Like collection(), the prescan skips junk before the first game but
+ * stops at anything other than whitespace and parentheses after it.
+ * Parenthesized text without a node is junk as well. Errors can only
+ * come from an unterminated value.
+ */
+
+static int
+index_input(SGFParser *ctx, SGFIndex *index)
+{
+  long start = 0;
+  int has_node = 0;
+  int depth = 0;
+  int c;
+
+  memset(index, 0, sizeof(*index));
+  if (setjmp(ctx->env) == 0) {
+    while ((c = sgf_getch(ctx)) != EOF) {
+      if (depth == 0) {
+	if (c == '(') {
+	  start = parse_position(ctx) - 1;
+	  has_node = 0;
+	  depth = 1;
+	}
+	else if (index->ngames > 0 && c != ')' && !isspace(c))
 	  break;
       }
-      nexttoken();
+      else if (c == '[')
+	skip_value(ctx);
+      else if (c == ';')
+	has_node = 1;
+      else if (c == '(')
+	depth++;
+      else if (c == ')' && --depth == 0 && has_node)
+	index_add(index, start, parse_position(ctx) - start);
     }
-  
-  /* The head is parsed */
-  {
+    /* The parser does not insist on the closing parentheses of the
+     * last game either.
+     */
+    if (depth > 0 && has_node)
+      index_add(index, start, parse_position(ctx) - start);
+  }
+  else
+    sgf_index_free(index);
 
-    SGFNode *head = sgfNewNode();
-    SGFNode *last;
-    head->parent = parent;
-    *p = head;
-    
-    last = sequence(head);
-    p = &last->child;
-    while (lookahead == '(') {
-      if (last->props 
-	  && (last->props->name == SGFB || last->props->name == SGFW))
-	i++;
-      /* break after number_of_moves moves in SGF file */
-      if (i >= moves_per_game) { 
-	last->child = NULL;
-	last->next = NULL;
-	break;
-      }
-      else {
-	gametreefuseki(p, last, mode, moves_per_game, i);
-	p = &((*p)->next);
-      }
+  return ctx->error;
+}
+
+
+/*
+ * Build an index of the byte offset and length of each game tree in
+ * filename, which is mapped into memory if possible. Returns the same
+ * codes as readsgffile_ctx(); on failure the index is empty. For a
+ * compressed file the offsets count decoded bytes.
+ */
+
+int
+sgf_index_build_file(SGFParser *ctx, const char *filename, SGFIndex *index)
+{
+#ifndef WIN32
+  struct stat st;
+  int fd;
+
+  memset(index, 0, sizeof(*index));
+  fd = open(filename, O_RDONLY);
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+      && st.st_size > 0) {
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base != MAP_FAILED
+	&& sgfz_detect(base, st.st_size) != SGFZ_PLAIN) {
+      munmap(base, st.st_size);
+      base = MAP_FAILED;
+    }
+    if (base != MAP_FAILED) {
+      madvise(base, st.st_size, MADV_SEQUENTIAL);
+      sgf_index_build_mem(ctx, base, st.st_size, index);
+      munmap(base, st.st_size);
+      return ctx->error;
     }
-    if (mode == STRICT_SGF)
-      match(')');
   }
+  else if (fd >= 0)
+    close(fd);
+#endif
+
+  init_parser(ctx);
+  if (!open_input(ctx, filename))
+    return ctx->error;
+
+  index_input(ctx, index);
+  close_input(ctx);
+
+  return ctx->error;
 }
 
-SGFNode *
-readsgffilefuseki(const char *filename, int moves_per_game)
+
+int
+sgf_index_build_mem(SGFParser *ctx, const char *buffer, unsigned long size,
+		    SGFIndex *index)
 {
-  SGFNode *root;
-  int tmpi = 0;
+  static char empty[1];
 
-  if (strcmp(filename, "-") == 0)
-    sgffile = stdin;
+  init_parser(ctx);
+  ctx->buf = size > 0 ? (char *) buffer : empty;
+  ctx->bufp = ctx->buf;
+  ctx->bufend = ctx->buf + size;
+
+  return index_input(ctx, index);
+}
+
+
+void
+sgf_index_free(SGFIndex *index)
+{
+  free(index->games);
+  memset(index, 0, sizeof(*index));
+}
+
+
+/*
+ * Parse game n of an indexed file on its own. Only the bytes of that
+ * game are read; in a compressed file the games before it still have
+ * to be decoded. Error positions are relative to the start of the
+ * file, as for readsgffile_ctx().
+ */
+
+int
+readsgfgame_ctx(SGFParser *ctx, const char *filename, const SGFIndex *index,
+		int n, SGFNode **root)
+{
+  const SGFIndexEntry *game;
+  SGFZStream *z = NULL;
+  FILE *file;
+  char *buffer;
+  long got;
+
+  init_parser(ctx);
+  *root = NULL;
+  if (n < 0 || n >= index->ngames) {
+    ctx->error = SGF_OPEN_ERROR;
+    return ctx->error;
+  }
+
+  game = &index->games[n];
+  file = fopen(filename, "rb");
+  if (file)
+    z = sgfz_open(file);
+  if (!z
+      || (z->kind == SGFZ_PLAIN ? fseek(file, game->offset, SEEK_SET) != 0
+	  : sgfz_read(z, NULL, game->offset) != game->offset)) {
+    sgfz_close(z);
+    if (file)
+      fclose(file);
+    ctx->error = SGF_OPEN_ERROR;
+    return ctx->error;
+  }
+
+  buffer = xalloc(game->length);
+  if (z->kind == SGFZ_PLAIN)
+    got = fread(buffer, 1, game->length, file);
   else
-    sgffile = fopen(filename, "r");
+    got = sgfz_read(z, buffer, game->length);
+  sgfz_close(z);
+  fclose(file);
 
-  if (!sgffile)
-    return NULL;
+  readsgfmem_ctx(ctx, buffer, got, root);
+  free(buffer);
+  if (ctx->error == SGF_PARSE_ERROR)
+    ctx->errpos += game->offset;
 
+  return ctx->error;
+}
 
-  nexttoken();
-  gametreefuseki(&root, NULL, LAX_SGF, moves_per_game, 0);
 
-  fclose(sgffile);
+/*
+ * Print the error recorded in ctx, if any, to outfile.
+ */
 
-  if (sgferr) {
-    fprintf(stderr, "Parse error: %s at position %d\n", sgferr, sgferrpos);
-    sgfFreeNode(root);
-    return NULL;
+void
+sgfparser_perror(SGFParser *ctx, FILE *outfile)
+{
+  if (ctx->error == SGF_OPEN_ERROR)
+    fprintf(outfile, "Can not open SGF input\n");
+  else if (ctx->error == SGF_PARSE_ERROR) {
+    fprintf(outfile, "Parse error: ");
+    fprintf(outfile, ctx->errmsg, ctx->errarg);
+    fprintf(outfile, " at position %ld\n", ctx->errpos);
   }
+}
+
+
+/*
+ * Perform some simple checks on a freshly read tree.
+ */
+
+static SGFNode *
+check_root(SGFNode *root)
+{
+  int tmpi = 0;
 
-  /* perform some simple checks on the file */
   if (!sgfGetIntProperty(root, "GM", &tmpi)) {
     if (VERBOSE_WARNINGS)
       fprintf(stderr, "Couldn't find the game type (GM) attribute!\n");
@@ -1182,6 +3129,48 @@ readsgffilefuseki(const char *filename, int moves_per_game)
 }
 
 
+/*
+ * Non-reentrant style reader: report errors on stderr and return NULL.
+ */
+
+static SGFNode *
+read_file(const char *filename, SGFArena *arena)
+{
+  SGFParser ctx;
+  SGFNode *root;
+
+  if (readsgffile_arena(&ctx, filename, arena, &root) != SGF_OK) {
+    if (ctx.error == SGF_PARSE_ERROR)
+      sgfparser_perror(&ctx, stderr);
+    return NULL;
+  }
+
+  return check_root(root);
+}
+
+
+SGFNode *
+readsgffilefuseki(const char *filename, int moves_per_game)
+{
+  SGFParser ctx;
+  SGFNode *root;
+
+  init_parser(&ctx);
+  if (!open_input(&ctx, filename))
+    return NULL;
+
+  parse_input(&ctx, &root, 1, moves_per_game);
+  close_input(&ctx);
+
+  if (ctx.error != SGF_OK) {
+    sgfparser_perror(&ctx, stderr);
+    return NULL;
+  }
+
+  return check_root(root);
+}
+
+
 
 
 
@@ -1194,51 +3183,143 @@ readsgffilefuseki(const char *filename, int moves_per_game)
 SGFNode *
 readsgffile(const char *filename)
 {
-  SGFNode *root;
-  int tmpi = 0;
+  return read_file(filename, NULL);
+}
 
-  if (strcmp(filename, "-") == 0)
-    sgffile = stdin;
-  else
-    sgffile = fopen(filename, "r");
 
-  if (!sgffile)
-    return NULL;
+/*
+ * Read an SGF file by mapping it privately into memory and parsing
+ * straight from the mapping. The property values of the returned tree
+ * point into the mapping, which is returned in *mapping and must be
+ * released with sgf_unmap() after the tree has been freed.
+ *
+ * Input which cannot be mapped (stdin, pipes, or platforms without
+ * mmap) is read with readsgffile() and *mapping is set to NULL.
+ */
+
+static SGFNode *read_mapped(const char *filename, SGFArena *arena, int lazy,
+			    SGFMapping **mapping);
+
+SGFNode *
+readsgffile_mmap(const char *filename, SGFMapping **mapping)
+{
+  return readsgffile_mmap_arena(filename, NULL, mapping);
+}
+
+
+/*
+ * Read a tree from a mapping of filename into arena (or the heap if
+ * arena is NULL). Only the nodes and properties come from the arena;
+ * the values are borrowed from the mapping.
+ */
+
+SGFNode *
+readsgffile_mmap_arena(const char *filename, SGFArena *arena,
+		       SGFMapping **mapping)
+{
+  return read_mapped(filename, arena, 0, mapping);
+}
+
+
+/*
+ * Same as readsgffile_mmap_arena(), but in lazy mode: the variations
+ * after the first are parsed from the mapping when they are first
+ * needed, see sgfExpandVariations(). Input which cannot be mapped is
+ * read in full.
+ */
+
+SGFNode *
+readsgffile_mmap_lazy(const char *filename, SGFArena *arena,
+		      SGFMapping **mapping)
+{
+  return read_mapped(filename, arena, 1, mapping);
+}
 
 
-  nexttoken();
-  gametree(&root, NULL, LAX_SGF);
+static SGFNode *
+read_mapped(const char *filename, SGFArena *arena, int lazy,
+	    SGFMapping **mapping)
+{
+#ifndef WIN32
+  static char empty[1];
+  SGFParser ctx;
+  SGFMapping *map;
+  SGFNode *root;
+  struct stat st;
+  int fd;
 
-  if (sgffile != stdin)
-    fclose(sgffile);
+  *mapping = NULL;
+  if (strcmp(filename, "-") == 0)
+    return read_file(filename, arena);
 
-  if (sgferr) {
-    fprintf(stderr, "Parse error: %s at position %d\n", sgferr, sgferrpos);
-    sgfFreeNode(root);
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
     return NULL;
+
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return read_file(filename, arena);
   }
 
-  /* perform some simple checks on the file */
-  if (!sgfGetIntProperty(root, "GM", &tmpi)) {
-    if (VERBOSE_WARNINGS)
-      fprintf(stderr, "Couldn't find the game type (GM) attribute!\n");
+  map = xalloc(sizeof(SGFMapping));
+  map->size = st.st_size;
+  if (map->size > 0) {
+    map->base = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		     fd, 0);
+    if (map->base == MAP_FAILED) {
+      close(fd);
+      free(map);
+      return read_file(filename, arena);
+    }
+    madvise(map->base, map->size, MADV_SEQUENTIAL);
   }
-  else if (tmpi != 1) {
-    fprintf(stderr, "SGF file might be for game other than go: %d\n", tmpi);
-    fprintf(stderr, "Trying to load anyway.\n");
+  close(fd);
+
+  /* Compressed files cannot be parsed in place. */
+  if (sgfz_detect(map->base, map->size) != SGFZ_PLAIN) {
+    sgf_unmap(map);
+    return read_file(filename, arena);
   }
 
-  if (!sgfGetIntProperty(root, "FF", &tmpi)) {
-    if (VERBOSE_WARNINGS)
-      fprintf(stderr, "Can not determine SGF spec version (FF)!\n");
+  init_parser(&ctx);
+  ctx.buf = map->base ? map->base : empty;
+  ctx.bufp = ctx.buf;
+  ctx.bufend = ctx.buf + map->size;
+  ctx.inplace = 1;
+  ctx.lazy = lazy;
+  ctx.arena = arena;
+
+  if (parse_input(&ctx, &root, 0, 0) != SGF_OK) {
+    sgfparser_perror(&ctx, stderr);
+    sgf_unmap(map);
+    return NULL;
   }
-  else if ((tmpi < 3 || tmpi > 4) && VERBOSE_WARNINGS)
-    fprintf(stderr, "Unsupported SGF spec version: %d\n", tmpi);
 
-  return root;
+  *mapping = map;
+  return check_root(root);
+#else
+  *mapping = NULL;
+  return read_file(filename, arena);
+#endif
 }
 
 
+/*
+ * Release a mapping made by readsgffile_mmap(). NULL is ignored.
+ */
+
+void
+sgf_unmap(SGFMapping *mapping)
+{
+  if (!mapping)
+    return;
+#ifndef WIN32
+  if (mapping->base)
+    munmap(mapping->base, mapping->size);
+#endif
+  free(mapping);
+}
+
 
 /* ================================================================ */
 /*                          Write SGF tree                          */
@@ -1247,37 +3328,122 @@ readsgffile(const char *filename)
 
 #define OPTION_STRICT_FF4 0
 
-static int sgf_column = 0;
+/*
+ * The writer renders into a memory buffer. Output to a file is
+ * flushed in chunks of SGF_OUTPUT_CHUNK bytes; output for
+ * writesgf_to_buffer() grows the buffer instead.
+ *
+ * Properties are printed by name, all values of a name at once. The
+ * names printed in the current node are remembered in a bit set
+ * indexed by the name. Variations of a lazily read tree which are
+ * still unparsed are copied as text rather than expanded. The tree
+ * itself is thus left alone and may be read by other threads
+ * meanwhile.
+ */
+
+#define SGF_OUTPUT_CHUNK 65536
+
+typedef struct {
+  char *data;
+  unsigned long length;
+  unsigned long size;
+  FILE *file;			/* where to flush to, or NULL */
+  int error;			/* a write to file failed */
+  int column;
+  unsigned char printed[65536 / 8];
+} SGFOutput;
+
+#define name_printed(out, name) \
+  ((out)->printed[(unsigned short) (name) >> 3] & (1 << ((name) & 7)))
+#define mark_printed(out, name) \
+  ((out)->printed[(unsigned short) (name) >> 3] |= 1 << ((name) & 7))
+#define unmark_printed(out, name) \
+  ((out)->printed[(unsigned short) (name) >> 3] &= ~(1 << ((name) & 7)))
+
+
+static SGFOutput *
+sgf_output_new(FILE *file)
+{
+  SGFOutput *out = xalloc(sizeof(SGFOutput));
+
+  out->file = file;
+  out->size = SGF_OUTPUT_CHUNK;
+  out->data = xalloc(out->size);
+  return out;
+}
+
+
+static void
+sgf_output_flush(SGFOutput *out)
+{
+  if (out->file && out->length > 0) {
+    if (fwrite(out->data, 1, out->length, out->file) != out->length)
+      out->error = 1;
+    out->length = 0;
+  }
+}
+
+
+/* Make room for at least n more bytes. */
+
+static void
+sgf_output_reserve(SGFOutput *out, unsigned long n)
+{
+  if (out->length + n <= out->size)
+    return;
+
+  if (out->file) {
+    sgf_output_flush(out);
+    if (n <= out->size)
+      return;
+  }
+
+  while (out->length + n > out->size)
+    out->size *= 2;
+  out->data = xrealloc(out->data, out->size);
+}
+
+
+#define sgf_output_char(out, c) \
+  do { \
+    if ((out)->length == (out)->size) \
+      sgf_output_reserve(out, 1); \
+    (out)->data[(out)->length++] = (c); \
+  } while (0)
+
 
 static void
-sgf_putc(int c, FILE *file)
+sgf_putc(int c, SGFOutput *out)
 {
-  if (c == '\n' && sgf_column == 0)
+  if (c == '\n' && out->column == 0)
     return;
 
-  fputc(c, file);
+  sgf_output_char(out, c);
 
   if (c == '\n')
-    sgf_column = 0;
+    out->column = 0;
   else
-    sgf_column++;
+    out->column++;
 
-  if (c == ']' && sgf_column > 60) {
-    fputc('\n', file);
-    sgf_column = 0;
+  if (c == ']' && out->column > 60) {
+    sgf_output_char(out, '\n');
+    out->column = 0;
   }
 }
 
 static void
-sgf_puts(const char *s, FILE *file)
+sgf_puts(const char *s, SGFOutput *out)
 {
+  /* At most two bytes per character once escaped. */
+  sgf_output_reserve(out, 2 * strlen(s));
+
   for (; *s; s++) {
     if (*s == '[' || *s == ']' || *s == '\\') {
-      fputc('\\', file);
-      sgf_column++;
+      out->data[out->length++] = '\\';
+      out->column++;
     }
-    fputc((int) *s, file);
-    sgf_column++;
+    out->data[out->length++] = *s;
+    out->column++;
   }
 }
 
@@ -1298,58 +3464,72 @@ sgf_puts(const char *s, FILE *file)
  */
 
 static void
-sgf_print_name(FILE *file, short name)
+sgf_print_name(SGFOutput *out, short name)
 {
-  sgf_putc(name & 0xff, file);
+  sgf_putc(name & 0xff, out);
   if (name >> 8 != ' ')
-    sgf_putc(name >> 8, file);
+    sgf_putc(name >> 8, out);
 }
 
 static void
-sgf_print_property(FILE *file, SGFNode *node, short name, int is_comment)
+sgf_print_property(SGFOutput *out, SGFNode *node, short name, int is_comment)
 {
   int n = 0;
   SGFProperty *prop;
 
+  if (name_printed(out, name))
+    return;
+
   for (prop = node->props; prop; prop = prop->next) {
     if (prop->name == name) {
-      prop->name |= 0x20;  /* Indicate already printed. */
       if (n == 0) {
-	sgf_print_name(file, name);
-	sgf_putc('[', file);
+	sgf_print_name(out, name);
+	sgf_putc('[', out);
       }
       else if (is_comment)
-	sgf_putc('\n', file);
+	sgf_putc('\n', out);
       else {
-	sgf_putc(']', file);
-	sgf_putc('[', file);
+	sgf_putc(']', out);
+	sgf_putc('[', out);
       }
       
-      sgf_puts(prop->value, file);
+      if (prop->flags & SGFPROP_POINTS) {
+	/* The value of a point set is itself a list of values. */
+	const char *p;
+	for (p = prop->value; *p; p++)
+	  sgf_putc(*p, out);
+      }
+      else
+	sgf_puts(prop->value, out);
       n++;
     }
   }
 
-  if (n > 0)
-    sgf_putc(']', file);
+  if (n > 0) {
+    sgf_putc(']', out);
+    mark_printed(out, name);
+  }
 
   /* Add a newline after certain properties. */
   if (name == SGFAB || name == SGFAW || name == SGFAE || (is_comment && n > 1))
-    sgf_putc('\n', file);
+    sgf_putc('\n', out);
 }
 
 /*
- * Print all remaining unprinted property values at node N to file.
+ * Print all remaining unprinted property values at node N to file,
+ * then forget which names have been printed.
  */
 
 static void
-sgfPrintRemainingProperties(FILE *file, SGFNode *node)
+sgfPrintRemainingProperties(SGFOutput *out, SGFNode *node)
 {
   SGFProperty *prop;
 
   for (prop = node->props; prop; prop = prop->next)
-    if (!(prop->name & 0x20))
-      sgf_print_property(file, node, prop->name, 0);
+    sgf_print_property(out, node, prop->name, 0);
+
+  for (prop = node->props; prop; prop = prop->next)
+    unmark_printed(out, prop->name);
 }
 
 
@@ -1358,11 +3538,11 @@ sgfPrintRemainingProperties(FILE *file, SGFNode *node)
  */
 
 static void
-sgfPrintCharProperty(FILE *file, SGFNode *node, const char *name)
+sgfPrintCharProperty(SGFOutput *out, SGFNode *node, const char *name)
 {
   short nam = name[0] | name[1] << 8;
   
-  sgf_print_property(file, node, nam, 0);
+  sgf_print_property(out, node, nam, 0);
 }
 
 
@@ -1374,181 +3554,251 @@ sgfPrintCharProperty(FILE *file, SGFNode *node, const char *name)
  */
 
 static void
-sgfPrintCommentProperty(FILE *file, SGFNode *node, const char *name)
+sgfPrintCommentProperty(SGFOutput *out, SGFNode *node, const char *name)
 {
   short nam = name[0] | name[1] << 8;
   
-  sgf_print_property(file, node, nam, 1);
+  sgf_print_property(out, node, nam, 1);
 }
 
 
 static void
-unparse_node(FILE *file, SGFNode *node)
+unparse_node(SGFOutput *out, SGFNode *node)
 {
-  sgf_putc(';', file);
-  sgfPrintCharProperty(file, node, "B ");
-  sgfPrintCharProperty(file, node, "W ");
-  sgfPrintCommentProperty(file, node, "N ");
-  sgfPrintCommentProperty(file, node, "C ");
-  sgfPrintRemainingProperties(file, node);
+  sgf_putc(';', out);
+  sgfPrintCharProperty(out, node, "B ");
+  sgfPrintCharProperty(out, node, "W ");
+  sgfPrintCommentProperty(out, node, "N ");
+  sgfPrintCommentProperty(out, node, "C ");
+  sgfPrintRemainingProperties(out, node);
 }
 
 
 static void
-unparse_root(FILE *file, SGFNode *node)
+unparse_root(SGFOutput *out, SGFNode *node)
 {
-  sgf_putc(';', file);
+  sgf_putc(';', out);
   
   if (sgfHasProperty(node, "GM"))
-    sgfPrintCharProperty(file, node, "GM");
+    sgfPrintCharProperty(out, node, "GM");
   else {
-    fputs("GM[1]", file);
-    sgf_column += 5;
+    sgf_output_reserve(out, 5);
+    memcpy(out->data + out->length, "GM[1]", 5);
+    out->length += 5;
+    out->column += 5;
   }
   
-  sgfPrintCharProperty(file, node, "FF");
-  sgf_putc('\n', file);
+  sgfPrintCharProperty(out, node, "FF");
+  sgf_putc('\n', out);
 
-  sgfPrintCharProperty(file, node, "SZ");
-  sgf_putc('\n', file);
+  sgfPrintCharProperty(out, node, "SZ");
+  sgf_putc('\n', out);
   
-  sgfPrintCharProperty(file, node, "GN");
-  sgf_putc('\n', file);
+  sgfPrintCharProperty(out, node, "GN");
+  sgf_putc('\n', out);
   
-  sgfPrintCharProperty(file, node, "DT");
-  sgf_putc('\n', file);
+  sgfPrintCharProperty(out, node, "DT");
+  sgf_putc('\n', out);
   
-  sgfPrintCommentProperty(file, node, "PB");
-  sgfPrintCommentProperty(file, node, "BR");
-  sgf_putc('\n', file);
+  sgfPrintCommentProperty(out, node, "PB");
+  sgfPrintCommentProperty(out, node, "BR");
+  sgf_putc('\n', out);
   
-  sgfPrintCommentProperty(file, node, "PW");
-  sgfPrintCommentProperty(file, node, "WR");
-  sgf_putc('\n', file);
+  sgfPrintCommentProperty(out, node, "PW");
+  sgfPrintCommentProperty(out, node, "WR");
+  sgf_putc('\n', out);
   
-  sgfPrintCommentProperty(file, node, "N ");
-  sgfPrintCommentProperty(file, node, "C ");
-  sgfPrintRemainingProperties(file, node);
+  sgfPrintCommentProperty(out, node, "N ");
+  sgfPrintCommentProperty(out, node, "C ");
+  sgfPrintRemainingProperties(out, node);
 
-  sgf_putc('\n', file);
+  sgf_putc('\n', out);
 }
 
 
 /*
  * p->child is the next move.
  * p->next  is the next variation
+ *
+ * The game is written without recursion. A node starts a variation,
+ * i.e. is written after a '(', if it is the root or one of several
+ * children; the others continue the sequence of their parent.
+ *
+ * In a tree read in lazy mode, a node may have variations left
+ * unparsed after its parsed children. Their text is written as it was
+ * read, after those children, so that the tree need not be expanded.
  */
 
-static void
-unparse_game(FILE *file, SGFNode *node, int root)
+static int
+has_variations(SGFNode *node)
 {
-  if (!root)
-    sgf_putc('\n', file);
-  sgf_putc('(', file);
-  if (root)
-    unparse_root(file, node);
-  else
-    unparse_node(file, node);
+  return node->child != NULL && (node->child->next != NULL || node->lazy);
+}
 
-  node = node->child;
-  while (node != NULL && node->next == NULL) {
-    unparse_node(file, node);
-    node = node->child;
-  } 
+static int
+starts_variation(SGFNode *node, SGFNode *game)
+{
+  return node == game || has_variations(node->parent);
+}
 
-  while (node != NULL) {
-    unparse_game(file, node, 0);
-    node = node->next;
-  }
-  sgf_putc(')', file);
-  if (root)
-    sgf_putc('\n', file);
+static void
+unparse_lazy(SGFOutput *out, struct SGFLazy_t *lazy)
+{
+  sgf_putc('\n', out);
+  sgf_output_reserve(out, lazy->length);
+  memcpy(out->data + out->length, lazy->start, lazy->length);
+  out->length += lazy->length;
+  out->column = 0;
 }
 
-/* Printed properties are marked by adding the 0x20 bit to the
- * property name (changing an upper case letter to lower case). This
- * function removes this mark so that we can print the property next
- * time too. It recurses to all properties in the linked list.
- */
 static void
-restore_property(SGFProperty *prop)
+unparse_game(SGFOutput *out, SGFNode *game)
 {
-  if (prop) {
-    restore_property(prop->next);
-    prop->name &= ~0x20;
+  SGFNode *variation = game;
+  SGFNode *node;
+
+  sgf_putc('(', out);
+  unparse_root(out, game);
+
+  for (;;) {
+    /* Write the rest of the sequence of the current variation. */
+    node = variation;
+    while (node->child != NULL && !has_variations(node)) {
+      node = node->child;
+      unparse_node(out, node);
+    }
+
+    if (node->child != NULL)
+      variation = node->child;
+    else {
+      /* Close variations until one has a sibling left to write. */
+      for (;;) {
+	sgf_putc(')', out);
+	if (variation == game) {
+	  sgf_putc('\n', out);
+	  return;
+	}
+	if (variation->next != NULL) {
+	  variation = variation->next;
+	  break;
+	}
+	variation = variation->parent;
+	if (variation->lazy)
+	  unparse_lazy(out, variation->lazy);
+	while (!starts_variation(variation, game))
+	  variation = variation->parent;
+      }
+    }
+
+    sgf_putc('\n', out);
+    sgf_putc('(', out);
+    unparse_node(out, variation);
   }
 }
 
-/* When called with the tree root, recurses to all properties in the
- * tree and removes all print marks.
- */
+
+/* Render all games of the collection starting at root. */
+
 static void
-restore_node(SGFNode *node)
+unparse_collection(SGFOutput *out, SGFNode *root)
 {
-  if (node) {
-    restore_property(node->props);
-    restore_node(node->child);
-    restore_node(node->next);
+  SGFNode *game;
+
+  /* The roots of the games of a collection are chained by next. */
+  for (game = root; game; game = game->next) {
+    out->column = 0;
+    unparse_game(out, game);
   }
 }
 
 
 /*
- * Opens filename and writes the game stored in the sgf structure.
+ * Opens filename and writes the game stored in the sgf structure,
+ * or all games of a collection. A name ending in .gz or .zst gives a
+ * compressed file. Missing header properties are added to the tree
+ * first, see sgf_write_header_reduced().
  */
 
 int
 writesgf(SGFNode *root, const char *filename)
 {
+  SGFOutput *out;
   FILE *outfile;
+  SGFNode *game;
+  int error;
 
   if (strcmp(filename, "-") == 0) 
     outfile = stdout;
   else
-    outfile = fopen(filename, "w");
+    outfile = sgfz_fopen_write(filename);
 
   if (!outfile) {
     fprintf(stderr, "Can not open %s\n", filename);
     return 0;
   }
 
-  sgf_write_header_reduced(root, 0);
+  for (game = root; game; game = game->next)
+    sgf_write_header_reduced(game, 0);
 
-  sgf_column = 0;
-  unparse_game(outfile, root, 1);
-  if (outfile != stdout)
-    fclose(outfile);
-  
-  /* Remove "printed" marks so that the tree can be written multiple
-   * times.
-   */
-  restore_node(root);
+  out = sgf_output_new(outfile);
+  unparse_collection(out, root);
+  sgf_output_flush(out);
+  error = out->error;
+  free(out->data);
+  free(out);
+
+  if (outfile == stdout)
+    error |= fflush(stdout) != 0;
+  else
+    error |= fclose(outfile) != 0;
+  if (error) {
+    fprintf(stderr, "Can not write %s\n", filename);
+    return 0;
+  }
   
   return 1;
 }
 
 
+/*
+ * Render root, with any further games of its collection, as SGF text
+ * into a new buffer, which the caller must free(). The text is
+ * terminated by a '\0', which is not included in *size. Unlike
+ * writesgf(), no header properties are added: the tree is only read,
+ * so other threads may read it at the same time.
+ */
+
+char *
+writesgf_to_buffer(SGFNode *root, unsigned long *size)
+{
+  SGFOutput *out = sgf_output_new(NULL);
+  char *data;
+
+  unparse_collection(out, root);
+  sgf_output_char(out, '\0');
+
+  data = out->data;
+  *size = out->length - 1;
+  free(out);
+  return data;
+}
+
+
 #ifdef TEST_SGFPARSER
 int
 main()
 {
-  static char buffer[25000];
-  static char output[25000];
+  SGFParser parser;
   SGFNode *game;
 
-  sgffile = stdin;
-
-  nexttoken();
-  gametree(&game, LAX_SGF);
-  if (sgferr) {
-    fprintf(stderr, "Parse error:");
-    fprintf(stderr, sgferr, sgferrarg);
-    fprintf(stderr, " at position %d\n", sgferrpos);
-  }
-  else {
-    unparse_game(stdin, game, 1);
-    write(1, output, outputp - output);
+  if (readsgffile_ctx(&parser, "-", &game) != SGF_OK) {
+    sgfparser_perror(&parser, stderr);
+    return EXIT_FAILURE;
   }
+
+  writesgf(game, "-");
+  sgfFreeNode(game);
+  return EXIT_SUCCESS;
 }
 #endif
 
@@ -22,6 +22,7 @@
 \* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <assert.h>
+#include <stdlib.h>
 
 #include "mgg_utils.h"
 #include "msgftree.h"
@@ -31,21 +32,145 @@ sgftree_clear(SGFTree *tree)
 {
   tree->root = NULL;
   tree->lastnode = NULL;
+  tree->mapping = NULL;
+  tree->arena = NULL;
+  tree->journal = NULL;
+  tree->checkpoints = NULL;
 }
 
+
+/*
+ * Like sgftree_clear(), but the nodes of the tree will be allocated
+ * from an arena of its own, both when reading and when building it
+ * with the sgftree* functions.
+ */
+
+void
+sgftree_clear_arena(SGFTree *tree)
+{
+  sgftree_clear(tree);
+  tree->arena = sgf_arena_new();
+}
+
+
+/*
+ * Free the nodes of the tree and release the file mapping its
+ * property values may be borrowed from. An arena tree is released
+ * in one go. A journal of the tree is closed.
+ */
+
+void
+sgftree_free(SGFTree *tree)
+{
+  sgfjournal_close(tree->journal);
+  sgftree_clear_checkpoints(tree);
+  if (tree->arena)
+    sgf_arena_free(tree->arena);
+  else
+    sgfFreeNode(tree->root);
+  sgf_unmap(tree->mapping);
+  sgftree_clear(tree);
+}
+
+
+/*
+ * Replace the tree by a freshly read one. If the tree uses an arena,
+ * the new tree gets a new arena and the old one is released. The
+ * journal of the old tree, if any, is closed.
+ */
+
+static void
+sgftree_replace(SGFTree *tree, SGFNode *root, SGFArena *arena,
+		SGFMapping *mapping)
+{
+  sgfjournal_close(tree->journal);
+  tree->journal = NULL;
+  sgftree_clear_checkpoints(tree);
+  if (tree->arena)
+    sgf_arena_free(tree->arena);
+  else
+    sgfFreeNode(tree->root);
+  sgf_unmap(tree->mapping);
+
+  tree->root = root;
+  tree->arena = arena;
+  tree->mapping = mapping;
+  tree->lastnode = NULL;
+}
+
+
 int
 sgftree_readfile(SGFTree *tree, const char *infilename)
 {
-  SGFNode *savetree = tree->root;
+  SGFArena *arena = NULL;
+  SGFParser ctx;
+  SGFNode *root;
+
+  if (tree->arena) {
+    arena = sgf_arena_new();
+    if (readsgffile_arena(&ctx, infilename, arena, &root) != SGF_OK) {
+      if (ctx.error == SGF_PARSE_ERROR)
+	sgfparser_perror(&ctx, stderr);
+      sgf_arena_free(arena);
+      return 0;
+    }
+  }
+  else {
+    root = readsgffile(infilename);
+    if (root == NULL)
+      return 0;
+  }
+
+  sgftree_replace(tree, root, arena, NULL);
+  return 1;
+}
+
+
+/*
+ * Same as sgftree_readfile(), but the file is mapped into memory and
+ * the property values are borrowed from the mapping instead of being
+ * copied. The mapping is owned by the tree and released by
+ * sgftree_free() or the next read.
+ */
 
-  tree->root = readsgffile(infilename);
-  if (tree->root == NULL) {
-    tree->root = savetree;
+int
+sgftree_readfile_mmap(SGFTree *tree, const char *infilename)
+{
+  SGFArena *arena = tree->arena ? sgf_arena_new() : NULL;
+  SGFMapping *mapping;
+  SGFNode *root;
+
+  root = readsgffile_mmap_arena(infilename, arena, &mapping);
+  if (root == NULL) {
+    sgf_arena_free(arena);
     return 0;
   }
-  
-  sgfFreeNode(savetree);
-  tree->lastnode = NULL;
+
+  sgftree_replace(tree, root, arena, mapping);
+  return 1;
+}
+
+
+/*
+ * Same as sgftree_readfile_mmap(), but only the first variation of
+ * each node is parsed up front. The others are parsed from the mapping
+ * when first needed, see sgfNextVariation().
+ */
+
+int
+sgftree_readfile_lazy(SGFTree *tree, const char *infilename)
+{
+  SGFArena *arena = tree->arena ? sgf_arena_new() : NULL;
+  SGFMapping *mapping;
+  SGFNode *root;
+
+  root = readsgffile_mmap_lazy(infilename, arena, &mapping);
+  if (root == NULL) {
+    sgf_arena_free(arena);
+    return 0;
+  }
+
+  sgftree_replace(tree, root, arena, mapping);
   return 1;
 }
 
@@ -91,10 +216,160 @@ sgftreeForward(SGFTree *tree)
 }
 
 
+/* ================================================================ */
+/*                           Checkpoints                            */
+/* ================================================================ */
+
+/* Open addressing hash table from nodes to saved states. */
+struct SGFCheckpoints_t {
+  SGFNode **nodes;
+  void **states;
+  unsigned int size;		/* a power of two */
+  unsigned int used;
+};
+
+
+static unsigned int
+checkpoint_hash(SGFNode *node, unsigned int size)
+{
+  unsigned long key = (unsigned long) node / sizeof(void *);
+
+  return (unsigned int) (key * 2654435761UL) & (size - 1);
+}
+
+
+/* The state saved for node, or NULL. */
+
+void *
+sgftree_get_checkpoint(SGFTree *tree, SGFNode *node)
+{
+  struct SGFCheckpoints_t *cp = tree->checkpoints;
+  unsigned int h;
+
+  if (!cp)
+    return NULL;
+
+  for (h = checkpoint_hash(node, cp->size); cp->nodes[h];
+       h = (h + 1) & (cp->size - 1))
+    if (cp->nodes[h] == node)
+      return cp->states[h];
+
+  return NULL;
+}
+
+
+/*
+ * Save state, a block from malloc(), for node. The tree takes it over
+ * and frees any state saved for the node before.
+ */
+
+void
+sgftree_set_checkpoint(SGFTree *tree, SGFNode *node, void *state)
+{
+  struct SGFCheckpoints_t *cp = tree->checkpoints;
+  unsigned int h;
+
+  if (!cp) {
+    cp = tree->checkpoints = xalloc(sizeof(*cp));
+    cp->size = 64;
+    cp->nodes = xalloc(cp->size * sizeof(SGFNode *));
+    cp->states = xalloc(cp->size * sizeof(void *));
+  }
+
+  if (2 * (cp->used + 1) > cp->size) {
+    SGFNode **nodes = cp->nodes;
+    void **states = cp->states;
+    unsigned int size = cp->size;
+    unsigned int k;
+
+    cp->size = 2 * size;
+    cp->nodes = xalloc(cp->size * sizeof(SGFNode *));
+    cp->states = xalloc(cp->size * sizeof(void *));
+    cp->used = 0;
+    for (k = 0; k < size; k++)
+      if (nodes[k])
+	sgftree_set_checkpoint(tree, nodes[k], states[k]);
+    free(nodes);
+    free(states);
+  }
+
+  for (h = checkpoint_hash(node, cp->size); cp->nodes[h];
+       h = (h + 1) & (cp->size - 1))
+    if (cp->nodes[h] == node) {
+      free(cp->states[h]);
+      cp->states[h] = state;
+      return;
+    }
+
+  cp->nodes[h] = node;
+  cp->states[h] = state;
+  cp->used++;
+}
+
+
+/* Forget all saved states. */
+
+void
+sgftree_clear_checkpoints(SGFTree *tree)
+{
+  struct SGFCheckpoints_t *cp = tree->checkpoints;
+  unsigned int k;
+
+  if (!cp)
+    return;
+
+  for (k = 0; k < cp->size; k++)
+    free(cp->states[k]);
+  free(cp->nodes);
+  free(cp->states);
+  free(cp);
+  tree->checkpoints = NULL;
+}
+
+
 /* ================================================================ */
 /*                        High level functions                      */
 /* ================================================================ */
 
+/*
+ * The last property of node if the tree is journaled. The properties
+ * added after it are then recorded by journal_properties().
+ */
+
+static SGFProperty *
+journal_mark(SGFTree *tree, SGFNode *node)
+{
+  SGFProperty *prop = node->props;
+
+  if (!tree->journal || !prop)
+    return NULL;
+
+  while (prop->next)
+    prop = prop->next;
+  return prop;
+}
+
+
+static void
+journal_properties(SGFTree *tree, SGFNode *node, SGFProperty *mark)
+{
+  if (tree->journal)
+    sgfjournal_add_properties(tree->journal, node, mark);
+}
+
+
+/* Record a new node with all its properties. */
+
+static void
+journal_node(SGFTree *tree, SGFNode *node, int first)
+{
+  if (tree->journal) {
+    sgfjournal_new_node(tree->journal, node, first);
+    sgfjournal_add_properties(tree->journal, node, NULL);
+  }
+}
+
+
 /*
  * Returns the node to modify. Use lastnode if available, otherwise
  * follow the main variation to the current end of the game.
@@ -127,7 +402,13 @@ void
 sgftreeAddStone(SGFTree *tree, int color, int movex, int movey)
 {
   SGFNode *node = sgftreeNodeCheck(tree);
+  SGFProperty *mark = journal_mark(tree, node);
+
   sgfAddStone(node, color, movex, movey);
+  journal_properties(tree, node, mark);
+
+  /* The positions at this node and below have changed. */
+  sgftree_clear_checkpoints(tree);
 }
 
 
@@ -140,6 +421,7 @@ sgftreeAddPlay(SGFTree *tree, int color, int movex, int movey)
 {
   SGFNode *node = sgftreeNodeCheck(tree);
   tree->lastnode = sgfAddPlay(node, color, movex, movey);
+  journal_node(tree, tree->lastnode, 1);
 }
 
 
@@ -153,19 +435,24 @@ sgftreeAddPlayLast(SGFTree *tree, int color, int movex, int movey)
 {
   SGFNode *node = sgftreeNodeCheck(tree);
   tree->lastnode = sgfAddPlayLast(node, color, movex, movey);
+  journal_node(tree, tree->lastnode, 0);
 }
 
 
 void
 sgftreeCreateHeaderNode(SGFTree *tree, int boardsize, float komi, int handicap)
 {
-  SGFNode *root = sgfNewNode();
+  SGFNode *root = tree->arena ? sgfNewArenaNode(tree->arena) : sgfNewNode();
 
   sgfAddPropertyInt(root, "SZ", boardsize);
   sgfAddPropertyFloat(root, "KM", komi);
   sgfAddPropertyInt(root, "HA", handicap);
   tree->root = root;
   tree->lastnode = root;
+  if (tree->journal) {
+    sgfjournal_new_root(tree->journal, root);
+    sgfjournal_add_properties(tree->journal, root, NULL);
+  }
 }
 
 
@@ -177,10 +464,13 @@ void
 sgftreeAddComment(SGFTree *tree, const char *comment)
 {
   SGFNode *node;
+  SGFProperty *mark;
   assert(tree && tree->root);
 
   node = sgftreeNodeCheck(tree);
+  mark = journal_mark(tree, node);
   sgfAddComment(node, comment);
+  journal_properties(tree, node, mark);
 }
 
 
@@ -192,10 +482,13 @@ void
 sgftreeBoardText(SGFTree *tree, int i, int j, const char *text)
 {
   SGFNode *node;
+  SGFProperty *mark;
   assert(tree->root);
 
   node = sgftreeNodeCheck(tree);
+  mark = journal_mark(tree, node);
   sgfBoardText(node, i, j, text);
+  journal_properties(tree, node, mark);
 }
 
 
@@ -207,10 +500,13 @@ void
 sgftreeBoardChar(SGFTree *tree, int i, int j, char c)
 {
   SGFNode *node;
+  SGFProperty *mark;
   assert(tree->root);
 
   node = sgftreeNodeCheck(tree);
+  mark = journal_mark(tree, node);
   sgfBoardChar(node, i, j, c);
+  journal_properties(tree, node, mark);
 }
 
 
@@ -222,7 +518,10 @@ void
 sgftreeBoardNumber(SGFTree *tree, int i, int j, int number)
 {
   SGFNode *node = sgftreeNodeCheck(tree);
+  SGFProperty *mark = journal_mark(tree, node);
+
   sgfBoardNumber(node, i, j, number);
+  journal_properties(tree, node, mark);
 }
 
 
@@ -234,7 +533,10 @@ void
 sgftreeTriangle(SGFTree *tree, int i, int j)
 {
   SGFNode *node = sgftreeNodeCheck(tree);
+  SGFProperty *mark = journal_mark(tree, node);
+
   sgfTriangle(node, i, j);
+  journal_properties(tree, node, mark);
 }
 
 
@@ -246,7 +548,10 @@ void
 sgftreeCircle(SGFTree *tree, int i, int j)
 {
   SGFNode *node = sgftreeNodeCheck(tree);
+  SGFProperty *mark = journal_mark(tree, node);
+
   sgfCircle(node, i, j);
+  journal_properties(tree, node, mark);
 }
 
 
@@ -258,7 +563,10 @@ void
 sgftreeSquare(SGFTree *tree, int i, int j)
 {
   SGFNode *node = sgftreeNodeCheck(tree);
+  SGFProperty *mark = journal_mark(tree, node);
+
   sgfSquare(node, i, j);
+  journal_properties(tree, node, mark);
 }
 
 
@@ -270,7 +578,10 @@ void
 sgftreeMark(SGFTree *tree, int i, int j)
 {
   SGFNode *node = sgftreeNodeCheck(tree);
+  SGFProperty *mark = journal_mark(tree, node);
+
   sgfMark(node, i, j);
+  journal_properties(tree, node, mark);
 }
 
 
@@ -283,6 +594,7 @@ sgftreeStartVariant(SGFTree *tree)
 {
   SGFNode *node = sgftreeNodeCheck(tree);
   tree->lastnode = sgfStartVariant(node);
+  journal_node(tree, tree->lastnode, 0);
 }
 
 
@@ -295,6 +607,7 @@ sgftreeStartVariantFirst(SGFTree *tree)
 {
   SGFNode *node = sgftreeNodeCheck(tree);
   tree->lastnode = sgfStartVariantFirst(node);
+  journal_node(tree, tree->lastnode, 1);
 }
 
 
@@ -308,6 +621,8 @@ sgftreeWriteResult(SGFTree *tree, float score, int overwrite)
   assert(tree->root);
 
   sgfWriteResult(tree->root, score, overwrite);
+  if (tree->journal)
+    sgfjournal_set_property(tree->journal, tree->root, SGFRE);
 }
 
 
@@ -318,6 +633,87 @@ sgftreeSetLastNode(SGFTree *tree, SGFNode *last_node)
 }
 
 
+/*
+ * Start journaling the tree to filename, replacing any journal the
+ * file held. The journal begins with a snapshot of the tree as it is
+ * now, followed by a record of each change made through the sgftree*
+ * functions. Adding a move appends a record or two and costs a single
+ * write; the journal is forced to disk every sync_every records, or
+ * only by sgftree_journal_sync() if sync_every is 0.
+ *
+ * Returns 1 on success, 0 if the journal cannot be written.
+ */
+
+int
+sgftree_journal_start(SGFTree *tree, const char *filename, int sync_every)
+{
+  SGFJournal *journal = sgfjournal_create(filename, tree->root, sync_every);
+
+  if (!journal) {
+    fprintf(stderr, "Cannot write SGF journal %s\n", filename);
+    return 0;
+  }
+
+  sgfjournal_close(tree->journal);
+  tree->journal = journal;
+  return 1;
+}
+
+
+/*
+ * Replace the tree by the one recorded in the journal filename, e.g.
+ * after a crash, and continue journaling to it. Records lost or torn
+ * at the end of the journal are dropped. lastnode is set to the node
+ * added or annotated last.
+ *
+ * Returns 1 on success, 0 if the journal cannot be read.
+ */
+
+int
+sgftree_journal_recover(SGFTree *tree, const char *filename, int sync_every)
+{
+  SGFArena *arena = tree->arena ? sgf_arena_new() : NULL;
+  SGFJournal *journal;
+  SGFNode *root;
+  SGFNode *lastnode;
+
+  journal = sgfjournal_replay(filename, arena, &root, &lastnode, sync_every);
+  if (!journal) {
+    if (arena)
+      sgf_arena_free(arena);
+    else
+      sgfFreeNode(root);
+    return 0;
+  }
+
+  sgftree_replace(tree, root, arena, NULL);
+  tree->lastnode = lastnode;
+  tree->journal = journal;
+  return 1;
+}
+
+
+/* Force the journal of the tree to disk. Returns 1 on success. */
+
+int
+sgftree_journal_sync(SGFTree *tree)
+{
+  return tree->journal ? sgfjournal_sync(tree->journal) : 1;
+}
+
+
+/* Stop journaling the tree. Returns 1 if all records were written. */
+
+int
+sgftree_journal_close(SGFTree *tree)
+{
+  int ok = sgfjournal_close(tree->journal);
+
+  tree->journal = NULL;
+  return ok;
+}
+
+
 /*
  * Local Variables:
  * tab-width: 8
@@ -25,6 +25,7 @@
 #define _MSGFTREE_H_
 
 #include <stdio.h>
+#include <setjmp.h>
 
 #include "msgf_properties.h"
 
@@ -47,6 +48,28 @@
 
 void *xalloc(unsigned int);
 
+/*
+ * A bump allocator owning all nodes, properties and values of one
+ * tree. Nothing in an arena tree is freed individually; the whole
+ * tree goes away with a single sgf_arena_free(). The counters tell
+ * how many objects were carved out of how many blocks, i.e. how many
+ * mallocs the arena saved.
+ */
+typedef struct SGFArena_t {
+  struct SGFArenaBlock_t *blocks;	/* most recent block first */
+  char *next;			/* free space in the current block */
+  char *end;
+
+  unsigned long allocations;	/* number of objects allocated */
+  unsigned long bytes;		/* bytes handed out */
+  unsigned long nblocks;	/* number of blocks malloc'd */
+  unsigned long block_bytes;	/* total size of those blocks */
+} SGFArena;
+
+SGFArena *sgf_arena_new(void);
+void *sgf_arena_alloc(SGFArena *arena, unsigned int size);
+void sgf_arena_free(SGFArena *arena);
+
 /*
  * A property of an SGF node.  An SGF node is described by a linked
  * list of these.
@@ -55,22 +78,65 @@ void *xalloc(unsigned int);
 typedef struct SGFProperty_t {
   struct SGFProperty_t *next;
   short name;
+  short flags;
   char *value;
 } SGFProperty;
 
+/* Property flags. A borrowed value points into storage owned by
+ * someone else (e.g. a file mapping or an arena) and must not be freed
+ * or reallocated; it is copied the first time it is changed.
+ */
+#define SGFPROP_BORROWED  0x0001
+#define SGFPROP_POINTS    0x0002	/* value is the text of an SGFPointSet */
+
+/*
+ * Setup and markup properties with more than one point, such as
+ * AB[aa:ss] or AB[dd][pd][dp], are stored as a single property backed
+ * by a bitset of the points instead of a property per point. Its value
+ * is the list of points compressed into ranges and joined by "][", as
+ * the writer prints it, so that it can be handled as any other string.
+ * The list starts with the first point in the source, which
+ * get_moveXY() and sgfGetCharProperty() return as before. The points
+ * are visited with sgfNextPoint().
+ */
+#define SGF_POINTSET_SIZE   19
+#define SGF_POINTSET_WORDS  ((SGF_POINTSET_SIZE * SGF_POINTSET_SIZE + 31) / 32)
+
+typedef struct SGFPointSet_t {
+  unsigned int bits[SGF_POINTSET_WORDS];	/* bit i * SIZE + j */
+  char first[3];		/* the first point in the source */
+  char text[1];			/* the value of the property */
+} SGFPointSet;
+
     
 typedef struct SGFNode_t {
   SGFProperty *props;
   struct SGFNode_t *parent;
   struct SGFNode_t *child;
   struct SGFNode_t *next;
+  SGFArena *arena;	/* owner of this node, or NULL for the heap */
+  struct SGFLazy_t *lazy;	/* unparsed variations after the first */
+  struct SGFNodeIndex_t *index;	/* navigation index, or NULL */
 } SGFNode;
 
+/* Navigation index of a node, see sgfBuildIndex(). */
+typedef struct SGFNodeIndex_t {
+  SGFNode *prev;		/* previous sibling, NULL for the first */
+  unsigned int nchildren;
+  unsigned int depth;		/* 0 for the root of a game */
+  unsigned long size;		/* nodes in the subtree, node included */
+} SGFNodeIndex;
+
 
 /* low level functions */
 SGFNode *sgfPrev(SGFNode *node);
 SGFNode *sgfRoot(SGFNode *node);
+void sgfBuildIndex(SGFNode *root);
+int sgfChildCount(SGFNode *node);
+int sgfDepth(SGFNode *node);
+unsigned long sgfSubtreeSize(SGFNode *node);
 SGFNode *sgfNewNode(void);
+SGFNode *sgfNewArenaNode(SGFArena *arena);
 void sgfFreeNode(SGFNode *node);
 
 int sgfGetIntProperty(SGFNode *node, const char *name, int *value);
@@ -85,6 +151,8 @@ void sgfOverwritePropertyInt(SGFNode *node, const char *name, int val);
 void *xrealloc(void *pt, unsigned int size);
 SGFProperty *sgfMkProperty(const char *name, const  char *value,
 			   SGFNode *node, SGFProperty *last);
+int sgfNextPoint(SGFProperty *prop, int *k, int *i, int *j, int boardsize);
+int sgfPointCount(SGFProperty *prop);
 void sgfFreeProperty(SGFProperty *prop);
 
 SGFNode *sgfAddStone(SGFNode *node, int color, int movex, int movey);
@@ -109,15 +177,176 @@ SGFNode *sgfStartVariant(SGFNode *node);
 SGFNode *sgfStartVariantFirst(SGFNode *node);
 SGFNode *sgfAddChild(SGFNode *node);
 
+/*
+ * Trees read in lazy mode only parse the first variation of each node
+ * and keep the others as unparsed text. They are turned into nodes by
+ * sgfExpandVariations(), which sgfNextVariation() calls on demand.
+ * Following child pointers needs no expansion; code which walks the
+ * next pointers of a lazy tree should expand it first. The writers
+ * copy unparsed variations as they are.
+ */
+int sgfExpandVariations(SGFNode *node);
+int sgfExpandAll(SGFNode *root);
+SGFNode *sgfNextVariation(SGFNode *node);
+
 SGFNode *sgfCreateHeaderNode(int boardsize, float komi, int handicap);
 
 /* Read SGF tree from file. */
 SGFNode *readsgffile(const char *filename);
+
+/*
+ * Compressed SGF files, see msgfzip.c. Input is recognised by its
+ * magic bytes and decoded while it is parsed; output is compressed if
+ * the file name ends in .gz or .zst.
+ */
+#define SGFZ_PLAIN  0
+#define SGFZ_GZIP   1
+#define SGFZ_ZSTD   2
+
+typedef struct SGFZStream_t {
+  unsigned char *next;		/* decoded bytes not read yet ... */
+  unsigned char *end;		/* ... up to here */
+  int kind;			/* SGFZ_PLAIN, SGFZ_GZIP or SGFZ_ZSTD */
+  int error;			/* corrupt or truncated input */
+  FILE *file;
+  struct SGFZState_t *state;	/* decoder */
+} SGFZStream;
+
+int sgfz_detect(const void *data, unsigned long size);
+int sgfz_kind_of_name(const char *filename);
+SGFZStream *sgfz_open(FILE *file);
+int sgfz_fill(SGFZStream *z);
+long sgfz_read(SGFZStream *z, char *buffer, long size);
+void sgfz_close(SGFZStream *z);
+FILE *sgfz_fopen_write(const char *filename);
+
+/* Return codes of the reentrant readers. */
+#define SGF_OK           0
+#define SGF_OPEN_ERROR   1
+#define SGF_PARSE_ERROR  2
+
+/*
+ * Parser state for the reentrant readers. Each thread parsing SGF
+ * needs its own context; the fields after `error' describe the
+ * outcome of the last read.
+ */
+typedef struct SGFParser_t {
+  FILE *file;		/* stdio input, decoded by zin, or */
+  SGFZStream *zin;
+  char *buf;		/* memory input buf .. bufend */
+  char *bufp;
+  char *bufend;
+  int inplace;		/* unescape memory input in place and borrow */
+  int lazy;		/* leave variations after the first unparsed */
+  long filepos;
+  int lookahead;
+  SGFNode *tree;	/* tree being built */
+  SGFArena *arena;	/* where to build it, or NULL for the heap */
+  SGFNode **stack;	/* open variations of gametree() */
+  int stacksize;
+  char *scratch;	/* value buffer of the event scanner */
+  int scratchsize;
+  jmp_buf env;
+
+  int error;		/* SGF_OK, SGF_OPEN_ERROR or SGF_PARSE_ERROR */
+  const char *errmsg;	/* printf format of a parse error ... */
+  int errarg;		/* ... and its argument */
+  long errpos;		/* byte offset where the error was found */
+} SGFParser;
+
+int readsgffile_ctx(SGFParser *ctx, const char *filename, SGFNode **root);
+int readsgfmem_ctx(SGFParser *ctx, const char *buffer, unsigned long size,
+		   SGFNode **root);
+int readsgffile_arena(SGFParser *ctx, const char *filename, SGFArena *arena,
+		      SGFNode **root);
+int readsgfmem_arena(SGFParser *ctx, const char *buffer, unsigned long size,
+		     SGFArena *arena, SGFNode **root);
+int readsgfmem_lazy(SGFParser *ctx, const char *buffer, unsigned long size,
+		    SGFArena *arena, SGFNode **root);
+void sgfparser_perror(SGFParser *ctx, FILE *outfile);
+
+/* Implementations of the delimiter search in property values. */
+#define SGF_DELIM_SCALAR  0
+#define SGF_DELIM_SSE2    1
+#define SGF_DELIM_AVX2    2
+
+int sgf_delim_impl(void);
+int sgf_set_delim_impl(int impl);
+
+/*
+ * Callbacks of the event scanner. Any of them may be NULL. depth is 0
+ * for the game tree itself and grows by one for each nested
+ * variation. Property names are encoded as in SGFProperty and ranges
+ * are not expanded. A value is a slice of length bytes which is only
+ * valid during the callback and need not be '\0' terminated.
+ *
+ * Each callback returns one of the SGF_SCAN_* actions. SGF_SCAN_SKIP
+ * skips the rest of the current game tree (variation), after which
+ * its end_gametree event still follows. SGF_SCAN_STOP ends the scan.
+ */
+#define SGF_SCAN_CONTINUE  0
+#define SGF_SCAN_SKIP      1
+#define SGF_SCAN_STOP      2
+
+typedef struct SGFEvents_t {
+  int (*begin_gametree)(void *data, int depth);
+  int (*node)(void *data, int depth);
+  int (*property)(void *data, short name, const char *value, int length);
+  int (*end_gametree)(void *data, int depth);
+} SGFEvents;
+
+int scansgffile_ctx(SGFParser *ctx, const char *filename,
+		    const SGFEvents *events, void *data);
+int scansgfmem_ctx(SGFParser *ctx, const char *buffer, unsigned long size,
+		   const SGFEvents *events, void *data);
+
+/*
+ * Byte offset and length of each game tree of a collection file, so
+ * that single games can be parsed without reading the rest of the
+ * file.
+ */
+typedef struct SGFIndexEntry_t {
+  long offset;
+  long length;
+} SGFIndexEntry;
+
+typedef struct SGFIndex_t {
+  SGFIndexEntry *games;
+  int ngames;
+  int size;		/* allocated entries */
+} SGFIndex;
+
+int sgf_index_build_file(SGFParser *ctx, const char *filename,
+			 SGFIndex *index);
+int sgf_index_build_mem(SGFParser *ctx, const char *buffer,
+			unsigned long size, SGFIndex *index);
+void sgf_index_free(SGFIndex *index);
+int readsgfgame_ctx(SGFParser *ctx, const char *filename,
+		    const SGFIndex *index, int n, SGFNode **root);
+
+/*
+ * A private, writable mapping of an SGF file. Trees read by
+ * readsgffile_mmap() borrow their property values from the mapping,
+ * so it must not be released before the tree has been freed.
+ */
+typedef struct SGFMapping_t {
+  char *base;
+  unsigned long size;
+} SGFMapping;
+
+/* Read SGF tree from a memory mapping of the file. */
+SGFNode *readsgffile_mmap(const char *filename, SGFMapping **mapping);
+SGFNode *readsgffile_mmap_arena(const char *filename, SGFArena *arena,
+				SGFMapping **mapping);
+SGFNode *readsgffile_mmap_lazy(const char *filename, SGFArena *arena,
+			       SGFMapping **mapping);
+void sgf_unmap(SGFMapping *mapping);
 /* Specific solution for fuseki */
 SGFNode *readsgffilefuseki(const char *filename, int moves_per_game);
 
-/* Write SGF tree to a file. */
+/* Write SGF tree to a file or into memory. */
 int writesgf(SGFNode *root, const char *filename);
+char *writesgf_to_buffer(SGFNode *root, unsigned long *size);
 
 
 /* ---------------------------------------------------------------- */
@@ -125,14 +354,30 @@ int writesgf(SGFNode *root, const char *filename);
 /* ---------------------------------------------------------------- */
 
 
+/*
+ * Append-only journal of the changes to a tree, see msgfjournal.c.
+ * Every node and property added by the sgftree* functions below is
+ * appended to the journal file as it is made, and a tree can be
+ * rebuilt from its journal after a crash.
+ */
+typedef struct SGFJournal_t SGFJournal;
+
 typedef struct SGFTree_t {
   SGFNode *root;
   SGFNode *lastnode;
+  SGFMapping *mapping;	/* backing store of borrowed values, if any */
+  SGFArena *arena;	/* allocator of the tree, or NULL for the heap */
+  SGFJournal *journal;	/* where changes are recorded, or NULL */
+  struct SGFCheckpoints_t *checkpoints;	/* saved positions, or NULL */
 } SGFTree;
 
 
 void sgftree_clear(SGFTree *tree);
+void sgftree_clear_arena(SGFTree *tree);
+void sgftree_free(SGFTree *tree);
 int sgftree_readfile(SGFTree *tree, const char *infilename);
+int sgftree_readfile_mmap(SGFTree *tree, const char *infilename);
+int sgftree_readfile_lazy(SGFTree *tree, const char *infilename);
 
 int sgftreeBack(SGFTree *tree);
 int sgftreeForward(SGFTree *tree);
@@ -157,6 +402,135 @@ void sgftreeCreateHeaderNode(SGFTree *tree, int boardsize, float komi,
 			     int handicap);
 void sgftreeSetLastNode(SGFTree *tree, SGFNode *lastnode);
 
+/* Saved board positions of sgftreeGoto(), keyed by node. The states
+ * are malloc'd blocks owned by the tree.
+ */
+void *sgftree_get_checkpoint(SGFTree *tree, SGFNode *node);
+void sgftree_set_checkpoint(SGFTree *tree, SGFNode *node, void *state);
+void sgftree_clear_checkpoints(SGFTree *tree);
+
+int sgftree_journal_start(SGFTree *tree, const char *filename, int sync_every);
+int sgftree_journal_recover(SGFTree *tree, const char *filename,
+			    int sync_every);
+int sgftree_journal_sync(SGFTree *tree);
+int sgftree_journal_close(SGFTree *tree);
+
+/* Low level journal functions used by the above. */
+SGFJournal *sgfjournal_create(const char *filename, SGFNode *root,
+			      int sync_every);
+SGFJournal *sgfjournal_replay(const char *filename, SGFArena *arena,
+			      SGFNode **root, SGFNode **lastnode,
+			      int sync_every);
+void sgfjournal_new_root(SGFJournal *journal, SGFNode *root);
+void sgfjournal_new_node(SGFJournal *journal, SGFNode *node, int first);
+void sgfjournal_add_properties(SGFJournal *journal, SGFNode *node,
+			       SGFProperty *after);
+void sgfjournal_set_property(SGFJournal *journal, SGFNode *node, short name);
+int sgfjournal_sync(SGFJournal *journal);
+int sgfjournal_close(SGFJournal *journal);
+
+
+/* ---------------------------------------------------------------- */
+/* ---                        SGFFlatTree                       --- */
+/* ---------------------------------------------------------------- */
+
+/*
+ * A frozen, read-only copy of an SGF tree. The nodes are stored in
+ * preorder in one array and refer to each other by 32-bit indices, so
+ * the first child of a node is always the next entry. The properties
+ * of all nodes are stored in a second array, those of node i being
+ * props[nodes[i].props] up to props[nodes[i].props + nodes[i].nprops - 1],
+ * and all values are '\0' terminated strings in one character pool.
+ *
+ * Moves and point valued properties are decoded to board positions
+ * (POS() in board.h) when the tree is built, so replaying a game is a
+ * linear scan which never looks at the property values. The arrays
+ * contain no pointers and can be stored as they are.
+ */
+
+#define SGF_FLAT_NONE  0xffffffffU
+
+typedef struct SGFFlatNode_t {
+  unsigned int parent;		/* SGF_FLAT_NONE for the root */
+  unsigned int child;		/* first variation, or SGF_FLAT_NONE */
+  unsigned int next;		/* next sibling, or SGF_FLAT_NONE */
+  unsigned int props;		/* index of the first property */
+  unsigned int nprops;
+  short move;			/* position of the B or W move, or PASS_MOVE */
+  short color;			/* BLACK, WHITE, or EMPTY if no move */
+} SGFFlatNode;
+
+typedef struct SGFFlatProperty_t {
+  short name;
+  short pos;			/* decoded point for point properties */
+  unsigned int value;		/* offset of the value in the pool */
+} SGFFlatProperty;
+
+typedef struct SGFFlatTree_t {
+  SGFFlatNode *nodes;
+  SGFFlatProperty *props;
+  char *values;
+  unsigned int nnodes;
+  unsigned int nprops;
+  unsigned int values_size;
+  int boardsize;
+} SGFFlatTree;
+
+/* Position in an SGFFlatTree, the counterpart of SGFTree.lastnode. */
+typedef struct SGFFlatCursor_t {
+  const SGFFlatTree *tree;
+  unsigned int lastnode;	/* SGF_FLAT_NONE before the root */
+} SGFFlatCursor;
+
+void sgfflat_clear(SGFFlatTree *flat);
+int sgfflat_build(SGFFlatTree *flat, SGFNode *root);
+void sgfflat_free(SGFFlatTree *flat);
+const char *sgfflat_get_property(const SGFFlatTree *flat, unsigned int node,
+				 short name);
+
+void sgfflat_cursor_init(SGFFlatCursor *cursor, const SGFFlatTree *flat);
+int sgfflatBack(SGFFlatCursor *cursor);
+int sgfflatForward(SGFFlatCursor *cursor);
+
+
+/*
+ * A binary cache of the flat trees of one or more games, usually those
+ * of one SGF file. The cache file is mapped into memory and its games
+ * are used in place; sgfcache_get_game() fills in an SGFFlatTree whose
+ * arrays point into the mapping and which must not be freed.
+ *
+ * The cache records the size and modification time of the SGF file it
+ * was made from and a checksum of its contents. sgfcache_open() only
+ * checks the header and the source file, and sgfcache_get_game() that
+ * the arrays of a game are consistent; sgfcache_verify() reads the
+ * whole cache to check the sum.
+ */
+
+#define SGFCACHE_OK          0
+#define SGFCACHE_OPEN_ERROR  1	/* cannot read the cache or the source */
+#define SGFCACHE_BAD_FORMAT  2	/* not a cache of this version/machine */
+#define SGFCACHE_STALE       3	/* source file changed since */
+#define SGFCACHE_CORRUPT     4	/* checksum or contents do not match */
+
+typedef struct SGFCache_t {
+  char *base;
+  unsigned long size;
+  unsigned int ngames;
+  int mapped;		/* base is a mapping rather than a malloc'd copy */
+} SGFCache;
+
+int sgfcache_write(const char *cachename, const char *source,
+		   const SGFFlatTree *games, unsigned int ngames);
+int sgfcache_open(SGFCache *cache, const char *cachename, const char *source);
+int sgfcache_get_game(const SGFCache *cache, unsigned int k,
+		      SGFFlatTree *flat);
+int sgfcache_verify(const SGFCache *cache);
+void sgfcache_close(SGFCache *cache);
+
+int sgfcache_build(const char *source, const char *cachename);
+int sgfcache_check(const char *source, const char *cachename);
+const char *sgfcache_strerror(int status);
+
 
 /* ---------------------------------------------------------------- */
 /* ---                         Utilities                        --- */
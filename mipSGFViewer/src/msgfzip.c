@@ -0,0 +1,623 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *\
+ * This is GNU Go, a Go program. Contact gnugo@gnu.org, or see       *
+ * http://www.gnu.org/software/gnugo/ for more information.          *
+ *                                                                   *
+ * Copyright 1999, 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2007,   *
+ * 2008 and 2009 by the Free Software Foundation.                    *
+ *                                                                   *
+ * This program is free software; you can redistribute it and/or     *
+ * modify it under the terms of the GNU General Public License as    *
+ * published by the Free Software Foundation - version 3 or          *
+ * (at your option) any later version.                               *
+ *                                                                   *
+ * This program is distributed in the hope that it will be useful,   *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of    *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the     *
+ * GNU General Public License in file COPYING for more details.      *
+ *                                                                   *
+ * You should have received a copy of the GNU General Public         *
+ * License along with this program; if not, write to the Free        *
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor,       *
+ * Boston, MA 02111, USA.                                            *
+\* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * msgfzip.c
+ *
+ * Streaming gzip and zstd support for SGF files. See msgftree.h.
+ *
+ * Readers wrap their FILE in an SGFZStream, which looks at the first
+ * bytes and then hands out the decoded data a buffer at a time, so
+ * that compressed archives are parsed without temporary files and in
+ * constant memory. Writers get a FILE which compresses on the fly;
+ * this needs fopencookie() (glibc) or funopen() (BSD).
+ */
+
+#define _GNU_SOURCE	/* fopencookie() */
+
+#include "mconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+#if HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
+#include "msgftree.h"
+
+#if defined(__GLIBC__)
+#define SGFZ_COOKIE_GLIBC 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) \
+      || defined(__OpenBSD__)
+#define SGFZ_COOKIE_BSD 1
+#endif
+
+#define SGFZ_CHUNK 65536
+
+
+/* ================================================================ */
+/*                              Input                               */
+/* ================================================================ */
+
+
+struct SGFZState_t {
+  unsigned char in[SGFZ_CHUNK];
+  unsigned char out[SGFZ_CHUNK];
+  unsigned long inpos;		/* undecoded input is in[inpos .. inlen) */
+  unsigned long inlen;
+  int frame_end;		/* at the end of a gzip member or zstd frame */
+  int eof;			/* nothing more to decode */
+#if HAVE_ZLIB_H
+  z_stream zs;
+#endif
+#if HAVE_ZSTD_H
+  ZSTD_DStream *zds;
+#endif
+};
+
+
+/*
+ * Kind of compression of data starting with the given bytes, judged
+ * by the gzip and zstd magic numbers. SGF text starts with '(' or
+ * white space, so it cannot be mistaken for either.
+ */
+
+int
+sgfz_detect(const void *data, unsigned long size)
+{
+  const unsigned char *p = data;
+
+  if (size >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+    return SGFZ_GZIP;
+  if (size >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f
+      && p[3] == 0xfd)
+    return SGFZ_ZSTD;
+  return SGFZ_PLAIN;
+}
+
+
+/*
+ * Kind of compression wanted for a file of the given name.
+ */
+
+int
+sgfz_kind_of_name(const char *filename)
+{
+  size_t length = strlen(filename);
+
+  if (length > 3 && strcmp(filename + length - 3, ".gz") == 0)
+    return SGFZ_GZIP;
+  if (length > 4 && strcmp(filename + length - 4, ".zst") == 0)
+    return SGFZ_ZSTD;
+  return SGFZ_PLAIN;
+}
+
+
+/* Read the next chunk of the file. Returns 0 at the end. */
+
+static int
+read_input(SGFZStream *z)
+{
+  struct SGFZState_t *s = z->state;
+
+  s->inpos = 0;
+  s->inlen = fread(s->in, 1, SGFZ_CHUNK, z->file);
+  return s->inlen > 0;
+}
+
+
+/*
+ * Decode the next piece of input into s->out. Input which ends in the
+ * middle of a gzip member or zstd frame counts as corrupt. Returns the
+ * number of bytes decoded.
+ */
+
+#if HAVE_ZLIB_H
+
+static unsigned long
+gzip_decode(SGFZStream *z)
+{
+  struct SGFZState_t *s = z->state;
+  z_stream *zs = &s->zs;
+  int ret;
+
+  zs->next_out = s->out;
+  zs->avail_out = SGFZ_CHUNK;
+
+  while (zs->avail_out > 0) {
+    if (s->inpos == s->inlen && !read_input(z)) {
+      if (!s->frame_end)
+	z->error = 1;
+      s->eof = 1;
+      break;
+    }
+
+    /* Another member may follow, as in "cat a.gz b.gz". Like gzip,
+     * ignore trailing garbage.
+     */
+    if (s->frame_end) {
+      if (s->in[s->inpos] != 0x1f) {
+	s->eof = 1;
+	break;
+      }
+      inflateReset(zs);
+      s->frame_end = 0;
+    }
+
+    zs->next_in = s->in + s->inpos;
+    zs->avail_in = s->inlen - s->inpos;
+    ret = inflate(zs, Z_NO_FLUSH);
+    s->inpos = s->inlen - zs->avail_in;
+
+    if (ret == Z_STREAM_END)
+      s->frame_end = 1;
+    else if (ret != Z_OK) {
+      z->error = 1;
+      s->eof = 1;
+      break;
+    }
+  }
+
+  return SGFZ_CHUNK - zs->avail_out;
+}
+
+#endif
+
+
+#if HAVE_ZSTD_H
+
+static unsigned long
+zstd_decode(SGFZStream *z)
+{
+  struct SGFZState_t *s = z->state;
+  ZSTD_outBuffer out;
+
+  out.dst = s->out;
+  out.size = SGFZ_CHUNK;
+  out.pos = 0;
+
+  while (out.pos < out.size) {
+    ZSTD_inBuffer in;
+    size_t ret;
+
+    if (s->inpos == s->inlen && !read_input(z)) {
+      if (!s->frame_end)
+	z->error = 1;
+      s->eof = 1;
+      break;
+    }
+
+    in.src = s->in;
+    in.size = s->inlen;
+    in.pos = s->inpos;
+    ret = ZSTD_decompressStream(s->zds, &out, &in);
+    s->inpos = in.pos;
+
+    if (ZSTD_isError(ret)) {
+      z->error = 1;
+      s->eof = 1;
+      break;
+    }
+    s->frame_end = (ret == 0);
+  }
+
+  return out.pos;
+}
+
+#endif
+
+
+/*
+ * Wrap file, positioned at the start of its data, for reading. The
+ * kind of compression is found from the first bytes. Returns NULL if
+ * this build cannot decode it. The file is not closed by
+ * sgfz_close().
+ */
+
+SGFZStream *
+sgfz_open(FILE *file)
+{
+  SGFZStream *z = xalloc(sizeof(SGFZStream));
+  struct SGFZState_t *s = xalloc(sizeof(struct SGFZState_t));
+  int ok = 1;
+
+  z->file = file;
+  z->state = s;
+  read_input(z);
+  z->kind = sgfz_detect(s->in, s->inlen);
+
+  switch (z->kind) {
+  case SGFZ_PLAIN:
+    z->next = s->in;
+    z->end = s->in + s->inlen;
+    s->inpos = s->inlen;
+    return z;
+
+  case SGFZ_GZIP:
+#if HAVE_ZLIB_H
+    /* 16 + MAX_WBITS: gzip header and trailer, largest window. */
+    ok = inflateInit2(&s->zs, 16 + MAX_WBITS) == Z_OK;
+#else
+    ok = 0;
+#endif
+    break;
+
+  case SGFZ_ZSTD:
+#if HAVE_ZSTD_H
+    s->zds = ZSTD_createDStream();
+    ok = s->zds && !ZSTD_isError(ZSTD_initDStream(s->zds));
+#else
+    ok = 0;
+#endif
+    break;
+  }
+
+  if (!ok) {
+    fprintf(stderr, "SGF input is compressed in a format this build"
+	    " cannot read\n");
+    sgfz_close(z);
+    return NULL;
+  }
+
+  z->next = s->out;
+  z->end = s->out;
+  return z;
+}
+
+
+/*
+ * Refill the buffer of z when next has reached end. Returns the next
+ * byte, which is consumed, or EOF at the end of the data or on an
+ * error, in which case z->error is set.
+ */
+
+int
+sgfz_fill(SGFZStream *z)
+{
+  struct SGFZState_t *s = z->state;
+  unsigned long n = 0;
+
+  while (n == 0 && !s->eof) {
+    switch (z->kind) {
+    case SGFZ_PLAIN:
+      if (!read_input(z))
+	s->eof = 1;
+      n = s->inlen;
+      z->next = s->in;
+      break;
+#if HAVE_ZLIB_H
+    case SGFZ_GZIP:
+      n = gzip_decode(z);
+      z->next = s->out;
+      break;
+#endif
+#if HAVE_ZSTD_H
+    case SGFZ_ZSTD:
+      n = zstd_decode(z);
+      z->next = s->out;
+      break;
+#endif
+    default:
+      s->eof = 1;
+    }
+  }
+
+  if (n == 0)
+    return EOF;
+
+  z->end = z->next + n;
+  return *z->next++;
+}
+
+
+/*
+ * Read up to size decoded bytes into buffer, or skip them if buffer
+ * is NULL. Returns the number of bytes read or skipped.
+ */
+
+long
+sgfz_read(SGFZStream *z, char *buffer, long size)
+{
+  long got = 0;
+
+  while (got < size) {
+    long n = z->end - z->next;
+
+    if (n == 0) {
+      if (sgfz_fill(z) == EOF)
+	break;
+      z->next--;
+      continue;
+    }
+
+    if (n > size - got)
+      n = size - got;
+    if (buffer)
+      memcpy(buffer + got, z->next, n);
+    z->next += n;
+    got += n;
+  }
+
+  return got;
+}
+
+
+void
+sgfz_close(SGFZStream *z)
+{
+  if (!z)
+    return;
+
+#if HAVE_ZLIB_H
+  if (z->kind == SGFZ_GZIP)
+    inflateEnd(&z->state->zs);
+#endif
+#if HAVE_ZSTD_H
+  if (z->kind == SGFZ_ZSTD)
+    ZSTD_freeDStream(z->state->zds);
+#endif
+
+  free(z->state);
+  free(z);
+}
+
+
+/* ================================================================ */
+/*                              Output                              */
+/* ================================================================ */
+
+
+typedef struct {
+  FILE *file;
+  int kind;
+  int error;
+#if HAVE_ZLIB_H
+  z_stream zs;
+#endif
+#if HAVE_ZSTD_H
+  ZSTD_CStream *zcs;
+#endif
+  unsigned char out[SGFZ_CHUNK];
+} SGFZWriter;
+
+
+/*
+ * Compress size bytes of data, or finish the stream if finish is set,
+ * and write the result to the file.
+ */
+
+static int
+compress_data(SGFZWriter *w, const char *data, size_t size, int finish)
+{
+#if HAVE_ZLIB_H
+  if (w->kind == SGFZ_GZIP) {
+    z_stream *zs = &w->zs;
+    int ret;
+
+    zs->next_in = (unsigned char *) data;
+    zs->avail_in = size;
+    do {
+      zs->next_out = w->out;
+      zs->avail_out = SGFZ_CHUNK;
+      ret = deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH);
+      if (ret == Z_STREAM_ERROR)
+	return 0;
+      if (fwrite(w->out, 1, SGFZ_CHUNK - zs->avail_out, w->file)
+	  != SGFZ_CHUNK - zs->avail_out)
+	return 0;
+    } while (zs->avail_out == 0 || (finish && ret != Z_STREAM_END));
+    return 1;
+  }
+#endif
+
+#if HAVE_ZSTD_H
+  if (w->kind == SGFZ_ZSTD) {
+    ZSTD_inBuffer in;
+    size_t ret;
+
+    in.src = data;
+    in.size = size;
+    in.pos = 0;
+    do {
+      ZSTD_outBuffer out;
+
+      out.dst = w->out;
+      out.size = SGFZ_CHUNK;
+      out.pos = 0;
+      if (finish)
+	ret = ZSTD_endStream(w->zcs, &out);
+      else
+	ret = ZSTD_compressStream(w->zcs, &out, &in);
+      if (ZSTD_isError(ret))
+	return 0;
+      if (fwrite(w->out, 1, out.pos, w->file) != out.pos)
+	return 0;
+      if (!finish)
+	ret = in.size - in.pos;
+    } while (ret != 0);
+    return 1;
+  }
+#endif
+
+  return 0;
+}
+
+
+static int
+close_writer(SGFZWriter *w)
+{
+  int ok = !w->error && compress_data(w, NULL, 0, 1);
+
+#if HAVE_ZLIB_H
+  if (w->kind == SGFZ_GZIP)
+    deflateEnd(&w->zs);
+#endif
+#if HAVE_ZSTD_H
+  if (w->kind == SGFZ_ZSTD)
+    ZSTD_freeCStream(w->zcs);
+#endif
+
+  if (fclose(w->file) != 0)
+    ok = 0;
+  free(w);
+  return ok ? 0 : EOF;
+}
+
+
+#if SGFZ_COOKIE_GLIBC
+
+static ssize_t
+cookie_write(void *cookie, const char *data, size_t size)
+{
+  SGFZWriter *w = cookie;
+
+  if (!compress_data(w, data, size, 0)) {
+    w->error = 1;
+    return -1;
+  }
+  return size;
+}
+
+static int
+cookie_close(void *cookie)
+{
+  return close_writer(cookie);
+}
+
+#elif SGFZ_COOKIE_BSD
+
+static int
+cookie_write(void *cookie, const char *data, int size)
+{
+  SGFZWriter *w = cookie;
+
+  if (!compress_data(w, data, size, 0)) {
+    w->error = 1;
+    return -1;
+  }
+  return size;
+}
+
+static int
+cookie_close(void *cookie)
+{
+  return close_writer(cookie);
+}
+
+#endif
+
+
+/*
+ * Open filename for writing SGF. If the name ends in .gz or .zst the
+ * returned FILE compresses everything written to it; fclose() writes
+ * the end of the stream and reports any error on the way. Returns
+ * NULL if the file cannot be created or the compression is not
+ * supported by this build.
+ */
+
+FILE *
+sgfz_fopen_write(const char *filename)
+{
+  int kind = sgfz_kind_of_name(filename);
+  SGFZWriter *w;
+  FILE *file;
+  int ok = 0;
+
+  if (kind == SGFZ_PLAIN)
+    return fopen(filename, "w");
+
+  file = fopen(filename, "wb");
+  if (!file)
+    return NULL;
+
+  w = xalloc(sizeof(SGFZWriter));
+  w->file = file;
+  w->kind = kind;
+
+#if HAVE_ZLIB_H
+  if (kind == SGFZ_GZIP)
+    ok = deflateInit2(&w->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		      16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+#endif
+#if HAVE_ZSTD_H
+  if (kind == SGFZ_ZSTD) {
+    w->zcs = ZSTD_createCStream();
+    ok = w->zcs
+      && !ZSTD_isError(ZSTD_initCStream(w->zcs, ZSTD_CLEVEL_DEFAULT));
+    if (!ok)
+      ZSTD_freeCStream(w->zcs);
+  }
+#endif
+
+#if SGFZ_COOKIE_GLIBC
+  if (ok) {
+    cookie_io_functions_t io = {NULL, cookie_write, NULL, cookie_close};
+    FILE *out = fopencookie(w, "w", io);
+    if (out)
+      return out;
+    w->error = 1;
+    close_writer(w);
+    return NULL;
+  }
+#elif SGFZ_COOKIE_BSD
+  if (ok) {
+    FILE *out = funopen(w, NULL, cookie_write, NULL, cookie_close);
+    if (out)
+      return out;
+    w->error = 1;
+    close_writer(w);
+    return NULL;
+  }
+#else
+  if (ok) {
+#if HAVE_ZLIB_H
+    if (kind == SGFZ_GZIP)
+      deflateEnd(&w->zs);
+#endif
+#if HAVE_ZSTD_H
+    if (kind == SGFZ_ZSTD)
+      ZSTD_freeCStream(w->zcs);
+#endif
+  }
+#endif
+
+  fprintf(stderr, "%s: compressed output is not supported by this build\n",
+	  filename);
+  fclose(file);
+  remove(filename);
+  free(w);
+  return NULL;
+}
+
+
+/*
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 2
+ * End:
+ */